@@ -0,0 +1,70 @@
+#!/bin/sh
+# Measures a DEBUG build of pracc on the programs of `gen.c`, run by `make bench`.
+# The timers are only compiled into DEBUG builds. To compare with another build of the
+# compiler, build it with -DDEBUG and pass it after the bench directory:
+#
+#   bench/bench.sh build/bench path/to/other/pracc
+#
+# Every run starts without a .prac-cache, times are the best of RUNS runs.
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 <bench_dir> [pracc]" >&2
+	exit 1
+fi
+
+BENCH_DIR=$(cd "$1" && pwd)
+PRACC=${2:-$BENCH_DIR/pracc}
+case $PRACC in /*) ;; *) PRACC=$(pwd)/$PRACC ;; esac
+RUNS=${RUNS:-5}
+
+cd "$BENCH_DIR"
+
+# Best of `runs` runs of the `what` timer, in us
+best() {
+	runs=$1
+	what=$2
+	shift 2
+	i=0
+	while [ $i -lt "$runs" ]; do
+		rm -rf .prac-cache
+		"$PRACC" "$@" 2>/dev/null | sed -n "s/^$what took: \([0-9]*\)us$/\1/p" | head -n 1
+		i=$((i + 1))
+	done | sort -n | head -n 1
+}
+
+# What `preload.c` reports for one run
+preloaded() {
+	LD_PRELOAD=./preload.so "$PRACC" "$@" 2>&1 >/dev/null | grep "^mallocs" | tail -n 1
+}
+
+echo "pracc: $PRACC"
+
+# Lexer, 2.2 MB of tokens, the parser stops at the first error
+./gen lex lex.prac
+us=$(best "$RUNS" lexing lex.prac)
+bytes=$(wc -c < lex.prac)
+echo "lex.prac ($bytes bytes): lexing ${us}us," \
+	"$(awk "BEGIN { printf \"%.1f\", $bytes / ($us / 1000000) / 1048576 }") MB/s"
+
+# Front end and peak memory of a large program
+./gen program 200000 big.prac
+bytes=$(($(wc -c < big.prac) + $(wc -c < big_bindings.prac)))
+rm -rf .prac-cache
+echo "big.prac ($bytes bytes): parsing $(best "$RUNS" parsing big.prac)us," \
+	"constevaling $(best "$RUNS" constevaling big.prac)us, $(preloaded big.prac | sed 's/.*\(max_rss\)/\1/')"
+
+# Inline expansions, 48 deep, 1500 times, over a GB of asm that is thrown away unassembled
+./gen inline inline.prac
+rm -f out.asm
+ln -s /dev/null out.asm
+echo "inline.prac: compiling $(best 1 compiling --asm inline.prac)us"
+rm -f out.asm
+
+# Allocations with a cold and a warm token cache
+./gen program 4000 mid.prac
+rm -rf .prac-cache
+echo "mid.prac: cold $(preloaded mid.prac | sed 's/ max_rss.*//'), warm $(preloaded mid.prac | sed 's/ max_rss.*//')"
+
+rm -rf .prac-cache out out.o out.asm
@@ -0,0 +1,144 @@
+// Generates the programs `bench.sh` measures the compiler on. The output only depends on the
+// arguments, so the numbers of two builds can be compared.
+//
+//   gen lex <file>           2.2 MB of random tokens, no includes, for the lexer
+//   gen program <n> <file>   n procs/funcs, n/4 consts, vars and externs in <file>_bindings.prac
+//   gen inline <file>        48 nested inline funcs, each holding 250 values across its call
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static FILE *
+open_output(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (file == NULL) {
+		fprintf(stderr, "error: Failed to open file: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	return file;
+}
+
+// Not rand(), its sequence differs between libcs
+static unsigned
+next_random(unsigned *state)
+{
+	*state = *state * 1103515245u + 12345u;
+	return (*state >> 16) & 0x7fff;
+}
+
+static void
+gen_lex(const char *path)
+{
+	static const char *words[] = {
+		"dup", "drop", "if", "else", "end", "while", "do", "+", "-", "*", "x!", "!y",
+		"foo_bar_baz", "\"hello world\\n\"", "12345", "<=", ">=", ".", "proc", "func", "int",
+		"# a comment here",
+	};
+	const unsigned words_count = sizeof(words) / sizeof(words[0]);
+
+	FILE *file = open_output(path);
+	unsigned state = 2;
+	for (int line = 0; line < 45000; ++line) {
+		fputs(" ", file);
+		for (int i = 0; i < 9; ++i) fprintf(file, " %s", words[next_random(&state) % words_count]);
+		fputs("\n", file);
+	}
+	fclose(file);
+}
+
+// Every third body is a proc, a func calling it or an inline func calling that, main expands
+// the first 100 inline funcs, the rest is unreachable
+static void
+gen_program(int n, const char *path)
+{
+	const int m = n / 4;
+	if (m == 0) {
+		fprintf(stderr, "error: Expected at least 4 procs/funcs\n");
+		exit(EXIT_FAILURE);
+	}
+
+	const size_t path_len = strlen(path);
+	const size_t stem_len = path_len > 5 && 0 == strcmp(path + path_len - 5, ".prac") ? path_len - 5 : path_len;
+	char *bindings_path = (char *) malloc(stem_len + sizeof("_bindings.prac"));
+	memcpy(bindings_path, path, stem_len);
+	strcpy(bindings_path + stem_len, "_bindings.prac");
+
+	FILE *bindings = open_output(bindings_path);
+	for (int i = 0; i < m; ++i) {
+		fprintf(bindings, "extern proc ext_proc_%d\n  int a\n  int b\nend\n\nextern func ext_func_%d int end\n\n", i, i);
+	}
+	fclose(bindings);
+
+	FILE *file = open_output(path);
+
+	// Included by its name, the bindings are next to the program
+	const char *bindings_name = strrchr(bindings_path, '/');
+	fprintf(file, "include \"%s\"\n\n", bindings_name ? bindings_name + 1 : bindings_path);
+
+	for (int i = 0; i < m; ++i) {
+		fprintf(file, "const C%d %d end\n", i, i);
+		fprintf(file, "var v%d C%d end\n", i, i);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		switch (i % 3) {
+		case 0: {
+			fprintf(file, "proc p%d do\n  # comment %d\n  v%d! C%d + 3 * dup . drop\n  \"hello %d\\n\" .\nend\n\n",
+							i, i, i % m, i % m, i);
+		} break;
+		case 1: {
+			fprintf(file, "func f%d int do\n  1 while dup 10 < do\n    dup 2 %% 0 = if\n      v%d! 1 + !v%d\n"
+							"    else\n      p%d!\n    end\n    1 +\n  end\nend\n\n", i, i % m, i % m, i - 1);
+		} break;
+		default: {
+			fprintf(file, "inline func g%d int do\n  f%d! %d + C0 |\nend\n\n", i, i - 1, i);
+		} break;
+		}
+	}
+
+	fputs("func main int do\n", file);
+	for (int i = 2; i < n && i < 300; i += 3) fprintf(file, "  g%d! .\n", i);
+	fputs("  0\nend\n", file);
+
+	fclose(file);
+	free(bindings_path);
+}
+
+static void
+gen_inline(const char *path)
+{
+	FILE *file = open_output(path);
+
+	fputs("inline func f0 int int x do x 1 + end\n", file);
+	for (int i = 1; i <= 48; ++i) {
+		fprintf(file, "inline func f%d int int x do", i);
+		for (int j = 0; j < 250; ++j) fputs(" 1", file);
+		fprintf(file, " x f%d!", i - 1);
+		for (int j = 0; j < 250; ++j) fputs(" drop", file);
+		fputs(" end\n", file);
+	}
+
+	fputs("\nfunc main int do\n", file);
+	for (int i = 0; i < 1500; ++i) fprintf(file, "  %d f48! drop\n", i);
+	fputs("  0\nend\n", file);
+
+	fclose(file);
+}
+
+int
+main(int argc, const char *argv[])
+{
+	if (argc == 3 && 0 == strcmp(argv[1], "lex")) {
+		gen_lex(argv[2]);
+	} else if (argc == 4 && 0 == strcmp(argv[1], "program")) {
+		gen_program(atoi(argv[2]), argv[3]);
+	} else if (argc == 3 && 0 == strcmp(argv[1], "inline")) {
+		gen_inline(argv[2]);
+	} else {
+		fprintf(stderr, "Usage: %s lex <file> | program <n> <file> | inline <file>\n", argv[0]);
+		return 1;
+	}
+	return 0;
+}
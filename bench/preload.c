@@ -0,0 +1,40 @@
+// Preloaded by `bench.sh` to count the calls to malloc and realloc of a compiler run and report
+// its peak RSS, so builds without the DEBUG statistics can be measured too. glibc only.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long mallocs = 0;
+static unsigned long reallocs = 0;
+
+void *
+malloc(size_t size)
+{
+	mallocs++;
+	return __libc_malloc(size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	reallocs++;
+	return __libc_realloc(ptr, size);
+}
+
+// Written by the process that exits, printf could allocate
+__attribute__((destructor)) static void
+print_counts(void)
+{
+	struct rusage usage = {0};
+	getrusage(RUSAGE_SELF, &usage);
+
+	char buffer[128];
+	const int len = snprintf(buffer, sizeof(buffer), "mallocs %lu reallocs %lu max_rss %ld Kb\n",
+		mallocs, reallocs, usage.ru_maxrss);
+	if (write(STDERR_FILENO, buffer, (size_t) len) < 0) return;
+}
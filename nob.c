@@ -49,6 +49,31 @@ parse_flags(int argc, const char *argv[])
 	}
 }
 
+// Cached tokens and bodies are only valid for the compiler built from the same sources.
+// The hashes of the files are added, so the order the directory is read in does not matter.
+static u32
+sources_hash(const Nob_File_Paths *src_files)
+{
+	u32 hash = 0;
+	for (size_t i = 0; i < src_files->count; ++i) {
+		if (*src_files->items[i] == '.') continue;
+
+		Nob_String_Builder sb = {0};
+		nob_sb_append_cstr(&sb, SRC_DIR"/");
+		nob_sb_append_cstr(&sb, src_files->items[i]);
+		nob_sb_append_null(&sb);
+
+		// The path stays in front of the content, a renamed file changes the hash too
+		if (!nob_read_entire_file(sb.items, &sb)) exit(1);
+
+		u32 file_hash = 2166136261u;
+		for (size_t j = 0; j < sb.count; ++j) file_hash = (file_hash ^ (u8) sb.items[j]) * 16777619u;
+		hash += file_hash;
+		nob_sb_free(sb);
+	}
+	return hash;
+}
+
 int
 main(int argc, const char *argv[])
 {
@@ -115,6 +140,8 @@ main(int argc, const char *argv[])
 		nob_da_append(&src_files_prefixed, sb.items);
 	}
 
+	const char *source_hash = nob_temp_sprintf("-DPRACC_SOURCE_HASH=%uu", sources_hash(&src_files_));
+
 	// Avoid `[INFO] directory `build` already exists` message.
 	if (!nob_file_exists(BUILD_DIR)) {
 		nob_mkdir_if_not_exists(BUILD_DIR);
@@ -129,9 +156,9 @@ main(int argc, const char *argv[])
 		{
 			cmd.count = 0;
 			if (release_mode) {
-				nob_cmd_append(&cmd, CC, CFLAGS, "-O3", WFLAGS, "-c", c_files.items[i], "-o", obj_files.items[i]);
+				nob_cmd_append(&cmd, CC, CFLAGS, "-O3", WFLAGS, source_hash, "-c", c_files.items[i], "-o", obj_files.items[i]);
 			} else {
-				nob_cmd_append(&cmd, CC, CFLAGS, "-O0", WFLAGS, "-c", c_files.items[i], "-o", obj_files.items[i]);
+				nob_cmd_append(&cmd, CC, CFLAGS, "-O0", WFLAGS, source_hash, "-c", c_files.items[i], "-o", obj_files.items[i]);
 			}
 #ifdef DEBUG
 			nob_cmd_run_sync(cmd, true);
@@ -151,9 +178,9 @@ main(int argc, const char *argv[])
 	{
 		cmd.count = 0;
 		if (release_mode) {
-			nob_cmd_append(&cmd, CC, "-o", BIN_FILE, CFLAGS, "-O3", WFLAGS);
+			nob_cmd_append(&cmd, CC, "-o", BIN_FILE, CFLAGS, "-O3", WFLAGS, source_hash);
 		} else {
-			nob_cmd_append(&cmd, CC, "-o", BIN_FILE, CFLAGS, "-O0", WFLAGS);
+			nob_cmd_append(&cmd, CC, "-o", BIN_FILE, CFLAGS, "-O0", WFLAGS, source_hash);
 		}
 		for (size_t i = 0; i < obj_files.count; ++i) {
 			nob_cmd_append(&cmd, obj_files.items[i]);
@@ -0,0 +1,1172 @@
+#include "lib.h"
+#include "insn.h"
+#include "symbol.h"
+#include "common.h"
+#include "assembler.h"
+
+#include <elf.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ASM_NAME_MAX 256
+#define ASM_BUFFER_INIT_CAP 4096
+
+// The records come from the compiler, an error here is a bug of it. `insn` counts them from 1.
+#define asm_error(as_, fmt, ...) \
+	report_error("assembler: record %u: error: " fmt, (as_)->insn, __VA_ARGS__)
+
+#define asm_str(as_, id) ((as_)->names.syms[id].str)
+
+typedef enum {
+	ASM_SECTION_NONE,
+	ASM_SECTION_TEXT,
+	ASM_SECTION_DATA,
+	ASM_SECTION_BSS,
+	ASM_SECTION_EXTERN,
+} asm_section_t;
+
+// Label or extern. `section` is `ASM_SECTION_NONE` till it is defined.
+typedef struct {
+	u8 section;
+	bool global;
+	u32 elf_index;
+	u64 value;
+} asm_sym_t;
+
+typedef enum {
+	// Displacement of a memory operand relative to the next instruction
+	FIXUP_REL32,
+	// Target of `call` or `jmp`, an extern one goes through the PLT of the linker
+	FIXUP_BRANCH,
+	FIXUP_ABS32S,
+	FIXUP_ABS64,
+} fixup_kind_t;
+
+// Bytes at `offset` of the section to be patched with the address of `sym` plus `addend`.
+// The relative ones are taken from `offset` itself, `addend` accounts for the bytes till the end.
+typedef struct {
+	u8 section;
+	u8 kind;
+	u32 insn;
+	u32 offset;
+	sym_id_t sym;
+	i64 addend;
+} fixup_t;
+
+typedef struct {
+	u8 *bytes;
+	size_t len;
+	size_t cap;
+} asm_buffer_t;
+
+typedef struct {
+	u32 insn;
+	asm_section_t section;
+
+	asm_buffer_t text;
+	asm_buffer_t data;
+	u64 bss_len;
+
+	// Names of labels and externs, the local labels are qualified by their scope
+	symtab_t names;
+	asm_sym_t *syms;
+	u32 syms_cap;
+
+	fixup_t *fixups;
+	size_t fixups_len;
+	size_t fixups_cap;
+
+	bool has_externs;
+
+	// Last label that is not local, the ones starting with `.` belong to it
+	char scope[ASM_NAME_MAX];
+	u32 scope_len;
+} Assembler;
+
+// Operand of a record with its label interned. `size` is 0 if it is not known: an immediate,
+// or memory without a size.
+typedef struct {
+	operand_kind_t kind;
+	u8 size;
+	u8 reg;
+	i8 base;
+	i8 index;
+	u8 scale;
+	i64 value;
+	sym_id_t sym;
+} asm_operand_t;
+
+typedef enum {
+	ENCODING_ALU,
+	ENCODING_MOV,
+	ENCODING_MOVZX,
+	ENCODING_MOVSXD,
+	ENCODING_LEA,
+	ENCODING_TEST,
+	ENCODING_PUSH,
+	ENCODING_POP,
+	ENCODING_CALL,
+	ENCODING_JMP,
+	ENCODING_JCC,
+	ENCODING_SETCC,
+	ENCODING_UNARY,
+	ENCODING_INCDEC,
+	ENCODING_IMUL,
+	ENCODING_ENTER,
+	ENCODING_PLAIN,
+} encoding_t;
+
+// `ext` is the opcode extension of the group, or the length of the encoding of a plain one
+typedef struct {
+	const char *name;
+	encoding_t encoding;
+	u8 ext;
+	const char *bytes;
+} mnemonic_t;
+
+static const mnemonic_t MNEMONICS[OP_COUNT] = {
+	[OP_ADD]     = { "add",     ENCODING_ALU,    0, NULL },
+	[OP_OR]      = { "or",      ENCODING_ALU,    1, NULL },
+	[OP_AND]     = { "and",     ENCODING_ALU,    4, NULL },
+	[OP_SUB]     = { "sub",     ENCODING_ALU,    5, NULL },
+	[OP_XOR]     = { "xor",     ENCODING_ALU,    6, NULL },
+	[OP_CMP]     = { "cmp",     ENCODING_ALU,    7, NULL },
+	[OP_MOV]     = { "mov",     ENCODING_MOV,    0, NULL },
+	[OP_MOVZX]   = { "movzx",   ENCODING_MOVZX,  0, NULL },
+	[OP_MOVSXD]  = { "movsxd",  ENCODING_MOVSXD, 0, NULL },
+	[OP_LEA]     = { "lea",     ENCODING_LEA,    0, NULL },
+	[OP_TEST]    = { "test",    ENCODING_TEST,   0, NULL },
+	[OP_PUSH]    = { "push",    ENCODING_PUSH,   0, NULL },
+	[OP_POP]     = { "pop",     ENCODING_POP,    0, NULL },
+	[OP_CALL]    = { "call",    ENCODING_CALL,   0, NULL },
+	[OP_JMP]     = { "jmp",     ENCODING_JMP,    0, NULL },
+	[OP_JCC]     = { "j<cc>",   ENCODING_JCC,    0, NULL },
+	[OP_SETCC]   = { "set<cc>", ENCODING_SETCC,  0, NULL },
+	[OP_NOT]     = { "not",     ENCODING_UNARY,  2, NULL },
+	[OP_DIV]     = { "div",     ENCODING_UNARY,  6, NULL },
+	[OP_IDIV]    = { "idiv",    ENCODING_UNARY,  7, NULL },
+	[OP_INC]     = { "inc",     ENCODING_INCDEC, 0, NULL },
+	[OP_DEC]     = { "dec",     ENCODING_INCDEC, 1, NULL },
+	[OP_IMUL]    = { "imul",    ENCODING_IMUL,   0, NULL },
+	[OP_ENTER]   = { "enter",   ENCODING_ENTER,  0, NULL },
+	[OP_RET]     = { "ret",     ENCODING_PLAIN,  1, "\xC3" },
+	[OP_LEAVE]   = { "leave",   ENCODING_PLAIN,  1, "\xC9" },
+	[OP_SYSCALL] = { "syscall", ENCODING_PLAIN,  2, "\x0F\x05" },
+	[OP_CDQE]    = { "cdqe",    ENCODING_PLAIN,  2, "\x48\x98" },
+	[OP_CQO]     = { "cqo",     ENCODING_PLAIN,  2, "\x48\x99" },
+};
+
+INLINE bool
+fits_i8(i64 value)
+{
+	return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+INLINE bool
+fits_i32(i64 value)
+{
+	return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static void
+buffer_reserve(asm_buffer_t *buf, size_t len)
+{
+	if (buf->len + len <= buf->cap) return;
+	while (buf->len + len > buf->cap) buf->cap = buf->cap ? buf->cap * 2 : ASM_BUFFER_INIT_CAP;
+	buf->bytes = (u8 *) realloc(buf->bytes, buf->cap);
+}
+
+static void
+buffer_append(asm_buffer_t *buf, const void *data, size_t len)
+{
+	buffer_reserve(buf, len);
+	memcpy(buf->bytes + buf->len, data, len);
+	buf->len += len;
+}
+
+static void
+buffer_zeros(asm_buffer_t *buf, size_t len)
+{
+	buffer_reserve(buf, len);
+	memset(buf->bytes + buf->len, 0, len);
+	buf->len += len;
+}
+
+INLINE void
+buffer_align(asm_buffer_t *buf, size_t align)
+{
+	buffer_zeros(buf, (align - buf->len % align) % align);
+}
+
+INLINE size_t
+align_up(size_t value, size_t align)
+{
+	return (value + align - 1) / align * align;
+}
+
+/* ------------------------------------------------------- */
+/* Symbols                                                 */
+/* ------------------------------------------------------- */
+
+// Intern the name, a local one is qualified by the current scope
+static sym_id_t
+asm_name(Assembler *as, const char *str, u32 len)
+{
+	char qualified[ASM_NAME_MAX];
+	if (len > 0 && str[0] == '.') {
+		if (as->scope_len + len >= ASM_NAME_MAX) asm_error(as, "label is too long: `%.*s`", len, str);
+		memcpy(qualified, as->scope, as->scope_len);
+		memcpy(qualified + as->scope_len, str, len);
+		str = qualified;
+		len += as->scope_len;
+	}
+
+	const sym_id_t id = symtab_intern(&as->names, str, len, fnv1a(str, len));
+	if (id >= as->syms_cap) {
+		u32 cap = as->syms_cap ? as->syms_cap : ASM_BUFFER_INIT_CAP;
+		while (cap <= id) cap *= 2;
+		as->syms = (asm_sym_t *) realloc(as->syms, sizeof(asm_sym_t) * cap);
+		memset(as->syms + as->syms_cap, 0, sizeof(asm_sym_t) * (cap - as->syms_cap));
+		as->syms_cap = cap;
+	}
+
+	return id;
+}
+
+INLINE u64
+section_position(const Assembler *as)
+{
+	switch (as->section) {
+	case ASM_SECTION_TEXT: return as->text.len;
+	case ASM_SECTION_DATA: return as->data.len;
+	case ASM_SECTION_BSS:  return as->bss_len;
+	case ASM_SECTION_NONE:
+	case ASM_SECTION_EXTERN: break;
+	}
+	return 0;
+}
+
+static void
+define_symbol(Assembler *as, const char *str, u32 len, asm_section_t section, u64 value)
+{
+	if (str[0] != '.') {
+		if (len >= ASM_NAME_MAX) asm_error(as, "label is too long: `%.*s`", len, str);
+		memcpy(as->scope, str, len);
+		as->scope_len = len;
+	}
+
+	const sym_id_t id = asm_name(as, str, len);
+	asm_sym_t *sym = &as->syms[id];
+	if (sym->section != ASM_SECTION_NONE) {
+		asm_error(as, "`%s` is already defined", asm_str(as, id));
+	}
+
+	sym->section = (u8) section;
+	sym->value = value;
+}
+
+INLINE void
+define_label(Assembler *as, const char *str, u32 len)
+{
+	if (as->section == ASM_SECTION_NONE) asm_error(as, "label `%.*s` outside of a section", len, str);
+	define_symbol(as, str, len, as->section, section_position(as));
+}
+
+/* ------------------------------------------------------- */
+/* Encoding                                                */
+/* ------------------------------------------------------- */
+
+INLINE void
+emit_u8(Assembler *as, u8 byte)
+{
+	buffer_append(&as->text, &byte, 1);
+}
+
+INLINE void
+emit_imm(Assembler *as, i64 value, u8 len)
+{
+	// Little endian, as the target
+	buffer_append(&as->text, &value, len);
+}
+
+static void
+add_fixup(Assembler *as, fixup_kind_t kind, sym_id_t sym, i64 addend)
+{
+	if (as->fixups_len >= as->fixups_cap) {
+		as->fixups_cap = as->fixups_cap ? as->fixups_cap * 2 : ASM_BUFFER_INIT_CAP;
+		as->fixups = (fixup_t *) realloc(as->fixups, sizeof(fixup_t) * as->fixups_cap);
+	}
+
+	const asm_buffer_t *buf = as->section == ASM_SECTION_TEXT ? &as->text : &as->data;
+	as->fixups[as->fixups_len++] = (fixup_t) {
+		.section = (u8) as->section,
+		.kind = (u8) kind,
+		.insn = as->insn,
+		.offset = (u32) buf->len,
+		.sym = sym,
+		.addend = addend
+	};
+}
+
+INLINE bool
+needs_rex8(const asm_operand_t *op)
+{
+	// spl, bpl, sil and dil are ah, ch, dh and bh without REX
+	return op->kind == OPERAND_REG && op->size == 1 && op->reg >= 4 && op->reg < 8;
+}
+
+// Prefixes, opcode, ModRM, SIB and displacement. `reg` goes to the reg field, `size` selects
+// the operand size prefixes, and `imm_len` bytes of an immediate follow the displacement.
+static void
+emit_op(Assembler *as, const char *opcode, u8 opcode_len, u8 size, u8 reg, bool reg_rex8,
+				const asm_operand_t *rm, u8 imm_len)
+{
+	if (size == 2) emit_u8(as, 0x66);
+
+	u8 rex = 0x40;
+	if (size == 8) rex |= 0x08;
+	if (reg & 8) rex |= 0x04;
+	if (rm->kind == OPERAND_REG && (rm->reg & 8)) rex |= 0x01;
+	if (rm->kind == OPERAND_MEM && rm->base >= 0 && (rm->base & 8)) rex |= 0x01;
+	if (rm->kind == OPERAND_MEM && rm->index >= 0 && (rm->index & 8)) rex |= 0x02;
+	if (rex != 0x40 || reg_rex8 || needs_rex8(rm)) emit_u8(as, rex);
+
+	for (u8 i = 0; i < opcode_len; ++i) emit_u8(as, (u8) opcode[i]);
+
+	const u8 reg_bits = (u8) ((reg & 7) << 3);
+	if (rm->kind == OPERAND_REG) {
+		emit_u8(as, 0xC0 | reg_bits | (rm->reg & 7));
+		return;
+	}
+
+	if (rm->kind != OPERAND_MEM) asm_error(as, "expected a register or memory, but got: %s", "an immediate");
+
+	// A label alone is addressed relative to the next instruction, a number alone is absolute
+	if (rm->base < 0 && rm->index < 0) {
+		if (rm->sym != SYM_NONE) {
+			emit_u8(as, 0x05 | reg_bits);
+			add_fixup(as, FIXUP_REL32, rm->sym, rm->value - 4 - imm_len);
+			emit_imm(as, 0, 4);
+		} else {
+			if (!fits_i32(rm->value)) asm_error(as, "address does not fit in 32 bits: 0x%lX", rm->value);
+			emit_u8(as, 0x04 | reg_bits);
+			emit_u8(as, 0x25);
+			emit_imm(as, rm->value, 4);
+		}
+		return;
+	}
+
+	if (rm->index == 4) asm_error(as, "`%s` can't be an index", "rsp");
+	if (!fits_i32(rm->value)) asm_error(as, "displacement does not fit in 32 bits: 0x%lX", rm->value);
+
+	u8 mod = 2;
+	if (rm->base < 0) mod = 0;
+	else if (rm->value == 0 && (rm->base & 7) != 5) mod = 0;
+	else if (fits_i8(rm->value)) mod = 1;
+
+	const bool sib = rm->index >= 0 || rm->base < 0 || (rm->base & 7) == 4;
+	emit_u8(as, (u8) (mod << 6) | reg_bits | (sib ? 4 : (rm->base & 7)));
+
+	if (sib) {
+		u8 scale = 0;
+		while ((1u << scale) < rm->scale) scale++;
+		const u8 index = rm->index >= 0 ? (rm->index & 7) : 4;
+		const u8 base = rm->base >= 0 ? (rm->base & 7) : 5;
+		emit_u8(as, (u8) (scale << 6) | (u8) (index << 3) | base);
+	}
+
+	if (mod == 1) emit_imm(as, rm->value, 1);
+	else if (mod == 2 || rm->base < 0) emit_imm(as, rm->value, 4);
+}
+
+INLINE void
+emit_op1(Assembler *as, u8 opcode, u8 size, u8 reg, bool reg_rex8, const asm_operand_t *rm, u8 imm_len)
+{
+	const char byte = (char) opcode;
+	emit_op(as, &byte, 1, size, reg, reg_rex8, rm, imm_len);
+}
+
+INLINE void
+emit_op2(Assembler *as, u8 opcode, u8 opcode2, u8 size, u8 reg, bool reg_rex8, const asm_operand_t *rm, u8 imm_len)
+{
+	const char bytes[2] = { (char) opcode, (char) opcode2 };
+	emit_op(as, bytes, 2, size, reg, reg_rex8, rm, imm_len);
+}
+
+// Opcode with the register in its low bits, as in `push`, `pop` and `mov` of an immediate
+static void
+emit_op_reg(Assembler *as, u8 opcode, u8 size, const asm_operand_t *reg)
+{
+	if (size == 2) emit_u8(as, 0x66);
+	u8 rex = 0x40;
+	if (size == 8) rex |= 0x08;
+	if (reg->reg & 8) rex |= 0x01;
+	if (rex != 0x40 || needs_rex8(reg)) emit_u8(as, rex);
+	emit_u8(as, opcode + (reg->reg & 7));
+}
+
+INLINE u8
+imm_len_of(u8 size)
+{
+	return size == 8 ? 4 : size;
+}
+
+static void
+expect_operands(Assembler *as, const char *name, u32 count, u32 expected)
+{
+	if (count != expected) {
+		asm_error(as, "`%s` expects %u operands, but got %u", name, expected, count);
+	}
+}
+
+static u8
+operands_size(Assembler *as, const char *name, const asm_operand_t *dst, const asm_operand_t *src)
+{
+	if (dst->kind == OPERAND_REG && src->kind == OPERAND_REG && dst->size != src->size) {
+		asm_error(as, "operands of `%s` differ in size", name);
+	}
+
+	const u8 size = dst->size ? dst->size : src->size;
+	if (size == 0) asm_error(as, "operand size of `%s` is not specified", name);
+	return size;
+}
+
+static void
+encode_alu(Assembler *as, const mnemonic_t *mn, const asm_operand_t *ops, u32 count)
+{
+	expect_operands(as, mn->name, count, 2);
+	const asm_operand_t *dst = &ops[0], *src = &ops[1];
+	const u8 size = operands_size(as, mn->name, dst, src);
+	const u8 base = (u8) (mn->ext * 8);
+
+	if (src->kind == OPERAND_REG) {
+		if (dst->kind == OPERAND_IMM) asm_error(as, "immediate destination of `%s`", mn->name);
+		emit_op1(as, base + (size == 1 ? 0 : 1), size, src->reg, needs_rex8(src), dst, 0);
+	} else if (src->kind == OPERAND_MEM) {
+		if (dst->kind != OPERAND_REG) asm_error(as, "two memory operands of `%s`", mn->name);
+		emit_op1(as, base + (size == 1 ? 2 : 3), size, dst->reg, needs_rex8(dst), src, 0);
+	} else {
+		if (src->sym != SYM_NONE) asm_error(as, "label as an immediate of `%s`", mn->name);
+		if (size == 1) {
+			emit_op1(as, 0x80, size, mn->ext, false, dst, 1);
+			emit_imm(as, src->value, 1);
+		} else if (fits_i8(src->value)) {
+			emit_op1(as, 0x83, size, mn->ext, false, dst, 1);
+			emit_imm(as, src->value, 1);
+		} else {
+			if (size == 8 && !fits_i32(src->value)) asm_error(as, "immediate of `%s` does not fit in 32 bits", mn->name);
+			emit_op1(as, 0x81, size, mn->ext, false, dst, imm_len_of(size));
+			emit_imm(as, src->value, imm_len_of(size));
+		}
+	}
+}
+
+static void
+encode_mov(Assembler *as, const mnemonic_t *mn, const asm_operand_t *ops, u32 count)
+{
+	expect_operands(as, mn->name, count, 2);
+	const asm_operand_t *dst = &ops[0], *src = &ops[1];
+	const u8 size = operands_size(as, mn->name, dst, src);
+
+	if (src->kind == OPERAND_REG) {
+		if (dst->kind == OPERAND_IMM) asm_error(as, "immediate destination of `%s`", mn->name);
+		emit_op1(as, size == 1 ? 0x88 : 0x89, size, src->reg, needs_rex8(src), dst, 0);
+	} else if (src->kind == OPERAND_MEM) {
+		if (dst->kind != OPERAND_REG) asm_error(as, "two memory operands of `%s`", mn->name);
+		emit_op1(as, size == 1 ? 0x8A : 0x8B, size, dst->reg, needs_rex8(dst), src, 0);
+	} else if (dst->kind == OPERAND_REG) {
+		if (size == 8 && src->sym != SYM_NONE) {
+			emit_op_reg(as, 0xB8, 8, dst);
+			add_fixup(as, FIXUP_ABS64, src->sym, src->value);
+			emit_imm(as, 0, 8);
+		} else if (src->sym != SYM_NONE) {
+			asm_error(as, "label as an immediate of `%s` needs a 64-bit register", mn->name);
+		} else if (size == 8 && fits_i32(src->value)) {
+			emit_op1(as, 0xC7, 8, 0, false, dst, 4);
+			emit_imm(as, src->value, 4);
+		} else if (size == 8 && (u64) src->value <= UINT32_MAX) {
+			// The upper half is cleared by the 32-bit move
+			emit_op_reg(as, 0xB8, 4, dst);
+			emit_imm(as, src->value, 4);
+		} else if (size == 1) {
+			emit_op_reg(as, 0xB0, 1, dst);
+			emit_imm(as, src->value, 1);
+		} else {
+			emit_op_reg(as, 0xB8, size, dst);
+			emit_imm(as, src->value, size);
+		}
+	} else {
+		if (src->sym != SYM_NONE) asm_error(as, "label as an immediate of `%s` into memory", mn->name);
+		if (size == 8 && !fits_i32(src->value)) asm_error(as, "immediate of `%s` does not fit in 32 bits", mn->name);
+		emit_op1(as, size == 1 ? 0xC6 : 0xC7, size, 0, false, dst, imm_len_of(size));
+		emit_imm(as, src->value, imm_len_of(size));
+	}
+}
+
+// Relative target of `call`, `jmp` and `j<cc>`
+static void
+emit_branch_target(Assembler *as, const char *name, const asm_operand_t *op)
+{
+	if (op->sym == SYM_NONE) asm_error(as, "`%s` to an absolute address", name);
+	add_fixup(as, FIXUP_BRANCH, op->sym, op->value - 4);
+	emit_imm(as, 0, 4);
+}
+
+static void
+encode_push_pop(Assembler *as, const mnemonic_t *mn, const asm_operand_t *ops, u32 count)
+{
+	expect_operands(as, mn->name, count, 1);
+	const asm_operand_t *op = &ops[0];
+	const bool push = mn->encoding == ENCODING_PUSH;
+
+	if (op->kind == OPERAND_REG) {
+		if (op->size != 8) asm_error(as, "`%s` of a register that is not 64-bit", mn->name);
+		emit_op_reg(as, push ? 0x50 : 0x58, 0, op);
+	} else if (op->kind == OPERAND_MEM) {
+		emit_op1(as, push ? 0xFF : 0x8F, 0, push ? 6 : 0, false, op, 0);
+	} else if (!push) {
+		asm_error(as, "`%s` into an immediate", mn->name);
+	} else if (op->sym != SYM_NONE) {
+		emit_u8(as, 0x68);
+		add_fixup(as, FIXUP_ABS32S, op->sym, op->value);
+		emit_imm(as, 0, 4);
+	} else if (fits_i8(op->value)) {
+		emit_u8(as, 0x6A);
+		emit_imm(as, op->value, 1);
+	} else {
+		if (!fits_i32(op->value)) asm_error(as, "immediate of `%s` does not fit in 32 bits", mn->name);
+		emit_u8(as, 0x68);
+		emit_imm(as, op->value, 4);
+	}
+}
+
+static void
+encode_instruction(Assembler *as, const mnemonic_t *mn, u8 cc, const asm_operand_t *ops, u32 count)
+{
+	switch (mn->encoding) {
+	case ENCODING_ALU: encode_alu(as, mn, ops, count); break;
+	case ENCODING_MOV: encode_mov(as, mn, ops, count); break;
+
+	case ENCODING_MOVZX: {
+		expect_operands(as, mn->name, count, 2);
+		if (ops[0].kind != OPERAND_REG || ops[1].kind == OPERAND_IMM) asm_error(as, "invalid operands of `%s`", mn->name);
+		if (ops[1].size != 1 && ops[1].size != 2) asm_error(as, "source of `%s` has to be a byte or a word", mn->name);
+		emit_op2(as, 0x0F, ops[1].size == 1 ? 0xB6 : 0xB7, ops[0].size, ops[0].reg, false, &ops[1], 0);
+	} break;
+
+	case ENCODING_MOVSXD: {
+		expect_operands(as, mn->name, count, 2);
+		if (ops[0].kind != OPERAND_REG || ops[0].size != 8 || ops[1].kind == OPERAND_IMM) {
+			asm_error(as, "invalid operands of `%s`", mn->name);
+		}
+		emit_op1(as, 0x63, 8, ops[0].reg, false, &ops[1], 0);
+	} break;
+
+	case ENCODING_LEA: {
+		expect_operands(as, mn->name, count, 2);
+		if (ops[0].kind != OPERAND_REG || ops[1].kind != OPERAND_MEM) asm_error(as, "invalid operands of `%s`", mn->name);
+		emit_op1(as, 0x8D, ops[0].size, ops[0].reg, false, &ops[1], 0);
+	} break;
+
+	case ENCODING_TEST: {
+		expect_operands(as, mn->name, count, 2);
+		const u8 size = operands_size(as, mn->name, &ops[0], &ops[1]);
+		if (ops[1].kind == OPERAND_REG) {
+			emit_op1(as, size == 1 ? 0x84 : 0x85, size, ops[1].reg, needs_rex8(&ops[1]), &ops[0], 0);
+		} else if (ops[1].kind == OPERAND_IMM && ops[1].sym == SYM_NONE) {
+			emit_op1(as, size == 1 ? 0xF6 : 0xF7, size, 0, false, &ops[0], imm_len_of(size));
+			emit_imm(as, ops[1].value, imm_len_of(size));
+		} else {
+			asm_error(as, "invalid operands of `%s`", mn->name);
+		}
+	} break;
+
+	case ENCODING_PUSH:
+	case ENCODING_POP: encode_push_pop(as, mn, ops, count); break;
+
+	case ENCODING_CALL:
+	case ENCODING_JMP: {
+		expect_operands(as, mn->name, count, 1);
+		const bool call = mn->encoding == ENCODING_CALL;
+		if (ops[0].kind == OPERAND_IMM) {
+			emit_u8(as, call ? 0xE8 : 0xE9);
+			emit_branch_target(as, mn->name, &ops[0]);
+		} else {
+			emit_op1(as, 0xFF, 0, call ? 2 : 4, false, &ops[0], 0);
+		}
+	} break;
+
+	case ENCODING_JCC: {
+		expect_operands(as, mn->name, count, 1);
+		if (ops[0].kind != OPERAND_IMM) asm_error(as, "`%s` to a register or memory", mn->name);
+		emit_u8(as, 0x0F);
+		emit_u8(as, 0x80 + cc);
+		emit_branch_target(as, mn->name, &ops[0]);
+	} break;
+
+	case ENCODING_SETCC: {
+		expect_operands(as, mn->name, count, 1);
+		if (ops[0].kind == OPERAND_IMM || (ops[0].size != 0 && ops[0].size != 1)) {
+			asm_error(as, "`%s` needs a byte", mn->name);
+		}
+		emit_op2(as, 0x0F, 0x90 + cc, 1, 0, false, &ops[0], 0);
+	} break;
+
+	case ENCODING_UNARY:
+	case ENCODING_INCDEC: {
+		expect_operands(as, mn->name, count, 1);
+		if (ops[0].kind == OPERAND_IMM) asm_error(as, "immediate operand of `%s`", mn->name);
+		if (ops[0].size == 0) asm_error(as, "operand size of `%s` is not specified", mn->name);
+		const u8 opcode = mn->encoding == ENCODING_UNARY ? 0xF6 : 0xFE;
+		emit_op1(as, opcode + (ops[0].size == 1 ? 0 : 1), ops[0].size, mn->ext, false, &ops[0], 0);
+	} break;
+
+	case ENCODING_IMUL: {
+		expect_operands(as, mn->name, count, 2);
+		if (ops[0].kind != OPERAND_REG || ops[1].kind == OPERAND_IMM) asm_error(as, "invalid operands of `%s`", mn->name);
+		emit_op2(as, 0x0F, 0xAF, operands_size(as, mn->name, &ops[0], &ops[1]), ops[0].reg, false, &ops[1], 0);
+	} break;
+
+	case ENCODING_ENTER: {
+		expect_operands(as, mn->name, count, 2);
+		if (ops[0].kind != OPERAND_IMM || ops[1].kind != OPERAND_IMM) asm_error(as, "invalid operands of `%s`", mn->name);
+		emit_u8(as, 0xC8);
+		emit_imm(as, ops[0].value, 2);
+		emit_imm(as, ops[1].value, 1);
+	} break;
+
+	case ENCODING_PLAIN: {
+		expect_operands(as, mn->name, count, 0);
+		buffer_append(&as->text, mn->bytes, mn->ext);
+	} break;
+	}
+}
+
+/* ------------------------------------------------------- */
+/* Records                                                 */
+/* ------------------------------------------------------- */
+
+static sym_id_t
+label_sym(Assembler *as, label_t label)
+{
+	char buf[ASM_NAME_MAX];
+	const char *name = label_name(label, buf, sizeof(buf));
+	return asm_name(as, name, (u32) strlen(name));
+}
+
+static asm_operand_t
+asm_operand(Assembler *as, const operand_t *operand)
+{
+	asm_operand_t op = {
+		.kind = (operand_kind_t) operand->kind,
+		.size = operand->size,
+		.base = -1,
+		.index = -1,
+		.scale = 1,
+		.value = operand->value,
+		.sym = operand->label.kind == LABEL_NONE ? SYM_NONE : label_sym(as, operand->label),
+	};
+
+	switch ((operand_kind_t) operand->kind) {
+	case OPERAND_REG: op.reg = operand->reg; break;
+	case OPERAND_MEM: {
+		if (operand->reg != REG_NONE) op.base = (i8) operand->reg;
+		if (operand->index != REG_NONE) op.index = (i8) operand->index;
+		if (operand->scale > 1) op.scale = operand->scale;
+	} break;
+	case OPERAND_IMM: op.size = 0; break;
+	case OPERAND_NONE: UNREACHABLE; break;
+	}
+
+	return op;
+}
+
+INLINE void
+define_label_of(Assembler *as, const insn_t *insn)
+{
+	char buf[ASM_NAME_MAX];
+	const char *name = label_name(insn->operands[0].label, buf, sizeof(buf));
+	define_label(as, name, (u32) strlen(name));
+}
+
+INLINE asm_buffer_t *
+data_buffer(Assembler *as, u8 unit)
+{
+	if (as->section == ASM_SECTION_NONE) asm_error(as, "data outside of a section, unit: %u", unit);
+	if (as->section == ASM_SECTION_BSS) asm_error(as, "initialized data in the bss section, unit: %u", unit);
+	return as->section == ASM_SECTION_TEXT ? &as->text : &as->data;
+}
+
+static void
+assemble_op(Assembler *as, const insn_t *insn)
+{
+	const mnemonic_t *mn = &MNEMONICS[insn->op];
+	if (as->section != ASM_SECTION_TEXT) asm_error(as, "instruction outside of the text section: `%s`", mn->name);
+
+	asm_operand_t ops[INSN_OPERANDS_MAX];
+	const u32 count = insn_operands_count(insn);
+	for (u32 i = 0; i < count; ++i) ops[i] = asm_operand(as, &insn->operands[i]);
+
+	encode_instruction(as, mn, insn->cc, ops, count);
+}
+
+static void
+assemble_quad(Assembler *as, const insn_t *insn)
+{
+	asm_buffer_t *buf = data_buffer(as, 8);
+	define_label_of(as, insn);
+
+	const operand_t *value = &insn->operands[1];
+	if (value->label.kind != LABEL_NONE) {
+		add_fixup(as, FIXUP_ABS64, label_sym(as, value->label), value->value);
+		buffer_zeros(buf, 8);
+	} else {
+		buffer_append(buf, &value->value, 8);
+	}
+}
+
+static void
+assemble_reserve(Assembler *as, const insn_t *insn)
+{
+	if (as->section == ASM_SECTION_NONE) asm_error(as, "data outside of a section, unit: %u", 8);
+	define_label_of(as, insn);
+
+	const size_t len = (size_t) insn->operands[1].value * 8;
+	if (as->section == ASM_SECTION_BSS) as->bss_len += len;
+	else buffer_zeros(as->section == ASM_SECTION_TEXT ? &as->text : &as->data, len);
+}
+
+/* ------------------------------------------------------- */
+/* Output                                                  */
+/* ------------------------------------------------------- */
+
+typedef struct {
+	u64 text;
+	u64 data;
+	u64 bss;
+} layout_t;
+
+static u64
+symbol_address(const Assembler *as, const layout_t *layout, const fixup_t *fixup)
+{
+	const asm_sym_t *sym = &as->syms[fixup->sym];
+	switch ((asm_section_t) sym->section) {
+	case ASM_SECTION_TEXT: return layout->text + sym->value;
+	case ASM_SECTION_DATA: return layout->data + sym->value;
+	case ASM_SECTION_BSS:  return layout->bss + sym->value;
+	case ASM_SECTION_NONE:
+	case ASM_SECTION_EXTERN: break;
+	}
+
+	report_error("assembler: record %u: error: undefined symbol: `%s`", fixup->insn, asm_str(as, fixup->sym));
+	return 0;
+}
+
+INLINE u8 *
+fixup_bytes(Assembler *as, const fixup_t *fixup)
+{
+	return (fixup->section == ASM_SECTION_TEXT ? as->text.bytes : as->data.bytes) + fixup->offset;
+}
+
+static void
+patch_fixup(Assembler *as, const fixup_t *fixup, u64 target, u64 place)
+{
+	u8 *bytes = fixup_bytes(as, fixup);
+	const i64 value = (i64) target + fixup->addend;
+
+	switch ((fixup_kind_t) fixup->kind) {
+	case FIXUP_REL32:
+	case FIXUP_BRANCH: {
+		const i64 rel = value - (i64) place;
+		if (!fits_i32(rel)) report_error("assembler: record %u: error: relative address out of range", fixup->insn);
+		const i32 rel32 = (i32) rel;
+		memcpy(bytes, &rel32, 4);
+	} break;
+
+	case FIXUP_ABS32S: {
+		if (!fits_i32(value)) report_error("assembler: record %u: error: address out of range", fixup->insn);
+		const i32 abs32 = (i32) value;
+		memcpy(bytes, &abs32, 4);
+	} break;
+
+	case FIXUP_ABS64: memcpy(bytes, &value, 8); break;
+	}
+}
+
+static void
+write_file(const char *path, const asm_buffer_t *buf, mode_t mode)
+{
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (fd < 0) report_error("error: failed to open file: %s", path);
+
+	size_t written = 0;
+	while (written < buf->len) {
+		const ssize_t n = write(fd, buf->bytes + written, buf->len - written);
+		if (n <= 0) {
+			close(fd);
+			report_error("error: failed to write file: %s", path);
+		}
+		written += (size_t) n;
+	}
+
+	fchmod(fd, mode);
+	close(fd);
+}
+
+// Text and headers in the first segment, data and bss in the second one
+static void
+write_executable(Assembler *as, const char *path)
+{
+	const size_t headers_len = sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr);
+	const size_t text_offset = align_up(headers_len, 16);
+	const size_t data_offset = align_up(text_offset + as->text.len, ASM_PAGE_SIZE);
+	const size_t bss_offset = align_up(data_offset + as->data.len, 16);
+
+	const layout_t layout = {
+		.text = ASM_BASE_ADDRESS + text_offset,
+		.data = ASM_BASE_ADDRESS + data_offset,
+		.bss = ASM_BASE_ADDRESS + bss_offset,
+	};
+
+	for (size_t i = 0; i < as->fixups_len; ++i) {
+		const fixup_t *fixup = &as->fixups[i];
+		const u64 base = fixup->section == ASM_SECTION_TEXT ? layout.text : layout.data;
+		patch_fixup(as, fixup, symbol_address(as, &layout, fixup), base + fixup->offset);
+	}
+
+	const sym_id_t start = asm_name(as, "_start", 6);
+	if (as->syms[start].section != ASM_SECTION_TEXT) {
+		report_error("assembler: error: no `%s` in the text section", "_start");
+	}
+
+	const Elf64_Ehdr ehdr = {
+		.e_ident = {
+			ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
+			ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV
+		},
+		.e_type = ET_EXEC,
+		.e_machine = EM_X86_64,
+		.e_version = EV_CURRENT,
+		.e_entry = layout.text + as->syms[start].value,
+		.e_phoff = sizeof(Elf64_Ehdr),
+		.e_ehsize = sizeof(Elf64_Ehdr),
+		.e_phentsize = sizeof(Elf64_Phdr),
+		.e_phnum = 2,
+	};
+
+	const Elf64_Phdr phdrs[2] = {
+		{
+			.p_type = PT_LOAD,
+			.p_flags = PF_R | PF_X,
+			.p_offset = 0,
+			.p_vaddr = ASM_BASE_ADDRESS,
+			.p_paddr = ASM_BASE_ADDRESS,
+			.p_filesz = text_offset + as->text.len,
+			.p_memsz = text_offset + as->text.len,
+			.p_align = ASM_PAGE_SIZE,
+		},
+		{
+			.p_type = PT_LOAD,
+			.p_flags = PF_R | PF_W,
+			.p_offset = data_offset,
+			.p_vaddr = layout.data,
+			.p_paddr = layout.data,
+			.p_filesz = as->data.len,
+			.p_memsz = bss_offset - data_offset + as->bss_len,
+			.p_align = ASM_PAGE_SIZE,
+		},
+	};
+
+	asm_buffer_t out = {0};
+	buffer_append(&out, &ehdr, sizeof(ehdr));
+	buffer_append(&out, phdrs, sizeof(phdrs));
+	buffer_zeros(&out, text_offset - out.len);
+	buffer_append(&out, as->text.bytes, as->text.len);
+	buffer_zeros(&out, data_offset - out.len);
+	buffer_append(&out, as->data.bytes, as->data.len);
+
+	write_file(path, &out, 0755);
+	free(out.bytes);
+}
+
+#define OBJ_SECTION_TEXT 1
+#define OBJ_SECTION_DATA 2
+#define OBJ_SECTION_BSS 3
+#define OBJ_SECTION_SYMTAB 4
+#define OBJ_SECTION_STRTAB 5
+#define OBJ_SECTION_RELA_TEXT 6
+#define OBJ_SECTION_RELA_DATA 7
+#define OBJ_SECTION_SHSTRTAB 8
+#define OBJ_SECTIONS 9
+
+INLINE u32
+obj_section_of(u8 section)
+{
+	switch ((asm_section_t) section) {
+	case ASM_SECTION_TEXT: return OBJ_SECTION_TEXT;
+	case ASM_SECTION_DATA: return OBJ_SECTION_DATA;
+	case ASM_SECTION_BSS:  return OBJ_SECTION_BSS;
+	case ASM_SECTION_NONE:
+	case ASM_SECTION_EXTERN: break;
+	}
+	return SHN_UNDEF;
+}
+
+static u32
+strtab_add(asm_buffer_t *strtab, const char *str)
+{
+	const u32 offset = (u32) strtab->len;
+	buffer_append(strtab, str, strlen(str) + 1);
+	return offset;
+}
+
+static void
+add_elf_symbol(asm_buffer_t *symtab, asm_buffer_t *strtab, const Assembler *as, sym_id_t id, u8 bind)
+{
+	const asm_sym_t *sym = &as->syms[id];
+	const Elf64_Sym elf_sym = {
+		.st_name = strtab_add(strtab, asm_str(as, id)),
+		.st_info = ELF64_ST_INFO(bind, sym->section == ASM_SECTION_TEXT ? STT_FUNC : STT_NOTYPE),
+		.st_shndx = (u16) obj_section_of(sym->section),
+		.st_value = sym->value,
+	};
+	buffer_append(symtab, &elf_sym, sizeof(elf_sym));
+}
+
+// Relative addresses inside of a section are patched here, the rest is left to the linker
+static void
+write_object(Assembler *as, const char *path)
+{
+	asm_buffer_t symtab = {0}, strtab = {0}, shstrtab = {0};
+	asm_buffer_t relas[2] = {0};
+
+	// Null symbol, then the sections, the local labels, and the globals last
+	buffer_zeros(&symtab, sizeof(Elf64_Sym));
+	buffer_zeros(&strtab, 1);
+	for (u32 section = OBJ_SECTION_TEXT; section <= OBJ_SECTION_BSS; ++section) {
+		const Elf64_Sym elf_sym = { .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION), .st_shndx = (u16) section };
+		buffer_append(&symtab, &elf_sym, sizeof(elf_sym));
+	}
+
+	for (sym_id_t id = SYM_NONE + 1; id < as->names.size; ++id) {
+		const asm_sym_t *sym = &as->syms[id];
+		if (sym->global || sym->section == ASM_SECTION_NONE || sym->section == ASM_SECTION_EXTERN) continue;
+		if (strchr(asm_str(as, id), '.') != NULL) continue;
+		add_elf_symbol(&symtab, &strtab, as, id, STB_LOCAL);
+	}
+
+	const u32 first_global = (u32) (symtab.len / sizeof(Elf64_Sym));
+	for (sym_id_t id = SYM_NONE + 1; id < as->names.size; ++id) {
+		asm_sym_t *sym = &as->syms[id];
+		if (!sym->global && sym->section != ASM_SECTION_EXTERN) continue;
+		sym->elf_index = (u32) (symtab.len / sizeof(Elf64_Sym));
+		add_elf_symbol(&symtab, &strtab, as, id, STB_GLOBAL);
+	}
+
+	for (size_t i = 0; i < as->fixups_len; ++i) {
+		const fixup_t *fixup = &as->fixups[i];
+		const asm_sym_t *sym = &as->syms[fixup->sym];
+		const bool relative = fixup->kind == FIXUP_REL32 || fixup->kind == FIXUP_BRANCH;
+
+		if (sym->section == ASM_SECTION_NONE) {
+			report_error("assembler: record %u: error: undefined symbol: `%s`", fixup->insn, asm_str(as, fixup->sym));
+		}
+
+		if (relative && sym->section == fixup->section) {
+			patch_fixup(as, fixup, sym->value, fixup->offset);
+			continue;
+		}
+
+		u32 type = R_X86_64_64;
+		switch ((fixup_kind_t) fixup->kind) {
+		case FIXUP_REL32:  type = R_X86_64_PC32; break;
+		case FIXUP_BRANCH: type = sym->section == ASM_SECTION_EXTERN ? R_X86_64_PLT32 : R_X86_64_PC32; break;
+		case FIXUP_ABS32S: type = R_X86_64_32S; break;
+		case FIXUP_ABS64:  type = R_X86_64_64; break;
+		}
+
+		const bool external = sym->section == ASM_SECTION_EXTERN || sym->global;
+		const Elf64_Rela rela = {
+			.r_offset = fixup->offset,
+			.r_info = ELF64_R_INFO(external ? sym->elf_index : obj_section_of(sym->section), type),
+			.r_addend = fixup->addend + (external ? 0 : (i64) sym->value),
+		};
+		buffer_append(&relas[fixup->section == ASM_SECTION_TEXT ? 0 : 1], &rela, sizeof(rela));
+	}
+
+	u32 names[OBJ_SECTIONS] = {0};
+	buffer_zeros(&shstrtab, 1);
+	names[OBJ_SECTION_TEXT] = strtab_add(&shstrtab, ".text");
+	names[OBJ_SECTION_DATA] = strtab_add(&shstrtab, ".data");
+	names[OBJ_SECTION_BSS] = strtab_add(&shstrtab, ".bss");
+	names[OBJ_SECTION_SYMTAB] = strtab_add(&shstrtab, ".symtab");
+	names[OBJ_SECTION_STRTAB] = strtab_add(&shstrtab, ".strtab");
+	names[OBJ_SECTION_RELA_TEXT] = strtab_add(&shstrtab, ".rela.text");
+	names[OBJ_SECTION_RELA_DATA] = strtab_add(&shstrtab, ".rela.data");
+	names[OBJ_SECTION_SHSTRTAB] = strtab_add(&shstrtab, ".shstrtab");
+
+	asm_buffer_t out = {0};
+	buffer_zeros(&out, sizeof(Elf64_Ehdr));
+
+	Elf64_Shdr shdrs[OBJ_SECTIONS] = {0};
+	const asm_buffer_t *contents[OBJ_SECTIONS] = {
+		NULL, &as->text, &as->data, NULL, &symtab, &strtab, &relas[0], &relas[1], &shstrtab
+	};
+	static const u32 aligns[OBJ_SECTIONS] = { 0, 16, 8, 16, 8, 1, 8, 8, 1 };
+
+	for (u32 i = 1; i < OBJ_SECTIONS; ++i) {
+		shdrs[i].sh_name = names[i];
+		shdrs[i].sh_addralign = aligns[i];
+		if (contents[i] == NULL) continue;
+		buffer_align(&out, aligns[i]);
+		shdrs[i].sh_offset = out.len;
+		shdrs[i].sh_size = contents[i]->len;
+		buffer_append(&out, contents[i]->bytes, contents[i]->len);
+	}
+
+	shdrs[OBJ_SECTION_TEXT].sh_type = SHT_PROGBITS;
+	shdrs[OBJ_SECTION_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+	shdrs[OBJ_SECTION_DATA].sh_type = SHT_PROGBITS;
+	shdrs[OBJ_SECTION_DATA].sh_flags = SHF_ALLOC | SHF_WRITE;
+	shdrs[OBJ_SECTION_BSS].sh_type = SHT_NOBITS;
+	shdrs[OBJ_SECTION_BSS].sh_flags = SHF_ALLOC | SHF_WRITE;
+	shdrs[OBJ_SECTION_BSS].sh_offset = out.len;
+	shdrs[OBJ_SECTION_BSS].sh_size = as->bss_len;
+	shdrs[OBJ_SECTION_SYMTAB].sh_type = SHT_SYMTAB;
+	shdrs[OBJ_SECTION_SYMTAB].sh_link = OBJ_SECTION_STRTAB;
+	shdrs[OBJ_SECTION_SYMTAB].sh_info = first_global;
+	shdrs[OBJ_SECTION_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+	shdrs[OBJ_SECTION_STRTAB].sh_type = SHT_STRTAB;
+	shdrs[OBJ_SECTION_SHSTRTAB].sh_type = SHT_STRTAB;
+	for (u32 i = OBJ_SECTION_RELA_TEXT; i <= OBJ_SECTION_RELA_DATA; ++i) {
+		shdrs[i].sh_type = SHT_RELA;
+		shdrs[i].sh_flags = SHF_INFO_LINK;
+		shdrs[i].sh_link = OBJ_SECTION_SYMTAB;
+		shdrs[i].sh_info = i == OBJ_SECTION_RELA_TEXT ? OBJ_SECTION_TEXT : OBJ_SECTION_DATA;
+		shdrs[i].sh_entsize = sizeof(Elf64_Rela);
+	}
+
+	buffer_align(&out, 8);
+	const Elf64_Ehdr ehdr = {
+		.e_ident = {
+			ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
+			ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV
+		},
+		.e_type = ET_REL,
+		.e_machine = EM_X86_64,
+		.e_version = EV_CURRENT,
+		.e_shoff = out.len,
+		.e_ehsize = sizeof(Elf64_Ehdr),
+		.e_shentsize = sizeof(Elf64_Shdr),
+		.e_shnum = OBJ_SECTIONS,
+		.e_shstrndx = OBJ_SECTION_SHSTRTAB,
+	};
+
+	buffer_append(&out, shdrs, sizeof(shdrs));
+	memcpy(out.bytes, &ehdr, sizeof(ehdr));
+
+	write_file(path, &out, 0644);
+
+	free(out.bytes);
+	free(symtab.bytes);
+	free(strtab.bytes);
+	free(shstrtab.bytes);
+	free(relas[0].bytes);
+	free(relas[1].bytes);
+}
+
+static void
+assembler_free(Assembler *as)
+{
+	free(as->text.bytes);
+	free(as->data.bytes);
+	free(as->syms);
+	free(as->fixups);
+	symtab_free(&as->names);
+}
+
+static Assembler assembler = {0};
+static bool assembler_active = false;
+
+void
+assembler_open(void)
+{
+	assert(!assembler_active);
+	assembler = (Assembler) { .names = { .copy = true } };
+	assembler_active = true;
+}
+
+void
+assembler_insn(const insn_t *insn)
+{
+	Assembler *as = &assembler;
+	as->insn++;
+
+	switch ((insn_kind_t) insn->kind) {
+	case INSN_OP: assemble_op(as, insn); break;
+
+	case INSN_LABEL: define_label_of(as, insn); break;
+
+	case INSN_COMMENT: break;
+
+	case INSN_SECTION: {
+		switch ((section_t) insn->op) {
+		case SECTION_TEXT: as->section = ASM_SECTION_TEXT; break;
+		case SECTION_DATA: as->section = ASM_SECTION_DATA; break;
+		case SECTION_BSS:  as->section = ASM_SECTION_BSS;  break;
+		}
+	} break;
+
+	case INSN_GLOBAL: {
+		as->syms[label_sym(as, insn->operands[0].label)].global = true;
+	} break;
+
+	case INSN_EXTERN: {
+		char buf[ASM_NAME_MAX];
+		const char *name = label_name(insn->operands[0].label, buf, sizeof(buf));
+		define_symbol(as, name, (u32) strlen(name), ASM_SECTION_EXTERN, 0);
+		as->has_externs = true;
+	} break;
+
+	case INSN_BYTES: {
+		asm_buffer_t *buf = data_buffer(as, 1);
+		define_label_of(as, insn);
+		buffer_append(buf, insn->text, insn->text_len);
+	} break;
+
+	case INSN_QUAD: assemble_quad(as, insn); break;
+
+	case INSN_RESERVE: assemble_reserve(as, insn); break;
+	}
+}
+
+bool
+assembler_close(const char *exe_path, const char *obj_path)
+{
+	assert(assembler_active);
+	Assembler *as = &assembler;
+
+#ifdef DEBUG
+	printf("assembled: %zu bytes of text, %zu of data, %lu of bss, %zu fixups\n",
+				 as->text.len, as->data.len, as->bss_len, as->fixups_len);
+#endif
+
+	const bool linked = !as->has_externs;
+	if (linked) write_executable(as, exe_path);
+	else write_object(as, obj_path);
+
+	assembler_abort();
+	return linked;
+}
+
+void
+assembler_abort(void)
+{
+	if (!assembler_active) return;
+	assembler_free(&assembler);
+	assembler_active = false;
+}
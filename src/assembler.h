@@ -0,0 +1,30 @@
+#ifndef ASSEMBLER_H_
+#define ASSEMBLER_H_
+
+#include "insn.h"
+#include "common.h"
+
+#include <stdbool.h>
+
+// Static executables are loaded at the usual address of `ld`, so the addresses of the labels
+// fit in the sign-extended 32-bit immediates, as they do in the linked objects.
+#define ASM_BASE_ADDRESS 0x400000
+#define ASM_PAGE_SIZE 0x1000
+
+// Encode the records the compiler emits, in the order it emits them. `assembler_close`
+// writes the static executable to `exe_path` and returns true if there are no externs.
+// Otherwise the relocatable object is written to `obj_path`, it still has to be linked.
+void
+assembler_open(void);
+
+void
+assembler_insn(const insn_t *insn);
+
+bool
+assembler_close(const char *exe_path, const char *obj_path);
+
+// Drop what is assembled so far, if the assembler is open
+void
+assembler_abort(void);
+
+#endif // ASSEMBLER_H_
@@ -2,20 +2,195 @@
 #include "common.h"
 #include "lexer.h"
 #include "lib.h"
+#include "vmem.h"
 
 #include <string.h>
+#include <pthread.h>
 
-DECLARE_STATIC(ast, AST);
+ast_store_t ASTS = {0};
+
+// All the columns grow together, so one id indexes each of them
+ast_id_t
+ast_store_alloc(ast_store_t *store, u32 count)
+{
+	if (store->kinds == NULL) {
+		vmem_init(&store->kinds_arena, ASTS_ARENA_MB);
+		vmem_init(&store->nexts_arena, ASTS_ARENA_MB);
+		vmem_init(&store->locs_arena, ASTS_ARENA_MB);
+		vmem_init(&store->data_arena, ASTS_ARENA_MB);
+		vmem_init(&store->resolved_arena, ASTS_ARENA_MB);
+		store->kinds = (u8 *) store->kinds_arena.ptr;
+		store->nexts = (ast_id_t *) store->nexts_arena.ptr;
+		store->locs = (loc_id_t *) store->locs_arena.ptr;
+		store->data = (u32 *) store->data_arena.ptr;
+		store->resolved = (u32 *) store->resolved_arena.ptr;
+	}
+
+	vmem_alloc(&store->kinds_arena, sizeof(u8) * count);
+	vmem_alloc(&store->nexts_arena, sizeof(ast_id_t) * count);
+	vmem_alloc(&store->locs_arena, sizeof(loc_id_t) * count);
+	vmem_alloc(&store->data_arena, sizeof(u32) * count);
+	vmem_alloc(&store->resolved_arena, sizeof(u32) * count);
+
+	const ast_id_t id = store->size;
+	store->size += count;
+	return id;
+}
+
+static u32
+ast_table_alloc(ast_table_t *table, size_t element_size, size_t arena_mb)
+{
+	if (table->arena.ptr == NULL) vmem_init(&table->arena, arena_mb);
+	vmem_alloc(&table->arena, element_size);
+	return table->size++;
+}
+
+// Index of the payload is stored into `data`, the table is initialized by the allocation
+#define ast_table_push(table_, type_, arena_mb_, value_) do { \
+	data = ast_table_alloc(&(table_), sizeof(type_), arena_mb_); \
+	*ast_table_at(table_, type_, data) = (value_); \
+} while (0)
+
+void
+ast_store_free(ast_store_t *store)
+{
+	vmem_free(&store->kinds_arena);
+	vmem_free(&store->nexts_arena);
+	vmem_free(&store->locs_arena);
+	vmem_free(&store->data_arena);
+	vmem_free(&store->resolved_arena);
+	vmem_free(&store->pushes.arena);
+	vmem_free(&store->ifs.arena);
+	vmem_free(&store->whiles.arena);
+	vmem_free(&store->funcs.arena);
+	vmem_free(&store->procs.arena);
+	vmem_free(&store->consts.arena);
+	vmem_free(&store->vars.arena);
+	vmem_free(&store->externs.arena);
+	vmem_free(&store->vecs);
+	*store = (ast_store_t) {0};
+}
+
+ast_store_mark_t
+ast_store_mark(const ast_store_t *store)
+{
+	return (ast_store_mark_t) {
+		.size = store->size,
+		.pushes = store->pushes.size,
+		.ifs = store->ifs.size,
+		.whiles = store->whiles.size
+	};
+}
+
+// Arenas keep their pages, the next nodes are written over the dropped ones
+void
+ast_store_truncate(ast_store_t *store, ast_id_t size, ast_store_mark_t mark)
+{
+	store->size = size;
+	store->kinds_arena.allocated = sizeof(u8) * size;
+	store->nexts_arena.allocated = sizeof(ast_id_t) * size;
+	store->locs_arena.allocated = sizeof(loc_id_t) * size;
+	store->data_arena.allocated = sizeof(u32) * size;
+	store->resolved_arena.allocated = sizeof(u32) * size;
+
+	store->pushes.size = mark.pushes;
+	store->pushes.arena.allocated = sizeof(push_stmt_t) * mark.pushes;
+	store->ifs.size = mark.ifs;
+	store->ifs.arena.allocated = sizeof(if_stmt_t) * mark.ifs;
+	store->whiles.size = mark.whiles;
+	store->whiles.arena.allocated = sizeof(while_stmt_t) * mark.whiles;
+}
+
+void *
+ast_store_expand(ast_store_t *store, void *vec, size_t element_size)
+{
+	if (store->vecs.ptr == NULL) vmem_init(&store->vecs, AST_VECS_ARENA_MB);
+
+	VHeader_ *header = vec ? ((VHeader_ *) vec) - 1 : NULL;
+	if (header == NULL || header->size == header->capacity) {
+		// Signatures are short, the old block is left behind in the arena
+		const u32 capacity = header ? header->capacity * 2 : 4;
+		const size_t size = (sizeof(VHeader_) + element_size * capacity + 15) & ~(size_t) 15;
+		VHeader_ *new_header = (VHeader_ *) vmem_alloc(&store->vecs, size);
+		new_header->size = header ? header->size : 0;
+		new_header->capacity = capacity;
+		if (header) memcpy(new_header->data, header->data, element_size * header->size);
+		header = new_header;
+	}
+
+	header->size++;
+	return header->data;
+}
+
+void
+ast_store_append(ast_store_t *store, const ast_t *ast)
+{
+	const ast_id_t id = ast->ast_id;
+	store->kinds[id] = (u8) ast->ast_kind;
+	store->nexts[id] = ast->next;
+	store->locs[id] = ast->loc_id;
+
+	u32 data = 0;
+	switch (ast->ast_kind) {
+	case AST_CALL:		data = ast->call.sym; break;
+	case AST_LITERAL:	data = ast->literal.sym; break;
+	case AST_WRITE:		data = ast->write_stmt.sym; break;
+	case AST_SYSCALL:	data = ast->syscall.args_count; break;
+
+	case AST_PUSH:		ast_table_push(store->pushes, push_stmt_t, AST_PUSHES_ARENA_MB, ast->push_stmt); break;
+	case AST_IF:			ast_table_push(store->ifs, if_stmt_t, AST_IFS_ARENA_MB, ast->if_stmt); break;
+	case AST_WHILE:		ast_table_push(store->whiles, while_stmt_t, AST_WHILES_ARENA_MB, ast->while_stmt); break;
+	case AST_FUNC:		ast_table_push(store->funcs, func_stmt_t, AST_FUNCS_ARENA_MB, ast->func_stmt); break;
+	case AST_PROC:		ast_table_push(store->procs, proc_stmt_t, AST_PROCS_ARENA_MB, ast->proc_stmt); break;
+	case AST_CONST:		ast_table_push(store->consts, const_stmt_t, AST_CONSTS_ARENA_MB, ast->const_stmt); break;
+	case AST_VAR:			ast_table_push(store->vars, var_stmt_t, AST_VARS_ARENA_MB, ast->var_stmt); break;
+	case AST_EXTERN:	ast_table_push(store->externs, extern_decl_t, AST_EXTERNS_ARENA_MB, ast->extern_decl); break;
+
+	case AST_POISONED:
+	case AST_DOT:
+	case AST_DUP:
+	case AST_BNOT:
+	case AST_BOR:
+	case AST_MOD:
+	case AST_MUL:
+	case AST_DIV:
+	case AST_MINUS:
+	case AST_PLUS:
+	case AST_LESS:
+	case AST_GREATER_EQUAL:
+	case AST_LESS_EQUAL:
+	case AST_EQUAL:
+	case AST_DROP:
+	case AST_GREATER: break;
+	}
+
+	store->data[id] = data;
+}
 
 ast_id_t main_function = -1;
 
+static sym_id_t value_kind_syms[VALUE_KIND_LAST] = {0};
+static pthread_once_t value_kind_syms_once = PTHREAD_ONCE_INIT;
+
+static void
+value_kind_syms_init(void)
+{
+	for (i32 i = (i32) VALUE_KIND_POISONED + 1; i < (i32) VALUE_KIND_LAST; ++i) {
+		const char *str = value_kind_to_str_pretty((value_kind_t) i);
+		value_kind_syms[i] = sym_intern(str, strlen(str));
+	}
+}
+
+// Parses may run on several threads, so the symbols are interned once
 i32
-value_kind_try_from_str(const char *str)
+value_kind_try_from_sym(sym_id_t sym)
 {
+	pthread_once(&value_kind_syms_once, value_kind_syms_init);
+
+	if (sym == SYM_NONE) return -1;
+
 	for (i32 i = (i32) VALUE_KIND_POISONED + 1; i < (i32) VALUE_KIND_LAST; ++i) {
-		if (0 == strcmp(str, value_kind_to_str_pretty((value_kind_t) i))) {
-			return i;
-		}
+		if (sym == value_kind_syms[i]) return i;
 	}
 
 	return -1;
@@ -39,16 +214,16 @@ arg_to_str(const arg_t *arg)
 {
 	const char *kind = value_kind_to_str_pretty(arg->kind);
 	const size_t len = 0
-		+ strlen(kind)					 // value_kind
-		+ 1											 // space between
-		+ strlen(arg->name) // name
-		+ 1;										 // \0
+		+ strlen(kind)							// value_kind
+		+ 1													// space between
+		+ symid(arg->name).len			// name
+		+ 1;												// \0
 
 	char *ret = calloc_string(len);
 	snprintf(ret, len,
 					 "%s %s",
 					 kind,
-					 arg->name);
+					 symstr(arg->name));
 
 	return ret;
 }
@@ -79,65 +254,67 @@ print_proc(const proc_stmt_t *proc_stmt)
 }
 
 void
-print_ast(const ast_t *ast)
+print_ast(ast_id_t ast_id)
 {
 	printf("--------------\n");
 
-	printf("ast_id: %d\n", ast->ast_id);
-	printf("next: %d\n", ast->next);
-	printf("ast_kind: %s\n", ast_kind_to_str(ast->ast_kind));
+	printf("ast_id: %d\n", ast_id);
+	printf("next: %d\n", ast_next(ast_id));
+	printf("ast_kind: %s\n", ast_kind_to_str(ast_kind(ast_id)));
 
-	switch (ast->ast_kind) {
+	switch (ast_kind(ast_id)) {
 	case AST_WRITE: {
-		printf("token: %s\n", token_to_str(ast->write_stmt.token));
+		printf("name: %s\n", symstr(ast_sym(ast_id)));
 	} break;
 
 	case AST_EXTERN: {
-		printf("%s\n", extern_kind_to_str(ast->extern_decl.kind));
-		switch (ast->extern_decl.kind) {
-		case EXTERN_FUNC: print_func(&ast->extern_decl.func_stmt); break;
-		case EXTERN_PROC: print_proc(&ast->extern_decl.proc_stmt); break;
+		const extern_decl_t *extern_decl = ast_extern(ast_id);
+		printf("%s\n", extern_kind_to_str(extern_decl->kind));
+		switch (extern_decl->kind) {
+		case EXTERN_FUNC: print_func(&extern_decl->func_stmt); break;
+		case EXTERN_PROC: print_proc(&extern_decl->proc_stmt); break;
 		}
 	} break;
 
 	case AST_VAR: {
-		printf("constexpr: %b\n", ast->var_stmt.constexpr);
-		printf("body: %d\n", ast->var_stmt.body);
-		printf("name: %s\n", ast->var_stmt.name->str);
+		printf("constexpr: %b\n", ast_var(ast_id)->constexpr);
+		printf("body: %d\n", ast_var(ast_id)->body);
+		printf("name: %s\n", ast_var(ast_id)->name->str);
 	} break;
 
 	case AST_CONST: {
-		printf("constexpr: %b\n", ast->const_stmt.constexpr);
-		printf("body: %d\n", ast->const_stmt.body);
-		printf("name: %s\n", ast->const_stmt.name->str);
+		printf("constexpr: %b\n", ast_const(ast_id)->constexpr);
+		printf("body: %d\n", ast_const(ast_id)->body);
+		printf("name: %s\n", ast_const(ast_id)->name->str);
 	} break;
 
 	case AST_LITERAL: {
-		printf("str: %s\n", ast->literal.str);
+		printf("str: %s\n", symstr(ast_sym(ast_id)));
 	} break;
 
 	case AST_FUNC: {
-		print_func(&ast->func_stmt);
+		print_func(ast_func(ast_id));
 	} break;
 
 	case AST_PROC: {
-		print_proc(&ast->proc_stmt);
+		print_proc(ast_proc(ast_id));
 	} break;
 
 	case AST_PUSH: {
-		printf("value_kind: %s\n", value_kind_to_str_pretty(ast->push_stmt.value_kind));
-		if (ast->push_stmt.value_kind == VALUE_KIND_INTEGER) printf("integer: %ld\n", ast->push_stmt.integer);
-		else printf("str: %s\n", ast->push_stmt.str ? ast->push_stmt.str : "NULL");
+		const push_stmt_t *push_stmt = ast_push(ast_id);
+		printf("value_kind: %s\n", value_kind_to_str_pretty(push_stmt->value_kind));
+		if (push_stmt->value_kind == VALUE_KIND_INTEGER) printf("integer: %ld\n", push_stmt->integer);
+		else printf("str: %s\n", push_stmt->str ? push_stmt->str : "NULL");
 	} break;
 
 	case AST_IF: {
-		printf("then_body: %d\n", ast->if_stmt.then_body);
-		printf("else_body: %d\n", ast->if_stmt.else_body);
+		printf("then_body: %d\n", ast_if(ast_id)->then_body);
+		printf("else_body: %d\n", ast_if(ast_id)->else_body);
 	} break;
 
 	case AST_WHILE: {
-		printf("cond: %d\n", ast->while_stmt.cond);
-		printf("body: %d\n", ast->while_stmt.body);
+		printf("cond: %d\n", ast_while(ast_id)->cond);
+		printf("body: %d\n", ast_while(ast_id)->body);
 	} break;
 
 	case AST_DUP:						break;
@@ -240,52 +417,61 @@ extern_kind_to_str(const extern_kind_t extern_kind)
 	}
 }
 
-void
-main_function_check(bool at_top_level, ast_t ast)
+bool
+top_level_check(ast_id_t ast_id)
 {
-	if (ast.ast_kind == AST_FUNC
-	&& 0 == strcmp(MAIN_FUNCTION, ast.func_stmt.name->str))
-	{
-		main_function = ast.ast_id;
-		return;
-	} else {
-		switch (ast.ast_kind) {
-		case AST_FUNC: break;
-		case AST_EXTERN: break;
-		case AST_PROC: break;
-		case AST_VAR: break;
-		case AST_CONST: break;
-
-		case AST_POISONED:
-		case AST_IF:
-		case AST_WHILE:
-		case AST_DOT:
-		case AST_DUP:
-		case AST_BNOT:
-		case AST_BOR:
-		case AST_MOD:
-		case AST_PUSH:
-		case AST_MUL:
-		case AST_DIV:
-		case AST_MINUS:
-		case AST_PLUS:
-		case AST_LESS:
-		case AST_EQUAL:
-		case AST_CALL:
-		case AST_WRITE:
-		case AST_DROP:
-		case AST_GREATER:
-		case AST_GREATER_EQUAL:
-		case AST_LESS_EQUAL:
-		case AST_SYSCALL:
-		case AST_LITERAL: {
-			report_error("%s error: no %ss are allowed at the top level",
-									 loc_to_str(&locid(ast.loc_id)),
-									 ast_kind_to_str_pretty(ast.ast_kind));
-		} break;
-		}
+	const ast_kind_t kind = ast_kind(ast_id);
+	if (kind == AST_FUNC && ast_func(ast_id)->name->sym == sym_main()) {
+		main_function = ast_id;
+		return true;
 	}
 
-	if (ast.next < 0 || ast.ast_kind == AST_POISONED) return;
-	main_function_check(at_top_level, astid(ast.next));
+	switch (kind) {
+	case AST_FUNC: break;
+	case AST_EXTERN: break;
+	case AST_PROC: break;
+	case AST_VAR: break;
+	case AST_CONST: break;
+
+	case AST_POISONED:
+	case AST_IF:
+	case AST_WHILE:
+	case AST_DOT:
+	case AST_DUP:
+	case AST_BNOT:
+	case AST_BOR:
+	case AST_MOD:
+	case AST_PUSH:
+	case AST_MUL:
+	case AST_DIV:
+	case AST_MINUS:
+	case AST_PLUS:
+	case AST_LESS:
+	case AST_EQUAL:
+	case AST_CALL:
+	case AST_WRITE:
+	case AST_DROP:
+	case AST_GREATER:
+	case AST_GREATER_EQUAL:
+	case AST_LESS_EQUAL:
+	case AST_SYSCALL:
+	case AST_LITERAL: {
+		report_error("%s error: no %ss are allowed at the top level",
+								 loc_to_str(ast_loc(ast_id)),
+								 ast_kind_to_str_pretty(kind));
+	} break;
+	}
+
+	return false;
+}
+
+void
+main_function_check(bool at_top_level, ast_id_t ast_id)
+{
+	(void) at_top_level;
+	for (;;) {
+		if (top_level_check(ast_id)) return;
+		if (ast_next(ast_id) < 0 || ast_kind(ast_id) == AST_POISONED) return;
+		ast_id = ast_next(ast_id);
+	}
 }
@@ -4,18 +4,18 @@
 #include "file.h"
 #include "lexer.h"
 #include "common.h"
+#include "vmem.h"
 
 #include <stdio.h>
 
-#define astid(id) (ASTS[id])
-#define asts_len (ASTS_SIZE)
-#define last_ast (ASTS[ASTS_SIZE - 1])
-#define append_ast(ast_) (ASTS[ast_.ast_id] = ast_)
+#define asts_len (ASTS.size)
+#define last_ast_next(store_) ((store_)->nexts[(store_)->size - 1])
 
+// Node under construction, it is scattered into the columns of `store_` by `ast_store_append`.
 // Last argument represents stmt
-#define make_ast(loc_id_, next_, ast_kind_, ...) {	\
+#define make_ast(store_, loc_id_, next_, ast_kind_, ...) {	\
 	.loc_id = loc_id_, \
-	.ast_id = ASTS_SIZE++, \
+	.ast_id = ast_store_alloc(store_, 1), \
 	.next = next_, \
 	.ast_kind = ast_kind_, \
 	__VA_ARGS__ \
@@ -37,7 +37,7 @@ typedef enum {
 } value_kind_t;
 
 i32
-value_kind_try_from_str(const char *str);
+value_kind_try_from_sym(sym_id_t sym);
 
 const char *
 value_kind_to_str_pretty(value_kind_t kind);
@@ -77,16 +77,21 @@ typedef struct {
 typedef struct {
 	value_kind_t kind;
 	loc_id_t loc_id;
-	const char *name;
+	sym_id_t name;
 } arg_t;
 
 const char *
 arg_to_str(const arg_t *proc_arg);
 
+// `body` of a top level proc or func is parsed on the first use, till then it is
+// `AST_BODY_LAZY` and `body_token` is the index of its first token
+#define AST_BODY_LAZY (-2)
+
 typedef struct {
 	bool inlin;
 	arg_t *args;
 	ast_id_t body;
+	u32 body_token;
 	const token_t *name;
 } proc_stmt_t;
 
@@ -94,20 +99,21 @@ typedef struct {
 	bool inlin;
 	arg_t *args;
 	ast_id_t body;
+	u32 body_token;
 	const token_t *name;
 	value_kind_t *ret_types;
 } func_stmt_t;
 
 typedef struct {
-	const token_t *token;
+	sym_id_t sym;
 } write_stmt_t;
 
 typedef struct {
-	const char *str;
+	sym_id_t sym;
 } literal_t;
 
 typedef struct {
-	const char *str;
+	sym_id_t sym;
 } call_t;
 
 typedef struct {
@@ -210,9 +216,114 @@ typedef struct {
 	};
 } ast_t;
 
-#define ASTS_CAP (1024 * 500)
-extern ast_id_t ASTS_SIZE;
-extern ast_t ASTS[ASTS_CAP];
+// Side table of a store, it grows in its own reserved range, so the pointers into it stay valid
+typedef struct {
+	Vmem arena;
+	u32 size;
+} ast_table_t;
+
+// Nodes of one parse are stored as columns indexed by `ast_id_t`. Kind, next and location
+// of every node are dense, so walking a body touches 13 bytes per node. `data` holds the
+// symbol of calls, literals and writes, the amount of arguments of syscalls, or the index
+// into the side table of the kind for the nodes with a bigger payload. `resolved` is filled
+// by the check pass for the codegen, see `ast_resolved`. Vectors of the signatures live in
+// `vecs`, so a store shares no allocator with the other parses.
+typedef struct {
+	u8 *kinds;
+	ast_id_t *nexts;
+	loc_id_t *locs;
+	u32 *data;
+	u32 *resolved;
+	ast_id_t size;
+
+	Vmem kinds_arena;
+	Vmem nexts_arena;
+	Vmem locs_arena;
+	Vmem data_arena;
+	Vmem resolved_arena;
+
+	ast_table_t pushes;
+	ast_table_t ifs;
+	ast_table_t whiles;
+	ast_table_t funcs;
+	ast_table_t procs;
+	ast_table_t consts;
+	ast_table_t vars;
+	ast_table_t externs;
+
+	Vmem vecs;
+} ast_store_t;
+
+#define ASTS_ARENA_MB 1024
+#define AST_PUSHES_ARENA_MB 256
+#define AST_IFS_ARENA_MB 128
+#define AST_WHILES_ARENA_MB 128
+#define AST_FUNCS_ARENA_MB 128
+#define AST_PROCS_ARENA_MB 128
+#define AST_CONSTS_ARENA_MB 128
+#define AST_VARS_ARENA_MB 128
+#define AST_EXTERNS_ARENA_MB 64
+#define AST_VECS_ARENA_MB 256
+
+// Store of the program being compiled, `parse_step` parses into it
+extern ast_store_t ASTS;
+
+ast_id_t
+ast_store_alloc(ast_store_t *store, u32 count);
+
+// Store the node into the columns, and its payload into the side table of its kind
+void
+ast_store_append(ast_store_t *store, const ast_t *ast);
+
+// Sizes of the store and of the side tables of body nodes at some point of a parse
+typedef struct {
+	ast_id_t size;
+	u32 pushes;
+	u32 ifs;
+	u32 whiles;
+} ast_store_mark_t;
+
+ast_store_mark_t
+ast_store_mark(const ast_store_t *store);
+
+// Drop the nodes from `size` on, and the payloads of body nodes added after `mark`
+void
+ast_store_truncate(ast_store_t *store, ast_id_t size, ast_store_mark_t mark);
+
+// Release the columns, the side tables and the vectors
+void
+ast_store_free(ast_store_t *store);
+
+// Grow `vec` by one element inside `store->vecs`, the layout is the same as the one of `vec_add`
+void *
+ast_store_expand(ast_store_t *store, void *vec, size_t element_size);
+
+#define ast_store_vec_add(store_, vec_, ...) do { \
+	(vec_) = ast_store_expand((store_), (vec_), sizeof(*(vec_))); \
+	(vec_)[vec_size(vec_) - 1] = __VA_ARGS__; \
+} while (0)
+
+#define ast_table_at(table_, type_, idx_) (&((type_ *) (table_).arena.ptr)[idx_])
+
+#define ast_kind(id) ((ast_kind_t) ASTS.kinds[id])
+#define ast_next(id) (ASTS.nexts[id])
+#define ast_loc(id) (ASTS.locs[id])
+#define ast_sym(id) ((sym_id_t) ASTS.data[id])
+#define ast_syscall_args(id) ((u8) ASTS.data[id])
+
+// What the check pass resolved for the codegen of the node: the kind of the result of `+`, the
+// kind printed by `.`, and the offset of an argument that is pushed or called. A node resolves
+// to the same whenever it is checked, an inline body is checked at every expansion but starts
+// with an empty frame of its own. Written before the codegen of the body reads it.
+#define ast_resolved(id) (ASTS.resolved[id])
+#define ast_push(id) ast_table_at(ASTS.pushes, push_stmt_t, ASTS.data[id])
+#define ast_if(id) ast_table_at(ASTS.ifs, if_stmt_t, ASTS.data[id])
+#define ast_while(id) ast_table_at(ASTS.whiles, while_stmt_t, ASTS.data[id])
+#define ast_func(id) ast_table_at(ASTS.funcs, func_stmt_t, ASTS.data[id])
+#define ast_proc(id) ast_table_at(ASTS.procs, proc_stmt_t, ASTS.data[id])
+#define ast_const(id) ast_table_at(ASTS.consts, const_stmt_t, ASTS.data[id])
+#define ast_var(id) ast_table_at(ASTS.vars, var_stmt_t, ASTS.data[id])
+#define ast_extern(id) ast_table_at(ASTS.externs, extern_decl_t, ASTS.data[id])
 
 const char *
 ast_kind_to_str(const ast_kind_t ast_kind);
@@ -221,7 +332,7 @@ const char *
 ast_kind_to_str_pretty(const ast_kind_t ast_kind);
 
 void
-print_ast(const ast_t *ast);
+print_ast(ast_id_t ast_id);
 
 extern ast_id_t main_function;
 extern ast_id_t main_function_not_at_top_level;
@@ -229,7 +340,11 @@ extern ast_id_t main_function_not_at_top_level;
 const char *
 extern_kind_to_str(const extern_kind_t extern_kind);
 
+// Report the node if it is not allowed at the top level, true if it is the main function
+bool
+top_level_check(ast_id_t ast_id);
+
 void
-main_function_check(bool at_top_level, ast_t ast);
+main_function_check(bool at_top_level, ast_id_t ast_id);
 
 #endif // AST_H_
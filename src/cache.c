@@ -0,0 +1,600 @@
+#include "lib.h"
+#include "file.h"
+#include "cache.h"
+#include "lexer.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TOKEN_CACHE_MAGIC "PRACTOK"
+
+// Files are named by the hash of the content only, so an entry written by an older
+// compiler gets overwritten instead of piling up, the version is checked from the header.
+// It is the hash of the sources the compiler is built from, a change to any of them
+// changes the tokens or the code that is cached. Without it nothing is cached.
+#ifdef PRACC_SOURCE_HASH
+#define CACHE_ENABLED true
+#define CACHE_SOURCE_HASH ((u32) PRACC_SOURCE_HASH)
+#else
+#define CACHE_ENABLED false
+#define CACHE_SOURCE_HASH 0u
+#endif
+
+static atomic_uint cache_hits = 0;
+static atomic_uint cache_misses = 0;
+
+// Everything is stored as offsets, so the file can be used right from the mapping
+typedef struct {
+	char magic[8];
+	u32 format;
+	u32 version;
+	u64 content_hash;
+	u64 content_len;
+	u32 tokens_count;
+	u32 lines_count;
+	u32 syms_count;
+	u32 includes_count;
+	u32 strings_len;
+	// The path of the file the tokens are lexed from starts the strings
+	u32 path_len;
+} cache_header_t;
+
+typedef struct {
+	u32 loc_id;
+	u32 kind;
+	u32 sym;
+	u32 len;
+	u32 str;
+} cached_token_t;
+
+typedef struct {
+	u32 len;
+	u32 hash;
+	u32 str;
+} cached_sym_t;
+
+typedef struct {
+	u32 at;
+	u32 path_loc_id;
+	u32 path;
+	u32 path_len;
+} cached_include_t;
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} cache_strings_t;
+
+static u32
+cache_strings_append(cache_strings_t *strings, const char *str, u32 len)
+{
+	if (strings->len + len + 1 > strings->cap) {
+		while (strings->len + len + 1 > strings->cap) {
+			strings->cap = strings->cap ? strings->cap * 2 : 4096;
+		}
+		strings->data = (char *) realloc(strings->data, strings->cap);
+	}
+
+	const u32 off = (u32) strings->len;
+	memcpy(strings->data + off, str, len);
+	strings->data[off + len] = '\0';
+	strings->len += len + 1;
+	return off;
+}
+
+INLINE u32
+cache_version(void)
+{
+	return CACHE_SOURCE_HASH ^ TOKEN_CACHE_FORMAT;
+}
+
+INLINE void
+cache_path(char *buf, size_t size, u64 hash)
+{
+	snprintf(buf, size, TOKEN_CACHE_DIR "/%016llx.tok", (unsigned long long) hash);
+}
+
+bool
+token_cache_init(void)
+{
+	if (!CACHE_ENABLED) return false;
+	if (mkdir(TOKEN_CACHE_DIR, 0755) == 0 || errno == EEXIST) return true;
+	return false;
+}
+
+u64
+token_cache_hash(const char *data, size_t len)
+{
+	u64 hash = 0x9E3779B97F4A7C15ull ^ len;
+
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		u64 word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 32;
+	}
+
+	u64 tail = 0;
+	memcpy(&tail, data + i, len - i);
+	hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53ull;
+	hash ^= hash >> 29;
+
+	return hash;
+}
+
+// A hit has the content of the file, and was lexed from the same path, the hash alone
+// could be the one of another file
+static bool
+cache_header_valid(const cache_header_t *header, size_t size, u64 hash, const file_t *file)
+{
+	if (size < sizeof(cache_header_t)
+	|| 0 != memcmp(header->magic, TOKEN_CACHE_MAGIC, sizeof(TOKEN_CACHE_MAGIC))
+	|| header->format != TOKEN_CACHE_FORMAT
+	|| header->version != cache_version()
+	|| header->content_hash != hash
+	|| header->content_len != file->src_len
+	|| header->path_len != file->file_path.len)
+	{
+		return false;
+	}
+
+	const size_t expected = sizeof(cache_header_t)
+		+ header->tokens_count * sizeof(cached_token_t)
+		+ header->lines_count * sizeof(u32)
+		+ header->syms_count * sizeof(cached_sym_t)
+		+ header->includes_count * sizeof(cached_include_t)
+		+ header->strings_len;
+
+	if (expected != size || header->strings_len < header->path_len) return false;
+
+	const char *strings = (const char *) header + size - header->strings_len;
+	return 0 == memcmp(strings, file->file_path.buf, header->path_len);
+}
+
+bool
+token_cache_load(lex_unit_t *unit, u64 hash)
+{
+	Lexer *lexer = &unit->lexer;
+	file_t *file = &fileid(lexer->file_id);
+
+	char path[64];
+	cache_path(path, sizeof(path), hash);
+
+	struct stat st;
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) goto miss;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		goto miss;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) goto miss;
+
+	const cache_header_t *header = (const cache_header_t *) map;
+	if (!cache_header_valid(header, st.st_size, hash, file)) {
+		munmap(map, st.st_size);
+		goto miss;
+	}
+
+	const cached_token_t *tokens = (const cached_token_t *) (header + 1);
+	const u32 *lines = (const u32 *) (tokens + header->tokens_count);
+	const cached_sym_t *syms = (const cached_sym_t *) (lines + header->lines_count);
+	const cached_include_t *includes = (const cached_include_t *) (syms + header->syms_count);
+	const char *strings = (const char *) (includes + header->includes_count);
+
+	// Ranges of the unit are reserved for the worst case of the source, see `lex_unit_add`.
+	// An entry that does not fit was not lexed from it.
+	tokens_t *tokens_ = &tokens_pool[unit->pool_idx];
+	if (header->tokens_count > tokens_->capacity || header->lines_count > file->lines_cap) {
+		munmap(map, st.st_size);
+		goto miss;
+	}
+
+	tokens_->count = header->tokens_count;
+	for (u32 i = 0; i < header->tokens_count; ++i) {
+		tokens_->tokens[i] = new_token(file->base + tokens[i].loc_id,
+																	 (token_kind_t) tokens[i].kind,
+																	 strings + tokens[i].str,
+																	 tokens[i].len,
+																	 tokens[i].sym);
+	}
+
+	file->lines_count = header->lines_count;
+	memcpy(file->lines, lines, sizeof(u32) * header->lines_count);
+
+	// Only `syms` are read when merging, so the lookup table is left empty
+	lexer->syms.syms = (symbol_t *) malloc(sizeof(symbol_t) * (header->syms_count + 1));
+	lexer->syms.cap = header->syms_count + 1;
+	lexer->syms.size = header->syms_count;
+	for (u32 i = 0; i < header->syms_count; ++i) {
+		lexer->syms.syms[i] = (symbol_t) {
+			.len = syms[i].len,
+			.hash = syms[i].hash,
+			.str = strings + syms[i].str
+		};
+	}
+
+	unit->includes = (include_t *) malloc(sizeof(include_t) * (header->includes_count + 1));
+	unit->includes_cap = header->includes_count + 1;
+	unit->includes_count = header->includes_count;
+	for (u32 i = 0; i < header->includes_count; ++i) {
+		unit->includes[i] = (include_t) {
+			.at = includes[i].at,
+			.path_loc_id = file->base + includes[i].path_loc_id,
+			.path = strings + includes[i].path,
+			.path_len = includes[i].path_len,
+			.file_id = 0
+		};
+	}
+
+	file->cache = map;
+	file->cache_len = st.st_size;
+	atomic_fetch_add(&cache_hits, 1);
+	return true;
+
+miss:
+	atomic_fetch_add(&cache_misses, 1);
+	return false;
+}
+
+void
+token_cache_store(const lex_unit_t *unit, u64 hash)
+{
+	const Lexer *lexer = &unit->lexer;
+	const file_t *file = lexer->file;
+	const tokens_t *tokens = &tokens_pool[unit->pool_idx];
+
+	cache_header_t header = {
+		.magic = TOKEN_CACHE_MAGIC,
+		.format = TOKEN_CACHE_FORMAT,
+		.version = cache_version(),
+		.content_hash = hash,
+		.content_len = file->src_len,
+		.tokens_count = (u32) tokens->count,
+		.lines_count = file->lines_count,
+		.syms_count = lexer->syms.size,
+		.includes_count = unit->includes_count,
+		.strings_len = 0,
+		.path_len = file->file_path.len
+	};
+
+	cache_strings_t strings = {0};
+	cache_strings_append(&strings, file->file_path.buf, file->file_path.len);
+
+	cached_token_t *tokens_ = (cached_token_t *) malloc(sizeof(cached_token_t) * (tokens->count + 1));
+	for (size_t i = 0; i < tokens->count; ++i) {
+		const token_t *token = &tokens->tokens[i];
+		tokens_[i] = (cached_token_t) {
+			.loc_id = token->loc_id - file->base,
+			.kind = token->kind,
+			.sym = token->sym,
+			.len = token->len,
+			.str = cache_strings_append(&strings, token->str, token->len)
+		};
+	}
+
+	cached_sym_t *syms = (cached_sym_t *) malloc(sizeof(cached_sym_t) * (lexer->syms.size + 1));
+	for (u32 i = 0; i < lexer->syms.size; ++i) {
+		const symbol_t *sym = &lexer->syms.syms[i];
+		syms[i] = (cached_sym_t) {
+			.len = sym->len,
+			.hash = sym->hash,
+			.str = cache_strings_append(&strings, sym->str, sym->len)
+		};
+	}
+
+	cached_include_t *includes = (cached_include_t *) malloc(sizeof(cached_include_t) * (unit->includes_count + 1));
+	for (u32 i = 0; i < unit->includes_count; ++i) {
+		const include_t *include = &unit->includes[i];
+		includes[i] = (cached_include_t) {
+			.at = include->at,
+			.path_loc_id = include->path_loc_id - file->base,
+			.path = cache_strings_append(&strings, include->path, include->path_len),
+			.path_len = include->path_len
+		};
+	}
+
+	header.strings_len = (u32) strings.len;
+
+	// Write into a temporary file first, so readers never see a half written entry
+	char path[64], tmp_path[96];
+	cache_path(path, sizeof(path), hash);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%u.tmp", path, (int) getpid(), lexer->file_id);
+
+	FILE *stream = fopen(tmp_path, "wb");
+	if (stream != NULL) {
+		const bool ok = 1 == fwrite(&header, sizeof(header), 1, stream)
+			&& tokens->count == fwrite(tokens_, sizeof(cached_token_t), tokens->count, stream)
+			&& file->lines_count == fwrite(file->lines, sizeof(u32), file->lines_count, stream)
+			&& lexer->syms.size == fwrite(syms, sizeof(cached_sym_t), lexer->syms.size, stream)
+			&& unit->includes_count == fwrite(includes, sizeof(cached_include_t), unit->includes_count, stream)
+			&& strings.len == fwrite(strings.data, 1, strings.len, stream);
+
+		if (0 != fclose(stream) || !ok || 0 != rename(tmp_path, path)) {
+			remove(tmp_path);
+		}
+	}
+
+	free(strings.data);
+	free(includes);
+	free(syms);
+	free(tokens_);
+}
+
+void
+token_cache_print_stats(void)
+{
+	printf("token cache: %u hits, %u misses\n",
+				 atomic_load(&cache_hits),
+				 atomic_load(&cache_misses));
+}
+
+#define FUNC_CACHE_MAGIC "PRACFUN"
+
+typedef struct {
+	char magic[8];
+	u32 format;
+	u32 version;
+	u64 program_hash;
+	u32 entries_count;
+	u32 data_len;
+	// The path of the program starts the data
+	u32 path_len;
+	u32 pad;
+} func_cache_header_t;
+
+// Sorted by `hash`, `insns` and `str_data` are offsets into the data following the entries
+typedef struct {
+	u64 hash;
+	u32 flags;
+	u32 label_base;
+	u32 labels;
+	u32 while_label_base;
+	u32 while_labels;
+	u32 str_base;
+	u32 strs;
+	u32 insns;
+	u32 insns_len;
+	u32 str_data;
+	u32 str_data_len;
+	u32 pad;
+} cached_func_t;
+
+static bool func_cache_opened = false;
+static u64 func_cache_program = 0;
+static const char *func_cache_program_path = NULL;
+static void *func_cache_map = NULL;
+static size_t func_cache_map_len = 0;
+
+static func_cache_entry_t *func_cache_entries = NULL;
+static u32 func_cache_entries_count = 0;
+
+static cached_func_t *func_cache_puts = NULL;
+static u32 func_cache_puts_count = 0;
+static u32 func_cache_puts_cap = 0;
+static cache_strings_t func_cache_data = {0};
+
+static u32 func_cache_hits = 0;
+static u32 func_cache_misses = 0;
+
+INLINE void
+func_cache_path(char *buf, size_t size, u64 program_hash)
+{
+	snprintf(buf, size, TOKEN_CACHE_DIR "/%016llx.fn", (unsigned long long) program_hash);
+}
+
+static void
+func_cache_load(const char *path)
+{
+	struct stat st;
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) return;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(func_cache_header_t)) {
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return;
+
+	const func_cache_header_t *header = (const func_cache_header_t *) map;
+	if (0 != memcmp(header->magic, FUNC_CACHE_MAGIC, sizeof(FUNC_CACHE_MAGIC))
+	|| header->format != FUNC_CACHE_FORMAT
+	|| header->version != cache_version()
+	|| header->program_hash != func_cache_program
+	|| header->path_len != strlen(func_cache_program_path)
+	|| header->data_len < header->path_len
+	|| (size_t) st.st_size != sizeof(func_cache_header_t)
+		+ (size_t) header->entries_count * sizeof(cached_func_t)
+		+ header->data_len)
+	{
+		munmap(map, st.st_size);
+		return;
+	}
+
+	const cached_func_t *funcs = (const cached_func_t *) (header + 1);
+	const char *data = (const char *) (funcs + header->entries_count);
+	if (0 != memcmp(data, func_cache_program_path, header->path_len)) {
+		munmap(map, st.st_size);
+		return;
+	}
+
+	func_cache_entries = (func_cache_entry_t *) malloc(sizeof(func_cache_entry_t) * (header->entries_count + 1));
+	for (u32 i = 0; i < header->entries_count; ++i) {
+		const cached_func_t *func = &funcs[i];
+		if ((u64) func->insns + func->insns_len > header->data_len
+		|| (u64) func->str_data + func->str_data_len > header->data_len)
+		{
+			continue;
+		}
+
+		func_cache_entries[func_cache_entries_count++] = (func_cache_entry_t) {
+			.hash = func->hash,
+			.flags = func->flags,
+			.label_base = func->label_base,
+			.labels = func->labels,
+			.while_label_base = func->while_label_base,
+			.while_labels = func->while_labels,
+			.str_base = func->str_base,
+			.strs = func->strs,
+			.insns_len = func->insns_len,
+			.str_data_len = func->str_data_len,
+			.insns = data + func->insns,
+			.str_data = data + func->str_data
+		};
+	}
+
+	func_cache_map = map;
+	func_cache_map_len = st.st_size;
+}
+
+bool
+func_cache_open(const char *program_path)
+{
+	if (!token_cache_init()) return false;
+
+	func_cache_program = token_cache_hash(program_path, strlen(program_path));
+	func_cache_program_path = program_path;
+	cache_strings_append(&func_cache_data, program_path, (u32) strlen(program_path));
+
+	char path[64];
+	func_cache_path(path, sizeof(path), func_cache_program);
+	func_cache_load(path);
+
+	func_cache_opened = true;
+	return true;
+}
+
+const func_cache_entry_t *
+func_cache_get(u64 hash)
+{
+	u32 lo = 0, hi = func_cache_entries_count;
+	while (lo < hi) {
+		const u32 mid = lo + (hi - lo) / 2;
+		if (func_cache_entries[mid].hash < hash) lo = mid + 1;
+		else hi = mid;
+	}
+
+	if (lo < func_cache_entries_count && func_cache_entries[lo].hash == hash) {
+		func_cache_hits++;
+		return &func_cache_entries[lo];
+	}
+
+	func_cache_misses++;
+	return NULL;
+}
+
+void
+func_cache_put(const func_cache_entry_t *entry)
+{
+	if (func_cache_puts_count == func_cache_puts_cap) {
+		func_cache_puts_cap = func_cache_puts_cap ? func_cache_puts_cap * 2 : 256;
+		func_cache_puts = (cached_func_t *) realloc(func_cache_puts, sizeof(cached_func_t) * func_cache_puts_cap);
+	}
+
+	func_cache_puts[func_cache_puts_count++] = (cached_func_t) {
+		.hash = entry->hash,
+		.flags = entry->flags,
+		.label_base = entry->label_base,
+		.labels = entry->labels,
+		.while_label_base = entry->while_label_base,
+		.while_labels = entry->while_labels,
+		.str_base = entry->str_base,
+		.strs = entry->strs,
+		.insns = cache_strings_append(&func_cache_data, entry->insns, entry->insns_len),
+		.insns_len = entry->insns_len,
+		.str_data = cache_strings_append(&func_cache_data, entry->str_data, entry->str_data_len),
+		.str_data_len = entry->str_data_len,
+		.pad = 0
+	};
+}
+
+static int
+cached_func_cmp(const void *a, const void *b)
+{
+	const u64 x = ((const cached_func_t *) a)->hash;
+	const u64 y = ((const cached_func_t *) b)->hash;
+	return (x > y) - (x < y);
+}
+
+static void
+func_cache_store(void)
+{
+	qsort(func_cache_puts, func_cache_puts_count, sizeof(cached_func_t), cached_func_cmp);
+
+	// The same declaration may be put twice, only the first one is kept
+	u32 count = 0;
+	for (u32 i = 0; i < func_cache_puts_count; ++i) {
+		if (count > 0 && func_cache_puts[count - 1].hash == func_cache_puts[i].hash) continue;
+		func_cache_puts[count++] = func_cache_puts[i];
+	}
+
+	const func_cache_header_t header = {
+		.magic = FUNC_CACHE_MAGIC,
+		.format = FUNC_CACHE_FORMAT,
+		.version = cache_version(),
+		.program_hash = func_cache_program,
+		.entries_count = count,
+		.data_len = (u32) func_cache_data.len,
+		.path_len = (u32) strlen(func_cache_program_path),
+		.pad = 0
+	};
+
+	char path[64], tmp_path[96];
+	func_cache_path(path, sizeof(path), func_cache_program);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int) getpid());
+
+	FILE *stream = fopen(tmp_path, "wb");
+	if (stream == NULL) return;
+
+	const bool ok = 1 == fwrite(&header, sizeof(header), 1, stream)
+		&& count == fwrite(func_cache_puts, sizeof(cached_func_t), count, stream)
+		&& func_cache_data.len == fwrite(func_cache_data.data, 1, func_cache_data.len, stream);
+
+	if (0 != fclose(stream) || !ok || 0 != rename(tmp_path, path)) {
+		remove(tmp_path);
+	}
+}
+
+void
+func_cache_close(void)
+{
+	if (!func_cache_opened) return;
+
+	func_cache_store();
+
+	free(func_cache_data.data);
+	free(func_cache_puts);
+	free(func_cache_entries);
+	if (func_cache_map != NULL) munmap(func_cache_map, func_cache_map_len);
+
+	func_cache_data = (cache_strings_t) {0};
+	func_cache_puts = NULL;
+	func_cache_puts_count = 0;
+	func_cache_puts_cap = 0;
+	func_cache_entries = NULL;
+	func_cache_entries_count = 0;
+	func_cache_map = NULL;
+	func_cache_map_len = 0;
+	func_cache_program_path = NULL;
+	func_cache_opened = false;
+}
+
+void
+func_cache_print_stats(void)
+{
+	printf("func cache: %u hits, %u misses\n", func_cache_hits, func_cache_misses);
+}
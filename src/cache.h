@@ -0,0 +1,74 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "lexer.h"
+#include "common.h"
+
+#include <stdbool.h>
+
+// Lexed tokens of included files are cached in `TOKEN_CACHE_DIR`, one file per source,
+// named by the hash of the content. Entries are valid for the sources of the compiler they
+// were written by, `PRACC_SOURCE_HASH` given by the build, there is no cache without it.
+#define TOKEN_CACHE_DIR ".prac-cache"
+#define TOKEN_CACHE_FORMAT 3
+
+// Create the cache directory, returns false if the cache can't be used.
+bool
+token_cache_init(void);
+
+u64
+token_cache_hash(const char *data, size_t len);
+
+// Fill the unit from the cache, the unit stays untouched on a miss.
+// Safe to call from worker threads.
+bool
+token_cache_load(lex_unit_t *unit, u64 hash);
+
+// Write lexed tokens of the unit into the cache. Safe to call from worker threads.
+void
+token_cache_store(const lex_unit_t *unit, u64 hash);
+
+void
+token_cache_print_stats(void);
+
+// Records of compiled procs and funcs are cached in one file per program, keyed by the hash
+// of the declaration and of the signatures it depends on. Numbers of the labels and of
+// the string literals are the ones the body was compiled with, starting at the bases.
+#define FUNC_CACHE_FORMAT 3
+
+typedef struct {
+	u64 hash;
+	u32 flags;
+	u32 label_base;
+	u32 labels;
+	u32 while_label_base;
+	u32 while_labels;
+	u32 str_base;
+	u32 strs;
+	u32 insns_len;
+	u32 str_data_len;
+	// The records one after another, as `insn_serialize` writes them
+	const char *insns;
+	// `strs` string literals one after another, each with its terminating zero
+	const char *str_data;
+} func_cache_entry_t;
+
+// Load the entries of the program, returns false if the cache can't be used
+bool
+func_cache_open(const char *program_path);
+
+const func_cache_entry_t *
+func_cache_get(u64 hash);
+
+// Keep the entry for the next run, its records and strings are copied
+void
+func_cache_put(const func_cache_entry_t *entry);
+
+// Write the entries put since `func_cache_open`, the ones not put are dropped
+void
+func_cache_close(void);
+
+void
+func_cache_print_stats(void);
+
+#endif // CACHE_H_
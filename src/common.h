@@ -5,11 +5,15 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 // #define PRINT_TOKENS
 // #define PRINT_ASTS
 // #define PRINT_STACK
 // #define MEM_PRINT 1
+// #define LEXER_NO_SIMD
+// #define LEXER_THREADS 1
+// #define NO_TOKEN_CACHE
 // #define DEBUG
 
 #ifdef DEBUG
@@ -39,9 +43,41 @@ typedef uint8_t  u8;
 
 #define MAIN_FUNCTION "main"
 
+// Global pool of `lower##_t` indexed by 32-bit ids, backed by its own `Vmem`.
+// The address range of `upper##S_ARENA_MB` is reserved on the first allocation
+// and pages are touched only as the pool grows, so the pointers never move.
 #define DECLARE_STATIC(lower, upper) \
-	lower##_t upper##S[upper##S_CAP]; \
-	lower##_id_t upper##S_SIZE = 0 \
+	static Vmem upper##S_arena; \
+	lower##_t *upper##S = NULL; \
+	lower##_id_t upper##S_SIZE = 0; \
+	\
+	lower##_id_t \
+	lower##s_alloc(u32 count) \
+	{ \
+		if (upper##S == NULL) { \
+			vmem_init(&upper##S_arena, upper##S_ARENA_MB); \
+			upper##S = (lower##_t *) upper##S_arena.ptr; \
+		} \
+		vmem_alloc(&upper##S_arena, sizeof(lower##_t) * count); \
+		const lower##_id_t id = upper##S_SIZE; \
+		upper##S_SIZE += count; \
+		return id; \
+	} \
+	\
+	void \
+	lower##s_arena_free(void) \
+	{ \
+		vmem_free(&upper##S_arena); \
+		upper##S = NULL; \
+		upper##S_SIZE = 0; \
+	} \
+	_Static_assert(sizeof(lower##_id_t) == 4, "ids of the pool must be 32-bit")
+
+#define DECLARE_STATIC_EXTERN(lower, upper) \
+	extern lower##_t *upper##S; \
+	extern lower##_id_t upper##S_SIZE; \
+	lower##_id_t lower##s_alloc(u32 count); \
+	void lower##s_arena_free(void)
 
 void
 main_deinit(void);
@@ -166,11 +202,20 @@ main_deinit(void);
 
 void eprintf(const char *format, ...);
 void evprintf(const char *format, va_list list);
+
 void report_error_noexit(const char *func, const char *file, const size_t line, const char *format, ...);
 NORETURN void report_error_(const char *func, const char *file, const size_t line, const char *format, ...);
 NORETURN void error_exit(const char *format, ...);
 
+// Hold the diagnostics back till the first error. It calls `reported_elsewhere` first, if that
+// returns true the error was reported by it and what is held and reported from then on is dropped.
+// What is held is printed at the exit otherwise.
+void errors_hold(bool (*reported_elsewhere)(void));
+
 UNUSED
 void print_elapsed(clock_t start, clock_t end, const char *what);
 
+UNUSED
+void print_throughput(clock_t start, clock_t end, size_t bytes, const char *what);
+
 #endif // COMMON_H_
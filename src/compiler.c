@@ -1,12 +1,18 @@
 #include "lexer.h"
 #include "lib.h"
 #include "ast.h"
+#include "cache.h"
 #include "common.h"
+#include "ir.h"
+#include "regalloc.h"
 #include "compiler.h"
-
-#include "stb_ds.h"
+#include "peephole.h"
+#include "insn.h"
+#include "emit.h"
+#include "assembler.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -17,14 +23,62 @@
 	exit(EXIT_FAILURE); \
 } while (0)
 
-#define wln(...) fprintf(stream, __VA_ARGS__ "\n")
-#define wprintln(fmt, ...) fprintf(stream, fmt "\n", __VA_ARGS__)
+// The text of the records, only written for `--asm` and in DEBUG builds
+static FILE *stream = NULL;
+// The records go to the built-in assembler, unless fasm or nasm assembles the text
+static bool assembling = false;
+// Records of the body being cached by `compile_and_cache`
+static insn_bytes_t *capture = NULL;
 
-#define TAB "\t"
-#define wtln(...) wln(TAB __VA_ARGS__)
-#define wtprintln(fmt, ...) wprintln(TAB fmt, __VA_ARGS__)
+// Records of the body being compiled, they go through the peephole pass before the output
+static insn_buffer_t body_insns = {0};
+static bool buffering = false;
 
-static FILE *stream = NULL;
+static void
+emit_insn(const insn_t *insn)
+{
+	if (capture != NULL) insn_serialize(capture, insn);
+	if (stream != NULL) insn_print(stream, insn);
+	if (assembling) assembler_insn(insn);
+}
+
+void
+emit(insn_t insn)
+{
+	if (buffering) insn_buffer_add(&body_insns, insn);
+	else emit_insn(&insn);
+}
+
+#ifdef DEBUG
+void
+emit_comment(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	if (buffering) {
+		insn_buffer_vcomment(&body_insns, fmt, args);
+	} else if (stream != NULL) {
+		fputs("; ", stream);
+		vfprintf(stream, fmt, args);
+		fputc('\n', stream);
+	}
+	va_end(args);
+}
+#endif
+
+INLINE void
+body_begin(void)
+{
+	buffering = true;
+}
+
+INLINE void
+body_end(void)
+{
+	buffering = false;
+	peephole_run(&body_insns);
+	insn_buffer_flush(&body_insns, emit_insn);
+}
 
 static size_t label_counter = 0;
 static size_t while_label_counter = 0;
@@ -35,28 +89,67 @@ static const char **strs = NULL;
 static bool used_strlen = false;
 static bool used_dmp_i64 = false;
 
-static const char *X86_64_LINUX_SYSTEM_V_CONVENTION_REGISTERS[6] = {
-	"rdi", "rsi", "rdx", "rcx", "r8", "r9"
-};
+const reg_t CONVENTION_REGISTERS[CONVENTION_REGISTERS_COUNT] = { REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9 };
 
-typedef struct {
-	bool is_used;
-	ast_id_t ast_id;
-	ast_kind_t ast_kind;
-} value_t;
+label_t
+string_literal(const char *str)
+{
+	vec_add(strs, str);
+	return label_numbered(LABEL_STR, string_literal_counter++);
+}
+
+#define SCOPE_INIT_CAP 1024
+
+scope_t scope = {0};
+
+static binding_t *
+scope_slot(sym_id_t sym)
+{
+	if (sym >= scope.cap) {
+		u32 cap = scope.cap ? scope.cap : SCOPE_INIT_CAP;
+		while (cap <= sym) cap *= 2;
 
-struct {
-	const char *key;
-	value_t value;
-} *values_map = NULL;
+		scope.bindings = (binding_t *) realloc(scope.bindings, sizeof(binding_t) * cap);
+		memset(scope.bindings + scope.cap, 0, sizeof(binding_t) * (cap - scope.cap));
+		scope.cap = cap;
+	}
+
+	return &scope.bindings[sym];
+}
+
+// Bind the evaluated const or var, unless the symbol is bound already
+static void
+scope_bind_entry(const consteval_map_t *map, sym_id_t sym, ast_kind_t ast_kind)
+{
+	const i32 idx = sym_index_get(&map->index, sym);
+	binding_t *binding = scope_slot(sym);
+	if (idx == -1 || binding->ast_kind != AST_POISONED) return;
+
+	binding->ast_kind = (u8) ast_kind;
+	binding->ast_id = map->entries[idx].value.ast_id;
+	binding->entry = (u32) idx;
+}
+
+static void
+scope_bind_map(const consteval_map_t *map, ast_kind_t ast_kind)
+{
+	FOREACH(consteval_entry_t, entry, map->entries) {
+		scope_bind_entry(map, entry.key, ast_kind);
+	}
+}
+
+static void
+scope_free(void)
+{
+	free(scope.bindings);
+	scope = (scope_t) {0};
+}
 
-struct {
-	const char *key;
-	value_t value;
-} *externs_map = NULL;
+static void
+check_ast(Compiler *ctx, ast_id_t ast_id);
 
 static void
-compile_ast(Compiler *ctx, const ast_t *ast);
+compile_ast(Compiler *ctx, ast_id_t ast_id);
 
 static void
 compiler_deinit(void);
@@ -64,49 +157,75 @@ compiler_deinit(void);
 static void
 compiler_emergency_clean(void);
 
-INLINE void
-scratch_buffer_genstr(void)
+// Compile an ast till its `next` is greater than or equal to `0`.
+// Every non-empty block should be with a `next` = -1 at the end.
+INLINE ast_id_t
+compile_block(Compiler *ctx, ast_id_t ast_id)
 {
-	scratch_buffer_clear();
-	scratch_buffer_printf("__str_%zu__", string_literal_counter);
+	while (ast_id < asts_len) {
+		compile_ast(ctx, ast_id);
+		if (ast_next(ast_id) < 0) break;
+		else ast_id = ast_next(ast_id);
+	}
+	return ast_id;
 }
 
-INLINE void
-scratch_buffer_genstrlen(void)
+// Same walk as `compile_block`, the last checked ast is returned
+INLINE ast_id_t
+check_block(Compiler *ctx, ast_id_t ast_id)
 {
-	scratch_buffer_clear();
-	scratch_buffer_printf("__str_%zu_len__", string_literal_counter);
+	while (ast_id < asts_len) {
+		check_ast(ctx, ast_id);
+		if (ast_next(ast_id) < 0) break;
+		else ast_id = ast_next(ast_id);
+	}
+	return ast_id;
 }
 
-// Compile an ast till the `ast.next` is greater than or equal to `0`.
-// Every non-empty block should be with an `ast.next` = -1 at the end.
-INLINE ast_id_t
-compile_block(Compiler *ctx, ast_t ast)
+static value_kind_t *stack_types = NULL;
+static size_t stack_types_cap = 0;
+
+// Stack effect of a proc, func or extern. The kinds live in `effect_kinds`: `ins` are the ones of
+// the arguments from the deepest to the top, `outs` the ones left, in the order they are pushed.
+typedef struct {
+	u32 ins;
+	u32 ins_count;
+	u32 outs;
+	u32 outs_count;
+} effect_t;
+
+static effect_t *effects = NULL;
+static value_kind_t *effect_kinds = NULL;
+
+// Procs and funcs reachable from main, in the order they are found. Bodies of the inline
+// ones are walked too, the calls in them are made from wherever they are expanded.
+static ast_id_t *reachable = NULL;
+
+// Index past the last type of the current body
+INLINE size_t
+stack_top(const Compiler *ctx)
 {
-	while (ast.ast_id < asts_len) {
-		compile_ast(ctx, &ast);
-		if (ast.next < 0) break;
-		else ast = astid(ast.next);
-	}
-	return ast.ast_id;
+	if (ctx->proc_ctx.stmt != NULL) return ctx->proc_ctx.stack_base + ctx->proc_ctx.stack_size;
+	else if (ctx->func_ctx.stmt != NULL) return ctx->func_ctx.stack_base + ctx->func_ctx.stack_size;
+	else return 0;
 }
 
 INLINE
 void stack_add_type(Compiler *ctx, value_kind_t type)
 {
-	if (ctx->proc_ctx.stmt != NULL) {
-		if (unlikely(ctx->proc_ctx.stack_size + 1 >= MAX_STACK_TYPES_CAP)) {
-			eprintf("EMERGENCY CRASH, STACK IS TOO BIG\n");
-			exit(1);
-		}
-		ctx->proc_ctx.stack_types[ctx->proc_ctx.stack_size++] = type;
-	} else if (ctx->func_ctx.stmt != NULL) {
-		if (unlikely(ctx->func_ctx.stack_size + 1 >= MAX_STACK_TYPES_CAP)) {
-			eprintf("EMERGENCY CRASH, STACK IS TOO BIG\n");
-			exit(1);
-		}
-		ctx->func_ctx.stack_types[ctx->func_ctx.stack_size++] = type;
+	size_t *stack_size = NULL;
+	if (ctx->proc_ctx.stmt != NULL) stack_size = &ctx->proc_ctx.stack_size;
+	else if (ctx->func_ctx.stmt != NULL) stack_size = &ctx->func_ctx.stack_size;
+	else return;
+
+	const size_t top = stack_top(ctx);
+	if (unlikely(top >= stack_types_cap)) {
+		stack_types_cap = stack_types_cap ? stack_types_cap * 2 : STACK_TYPES_INIT_CAP;
+		stack_types = (value_kind_t *) realloc(stack_types, sizeof(value_kind_t) * stack_types_cap);
 	}
+
+	stack_types[top] = type;
+	(*stack_size)++;
 }
 
 INLINE
@@ -121,19 +240,30 @@ void stack_pop(Compiler *ctx)
 INLINE const value_kind_t *
 stack_at(const Compiler *ctx, size_t idx)
 {
-	if (ctx->proc_ctx.stmt != NULL) return &ctx->proc_ctx.stack_types[idx];
-	else if (ctx->func_ctx.stmt != NULL) return &ctx->func_ctx.stack_types[idx];
+	if (ctx->proc_ctx.stmt != NULL) return &stack_types[ctx->proc_ctx.stack_base + idx];
+	else if (ctx->func_ctx.stmt != NULL) return &stack_types[ctx->func_ctx.stack_base + idx];
 	else return NULL;
 }
 
-UNUSED INLINE value_kind_t *
+INLINE value_kind_t *
 stack_at_mut(Compiler *ctx, size_t idx)
 {
-	if (ctx->proc_ctx.stmt != NULL) return &ctx->proc_ctx.stack_types[idx];
-	else if (ctx->func_ctx.stmt != NULL) return &ctx->func_ctx.stack_types[idx];
+	if (ctx->proc_ctx.stmt != NULL) return &stack_types[ctx->proc_ctx.stack_base + idx];
+	else if (ctx->func_ctx.stmt != NULL) return &stack_types[ctx->func_ctx.stack_base + idx];
 	else return NULL;
 }
 
+// Put back the `size` types of the stack of the body, saved in `types` (NULL if there are none)
+static void
+stack_restore(Compiler *ctx, const value_kind_t *types, size_t size)
+{
+	if (ctx->proc_ctx.stmt != NULL) ctx->proc_ctx.stack_size = size;
+	else if (ctx->func_ctx.stmt != NULL) ctx->func_ctx.stack_size = size;
+	else return;
+
+	if (types != NULL) memcpy(stack_at_mut(ctx, 0), types, sizeof(value_kind_t) * size);
+}
+
 INLINE size_t
 get_stack_size(const Compiler *ctx)
 {
@@ -165,18 +295,18 @@ const value_kind_t *third_type = NULL;
 
 // Check the stack size and types of values on the stack before performing a binop.
 void
-check_for_two_integers_on_the_stack(const Compiler *ctx, const char *op, const ast_t *ast)
+check_for_two_integers_on_the_stack(const Compiler *ctx, const char *op, ast_id_t ast_id)
 {
 	first_type = get_type_from_end(ctx, 1);
 	second_type = get_type_from_end(ctx, 0);
 
 	if (second_type == NULL || first_type == NULL) {
-		report_error("%s error: `%s` stack underflow, bruv", loc_to_str(&locid(ast->loc_id)), op);
+		report_error("%s error: `%s` stack underflow, bruv", loc_to_str(ast_loc(ast_id)), op);
 	} else if (*first_type  != VALUE_KIND_INTEGER
 				 ||  *second_type != VALUE_KIND_INTEGER)
 	{
 		report_error("%s error: expected two integers on the stack, but got: `%s` and `%s`",
-								 loc_to_str(&locid(ast->loc_id)),
+								 loc_to_str(ast_loc(ast_id)),
 								 value_kind_to_str_pretty(*second_type),
 								 value_kind_to_str_pretty(*first_type));
 	}
@@ -184,7 +314,7 @@ check_for_two_integers_on_the_stack(const Compiler *ctx, const char *op, const a
 
 // Check the stack size and types of values on the stack before performing a binop.
 void
-check_for_two_types_on_the_stack(const Compiler *ctx, const char *op, const ast_t *ast,
+check_for_two_types_on_the_stack(const Compiler *ctx, const char *op, ast_id_t ast_id,
 																 value_kind_t first_type_, value_kind_t first_type_or_,
 																 value_kind_t second_type_, value_kind_t second_type_or_)
 {
@@ -192,12 +322,12 @@ check_for_two_types_on_the_stack(const Compiler *ctx, const char *op, const ast_
 	second_type = get_type_from_end(ctx, 1);
 
 	if (second_type == NULL || first_type == NULL) {
-		report_error("%s error: `%s` stack underflow, bruv", loc_to_str(&locid(ast->loc_id)), op);
+		report_error("%s error: `%s` stack underflow, bruv", loc_to_str(ast_loc(ast_id)), op);
 	} else if ((*first_type  != first_type_  && *first_type  != first_type_or_)
 				 ||  (*second_type != second_type_ && *second_type != second_type_or_))
 	{
 		report_error("%s error: expected to have `%s`s or `%s`s on the stack, but got: `%s` and `%s`",
-								 loc_to_str(&locid(ast->loc_id)),
+								 loc_to_str(ast_loc(ast_id)),
 								 value_kind_to_str_pretty(first_type_),
 								 value_kind_to_str_pretty(first_type_or_),
 								 value_kind_to_str_pretty(*second_type),
@@ -206,359 +336,532 @@ check_for_two_types_on_the_stack(const Compiler *ctx, const char *op, const ast_
 }
 
 INLINE void
-check_for_integer_on_the_stack(const Compiler *ctx, const char *op, const char *msg, const ast_t *ast)
+check_for_integer_on_the_stack(const Compiler *ctx, const char *op, const char *msg, ast_id_t ast_id)
 {
 	const value_kind_t *type = get_type_from_end(ctx, 0);
 
 	if (type == NULL) {
-		report_error("%s error: `%s` with an empty stack", loc_to_str(&locid(ast->loc_id)), op);
+		report_error("%s error: `%s` with an empty stack", loc_to_str(ast_loc(ast_id)), op);
 	} else if (*type != VALUE_KIND_INTEGER) {
 		report_error("%s error: %s, but got: %s",
-								 loc_to_str(&locid(ast->loc_id)),
+								 loc_to_str(ast_loc(ast_id)),
 								 msg,
 								 value_kind_to_str_pretty(*type));
 	}
 }
 
 INLINE value_kind_t
-check_stack_for_last(const Compiler *ctx, const char *op, const ast_t *ast)
+check_stack_for_last(const Compiler *ctx, const char *op, ast_id_t ast_id)
 {
 	const value_kind_t *type = get_type_from_end(ctx, 0);
-	if (type == NULL) report_error("%s error: `%s` with an empty stack", loc_to_str(&locid(ast->loc_id)), op);
+	if (type == NULL) report_error("%s error: `%s` with an empty stack", loc_to_str(ast_loc(ast_id)), op);
 	return *type;
 }
 
-// Perform binary operation with rax, rbx
-#define print_binop(...) do {	\
-	wtln("pop rbx"); \
-	wtln("mov rax, qword [rsp]"); \
-	wtln(__VA_ARGS__); \
-	wtln("mov [rsp], rax"); \
-} while (0)
+INLINE const arg_t *
+binding_args(const binding_t *binding)
+{
+	const ast_id_t decl_ast = binding->ast_id;
+	if (binding->ast_kind == AST_PROC) {
+		return ast_proc(decl_ast)->args;
+	} else if (binding->ast_kind == AST_FUNC) {
+		return ast_func(decl_ast)->args;
+	} else if (binding->ast_kind == AST_EXTERN) {
+		switch (ast_extern(decl_ast)->kind) {
+		case EXTERN_FUNC: return ast_extern(decl_ast)->func_stmt.args;
+		case EXTERN_PROC: return ast_extern(decl_ast)->proc_stmt.args;
+		}
+	}
+
+	UNREACHABLE
+	return NULL;
+}
+
+// Stack effect of the proc, func or extern, computed on the first call of it
+static const effect_t *
+binding_effect(binding_t *binding)
+{
+	if (binding->effect != 0) return &effects[binding->effect - 1];
+
+	const arg_t *args = binding_args(binding);
+	const value_kind_t *ret_types = NULL;
+	if (binding->ast_kind == AST_FUNC) {
+		ret_types = ast_func(binding->ast_id)->ret_types;
+	} else if (binding->ast_kind == AST_EXTERN && ast_extern(binding->ast_id)->kind == EXTERN_FUNC) {
+		ret_types = ast_extern(binding->ast_id)->func_stmt.ret_types;
+	}
+
+	effect_t effect = {
+		.ins = vec_size(effect_kinds),
+		.ins_count = vec_size(args),
+	};
+
+	for (u32 i = 0; i < effect.ins_count; ++i) vec_add(effect_kinds, args[i].kind);
+
+	// The first of the return values ends up on the top
+	effect.outs = vec_size(effect_kinds);
+	effect.outs_count = vec_size(ret_types);
+	for (u32 i = effect.outs_count; i > 0; --i) vec_add(effect_kinds, ret_types[i - 1]);
+
+	vec_add(effects, effect);
+	binding->effect = vec_size(effects);
+	return &effects[binding->effect - 1];
+}
+
+// The top values of the stack are kept in registers, from the deepest to the top, the rest
+// is in memory. Nothing is kept at labels, calls and the ends of bodies, so the code on both
+// sides of a jump agrees on where the values are. The registers are not touched by the
+// syscalls, `dmp_i64` and `strlen`, and are preserved by the externs.
+static const reg_t TOS_REGISTERS[TOS_REGISTERS_COUNT] = TOS_REGISTER_LIST;
+
+static u8 tos[TOS_REGISTERS_COUNT] = {0};
+static u8 tos_count = 0;
+
+// Register of the `idx`th cached value from the top
+INLINE reg_t
+tos_reg(u8 idx)
+{
+	return TOS_REGISTERS[tos[tos_count - 1 - idx]];
+}
+
+INLINE u8
+tos_free_reg(void)
+{
+	u8 used = 0;
+	for (u8 i = 0; i < tos_count; ++i) used |= (u8) (1 << tos[i]);
+	for (u8 reg = 0; reg < TOS_REGISTERS_COUNT; ++reg) {
+		if (!(used & (1 << reg))) return reg;
+	}
+
+	UNREACHABLE
+	return 0;
+}
+
+// Push the cached values to the stack in memory
+static void
+tos_flush(void)
+{
+	for (u8 i = 0; i < tos_count; ++i) emit_op1(OP_PUSH, operand_reg(TOS_REGISTERS[tos[i]]));
+	tos_count = 0;
+}
+
+// Register for a new value on the top, the deepest cached value is spilled if there is none
+static reg_t
+tos_push(void)
+{
+	if (tos_count == TOS_REGISTERS_COUNT) {
+		emit_op1(OP_PUSH, operand_reg(TOS_REGISTERS[tos[0]]));
+		const u8 spilled = tos[0];
+		for (u8 i = 1; i < tos_count; ++i) tos[i - 1] = tos[i];
+		tos[tos_count - 1] = spilled;
+	} else {
+		const u8 reg = tos_free_reg();
+		tos[tos_count++] = reg;
+	}
+
+	return TOS_REGISTERS[tos[tos_count - 1]];
+}
+
+// Bring the top `count` values into registers
+static void
+tos_load(u8 count)
+{
+	while (tos_count < count) {
+		const u8 reg = tos_free_reg();
+		emit_op1(OP_POP, operand_reg(TOS_REGISTERS[reg]));
+		for (u8 i = tos_count; i > 0; --i) tos[i] = tos[i - 1];
+		tos[0] = reg;
+		tos_count++;
+	}
+}
+
+// Pop the top value, the register it is in is returned, `scratch` if it was in memory
+static reg_t
+tos_pop(reg_t scratch)
+{
+	if (tos_count == 0) {
+		emit_op1(OP_POP, operand_reg(scratch));
+		return scratch;
+	}
+
+	return TOS_REGISTERS[tos[--tos_count]];
+}
+
+INLINE void
+tos_pop_into(reg_t reg)
+{
+	if (tos_count == 0) emit_op1(OP_POP, operand_reg(reg));
+	else emit_op2(OP_MOV, operand_reg(reg), operand_reg(TOS_REGISTERS[tos[--tos_count]]));
+}
+
+// Read the value `idx` values deep, the offset counts the ones in registers too
+static void
+tos_read(reg_t reg, size_t idx)
+{
+	if (idx < tos_count) emit_op2(OP_MOV, operand_reg(reg), operand_reg(tos_reg((u8) idx)));
+	else emit_op2(OP_MOV, operand_reg(reg), operand_mem(0, REG_RSP, (idx - tos_count) * WORD_SIZE));
+}
+
+// Pop the top `count` values into the registers of the arguments, the top one to the last
+static void
+tos_pop_args(size_t count)
+{
+	for (size_t i = 0; i < count; ++i) tos_pop_into(CONVENTION_REGISTERS[count - 1 - i]);
+}
+
+// Pop the top `count` values into the registers of the results, the top one to the first
+static void
+tos_pop_results(size_t count)
+{
+	for (size_t i = 0; i < count; ++i) tos_pop_into(CONVENTION_REGISTERS[i]);
+}
+
+// Perform binary operation on the two top values, the result replaces the deeper one
+static void
+print_binop(op_t op)
+{
+	tos_load(2);
+	emit_op2(op, operand_reg(tos_reg(1)), operand_reg(tos_reg(0)));
+	tos_count--;
+}
+
+// Compare the two top values, the deeper one is replaced with 1 if `set<cc>` sets
+static void
+print_compare(cc_t cc)
+{
+	tos_load(2);
+	emit_op2(OP_CMP, operand_reg(tos_reg(1)), operand_reg(tos_reg(0)));
+	emit(insn_setcc(cc, operand_reg_sized(REG_RAX, 1)));
+	tos_count--;
+	emit_op2(OP_MOVZX, operand_reg(tos_reg(0)), operand_reg_sized(REG_RAX, 1));
+}
+
+static const label_t RSP_STACK_PTR = { .kind = LABEL_NAME, .name = "rsp_stack_ptr" };
+static const label_t RET_CODE = { .kind = LABEL_NAME, .name = "ret_code" };
 
 static void
 rsp_stack_mov_rsp(void)
 {
-	wtln("mov rax, qword [rsp_stack_ptr]");
-	wtln("mov qword [rax], rsp");
-	wtln("add qword [rsp_stack_ptr], WORD_SIZE");
+	emit_op2(OP_MOV, operand_reg(REG_RAX), operand_mem_label(8, RSP_STACK_PTR));
+	emit_op2(OP_MOV, operand_mem(8, REG_RAX, 0), operand_reg(REG_RSP));
+	emit_op2(OP_ADD, operand_mem_label(8, RSP_STACK_PTR), operand_imm(WORD_SIZE));
 }
 
 static void
 rsp_stack_mov_to_rsp(void)
 {
-	wtln("sub qword [rsp_stack_ptr], WORD_SIZE");
-	wtln("mov rax, qword [rsp_stack_ptr]");
-	wtln("mov rsp, qword [rax]");
+	emit_op2(OP_SUB, operand_mem_label(8, RSP_STACK_PTR), operand_imm(WORD_SIZE));
+	emit_op2(OP_MOV, operand_reg(REG_RAX), operand_mem_label(8, RSP_STACK_PTR));
+	emit_op2(OP_MOV, operand_reg(REG_RSP), operand_mem(8, REG_RAX, 0));
 }
 
+// Set rsp to the one the body started with, drop the arguments below it and push the results
+// from the registers they are in. A proc or func returns to the address the arguments are
+// under, an inline body goes on.
 static void
-compile_inline(Compiler *ctx, const ast_t *decl_ast, bool is_proc)
+frame_leave(size_t args_count, size_t rets_count, bool ret)
 {
-	// Save old proc/func context and reset the current one
-	const void *old_stmt = NULL;
-	size_t old_stack_size = 0;
-	value_kind_t old_stack_types[FUNC_CTX_MAX_STACK_TYPES_CAP] = {0};
-	if (is_proc) {
-		old_stmt = ctx->proc_ctx.stmt;
-		old_stack_size = ctx->proc_ctx.stack_size;
-		memcpy(old_stack_types, ctx->proc_ctx.stack_types, sizeof(value_kind_t) * ctx->proc_ctx.stack_size);
-		ctx->proc_ctx.stmt = &decl_ast->proc_stmt;
-		ctx->proc_ctx.stack_size = 0;
-	} else {
-		old_stmt = ctx->func_ctx.stmt;
-		old_stack_size = ctx->func_ctx.stack_size;
-		memcpy(old_stack_types, ctx->func_ctx.stack_types, sizeof(value_kind_t) * ctx->func_ctx.stack_size);
-		ctx->func_ctx.stmt = &decl_ast->func_stmt;
-		ctx->func_ctx.stack_size = 0;
-	}
+	rsp_stack_mov_to_rsp();
+	if (ret) emit_op1(OP_POP, operand_reg(REG_RAX));
 
-	// Preserve old rsp
-	rsp_stack_mov_rsp();
+	emit_op2(OP_ADD, operand_reg(REG_RSP), operand_imm(args_count * WORD_SIZE));
+	for (size_t i = 0; i < rets_count; ++i) emit_op1(OP_PUSH, operand_reg(CONVENTION_REGISTERS[i]));
 
-	ast_t ast = astid(is_proc ? decl_ast->proc_stmt.body : decl_ast->func_stmt.body);
+	if (ret) {
+		emit_op1(OP_PUSH, operand_reg(REG_RAX));
+		emit_op0(OP_RET);
+	}
+}
 
-	compile_block(ctx, ast);
+void
+emit_call(const char *name)
+{
+	emit_op1(OP_CALL, operand_address(label_func(name)));
+}
 
-	const value_kind_t *ret_types = is_proc ?
-		NULL : decl_ast->func_stmt.ret_types;
+// rsp is moved by a word around the call, to align it for the extern
+void
+emit_extern_call(const char *name)
+{
+	emit_op2(OP_SUB, operand_reg(REG_RSP), operand_imm(WORD_SIZE));
+	emit_op1(OP_CALL, operand_address(label_named(name)));
+	emit_op2(OP_ADD, operand_reg(REG_RSP), operand_imm(WORD_SIZE));
+}
 
-	const size_t ret_types_count = is_proc ?
-		0: vec_size(ret_types);
+// Bind the arguments of the current proc, or func if there is none, the previous ones go stale.
+// The offset is the distance of the argument from the values pushed by the body.
+static void
+bind_args(const Compiler *ctx)
+{
+	scope.arg_scope++;
 
-	for (size_t i = 0; i < ret_types_count; ++i) {
-		wtprintln("pop %s", X86_64_LINUX_SYSTEM_V_CONVENTION_REGISTERS[i]);
+	const arg_t *args = NULL;
+	bool inlin = false;
+	if (ctx->proc_ctx.stmt != NULL) {
+		args = ctx->proc_ctx.stmt->args;
+		inlin = ctx->proc_ctx.stmt->inlin;
+	} else if (ctx->func_ctx.stmt != NULL) {
+		args = ctx->func_ctx.stmt->args;
+		inlin = ctx->func_ctx.stmt->inlin;
 	}
 
-	// Set rsp to the old rsp
-	rsp_stack_mov_to_rsp();
+	const u32 args_count = vec_size(args);
+	for (u32 i = 0; i < args_count; ++i) {
+		binding_t *binding = scope_slot(args[i].name);
 
-	// Drop all the leftovers and push return values on the stack
-	wtprintln("add rsp, %u", vec_size(is_proc ?
-																		decl_ast->proc_stmt.args
-																		: decl_ast->func_stmt.args) * WORD_SIZE);
+		// The first of the arguments with the same name is used
+		if (binding->arg_scope == scope.arg_scope) continue;
 
-	for (size_t i = 0; i < ret_types_count; ++i) {
-		wtprintln("push %s", X86_64_LINUX_SYSTEM_V_CONVENTION_REGISTERS[i]);
+		binding->arg_scope = scope.arg_scope;
+		binding->arg_kind = (u8) args[i].kind;
+		binding->arg_offset = args_count - i - (inlin ? 1 : 0);
 	}
+}
 
-	// Set  current context to the old one
+static void
+check_inline(Compiler *ctx, ast_id_t decl_ast, bool is_proc)
+{
+	// Save old proc/func context, the inline body gets its frame at the top of the stack
+	const proc_ctx_t old_proc_ctx = ctx->proc_ctx;
+	const func_ctx_t old_func_ctx = ctx->func_ctx;
+	const size_t stack_base = stack_top(ctx);
 	if (is_proc) {
-		ctx->proc_ctx.stack_size = old_stack_size;
-		memcpy(ctx->proc_ctx.stack_types, old_stack_types, sizeof(value_kind_t) * old_stack_size);
-		ctx->proc_ctx.stmt = (const proc_stmt_t *) old_stmt;
+		ctx->proc_ctx = (proc_ctx_t) { .stmt = ast_proc(decl_ast), .stack_base = stack_base };
 	} else {
-		ctx->func_ctx.stack_size = old_stack_size;
-		memcpy(ctx->func_ctx.stack_types, old_stack_types, sizeof(value_kind_t) * old_stack_size);
-		ctx->func_ctx.stmt = (const func_stmt_t *) old_stmt;
+		// A proc it is called from would be taken for the current body
+		ctx->proc_ctx.stmt = NULL;
+		ctx->func_ctx = (func_ctx_t) { .stmt = ast_func(decl_ast), .stack_base = stack_base };
 	}
-}
 
-static size_t arg_idx = 0;
+	bind_args(ctx);
 
-static const arg_t *
-check_for_arg(Compiler *ctx, const char *str)
-{
-	arg_idx = 0;
-	arg_t *arg = NULL;
+	const ast_id_t body = parser_body(ctx->parser, decl_ast);
+	if (body >= 0) {
+		check_block(ctx, body);
+	}
 
-	arg_t *args = ctx->proc_ctx.stmt == NULL ?
-		ctx->func_ctx.stmt->args
-		: ctx->proc_ctx.stmt->args;
+	const bool called_funcptr = is_proc ? ctx->proc_ctx.called_funcptr : ctx->func_ctx.called_funcptr;
 
-	FOREACH_IDX(idx, arg_t, arg_, args) {
-		if (0 == strcmp(arg_.name, str)) {
-			arg = &arg_;
-			arg_idx = idx;
-			break;
-		}
-	}
+	// Set  current context to the old one, a function pointer called by the inline body
+	// is called by the body it is expanded in
+	ctx->proc_ctx = old_proc_ctx;
+	ctx->func_ctx = old_func_ctx;
+	if (ctx->proc_ctx.stmt != NULL) ctx->proc_ctx.called_funcptr |= called_funcptr;
+	else if (ctx->func_ctx.stmt != NULL) ctx->func_ctx.called_funcptr |= called_funcptr;
 
-	return arg;
+	bind_args(ctx);
 }
 
-INLINE void
-pre_ffi_call(size_t args_count_required)
+static void
+compile_inline(Compiler *ctx, ast_id_t decl_ast, bool is_proc)
 {
-	// Convert `prac-language` to `x86_64_linux` convention
-	for (size_t i = 0; i < args_count_required; ++i) {
-		wtprintln("pop %s", X86_64_LINUX_SYSTEM_V_CONVENTION_REGISTERS[args_count_required - 1 - i]);
+	// The arguments are read from memory and dropped with the frame
+	tos_flush();
+
+	// Preserve old rsp
+	rsp_stack_mov_rsp();
+
+	const ast_id_t body = parser_body(ctx->parser, decl_ast);
+	if (body >= 0) {
+		compile_block(ctx, body);
 	}
-	wtln("sub rsp, WORD_SIZE");
-}
 
-INLINE void
-post_ffi_call(size_t args_count_required)
-{
-	wtln("add rsp, WORD_SIZE");
-	(void) args_count_required;
+	const size_t ret_types_count = is_proc ?
+		0: vec_size(ast_func(decl_ast)->ret_types);
+	tos_pop_results(ret_types_count);
+
+	// What is left in the registers is dropped with the rest
+	tos_count = 0;
+	frame_leave(vec_size(is_proc ? ast_proc(decl_ast)->args : ast_func(decl_ast)->args), ret_types_count, false);
 }
 
+// Find the first argument of the call that does not match its type, and report it
 static void
-compile_function_call(Compiler *ctx, value_t value, const ast_t *ast)
+report_argument_mismatch(const Compiler *ctx, const binding_t *value, ast_id_t ast_id)
 {
-	const size_t stack_size = get_stack_size(ctx);
+	const arg_t *args = binding_args(value);
+	const size_t args_count_required = vec_size(args);
 
-	size_t args_count_required = 0;
-	const ast_t *decl_ast = &astid(value.ast_id);
-	if (value.ast_kind == AST_PROC) {
-		args_count_required = vec_size(decl_ast->proc_stmt.args);
-	} else if (value.ast_kind == AST_FUNC) {
-		args_count_required = vec_size(decl_ast->func_stmt.args);
-	} else if (value.ast_kind == AST_EXTERN) {
-		switch (decl_ast->extern_decl.kind) {
-		case EXTERN_FUNC: args_count_required = vec_size(decl_ast->extern_decl.func_stmt.args); break;
-		case EXTERN_PROC: args_count_required = vec_size(decl_ast->extern_decl.proc_stmt.args); break;
+	for (size_t i = 0; i < args_count_required; ++i) {
+		const value_kind_t expected = args[i].kind;
+		const value_kind_t got = *get_type_from_end(ctx, args_count_required - 1 - i);
+		if (expected == got) continue;
+
+		loc_id_t arg_loc = args[i].loc_id;
+		if (ast_id - 1 > 0
+		&& ast_kind(ast_id - 1) == AST_PUSH)
+		{
+			arg_loc = ast_loc(ast_id - 1);
 		}
-	} else {
-		UNREACHABLE
+
+		eprintf("%s error: expected %zuth argument to call `%s` to be `%s`, but "
+						"got: `%s`\n",
+						loc_to_str(arg_loc), i, symstr(ast_sym(ast_id)),
+						value_kind_to_str_pretty(expected),
+						value_kind_to_str_pretty(got));
+
+		report_error("%s note: `%s` defined here",
+								 loc_to_str(ast_loc(value->ast_id)), symstr(ast_sym(ast_id)));
 	}
+}
+
+// The arguments are checked at once against the stack effect of the callee,
+// which then replaces them with what it returns
+static void
+check_function_call(Compiler *ctx, binding_t *value, ast_id_t ast_id)
+{
+	const size_t stack_size = get_stack_size(ctx);
+	const effect_t *effect = binding_effect(value);
 
-	if (stack_size < args_count_required) {
+	if (stack_size < effect->ins_count) {
 		eprintf("%s error: stack underflow trying to call: `%s`\n",
-						loc_to_str(&locid(ast->loc_id)), ast->call.str);
+						loc_to_str(ast_loc(ast_id)), symstr(ast_sym(ast_id)));
 
 		report_error("	note: expected amount of values on "
-								 "the stack: %zu, the actual stack size: %zu",
-								 args_count_required, stack_size);
+								 "the stack: %u, the actual stack size: %zu",
+								 effect->ins_count, stack_size);
 	}
 
-	for (size_t i = 0; i < args_count_required; ++i) {
-		value_kind_t expected = 0;
-		value_kind_t got = *get_type_from_end(ctx, args_count_required - 1 - i);
-		if (value.ast_kind == AST_PROC) {
-#if defined(DEBUG) || defined(PRINT_STACK)
-			printf("--- %s ---\n", decl_ast->proc_stmt.name->str);
-#endif
-			expected = decl_ast->proc_stmt.args[i].kind;
-		} else if (value.ast_kind == AST_FUNC) {
-#if defined(DEBUG) || defined(PRINT_STACK)
-			printf("--- %s ---\n", decl_ast->func_stmt.name->str);
-#endif
-			expected = decl_ast->func_stmt.args[i].kind;
-		} else if (value.ast_kind == AST_EXTERN) {
-			switch (decl_ast->extern_decl.kind) {
-			case EXTERN_FUNC: {
-#if defined(DEBUG) || defined(PRINT_STACK)
-				printf("--- %s ---\n", decl_ast->extern_decl.func_stmt.name->str);
-#endif
-				expected = decl_ast->extern_decl.func_stmt.args[i].kind;
-			} break;
-			case EXTERN_PROC: {
-#if defined(DEBUG) || defined(PRINT_STACK)
-				printf("--- %s ---\n", decl_ast->extern_decl.proc_stmt.name->str);
-#endif
-				expected = decl_ast->extern_decl.proc_stmt.args[i].kind;
-			} break;
-			}
-		} else {
-			UNREACHABLE
-		}
-
 #if defined(DEBUG) || defined(PRINT_STACK)
-		stack_dump(ctx);
+	printf("--- %s ---\n", symstr(ast_sym(ast_id)));
+	stack_dump(ctx);
 #endif
 
-		if (expected != got) {
-			loc_id_t arg_loc = 0;
-			if (ast->ast_id - 1 > 0
-			&& astid(ast->ast_id - 1).ast_kind == AST_PUSH)
-			{
-				arg_loc = astid(ast->ast_id - 1).loc_id;
-			} else if (value.ast_kind == AST_PROC) {
-				arg_loc = decl_ast->proc_stmt.args[i].loc_id;
-			} else if (value.ast_kind == AST_FUNC) {
-				arg_loc = decl_ast->func_stmt.args[i].loc_id;
-			} else if (value.ast_kind == AST_EXTERN) {
-				switch (decl_ast->extern_decl.kind) {
-				case EXTERN_FUNC: {
-					arg_loc = decl_ast->extern_decl.func_stmt.args[i].loc_id;
-				} break;
-				case EXTERN_PROC: {
-					arg_loc = decl_ast->extern_decl.proc_stmt.args[i].loc_id;
-				} break;
-				}
-			} else {
-				UNREACHABLE
-			}
+	if (effect->ins_count > 0
+	&& 0 != memcmp(stack_types + stack_top(ctx) - effect->ins_count,
+								 effect_kinds + effect->ins,
+								 sizeof(value_kind_t) * effect->ins_count))
+	{
+		report_argument_mismatch(ctx, value, ast_id);
+	}
 
-			eprintf("%s error: expected %zuth argument to call `%s` to be `%s`, but "
-							"got: `%s`\n",
-							loc_to_str(&locid(arg_loc)), i, ast->call.str,
-							value_kind_to_str_pretty(expected),
-							value_kind_to_str_pretty(got));
+	for (u32 i = 0; i < effect->ins_count; ++i) {
+		stack_pop(ctx);
+	}
 
-			report_error("%s note: `%s` defined here",
-									 loc_to_str(&locid(decl_ast->loc_id)), ast->call.str);
-		}
+	if (value->ast_kind == AST_PROC && ast_proc(value->ast_id)->inlin) {
+		check_inline(ctx, value->ast_id, true);
+	} else if (value->ast_kind == AST_FUNC && ast_func(value->ast_id)->inlin) {
+		check_inline(ctx, value->ast_id, false);
 	}
 
-	for (size_t i = 0; i < args_count_required; ++i) {
-		stack_pop(ctx);
+	// `effect` may move while the inline body is checked
+	effect = &effects[value->effect - 1];
+	for (u32 i = 0; i < effect->outs_count; ++i) {
+		stack_add_type(ctx, effect_kinds[effect->outs + i]);
 	}
 
-	if (value.ast_kind == AST_PROC) {
-		if (decl_ast->proc_stmt.inlin) {
-			compile_inline(ctx, decl_ast, true);
-		} else {
-			wtprintln("call __%s__", decl_ast->proc_stmt.name->str);
-		}
-	} else if (value.ast_kind == AST_FUNC) {
-		if (decl_ast->func_stmt.inlin) {
-			compile_inline(ctx, decl_ast, false);
-		} else {
-			wtprintln("call __%s__", decl_ast->func_stmt.name->str);
-		}
+	value->is_used = true;
+}
 
-		// Add return values from function to the types stack
-		for (size_t i = vec_size(decl_ast->func_stmt.ret_types); i > 0; --i) {
-			stack_add_type(ctx, decl_ast->func_stmt.ret_types[i - 1]);
-		}
-	} else if (value.ast_kind == AST_EXTERN) {
-		switch (decl_ast->extern_decl.kind) {
-		case EXTERN_FUNC: {
-			pre_ffi_call(args_count_required);
-			wtprintln("call %s", decl_ast->extern_decl.func_stmt.name->str);
-			post_ffi_call(args_count_required);
-			// Only for integrals now
-			wtln("push rax");
-			// Add return values from function to the types stack
-			for (size_t i = vec_size(decl_ast->extern_decl.func_stmt.ret_types); i > 0; --i) {
-				stack_add_type(ctx, decl_ast->extern_decl.func_stmt.ret_types[i - 1]);
-			}
-		} break;
-		case EXTERN_PROC: {
-			pre_ffi_call(args_count_required);
-			wtprintln("call %s", decl_ast->extern_decl.proc_stmt.name->str);
-			post_ffi_call(args_count_required);
-		} break;
+static void
+compile_function_call(Compiler *ctx, const binding_t *value)
+{
+	const ast_id_t decl_ast = value->ast_id;
+	if (value->ast_kind == AST_PROC || value->ast_kind == AST_FUNC) {
+		const bool is_proc = value->ast_kind == AST_PROC;
+		if (is_proc ? ast_proc(decl_ast)->inlin : ast_func(decl_ast)->inlin) {
+			compile_inline(ctx, decl_ast, is_proc);
+		} else {
+			tos_flush();
+			emit_call(is_proc ? ast_proc(decl_ast)->name->str : ast_func(decl_ast)->name->str);
 		}
+	} else if (value->ast_kind == AST_EXTERN) {
+		// Convert `prac-language` to `x86_64_linux` convention
+		const extern_decl_t *extern_decl = ast_extern(decl_ast);
+		const bool is_func = extern_decl->kind == EXTERN_FUNC;
+		tos_pop_args(vec_size(is_func ? extern_decl->func_stmt.args : extern_decl->proc_stmt.args));
+		tos_flush();
+		emit_extern_call(is_func ? extern_decl->func_stmt.name->str : extern_decl->proc_stmt.name->str);
+
+		// Only for integrals now
+		if (is_func) emit_op2(OP_MOV, operand_reg(tos_push()), operand_reg(REG_RAX));
 	} else {
 		UNREACHABLE
 	}
-
-	const value_t value_ = {
-			.ast_id = value.ast_id,
-			.ast_kind = value.ast_kind,
-			.is_used = true
-	};
-
-	shput(values_map, ast->call.str, value_);
 }
 
 // TODO: deprecate `funcptr` type.
 // It may happen when you have a function that accepts `funcptr` as an argument,
 //   and you trying to call this argument, which is basically just calling a function pointer.
 static void
-compile_argument_push_or_call(Compiler *ctx, i32 value_idx, const ast_t *ast, bool is_call)
+check_argument_push_or_call(Compiler *ctx, const binding_t *binding, ast_id_t ast_id, bool is_call)
 {
 	if (ctx->proc_ctx.stmt != NULL || ctx->func_ctx.stmt != NULL) {
-		const arg_t *arg = check_for_arg(ctx, ast->literal.str);
-		if (arg == NULL) {
+		if (binding->arg_scope != scope.arg_scope) {
 			report_error("%s error: undefined symbol: `%s`",
-									 loc_to_str(&locid(ast->loc_id)), ast->literal.str);
+									 loc_to_str(ast_loc(ast_id)), symstr(ast_sym(ast_id)));
 		}
 
 		// Compute the index of the value from the end of the stack
-		size_t stack_idx = 0;
-		if (ctx->proc_ctx.stmt != NULL) {
-			stack_idx = vec_size(ctx->proc_ctx.stmt->args) - arg_idx + ctx->proc_ctx.stack_size;
-			if (ctx->proc_ctx.stmt->inlin) stack_idx--;
-		} else {
-			stack_idx = vec_size(ctx->func_ctx.stmt->args) - arg_idx + ctx->func_ctx.stack_size;
-			if (ctx->func_ctx.stmt->inlin) stack_idx--;
-		}
+		ast_resolved(ast_id) = binding->arg_offset + (ctx->proc_ctx.stmt != NULL ?
+																									ctx->proc_ctx.stack_size
+																									: ctx->func_ctx.stack_size);
 
-		if (is_call) {
-			wtprintln("call qword [rsp + %zu]", stack_idx * WORD_SIZE);
-		} else {
-			wtprintln("mov rax, [rsp + %zu]", stack_idx * WORD_SIZE);
-			wtln("push rax");
-			stack_add_type(ctx, arg->kind);
+		if (!is_call) {
+			stack_add_type(ctx, (value_kind_t) binding->arg_kind);
 		}
 	} else {
-		if (value_idx == -1) {
-			report_error("%s error: undefined symbol: `%s`",
-									 loc_to_str(&locid(ast->loc_id)), ast->call.str);
-		}
+		report_error("%s error: undefined symbol: `%s`",
+								 loc_to_str(ast_loc(ast_id)), symstr(ast_sym(ast_id)));
 	}
 }
 
-static void
-compile_ast(Compiler *ctx, const ast_t *ast)
+void
+print_value(value_kind_t kind)
 {
-#ifdef DEBUG
-	if (ast->ast_kind != AST_PROC && ast->ast_kind != AST_FUNC) {
-		wprintln("; -- %s --", ast_kind_to_str(ast->ast_kind));
+	switch (kind) {
+	// TODO: Create a separate function `dmp_byte`
+	case VALUE_KIND_BYTE:
+	case VALUE_KIND_FUNCTION_POINTER:
+	case VALUE_KIND_INTEGER: {
+		emit_op2(OP_MOV, operand_reg(REG_R14), operand_imm(1)); // mov 1 to r14 to print newline
+		emit_op1(OP_CALL, operand_address(label_named("dmp_i64")));
+		used_dmp_i64 = true;
+	} break;
 
-#ifdef PRINT_STACK
-		printf("%s:\n", ast_kind_to_str(ast->ast_kind));
-		stack_dump(ctx);
-#endif
+	case VALUE_KIND_STRING: {
+		emit_op1(OP_CALL, operand_address(label_named("strlen")));
+		emit_op2(OP_MOV, operand_reg(REG_RDX), operand_reg(REG_RAX));
+		emit_op2(OP_MOV, operand_reg(REG_RSI), operand_reg(REG_RDI));
+		emit_op2(OP_MOV, operand_reg(REG_RAX), operand_imm(SYS_WRITE));
+		emit_op2(OP_MOV, operand_reg(REG_RDI), operand_imm(SYS_STDOUT));
+		emit_op0(OP_SYSCALL);
+		used_strlen = true;
+	} break;
+
+	case VALUE_KIND_POISONED: UNREACHABLE; break;
+	case VALUE_KIND_LAST:			UNREACHABLE; break;
 	}
-#endif
+}
 
-	switch (ast->ast_kind) {
+static void
+compile_argument_push_or_call(ast_id_t ast_id, bool is_call)
+{
+	const size_t stack_idx = ast_resolved(ast_id);
+	if (is_call) {
+		tos_flush();
+		emit_op1(OP_CALL, operand_mem(8, REG_RSP, stack_idx * WORD_SIZE));
+	} else {
+		// The new value is one more above the argument
+		const reg_t reg = tos_push();
+		tos_read(reg, stack_idx + 1);
+	}
+}
+
+// Track the types of the values on the stack, report what does not match, and
+// resolve what the codegen of the ast depends on
+static void
+check_ast(Compiler *ctx, ast_id_t ast_id)
+{
+#ifdef PRINT_STACK
+	if (ast_kind(ast_id) != AST_PROC && ast_kind(ast_id) != AST_FUNC) {
+		printf("%s:\n", ast_kind_to_str(ast_kind(ast_id)));
+		stack_dump(ctx);
+	}
+#endif
+
+	switch (ast_kind(ast_id)) {
 	// These are handled in different place
 	case AST_VAR:
 	case AST_FUNC:
@@ -570,118 +873,81 @@ compile_ast(Compiler *ctx, const ast_t *ast)
 		check_for_integer_on_the_stack(ctx, "if",
 																	 "expected last value on "
 																	 "the stack to be integer",
-																	 ast);
+																	 ast_id);
 
-		wtln("pop rax");
 		stack_pop(ctx);
 
-		// If statement is empty
-		if (ast->if_stmt.then_body < 0 && ast->if_stmt.else_body < 0) return;
-
-		const size_t curr_label = label_counter++;
-
-		wtln("test rax, rax");
-		wtprintln("jz ._else_%zu", curr_label);
-
-		ast_t if_ast = astid(ast->if_stmt.then_body);
-		if (ast->if_stmt.then_body >= 0) {
-			compile_block(ctx, if_ast);
-			wtprintln("jmp ._edon_%zu", curr_label);
+		// The else body starts from the stack the then body starts from, the types the then
+		// body pops and pushes over are kept for it
+		const size_t start_stack_size = get_stack_size(ctx);
+		value_kind_t *start_types = NULL;
+		if (ast_if(ast_id)->then_body >= 0 && ast_if(ast_id)->else_body >= 0 && start_stack_size > 0) {
+			start_types = (value_kind_t *) malloc(sizeof(value_kind_t) * start_stack_size);
+			memcpy(start_types, stack_at(ctx, 0), sizeof(value_kind_t) * start_stack_size);
 		}
 
-		wprintln("._else_%zu:", curr_label);
-		if (ast->if_stmt.else_body >= 0) {
-			if_ast = astid(ast->if_stmt.else_body);
-			compile_block(ctx, if_ast);
+		if (ast_if(ast_id)->then_body >= 0) {
+			check_block(ctx, ast_if(ast_id)->then_body);
 		}
 
-		wprintln("._edon_%zu:", curr_label);
+		if (ast_if(ast_id)->else_body >= 0) {
+			stack_restore(ctx, start_types, start_stack_size);
+			check_block(ctx, ast_if(ast_id)->else_body);
+		}
+		free(start_types);
 	} break;
 
 	case AST_WRITE: {
-		value_kind_t value_kind = check_stack_for_last(ctx, "write", ast);
-		const char *str = ast->write_stmt.token->str + 1;
-		const i32 var_idx = shgeti(ctx->var_map, str);
-		if (var_idx == -1) {
+		value_kind_t value_kind = check_stack_for_last(ctx, "write", ast_id);
+		const sym_id_t name = ast_sym(ast_id);
+		const binding_t *binding = scope_get(name);
+		const consteval_value_t *var = binding->ast_kind == AST_VAR ?
+			&ctx->var_map->entries[binding->entry].value : NULL;
+		if (var == NULL) {
 			report_error("%s error: undefined symbol: `%s`",
-									 loc_to_str(&locid(ast->loc_id)),
-									 str);
+									 loc_to_str(ast_loc(ast_id)),
+									 symstr(name));
 		}
 
-		const consteval_value_t value = ctx->var_map[var_idx].value;
+		const consteval_value_t value = *var;
 
 		if (value_kind != value.kind) {
 			report_error("%s error: write a value of type `%s` into the variable of type `%s`",
-									 loc_to_str(&locid(ast->loc_id)),
+									 loc_to_str(ast_loc(ast_id)),
 									 value_kind_to_str_pretty(value_kind),
 									 value_kind_to_str_pretty(value.kind));
 		}
 
-		wtln("pop rax");
-		wtprintln("mov [%s], rax", str);
 		stack_pop(ctx);
 	} break;
 
 	case AST_SYSCALL: {
 		const size_t stack_size = get_stack_size(ctx);
-		if (stack_size < ast->syscall.args_count + 1) {
+		if (stack_size < ast_syscall_args(ast_id) + 1) {
 			report_error("%s error: too few arguments to call: `syscall%d`",
-									 loc_to_str(&locid(ast->loc_id)),
-									 ast->syscall.args_count);
-		}
-
-		// Pop syscall number
-		wtln("pop rax");
-
-		// Pop all the shit in the reversed order
-		for (u8 i = 0; i < ast->syscall.args_count; ++i) {
-			wtprintln("pop %s", X86_64_LINUX_SYSTEM_V_CONVENTION_REGISTERS[ast->syscall.args_count - 1 - i]);
+									 loc_to_str(ast_loc(ast_id)),
+									 ast_syscall_args(ast_id));
 		}
-
-		wtln("syscall");
 	} break;
 
 	case AST_WHILE: {
-		const size_t curr_label = while_label_counter++;
-
-		wprintln("._while_%zu:", curr_label);
-
-#ifdef DEBUG
-		wln("; -- COND --");
-#endif
-
-		ast_t while_ast;
-		ast_id_t last_ast_id_in_body;
+		ast_id_t last_ast_id_in_body = ast_id;
 
 		const size_t start_stack_size = get_stack_size(ctx);
 
-		if (ast->while_stmt.cond < 0) goto compile_loop;
+		if (ast_while(ast_id)->cond >= 0) {
+			last_ast_id_in_body = check_block(ctx, ast_while(ast_id)->cond);
 
-		while_ast = astid(ast->while_stmt.cond);
-		if (ast->while_stmt.cond >= 0) {
-			last_ast_id_in_body = compile_block(ctx, while_ast);
-		}
-
-#ifdef DEBUG
-		wln("; -- COND END --");
-#endif
-
-		check_for_integer_on_the_stack(ctx, "while",
-																	 "expected last value after performing `while` "
-																	 "condition on the stack to be integer",
-																	 ast);
-
-		wtln("pop rax");
-		stack_pop(ctx);
-		wtln("test rax, rax");
-
-		wtprintln("jz ._wdon_%zu", curr_label);
+			check_for_integer_on_the_stack(ctx, "while",
+																		 "expected last value after performing `while` "
+																		 "condition on the stack to be integer",
+																		 ast_id);
 
-compile_loop:
+			stack_pop(ctx);
+		}
 
-		if (ast->while_stmt.body >= 0) {
-			while_ast = astid(ast->while_stmt.body);
-			last_ast_id_in_body = compile_block(ctx, while_ast);
+		if (ast_while(ast_id)->body >= 0) {
+			last_ast_id_in_body = check_block(ctx, ast_while(ast_id)->body);
 		}
 
 		const size_t end_stack_size = get_stack_size(ctx);
@@ -697,7 +963,7 @@ compile_loop:
 		{
 			eprintf("%s error: The amount of elements at the start of the `while` statement "
 							"should be equal to the amount of elements at the end of the statement\n",
-							loc_to_str(&locid(ast->loc_id)));
+							loc_to_str(ast_loc(ast_id)));
 
 			eprintf("  note: expected size: %zu, but got: %zu. Perhaps, %s\n",
 							start_stack_size,
@@ -706,81 +972,42 @@ compile_loop:
 							"you can drop some elements" : "you lost the counter"
 			);
 
-			report_error("%s end of the statement", loc_to_str(&locid(astid(last_ast_id_in_body).loc_id)));
+			report_error("%s end of the statement", loc_to_str(ast_loc(last_ast_id_in_body)));
 		}
-
-		wtprintln("jmp ._while_%zu", curr_label);
-		wprintln("._wdon_%zu:", curr_label);
 	} break;
 
 	case AST_LITERAL: {
-		const i32 value_idx = shgeti(values_map, ast->literal.str);
-		const i32 const_idx = shgeti(ctx->const_map, ast->literal.str);
-		const i32 var_idx   = shgeti(ctx->var_map, ast->literal.str);
-		if (const_idx != -1) {
-			const consteval_value_t value = ctx->const_map[const_idx].value;
-			wtprintln("mov rax, 0x%lX", value.value);
-			wtln("push rax");
-			stack_add_type(ctx, value.kind);
-		} else if (var_idx != -1) {
-			wtprintln("mov rax, [%s]", ast->literal.str);
-			wtln("push rax");
-			stack_add_type(ctx, ctx->const_map[const_idx].value.kind);
-		} else if (value_idx != -1) {
-			const value_t value = values_map[value_idx].value;
-			if (value.ast_kind == AST_PROC) {
-				wtprintln("push __%s__", astid(value.ast_id).proc_stmt.name->str);
-			} else if (value.ast_kind == AST_FUNC) {
-				wtprintln("push __%s__", astid(value.ast_id).func_stmt.name->str);
-			} else {
-				UNREACHABLE;
-			}
-
-			const value_t value_ = {
-				.ast_id = value.ast_id,
-				.ast_kind = value.ast_kind,
-				.is_used = true
-			};
-			shput(values_map, ast->call.str, value_);
+		binding_t *binding = scope_slot(ast_sym(ast_id));
+		if (binding->ast_kind == AST_CONST) {
+			stack_add_type(ctx, ctx->const_map->entries[binding->entry].value.kind);
+		} else if (binding->ast_kind == AST_VAR) {
+			stack_add_type(ctx, ctx->var_map->entries[binding->entry].value.kind);
+		} else if (binding->ast_kind == AST_PROC || binding->ast_kind == AST_FUNC) {
+			binding->is_used = true;
 			stack_add_type(ctx, VALUE_KIND_FUNCTION_POINTER);
 		} else {
-			compile_argument_push_or_call(ctx, value_idx, ast, false);
+			check_argument_push_or_call(ctx, binding, ast_id, false);
 		}
 	} break;
 
 	case AST_CALL: {
-		const i32 value_idx		= shgeti(values_map, ast->call.str);
-		const i32 extern_idx	= shgeti(externs_map, ast->call.str);
-		const i32 var_idx			= shgeti(ctx->var_map, ast->call.str);
-		if (value_idx != -1) {
-			compile_function_call(ctx, values_map[value_idx].value, ast);
-		} else if (extern_idx != -1) {
-			compile_function_call(ctx, externs_map[extern_idx].value, ast);
-		} else if (var_idx != -1) {
-			wtprintln("mov rax, [%s]", ctx->var_map[var_idx].key);
-			wtln("push rax");
-			stack_add_type(ctx, ctx->var_map[var_idx].value.kind);
+		binding_t *binding = scope_slot(ast_sym(ast_id));
+		if (binding->ast_kind == AST_PROC
+		|| binding->ast_kind == AST_FUNC
+		|| binding->ast_kind == AST_EXTERN)
+		{
+			check_function_call(ctx, binding, ast_id);
+		} else if (binding->ast_kind == AST_VAR) {
+			stack_add_type(ctx, ctx->var_map->entries[binding->entry].value.kind);
 		} else {
-			compile_argument_push_or_call(ctx, value_idx, ast, false);
+			check_argument_push_or_call(ctx, binding, ast_id, false);
 		}
 	} break;
 
 	case AST_PUSH: {
-		switch (ast->push_stmt.value_kind) {
-		case VALUE_KIND_INTEGER: {
-			wtprintln("mov rax, 0x%lX", ast->push_stmt.integer);
-			wtln("push rax");
-			stack_add_type(ctx, VALUE_KIND_INTEGER);
-		} break;
-
-		case VALUE_KIND_STRING: {
-			scratch_buffer_genstr();
-			wtprintln("mov rax, %s", scratch_buffer_to_string());
-			wtln("push rax");
-			stack_add_type(ctx, VALUE_KIND_STRING);
-			string_literal_counter++;
-			vec_add(strs, ast->push_stmt.str);
-		} break;
+		switch (ast_push(ast_id)->value_kind) {
+		case VALUE_KIND_INTEGER: stack_add_type(ctx, VALUE_KIND_INTEGER); break;
+		case VALUE_KIND_STRING:	 stack_add_type(ctx, VALUE_KIND_STRING); break;
 
 		case VALUE_KIND_BYTE: TODO break;
 
@@ -795,7 +1022,7 @@ compile_loop:
 		second_type = get_type_from_end(ctx, 1);
 
 		if (second_type == NULL || first_type == NULL) {
-			report_error("%s error: `%s` stack underflow, bruv", loc_to_str(&locid(ast->loc_id)), "+");
+			report_error("%s error: `%s` stack underflow, bruv", loc_to_str(ast_loc(ast_id)), "+");
 		} else if ((*first_type  != VALUE_KIND_INTEGER
 						 && *first_type  != VALUE_KIND_BYTE
 						 && *first_type  != VALUE_KIND_STRING)
@@ -804,7 +1031,7 @@ compile_loop:
 						 && *second_type != VALUE_KIND_STRING))
 		{
 			report_error("%s error: expected to have `int`, `byte` or `str`s on the stack, but got: `%s` and `%s`",
-									 loc_to_str(&locid(ast->loc_id)),
+									 loc_to_str(ast_loc(ast_id)),
 									 value_kind_to_str_pretty(*second_type),
 									 value_kind_to_str_pretty(*first_type));
 		}
@@ -812,7 +1039,7 @@ compile_loop:
 		if (*first_type == VALUE_KIND_INTEGER
 		&& *second_type == VALUE_KIND_INTEGER)
 		{
-			print_binop("add rax, rbx");
+			ast_resolved(ast_id) = VALUE_KIND_INTEGER;
 			stack_pop(ctx);
 			return;
 		}
@@ -820,11 +1047,7 @@ compile_loop:
 		switch (*first_type) {
 		case VALUE_KIND_STRING:
 		case VALUE_KIND_INTEGER: {
-			wtln("pop rbx");
-			wtln("mov rax, qword [rsp]");
-			wtln("mov al, byte [rax + rbx]");
-			wtln("movzx rax, al");
-			wtln("mov [rsp], rax");
+			ast_resolved(ast_id) = VALUE_KIND_BYTE;
 			stack_pop(ctx);
 			*stack_at_mut(ctx, get_stack_size(ctx) - 1) = VALUE_KIND_BYTE;
 		} break;
@@ -841,332 +1064,521 @@ compile_loop:
 		const value_kind_t *type = get_type_from_end(ctx, 0);
 
 		if (type == NULL) {
-			report_error("%s error: `%s` stack underflow, bruv", loc_to_str(&locid(ast->loc_id)), "+");
+			report_error("%s error: `%s` stack underflow, bruv", loc_to_str(ast_loc(ast_id)), "+");
 		} else if (*type  != VALUE_KIND_INTEGER && *type  != VALUE_KIND_BYTE) {
 			report_error("%s error: expected to have a `byte` or an `int` on the stack, but got: `%s`",
-									 loc_to_str(&locid(ast->loc_id)),
+									 loc_to_str(ast_loc(ast_id)),
 									 value_kind_to_str_pretty(*type));
 		}
-
-		wtln("mov rax, [rsp]");
-		wtln("not rax");
-		wtln("mov [rsp], rax");
 	} break;
 
 	case AST_BOR: {
-		check_for_two_integers_on_the_stack(ctx, "|", ast);
-		print_binop("or rax, rbx");
+		check_for_two_integers_on_the_stack(ctx, "|", ast_id);
 		stack_pop(ctx);
 	} break;
 
 	case AST_MINUS: {
-		check_for_two_integers_on_the_stack(ctx, "-", ast);
-		print_binop("sub rax, rbx");
+		check_for_two_integers_on_the_stack(ctx, "-", ast_id);
 		stack_pop(ctx);
 	} break;
 
 	case AST_DIV: {
-		check_for_two_integers_on_the_stack(ctx, "/", ast);
-		wtln("xor edx, edx");
-		print_binop("div rbx");
+		check_for_two_integers_on_the_stack(ctx, "/", ast_id);
 		stack_pop(ctx);
 	} break;
 
 	case AST_MOD: {
-		check_for_two_integers_on_the_stack(ctx, "%", ast);
-		wtln("xor edx, edx");
-		wtln("pop rbx");
-		wtln("mov rax, qword [rsp]");
-		wtln("div rbx");
-		wtln("mov [rsp], rdx");
+		check_for_two_integers_on_the_stack(ctx, "%", ast_id);
 		stack_pop(ctx);
 	} break;
 
 	case AST_MUL: {
-		check_for_two_integers_on_the_stack(ctx, "*", ast);
-		wtln("xor edx, edx");
-		print_binop("mul rbx");
+		check_for_two_integers_on_the_stack(ctx, "*", ast_id);
 		stack_pop(ctx);
 	} break;
 
 	case AST_EQUAL: {
-		check_for_two_types_on_the_stack(ctx, "=", ast,
+		check_for_two_types_on_the_stack(ctx, "=", ast_id,
 																		 VALUE_KIND_INTEGER, VALUE_KIND_BYTE,
 																		 VALUE_KIND_INTEGER, VALUE_KIND_BYTE);
-
-		wtln("pop rax");
-		wtln("mov rbx, qword [rsp]");
-		wtln("cmp rax, rbx");
-		wtln("sete al");
-		wtln("movzx rax, al");
-		wtln("mov [rsp], rax");
 		stack_pop(ctx);
 		*stack_at_mut(ctx, get_stack_size(ctx) - 1) = VALUE_KIND_INTEGER;
 	} break;
 
 	case AST_LESS: {
-		check_for_two_integers_on_the_stack(ctx, "<", ast);
-		wtln("pop rax");
-		wtln("mov rbx, qword [rsp]");
-		wtln("cmp rbx, rax");
-		wtln("setb al");
-		wtln("movzx rax, al");
-		wtln("mov [rsp], rax");
+		check_for_two_integers_on_the_stack(ctx, "<", ast_id);
 		stack_pop(ctx);
 		*stack_at_mut(ctx, get_stack_size(ctx) - 1) = VALUE_KIND_INTEGER;
 	} break;
 
 	case AST_GREATER: {
-		check_for_two_integers_on_the_stack(ctx, ">", ast);
-		wtln("pop rax");
-		wtln("mov rbx, qword [rsp]");
-		wtln("cmp rbx, rax");
-		wtln("setg al");
-		wtln("movzx rax, al");
-		wtln("mov [rsp], rax");
+		check_for_two_integers_on_the_stack(ctx, ">", ast_id);
 		stack_pop(ctx);
 		*stack_at_mut(ctx, get_stack_size(ctx) - 1) = VALUE_KIND_INTEGER;
 	} break;
 
 	case AST_GREATER_EQUAL: {
-		check_for_two_integers_on_the_stack(ctx, ">=", ast);
-		wtln("pop rax");
-		wtln("mov rbx, qword [rsp]");
-		wtln("mov rdi, 0x1");
-		wtln("xor rcx, rcx");
-		wtln("cmp rbx, rax");
-		wtln("cmovl rdi, rcx");
-		wtln("mov [rsp], rdi");
+		check_for_two_integers_on_the_stack(ctx, ">=", ast_id);
 		stack_pop(ctx);
 		*stack_at_mut(ctx, get_stack_size(ctx) - 1) = VALUE_KIND_INTEGER;
 	} break;
 
 	case AST_LESS_EQUAL: {
-		check_for_two_integers_on_the_stack(ctx, "<=", ast);
-		wtln("pop rax");
-		wtln("mov rbx, qword [rsp]");
-		wtln("mov rdi, 0x1");
-		wtln("xor rcx, rcx");
-		wtln("cmp rbx, rax");
-		wtln("cmovg rdi, rcx");
-		wtln("mov [rsp], rdi");
+		check_for_two_integers_on_the_stack(ctx, "<=", ast_id);
 		stack_pop(ctx);
 		*stack_at_mut(ctx, get_stack_size(ctx) - 1) = VALUE_KIND_INTEGER;
 	} break;
 
 	case AST_DROP: {
-		check_stack_for_last(ctx, "drop", ast);
-		wtln("pop rax");
+		check_stack_for_last(ctx, "drop", ast_id);
 		stack_pop(ctx);
 	} break;
 
 	case AST_DUP: {
-		value_kind_t last_type = check_stack_for_last(ctx, "dup", ast);
-		wtln("mov rax, [rsp]");
-		wtln("push rax");
+		value_kind_t last_type = check_stack_for_last(ctx, "dup", ast_id);
 		stack_add_type(ctx, last_type);
 	} break;
 
 	case AST_DOT: {
-		value_kind_t last_type = check_stack_for_last(ctx, ".", ast);
-		switch (last_type) {
-		// TODO: Create a separate function `dmp_byte`
-		case VALUE_KIND_BYTE:
-		case VALUE_KIND_FUNCTION_POINTER:
+		ast_resolved(ast_id) = check_stack_for_last(ctx, ".", ast_id);
+	} break;
+
+	case AST_POISONED: UNREACHABLE;
+	}
+}
+
+// Emit the ast, the body it is in is checked already
+static void
+compile_ast(Compiler *ctx, ast_id_t ast_id)
+{
+#ifdef DEBUG
+	if (ast_kind(ast_id) != AST_PROC && ast_kind(ast_id) != AST_FUNC) {
+		emit_comment("-- %s --", ast_kind_to_str(ast_kind(ast_id)));
+	}
+#endif
+
+	switch (ast_kind(ast_id)) {
+	// These are handled in different place
+	case AST_VAR:
+	case AST_FUNC:
+	case AST_CONST:
+	case AST_EXTERN:
+	case AST_PROC: break;
+
+	case AST_IF: {
+		const reg_t cond = tos_pop(REG_RAX);
+
+		// If statement is empty
+		if (ast_if(ast_id)->then_body < 0 && ast_if(ast_id)->else_body < 0) return;
+
+		const size_t curr_label = label_counter++;
+
+		tos_flush();
+		emit_op2(OP_TEST, operand_reg(cond), operand_reg(cond));
+		emit_jcc(CC_E, label_numbered(LABEL_ELSE, curr_label));
+
+		if (ast_if(ast_id)->then_body >= 0) {
+			compile_block(ctx, ast_if(ast_id)->then_body);
+			tos_flush();
+			emit_op1(OP_JMP, operand_address(label_numbered(LABEL_EDON, curr_label)));
+		}
+
+		emit_label(label_numbered(LABEL_ELSE, curr_label));
+		if (ast_if(ast_id)->else_body >= 0) {
+			compile_block(ctx, ast_if(ast_id)->else_body);
+			tos_flush();
+		}
+
+		emit_label(label_numbered(LABEL_EDON, curr_label));
+	} break;
+
+	case AST_WRITE: {
+		const label_t var = label_named(symstr(ast_sym(ast_id)));
+		emit_op2(OP_MOV, operand_mem_label(0, var), operand_reg(tos_pop(REG_RAX)));
+	} break;
+
+	case AST_SYSCALL: {
+		// Pop syscall number
+		tos_pop_into(REG_RAX);
+
+		// Pop all the shit in the reversed order
+		tos_pop_args(ast_syscall_args(ast_id));
+
+		emit_op0(OP_SYSCALL);
+	} break;
+
+	case AST_WHILE: {
+		const size_t curr_label = while_label_counter++;
+
+		tos_flush();
+		emit_label(label_numbered(LABEL_WHILE, curr_label));
+
+#ifdef DEBUG
+		emit_comment("-- COND --");
+#endif
+
+		if (ast_while(ast_id)->cond >= 0) {
+			compile_block(ctx, ast_while(ast_id)->cond);
+
+#ifdef DEBUG
+			emit_comment("-- COND END --");
+#endif
+
+			const reg_t cond = tos_pop(REG_RAX);
+			tos_flush();
+			emit_op2(OP_TEST, operand_reg(cond), operand_reg(cond));
+
+			emit_jcc(CC_E, label_numbered(LABEL_WDON, curr_label));
+		}
+
+		if (ast_while(ast_id)->body >= 0) {
+			compile_block(ctx, ast_while(ast_id)->body);
+		}
+
+		tos_flush();
+		emit_op1(OP_JMP, operand_address(label_numbered(LABEL_WHILE, curr_label)));
+		emit_label(label_numbered(LABEL_WDON, curr_label));
+	} break;
+
+	case AST_LITERAL: {
+		const binding_t *binding = scope_get(ast_sym(ast_id));
+		if (binding->ast_kind == AST_CONST) {
+			const i64 value = ctx->const_map->entries[binding->entry].value.value;
+			emit_op2(OP_MOV, operand_reg(tos_push()), operand_imm(value));
+		} else if (binding->ast_kind == AST_VAR) {
+			const label_t var = label_named(symstr(ast_sym(ast_id)));
+			emit_op2(OP_MOV, operand_reg(tos_push()), operand_mem_label(0, var));
+		} else if (binding->ast_kind == AST_PROC) {
+			const label_t proc = label_func(ast_proc(binding->ast_id)->name->str);
+			emit_op2(OP_MOV, operand_reg(tos_push()), operand_address(proc));
+		} else if (binding->ast_kind == AST_FUNC) {
+			const label_t func = label_func(ast_func(binding->ast_id)->name->str);
+			emit_op2(OP_MOV, operand_reg(tos_push()), operand_address(func));
+		} else {
+			compile_argument_push_or_call(ast_id, false);
+		}
+	} break;
+
+	case AST_CALL: {
+		const binding_t *binding = scope_get(ast_sym(ast_id));
+		if (binding->ast_kind == AST_PROC
+		|| binding->ast_kind == AST_FUNC
+		|| binding->ast_kind == AST_EXTERN)
+		{
+			compile_function_call(ctx, binding);
+		} else if (binding->ast_kind == AST_VAR) {
+			const label_t var = label_named(symstr(ast_sym(ast_id)));
+			emit_op2(OP_MOV, operand_reg(tos_push()), operand_mem_label(0, var));
+		} else {
+			compile_argument_push_or_call(ast_id, false);
+		}
+	} break;
+
+	case AST_PUSH: {
+		switch (ast_push(ast_id)->value_kind) {
 		case VALUE_KIND_INTEGER: {
-			wtln("mov rax, qword [rsp]");
-			wtln("mov r14, 0x1"); // mov 1 to r14 to print newline
-			wtln("call dmp_i64");
-			used_dmp_i64 = true;
+			emit_op2(OP_MOV, operand_reg(tos_push()), operand_imm(ast_push(ast_id)->integer));
 		} break;
 
 		case VALUE_KIND_STRING: {
-			wtln("mov rdi, [rsp]");
-			wtln("call strlen");
-			wtln("mov rdx, rax");
-			wtln("mov rsi, rdi");
-			wtln("mov rax, SYS_WRITE");
-			wtln("mov rdi, SYS_STDOUT");
-			wtln("syscall");
-			used_strlen = true;
+			const label_t str = string_literal(ast_push(ast_id)->str);
+			emit_op2(OP_MOV, operand_reg(tos_push()), operand_address(str));
 		} break;
 
-		case VALUE_KIND_POISONED: UNREACHABLE; break;
-		case VALUE_KIND_LAST:			UNREACHABLE; break;
+		// Byte pushes stop at the check
+		case VALUE_KIND_BYTE:
+		case VALUE_KIND_FUNCTION_POINTER:
+		case VALUE_KIND_POISONED:
+		case VALUE_KIND_LAST:	UNREACHABLE; break;
+		}
+	} break;
+
+	case AST_PLUS: {
+		if (ast_resolved(ast_id) == VALUE_KIND_INTEGER) {
+			print_binop(OP_ADD);
+		} else {
+			// Index of a byte in a string
+			tos_load(2);
+			emit_op2(OP_MOVZX, operand_reg(tos_reg(1)), operand_mem_index(1, tos_reg(1), tos_reg(0), 0));
+			tos_count--;
 		}
 	} break;
 
+	case AST_BNOT: {
+		tos_load(1);
+		emit_op1(OP_NOT, operand_reg(tos_reg(0)));
+	} break;
+
+	case AST_BOR: {
+		print_binop(OP_OR);
+	} break;
+
+	case AST_MINUS: {
+		print_binop(OP_SUB);
+	} break;
+
+	case AST_DIV: {
+		tos_load(2);
+		emit_op2(OP_MOV, operand_reg(REG_RAX), operand_reg(tos_reg(1)));
+		emit_op2(OP_XOR, operand_reg_sized(REG_RDX, 4), operand_reg_sized(REG_RDX, 4));
+		emit_op1(OP_DIV, operand_reg(tos_reg(0)));
+		tos_count--;
+		emit_op2(OP_MOV, operand_reg(tos_reg(0)), operand_reg(REG_RAX));
+	} break;
+
+	case AST_MOD: {
+		tos_load(2);
+		emit_op2(OP_MOV, operand_reg(REG_RAX), operand_reg(tos_reg(1)));
+		emit_op2(OP_XOR, operand_reg_sized(REG_RDX, 4), operand_reg_sized(REG_RDX, 4));
+		emit_op1(OP_DIV, operand_reg(tos_reg(0)));
+		tos_count--;
+		emit_op2(OP_MOV, operand_reg(tos_reg(0)), operand_reg(REG_RDX));
+	} break;
+
+	case AST_MUL: {
+		print_binop(OP_IMUL);
+	} break;
+
+	case AST_EQUAL: {
+		print_compare(CC_E);
+	} break;
+
+	case AST_LESS: {
+		print_compare(CC_B);
+	} break;
+
+	case AST_GREATER: {
+		print_compare(CC_G);
+	} break;
+
+	case AST_GREATER_EQUAL: {
+		print_compare(CC_GE);
+	} break;
+
+	case AST_LESS_EQUAL: {
+		print_compare(CC_LE);
+	} break;
+
+	case AST_DROP: {
+		if (tos_count > 0) tos_count--;
+		else emit_op1(OP_POP, operand_reg(REG_RAX));
+	} break;
+
+	case AST_DUP: {
+		const reg_t reg = tos_push();
+		tos_read(reg, 1);
+	} break;
+
+	case AST_DOT: {
+		const value_kind_t last_type = (value_kind_t) ast_resolved(ast_id);
+		tos_read(print_value_reg(last_type), 0);
+		print_value(last_type);
+	} break;
+
 	case AST_POISONED: UNREACHABLE;
 	}
 }
 
-INLINE void
-print_defines(void)
+// Emit the body through the IR, or straight from the asts if it can't be translated.
+// True if the values it returns are moved to the registers of the epilogue, they are left
+// on the stack otherwise.
+static bool
+compile_body(Compiler *ctx, ast_id_t body, size_t ret_types_count, const char *name)
 {
-	wln(DEFINE " SYS_WRITE  1");
-	wln(DEFINE " SYS_STDOUT 1");
-	wln(DEFINE " WORD_SIZE  8");
-	wln(DEFINE " SYS_EXIT   60");
+	ir_func_t *ir = ir_build(ctx, body, ret_types_count);
+	if (ir == NULL) {
+#ifdef DEBUG
+		emit_comment("-- emitted from the asts --");
+#endif
+		compile_block(ctx, body);
+		return false;
+	}
+
+	ir_optimize(ir);
+
+#ifdef PRINT_IR
+	ir_print(ir, name);
+#else
+	(void) name;
+#endif
+
+	regalloc_lower(ir, label_counter, while_label_counter);
+	label_counter += ir->ifs;
+	while_label_counter += ir->whiles;
+	return true;
 }
 
 static void
 print_dmp_i64(void)
 {
 #ifdef DEBUG
-	wln("; r14b: newline");
-	wln("; rax: number to print");
+	emit_comment("r14b: newline");
+	emit_comment("rax: number to print");
 #endif
-	wln("dmp_i64:");
-	wtln("enter   0, 0");
-	wtln("sub     rsp, 64");
-	wtln("mov     qword [rbp - 8],  rax");
-	wtln("mov     dword [rbp - 36], 0");
-	wtln("mov     dword [rbp - 40], 0");
-	wtln("cmp     qword [rbp - 8],  0");
-	wtln("jge     .LBB0_2");
-	wtln("mov     dword [rbp - 40], 1");
-	wtln("xor     eax, eax");
-	wtln("sub     rax, qword [rbp - 8]");
-	wtln("mov     qword [rbp - 8], rax");
-	wln(".LBB0_2:");
-	wtln("cmp     qword [rbp - 8], 0");
-	wtln("jne     .LBB0_4");
-	wtln("mov     eax, dword [rbp - 36]");
-	wtln("mov     ecx, eax");
-	wtln("add     ecx, 1");
-	wtln("mov     dword [rbp - 36], ecx");
-	wtln("cdqe");
-	wtln("mov     byte [rbp + rax - 32], 48");
-	wtln("jmp     .LBB0_8");
-	wln(".LBB0_4:");
-	wtln("jmp     .LBB0_5");
-	wln(".LBB0_5:");
-	wtln("cmp     qword [rbp - 8], 0");
-	wtln("jle     .LBB0_7");
-	wtln("mov     rax, qword [rbp - 8]");
-	wtln("mov     ecx, 10");
-	wtln("cqo");
-	wtln("idiv    rcx");
-	wtln("mov     eax, edx");
-	wtln("mov     dword [rbp - 44], eax");
-	wtln("mov     eax, dword [rbp - 44]");
-	wtln("add     eax, 48");
-	wtln("mov     cl, al");
-	wtln("mov     eax, dword [rbp - 36]");
-	wtln("mov     edx, eax");
-	wtln("add     edx, 1");
-	wtln("mov     dword [rbp - 36], edx");
-	wtln("cdqe");
-	wtln("mov     byte [rbp + rax - 32], cl");
-	wtln("mov     rax, qword [rbp - 8]");
-	wtln("mov     ecx, 10");
-	wtln("cqo");
-	wtln("idiv    rcx");
-	wtln("mov     qword [rbp - 8], rax");
-	wtln("jmp     .LBB0_5");
-	wln(".LBB0_7:");
-	wtln("jmp     .LBB0_8");
-	wln(".LBB0_8:");
-	wtln("cmp     dword [rbp - 40], 0");
-	wtln("je      .LBB0_10");
-	wtln("mov     eax, dword [rbp - 36]");
-	wtln("mov     ecx, eax");
-	wtln("add     ecx, 1");
-	wtln("mov     dword [rbp - 36], ecx");
-	wtln("cdqe");
-	wtln("mov     byte [rbp + rax - 32], 45");
-	wln(".LBB0_10:");
-	wtln("movsxd  rax, dword [rbp - 36]");
-	wtln("mov     byte [rbp + rax - 32], 0");
-	wtln("mov     dword [rbp - 48], 0");
-	wtln("mov     eax, dword [rbp - 36]");
-	wtln("sub     eax, 1");
-	wtln("mov     dword [rbp - 52], eax");
-	wln(".LBB0_11:");
-	wtln("mov     eax, dword [rbp - 48]");
-	wtln("cmp     eax, dword [rbp - 52]");
-	wtln("jge     .LBB0_13");
-	wtln("movsxd  rax, dword [rbp - 48]");
-	wtln("mov     al, byte [rbp + rax - 32]");
-	wtln("mov     byte [rbp - 53], al");
-	wtln("movsxd  rax, dword [rbp - 52]");
-	wtln("mov     cl, byte [rbp + rax - 32]");
-	wtln("movsxd  rax, dword [rbp - 48]");
-	wtln("mov     byte [rbp + rax - 32], cl");
-	wtln("mov     cl, byte [rbp - 53]");
-	wtln("movsxd  rax, dword [rbp - 52]");
-	wtln("mov     byte [rbp + rax - 32], cl");
-	wtln("mov     eax, dword [rbp - 48]");
-	wtln("add     eax, 1");
-	wtln("mov     dword [rbp - 48], eax");
-	wtln("mov     eax, dword [rbp - 52]");
-	wtln("add     eax, -1");
-	wtln("mov     dword [rbp - 52], eax");
-	wtln("jmp     .LBB0_11");
-	wln(".LBB0_13:");
-	wtln("mov     eax, dword [rbp - 36]");
-	wtln("mov     ecx, eax");
-	wtln("add     ecx, 1");
-	wtln("mov     dword [rbp - 36], ecx");
-	wtln("cdqe");
-	wtln("mov     byte [rbp + rax - 32], 10");
-	wtln("lea     rsi, [rbp - 32]");
-	wtln("movsxd  rdx, dword [rbp - 36]");
-	wtln("test    r14b, r14b");
-	wtln("jz      .not_newline");
-	wtln("jmp     .write");
-	wln(".not_newline:");
-	wtln("dec rdx");
-	wln(".write:");
-	wtln("mov     eax, SYS_WRITE");
-	wtln("mov     edi, SYS_STDOUT");
-	wtln("syscall");
-	wtln("add     rsp, 64");
-	wtln("leave");
-	wtln("ret");
+	emit_label(label_named("dmp_i64"));
+	emit_op2(OP_ENTER, operand_imm(0), operand_imm(0));
+	emit_op2(OP_SUB, operand_reg(REG_RSP), operand_imm(64));
+	emit_op2(OP_MOV, operand_mem(8, REG_RBP, -8), operand_reg(REG_RAX));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -36), operand_imm(0));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -40), operand_imm(0));
+	emit_op2(OP_CMP, operand_mem(8, REG_RBP, -8), operand_imm(0));
+	emit_jcc(CC_GE, label_named(".LBB0_2"));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -40), operand_imm(1));
+	emit_op2(OP_XOR, operand_reg_sized(REG_RAX, 4), operand_reg_sized(REG_RAX, 4));
+	emit_op2(OP_SUB, operand_reg(REG_RAX), operand_mem(8, REG_RBP, -8));
+	emit_op2(OP_MOV, operand_mem(8, REG_RBP, -8), operand_reg(REG_RAX));
+	emit_label(label_named(".LBB0_2"));
+	emit_op2(OP_CMP, operand_mem(8, REG_RBP, -8), operand_imm(0));
+	emit_jcc(CC_NE, label_named(".LBB0_4"));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -36));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RCX, 4), operand_reg_sized(REG_RAX, 4));
+	emit_op2(OP_ADD, operand_reg_sized(REG_RCX, 4), operand_imm(1));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -36), operand_reg_sized(REG_RCX, 4));
+	emit_op0(OP_CDQE);
+	emit_op2(OP_MOV, operand_mem_index(1, REG_RBP, REG_RAX, -32), operand_imm(48));
+	emit_op1(OP_JMP, operand_address(label_named(".LBB0_8")));
+	emit_label(label_named(".LBB0_4"));
+	emit_op1(OP_JMP, operand_address(label_named(".LBB0_5")));
+	emit_label(label_named(".LBB0_5"));
+	emit_op2(OP_CMP, operand_mem(8, REG_RBP, -8), operand_imm(0));
+	emit_jcc(CC_LE, label_named(".LBB0_7"));
+	emit_op2(OP_MOV, operand_reg(REG_RAX), operand_mem(8, REG_RBP, -8));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RCX, 4), operand_imm(10));
+	emit_op0(OP_CQO);
+	emit_op1(OP_IDIV, operand_reg(REG_RCX));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_reg_sized(REG_RDX, 4));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -44), operand_reg_sized(REG_RAX, 4));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -44));
+	emit_op2(OP_ADD, operand_reg_sized(REG_RAX, 4), operand_imm(48));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RCX, 1), operand_reg_sized(REG_RAX, 1));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -36));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RDX, 4), operand_reg_sized(REG_RAX, 4));
+	emit_op2(OP_ADD, operand_reg_sized(REG_RDX, 4), operand_imm(1));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -36), operand_reg_sized(REG_RDX, 4));
+	emit_op0(OP_CDQE);
+	emit_op2(OP_MOV, operand_mem_index(1, REG_RBP, REG_RAX, -32), operand_reg_sized(REG_RCX, 1));
+	emit_op2(OP_MOV, operand_reg(REG_RAX), operand_mem(8, REG_RBP, -8));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RCX, 4), operand_imm(10));
+	emit_op0(OP_CQO);
+	emit_op1(OP_IDIV, operand_reg(REG_RCX));
+	emit_op2(OP_MOV, operand_mem(8, REG_RBP, -8), operand_reg(REG_RAX));
+	emit_op1(OP_JMP, operand_address(label_named(".LBB0_5")));
+	emit_label(label_named(".LBB0_7"));
+	emit_op1(OP_JMP, operand_address(label_named(".LBB0_8")));
+	emit_label(label_named(".LBB0_8"));
+	emit_op2(OP_CMP, operand_mem(4, REG_RBP, -40), operand_imm(0));
+	emit_jcc(CC_E, label_named(".LBB0_10"));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -36));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RCX, 4), operand_reg_sized(REG_RAX, 4));
+	emit_op2(OP_ADD, operand_reg_sized(REG_RCX, 4), operand_imm(1));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -36), operand_reg_sized(REG_RCX, 4));
+	emit_op0(OP_CDQE);
+	emit_op2(OP_MOV, operand_mem_index(1, REG_RBP, REG_RAX, -32), operand_imm(45));
+	emit_label(label_named(".LBB0_10"));
+	emit_op2(OP_MOVSXD, operand_reg(REG_RAX), operand_mem(4, REG_RBP, -36));
+	emit_op2(OP_MOV, operand_mem_index(1, REG_RBP, REG_RAX, -32), operand_imm(0));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -48), operand_imm(0));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -36));
+	emit_op2(OP_SUB, operand_reg_sized(REG_RAX, 4), operand_imm(1));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -52), operand_reg_sized(REG_RAX, 4));
+	emit_label(label_named(".LBB0_11"));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -48));
+	emit_op2(OP_CMP, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -52));
+	emit_jcc(CC_GE, label_named(".LBB0_13"));
+	emit_op2(OP_MOVSXD, operand_reg(REG_RAX), operand_mem(4, REG_RBP, -48));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 1), operand_mem_index(1, REG_RBP, REG_RAX, -32));
+	emit_op2(OP_MOV, operand_mem(1, REG_RBP, -53), operand_reg_sized(REG_RAX, 1));
+	emit_op2(OP_MOVSXD, operand_reg(REG_RAX), operand_mem(4, REG_RBP, -52));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RCX, 1), operand_mem_index(1, REG_RBP, REG_RAX, -32));
+	emit_op2(OP_MOVSXD, operand_reg(REG_RAX), operand_mem(4, REG_RBP, -48));
+	emit_op2(OP_MOV, operand_mem_index(1, REG_RBP, REG_RAX, -32), operand_reg_sized(REG_RCX, 1));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RCX, 1), operand_mem(1, REG_RBP, -53));
+	emit_op2(OP_MOVSXD, operand_reg(REG_RAX), operand_mem(4, REG_RBP, -52));
+	emit_op2(OP_MOV, operand_mem_index(1, REG_RBP, REG_RAX, -32), operand_reg_sized(REG_RCX, 1));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -48));
+	emit_op2(OP_ADD, operand_reg_sized(REG_RAX, 4), operand_imm(1));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -48), operand_reg_sized(REG_RAX, 4));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -52));
+	emit_op2(OP_ADD, operand_reg_sized(REG_RAX, 4), operand_imm(-1));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -52), operand_reg_sized(REG_RAX, 4));
+	emit_op1(OP_JMP, operand_address(label_named(".LBB0_11")));
+	emit_label(label_named(".LBB0_13"));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_mem(4, REG_RBP, -36));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RCX, 4), operand_reg_sized(REG_RAX, 4));
+	emit_op2(OP_ADD, operand_reg_sized(REG_RCX, 4), operand_imm(1));
+	emit_op2(OP_MOV, operand_mem(4, REG_RBP, -36), operand_reg_sized(REG_RCX, 4));
+	emit_op0(OP_CDQE);
+	emit_op2(OP_MOV, operand_mem_index(1, REG_RBP, REG_RAX, -32), operand_imm(10));
+	emit_op2(OP_LEA, operand_reg(REG_RSI), operand_mem(0, REG_RBP, -32));
+	emit_op2(OP_MOVSXD, operand_reg(REG_RDX), operand_mem(4, REG_RBP, -36));
+	emit_op2(OP_TEST, operand_reg_sized(REG_R14, 1), operand_reg_sized(REG_R14, 1));
+	emit_jcc(CC_E, label_named(".not_newline"));
+	emit_op1(OP_JMP, operand_address(label_named(".write")));
+	emit_label(label_named(".not_newline"));
+	emit_op1(OP_DEC, operand_reg(REG_RDX));
+	emit_label(label_named(".write"));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RAX, 4), operand_imm(SYS_WRITE));
+	emit_op2(OP_MOV, operand_reg_sized(REG_RDI, 4), operand_imm(SYS_STDOUT));
+	emit_op0(OP_SYSCALL);
+	emit_op2(OP_ADD, operand_reg(REG_RSP), operand_imm(64));
+	emit_op0(OP_LEAVE);
+	emit_op0(OP_RET);
 }
 
 static void
 print_strlen(void)
 {
-	wln("strlen:");
-	wtln("xor rax, rax");
-	wln(".loop:");
-	wtln("cmp byte [rdi + rax], 0");
-	wtln("jz .done");
-	wtln("inc rax");
-	wtln("jmp .loop");
-	wln(".done:");
-	wtln("ret");
+	emit_label(label_named("strlen"));
+	emit_op2(OP_XOR, operand_reg(REG_RAX), operand_reg(REG_RAX));
+	emit_label(label_named(".loop"));
+	emit_op2(OP_CMP, operand_mem_index(1, REG_RDI, REG_RAX, 0), operand_imm(0));
+	emit_jcc(CC_E, label_named(".done"));
+	emit_op1(OP_INC, operand_reg(REG_RAX));
+	emit_op1(OP_JMP, operand_address(label_named(".loop")));
+	emit_label(label_named(".done"));
+	emit_op0(OP_RET);
 }
 
 INLINE void
 print_exit(void)
 {
-	wtln("mov rax, SYS_EXIT");
-	wtln("mov rdi, [ret_code]");
-	wtln("syscall");
+	emit_op2(OP_MOV, operand_reg(REG_RAX), operand_imm(SYS_EXIT));
+	emit_op2(OP_MOV, operand_reg(REG_RDI), operand_mem_label(0, RET_CODE));
+	emit_op0(OP_SYSCALL);
 }
 
 INLINE void
 print_data_section(void)
 {
-	wln(SECTION_BSS_WRITEABLE);
-	wln("rsp_stack: " RESERVE_QUAD_WORD " 1024");
-	wln(SECTION_DATA_WRITEABLE);
-	wln("ret_code dq 0x0");
-	wln("rsp_stack_ptr: dq rsp_stack");
+	const label_t rsp_stack = label_named("rsp_stack");
+	emit(insn_section(SECTION_BSS));
+	emit(insn_data(INSN_RESERVE, rsp_stack, 1024));
+	emit(insn_section(SECTION_DATA));
+	emit(insn_data(INSN_QUAD, RET_CODE, 0));
+
+	insn_t ptr = insn_data(INSN_QUAD, RSP_STACK_PTR, 0);
+	ptr.operands[1] = operand_address(rsp_stack);
+	emit(ptr);
 }
 
 Compiler
 new_compiler(ast_id_t ast_cur,
-						 const_map_t *const_map,
-						 var_map_t *var_map)
+						 Parser *parser,
+						 const consteval_map_t *const_map,
+						 const consteval_map_t *var_map)
 {
 	return (Compiler) {
 		.ast_cur = ast_cur,
+		.parser = parser,
 		.proc_ctx = {
 			.stmt = NULL,
+			.stack_base = 0,
+			.stack_size = 0,
+			.called_funcptr = false
+		},
+		.func_ctx = {
+			.stmt = NULL,
+			.stack_base = 0,
 			.stack_size = 0,
 			.called_funcptr = false
 		},
@@ -1178,80 +1590,91 @@ new_compiler(ast_id_t ast_cur,
 static void
 compiler_deinit(void)
 {
-	shfree(externs_map);
-	shfree(values_map);
-	fclose(stream);
+	scope_free();
+	reachable = NULL;
+	free(stack_types);
+	stack_types = NULL;
+	stack_types_cap = 0;
+	effects = NULL;
+	effect_kinds = NULL;
+	insn_buffer_free(&body_insns);
+	ir_build_free();
+	regalloc_lower_free();
+	buffering = false;
+	assembling = false;
+	capture = NULL;
+	if (stream != NULL) fclose(stream);
+	stream = NULL;
 }
 
 static void
 compiler_emergency_clean(void)
 {
+	// The text is only written for `--asm` and in DEBUG builds, never by a check-only run
+	const bool opened = stream != NULL;
 	compiler_deinit();
 	main_deinit();
-	remove(X86_64_OUTPUT);
+	if (opened) remove(X86_64_OUTPUT);
 }
 
 static void
-compile_proc(Compiler *ctx, const ast_t *ast)
+check_proc(Compiler *ctx, ast_id_t ast_id)
 {
-#ifdef DEBUG
-	FOREACH(arg_t, arg, ast->proc_stmt.args) {
-		wprintln("; %s", arg_to_str(&arg));
-	}
-#endif
+	ctx->proc_ctx.stmt = ast_proc(ast_id);
+	bind_args(ctx);
 
-	wprintln("__%s__:", ast->proc_stmt.name->str);
-	rsp_stack_mov_rsp();
-
-	ctx->proc_ctx.stmt = &ast->proc_stmt;
-
-	ast_t proc_ast = astid(ast->proc_stmt.body);
-	if (ast->proc_stmt.body >= 0) {
-		compile_block(ctx, proc_ast);
+	const ast_id_t body = parser_body(ctx->parser, ast_id);
+	if (body >= 0) {
+		check_block(ctx, body);
 	}
 
-	rsp_stack_mov_to_rsp();
-
-	// Pop return address into the rax
-	wtln("pop rax");
-
-	// Pop the amount of procedure's arguments out of the stack
-	wtprintln("add rsp, %u", (vec_size(ast->proc_stmt.args)) * WORD_SIZE);
-
-	// Push return address from rax and return
-	wtln("push rax");
-	wtln("ret");
-
 	ctx->proc_ctx.stmt = NULL;
 	ctx->proc_ctx.stack_size = 0;
 	ctx->proc_ctx.called_funcptr = false;
 }
 
 static void
-compile_func(Compiler *ctx, const ast_t *ast)
+compile_proc(Compiler *ctx, ast_id_t ast_id)
 {
+	body_begin();
+
 #ifdef DEBUG
-	FOREACH(arg_t, arg, ast->func_stmt.args) {
-		wprintln("; %s", arg_to_str(&arg));
+	FOREACH(arg_t, arg, ast_proc(ast_id)->args) {
+		emit_comment("%s", arg_to_str(&arg));
 	}
 #endif
 
-	wprintln("__%s__:", ast->func_stmt.name->str);
+	emit_label(label_func(ast_proc(ast_id)->name->str));
 	rsp_stack_mov_rsp();
 
-	ctx->func_ctx.stmt = &ast->func_stmt;
+	const ast_id_t body = parser_body(ctx->parser, ast_id);
+	if (body >= 0) {
+		compile_body(ctx, body, 0, ast_proc(ast_id)->name->str);
+	}
+
+	tos_count = 0;
+	frame_leave(vec_size(ast_proc(ast_id)->args), 0, true);
+
+	body_end();
+}
+
+static void
+check_func(Compiler *ctx, ast_id_t ast_id)
+{
+	ctx->func_ctx.stmt = ast_func(ast_id);
+	bind_args(ctx);
 
-	ast_id_t last_ast_in_body = ast->ast_id;
-	ast_t func_ast = astid(ast->func_stmt.body);
-	if (ast->func_stmt.body >= 0) {
-		last_ast_in_body = compile_block(ctx, func_ast);
+	ast_id_t last_ast_in_body = ast_id;
+	const ast_id_t body = parser_body(ctx->parser, ast_id);
+	if (body >= 0) {
+		last_ast_in_body = check_block(ctx, body);
 	}
 
-	const size_t ret_types_count = vec_size(ast->func_stmt.ret_types);
+	const size_t ret_types_count = vec_size(ast_func(ast_id)->ret_types);
 	if (ctx->func_ctx.stack_size < ret_types_count) {
 		report_error("%s error: expected to have %zu %s on the stack "
 								 "to perform implicit return function, but got only %zu",
-								 loc_to_str(&locid(astid(last_ast_in_body).loc_id)),
+								 loc_to_str(ast_loc(last_ast_in_body)),
 								 ret_types_count,
 								 ret_types_count == 1 ? "element" : "elements",
 								 ctx->func_ctx.stack_size);
@@ -1260,17 +1683,17 @@ compile_func(Compiler *ctx, const ast_t *ast)
 	// Check if type of the argument in function signature matches
 	// to the corresponding value's type on the stack.
 	for (size_t i = 0; i < ret_types_count; ++i) {
-		value_kind_t expected = ast->func_stmt.ret_types[i];
+		value_kind_t expected = ast_func(ast_id)->ret_types[i];
 		value_kind_t got = *get_type_from_end(ctx, ret_types_count - 1 - i);
 		if (expected != got) {
 			if (i == 0) {
 				report_error("%s error: expected last element on the stack to be `%s`, but got: `%s`",
-								loc_to_str(&locid(astid(last_ast_in_body).loc_id)),
+								loc_to_str(ast_loc(last_ast_in_body)),
 								value_kind_to_str_pretty(got),
 								value_kind_to_str_pretty(expected));
 			} else {
 				report_error("%s error: expected %zuth element from the end of the stack to be `%s`, but got: `%s`",
-										 loc_to_str(&locid(astid(last_ast_in_body).loc_id)),
+										 loc_to_str(ast_loc(last_ast_in_body)),
 										 i,
 										 value_kind_to_str_pretty(got),
 										 value_kind_to_str_pretty(expected));
@@ -1278,131 +1701,139 @@ compile_func(Compiler *ctx, const ast_t *ast)
 		}
 	}
 
-	// Save return values into the registers
-	for (size_t i = 0; i < ret_types_count; ++i) {
-		wtprintln("pop %s", X86_64_LINUX_SYSTEM_V_CONVENTION_REGISTERS[i]);
-	}
+	ctx->func_ctx.stmt = NULL;
+	ctx->func_ctx.stack_size = 0;
+	ctx->func_ctx.called_funcptr = false;
+}
 
-	// If name of the function is `main`, save last returned value to the `ret_code`,
-	// to use it as an exit code in the future.
-	if (0 == strcmp(MAIN_FUNCTION, ctx->func_ctx.stmt->name->str)) {
-		wtprintln("mov [ret_code], %s", X86_64_LINUX_SYSTEM_V_CONVENTION_REGISTERS[ret_types_count - 1]);
+static void
+compile_func(Compiler *ctx, ast_id_t ast_id)
+{
+	body_begin();
+
+#ifdef DEBUG
+	FOREACH(arg_t, arg, ast_func(ast_id)->args) {
+		emit_comment("%s", arg_to_str(&arg));
 	}
+#endif
 
-	rsp_stack_mov_to_rsp();
+	emit_label(label_func(ast_func(ast_id)->name->str));
+	rsp_stack_mov_rsp();
 
-	// Pop return address into the rax
-	wtln("pop rax");
+	const size_t ret_types_count = vec_size(ast_func(ast_id)->ret_types);
+	const ast_id_t body = parser_body(ctx->parser, ast_id);
+	bool returned = false;
+	if (body >= 0) {
+		returned = compile_body(ctx, body, ret_types_count, ast_func(ast_id)->name->str);
+	}
 
-	// Pop the amount of function's arguments out of the stack
-	wtprintln("add rsp, %u", (vec_size(ast->func_stmt.args)) * WORD_SIZE);
+	// Save return values into the registers, the rest is dropped with the frame
+	if (!returned) tos_pop_results(ret_types_count);
+	tos_count = 0;
 
-	// Retrieve return values
-	for (size_t i = 0; i < ret_types_count; ++i) {
-		wtprintln("push %s", X86_64_LINUX_SYSTEM_V_CONVENTION_REGISTERS[i]);
+	// If name of the function is `main`, save last returned value to the `ret_code`,
+	// to use it as an exit code in the future.
+	if (ast_func(ast_id)->name->sym == sym_main()) {
+		emit_op2(OP_MOV, operand_mem_label(0, RET_CODE), operand_reg(CONVENTION_REGISTERS[ret_types_count - 1]));
 	}
 
-	// Push return address from rax and return
-	wtln("push rax");
-	wtln("ret");
+	frame_leave(vec_size(ast_func(ast_id)->args), ret_types_count, true);
 
-	ctx->func_ctx.stmt = NULL;
-	ctx->func_ctx.stack_size = 0;
-	ctx->func_ctx.called_funcptr = false;
+	body_end();
 }
 
 static void
-report_if_redeclared(Compiler *ctx, const ast_t *ast, const char *key)
+report_if_redeclared(ast_id_t decl, sym_id_t key)
 {
-	ast_id_t ast_id = -1;
-
-	if (-1 != shgeti(values_map, key)) {
-		ast_id = values_map[shgeti(values_map, key)].value.ast_id;
-	} else if (-1 != shgeti(externs_map, key)) {
-		ast_id = externs_map[shgeti(externs_map, key)].value.ast_id;
-	} else if (-1 != shgeti(ctx->const_map, key)) {
-		ast_id = ctx->const_map[shgeti(ctx->const_map, key)].value.ast_id;
-	} else if (-1 != shgeti(ctx->var_map, key)) {
-		ast_id = ctx->var_map[shgeti(ctx->var_map, key)].value.ast_id;
-	}
-
-	if (-1 != ast_id && ast_id != ast->ast_id) {
+	const binding_t *binding = scope_get(key);
+	if (binding->ast_kind != AST_POISONED && binding->ast_id != decl) {
 		eprintf("%s error: %s `%s` got redeclared\n",
-						loc_to_str(&locid(ast->loc_id)),
-						ast_kind_to_str_pretty(ast->ast_kind),
-						key);
+						loc_to_str(ast_loc(decl)),
+						ast_kind_to_str_pretty(ast_kind(decl)),
+						symstr(key));
 
 		report_error("%s note: previously declared here",
-								 loc_to_str(&locid(astid(ast_id).loc_id)));
+								 loc_to_str(ast_loc(binding->ast_id)));
 	}
 }
 
-static void
-fill_maps(Compiler *ctx)
+INLINE void
+bind_decl(sym_id_t sym, ast_id_t ast_id, ast_kind_t ast_kind)
 {
-	ast_t ast = astid(0);
-	while (ast.next && ast.next <= ASTS_SIZE) {
-		switch (ast.ast_kind) {
-		case AST_POISONED:
-		case AST_IF:
-		case AST_WHILE:
-		case AST_DOT:
-		case AST_DUP:
-		case AST_BNOT:
-		case AST_BOR:
-		case AST_MOD:
-		case AST_PUSH:
-		case AST_MUL:
-		case AST_DIV:
-		case AST_MINUS:
-		case AST_PLUS:
-		case AST_LESS:
-		case AST_EQUAL:
-		case AST_CALL:
-		case AST_WRITE:
-		case AST_DROP:
-		case AST_GREATER:
-		case AST_GREATER_EQUAL:
-		case AST_LESS_EQUAL:
-		case AST_SYSCALL:
-		case AST_LITERAL: break;
-
-		case AST_EXTERN: {
-			const char *name = NULL;
-			switch (ast.extern_decl.kind) {
-			case EXTERN_FUNC: name = ast.extern_decl.func_stmt.name->str; break;
-			case EXTERN_PROC: name = ast.extern_decl.proc_stmt.name->str; break;
-			}
-			report_if_redeclared(ctx, &ast, name);
-			const value_t value = {
-				.ast_id = ast.ast_id,
-				.ast_kind = ast.ast_kind
-			};
-			shput(externs_map, name, value);
-		} break;
+	binding_t *binding = scope_slot(sym);
+	binding->ast_kind = (u8) ast_kind;
+	binding->ast_id = ast_id;
+}
 
-		case AST_VAR: {
-			report_if_redeclared(ctx, &ast, ast.var_stmt.name->str);
-		} break;
+// Bind a top level declaration, reporting a redeclaration
+static void
+declare(Compiler *ctx, ast_id_t ast_id)
+{
+	switch (ast_kind(ast_id)) {
+	case AST_POISONED:
+	case AST_IF:
+	case AST_WHILE:
+	case AST_DOT:
+	case AST_DUP:
+	case AST_BNOT:
+	case AST_BOR:
+	case AST_MOD:
+	case AST_PUSH:
+	case AST_MUL:
+	case AST_DIV:
+	case AST_MINUS:
+	case AST_PLUS:
+	case AST_LESS:
+	case AST_EQUAL:
+	case AST_CALL:
+	case AST_WRITE:
+	case AST_DROP:
+	case AST_GREATER:
+	case AST_GREATER_EQUAL:
+	case AST_LESS_EQUAL:
+	case AST_SYSCALL:
+	case AST_LITERAL: break;
+
+	case AST_EXTERN: {
+		sym_id_t name = SYM_NONE;
+		const extern_decl_t *extern_decl = ast_extern(ast_id);
+		switch (extern_decl->kind) {
+		case EXTERN_FUNC: name = extern_decl->func_stmt.name->sym; break;
+		case EXTERN_PROC: name = extern_decl->proc_stmt.name->sym; break;
+		}
+		report_if_redeclared(ast_id, name);
+		bind_decl(name, ast_id, AST_EXTERN);
+		vec_add(scope.externs, ast_id);
+	} break;
 
-		case AST_CONST: {
-			report_if_redeclared(ctx, &ast, ast.const_stmt.name->str);
-		} break;
+	case AST_VAR: {
+		report_if_redeclared(ast_id, ast_var(ast_id)->name->sym);
+		scope_bind_entry(ctx->var_map, ast_var(ast_id)->name->sym, AST_VAR);
+	} break;
 
-		case AST_FUNC:
-		case AST_PROC: {
-			const bool is_proc = ast.ast_kind == AST_PROC;
-			const char *name = is_proc ? ast.proc_stmt.name->str : ast.func_stmt.name->str;
-			report_if_redeclared(ctx, &ast, name);
-			const value_t value = {
-				.ast_id = ast.ast_id,
-				.ast_kind = ast.ast_kind
-			};
-			shput(values_map, name, value);
-		} break;
-		}
+	case AST_CONST: {
+		report_if_redeclared(ast_id, ast_const(ast_id)->name->sym);
+		scope_bind_entry(ctx->const_map, ast_const(ast_id)->name->sym, AST_CONST);
+	} break;
 
-		ast = astid(ast.next);
+	case AST_FUNC:
+	case AST_PROC: {
+		const bool is_proc = ast_kind(ast_id) == AST_PROC;
+		const sym_id_t name = is_proc ? ast_proc(ast_id)->name->sym : ast_func(ast_id)->name->sym;
+		report_if_redeclared(ast_id, name);
+		bind_decl(name, ast_id, ast_kind(ast_id));
+		vec_add(scope.values, ast_id);
+	} break;
+	}
+}
+
+static void
+fill_maps(Compiler *ctx)
+{
+	ast_id_t ast_id = 0;
+	while (ast_next(ast_id) && ast_next(ast_id) <= asts_len) {
+		declare(ctx, ast_id);
+		ast_id = ast_next(ast_id);
 	}
 }
 
@@ -1411,110 +1842,791 @@ compile_comptime_string_literals(void)
 {
 	string_literal_counter = 0;
 	FOREACH(const char *, str, strs) {
+		// The bytes between the quotes, `\n` at the end is the only escape
+		size_t len = strlen(str) - 2;
+		const bool newline = len >= 2 && str[len - 1] == '\\' && str[len] == 'n';
+		if (newline) len -= 2;
+
 		scratch_buffer_clear();
-		scratch_buffer_genstr();
-		char *strdb = scratch_buffer_copy();
-		size_t len = strlen(str);
-		if (len > 2 && str[len - 3] == '\\' && str[len - 2] == 'n') {
-			scratch_buffer_clear();
-			scratch_buffer_append(str);
+		scratch_buffer_append_len(str + 1, len);
+		if (newline) scratch_buffer_append_char('\n');
 
-			scratch_buffer.str[len - 3] = '"';
-			scratch_buffer.str[len - 2] = '\0';
+		// With the terminating zero
+		const label_t label = label_numbered(LABEL_STR, string_literal_counter);
+		emit(insn_bytes(label, scratch_buffer_to_string(), scratch_buffer.len + 1));
+		string_literal_counter++;
+	}
+}
 
-			wprintln("%s db %s, 0xA, 0x0", strdb, scratch_buffer_to_string());
-		} else {
-			wprintln("%s db %s, 0x0", strdb, str);
+INLINE void
+reach(binding_t *binding)
+{
+	if (binding->is_used) return;
+	binding->is_used = true;
+	if (binding->ast_kind == AST_PROC || binding->ast_kind == AST_FUNC) {
+		vec_add(reachable, binding->ast_id);
+	}
+}
+
+INLINE sym_id_t
+extern_name(ast_id_t ast_id)
+{
+	const extern_decl_t *extern_decl = ast_extern(ast_id);
+	switch (extern_decl->kind) {
+	case EXTERN_FUNC: return extern_decl->func_stmt.name->sym;
+	case EXTERN_PROC: return extern_decl->proc_stmt.name->sym;
+	}
+	return SYM_NONE;
+}
+
+// Follow the same names as `compile_ast` does: calls of procs, funcs and externs,
+// and procs and funcs pushed as function pointers
+static void
+reach_block(ast_id_t ast_id)
+{
+	while (ast_id < asts_len) {
+		const ast_kind_t kind = ast_kind(ast_id);
+		if (kind == AST_CALL) {
+			binding_t *binding = scope_slot(ast_sym(ast_id));
+			if (binding->ast_kind == AST_PROC
+			|| binding->ast_kind == AST_FUNC
+			|| binding->ast_kind == AST_EXTERN)
+			{
+				reach(binding);
+			}
+		} else if (kind == AST_LITERAL) {
+			binding_t *binding = scope_slot(ast_sym(ast_id));
+			if (binding->ast_kind == AST_PROC || binding->ast_kind == AST_FUNC) {
+				reach(binding);
+			}
+		} else if (kind == AST_IF) {
+			if (ast_if(ast_id)->then_body >= 0) reach_block(ast_if(ast_id)->then_body);
+			if (ast_if(ast_id)->else_body >= 0) reach_block(ast_if(ast_id)->else_body);
+		} else if (kind == AST_WHILE) {
+			if (ast_while(ast_id)->cond >= 0) reach_block(ast_while(ast_id)->cond);
+			if (ast_while(ast_id)->body >= 0) reach_block(ast_while(ast_id)->body);
 		}
 
-		scratch_buffer_genstrlen();
-		wprintln("%s " COMPTIME_EQU " $ - %s", scratch_buffer_to_string(), strdb);
-		string_literal_counter++;
+		if (ast_next(ast_id) < 0) break;
+		else ast_id = ast_next(ast_id);
 	}
 }
 
-// TODO: Properly check if procedure/function is used or not
-// Compile only used procs/funcs that are not inlined
+// Only the reachable bodies are emitted, the others are parsed and checked when planned,
+// unless `reachable_only` is set
 static void
-compile_funcs_and_procs(Compiler *ctx)
-{
-	for (ptrdiff_t i = 0; i < shlen(values_map); ++i) {
-		const value_t value = values_map[i].value;
-		if (value.ast_kind == AST_PROC
-		&& !astid(value.ast_id).proc_stmt.inlin
-		// && value.is_used
-			)
-		{
-			compile_proc(ctx, &astid(value.ast_id));
-		} else if (value.ast_kind == AST_FUNC
-					 && !astid(value.ast_id).func_stmt.inlin
-					 && 0 != strcmp(MAIN_FUNCTION, astid(value.ast_id).func_stmt.name->str)
-					 // && value.is_used
-			)
-		{
-			compile_func(ctx, &astid(value.ast_id));
+build_call_graph(Compiler *ctx)
+{
+	reach(scope_slot(ast_func(ctx->ast_cur)->name->sym));
+
+	for (u32 i = 0; i < vec_size(reachable); ++i) {
+		const ast_id_t body = parser_body(ctx->parser, reachable[i]);
+		if (body >= 0) reach_block(body);
+	}
+
+#ifdef DEBUG
+	u32 externs_used = 0;
+	FOREACH(ast_id_t, ast_id, scope.externs) {
+		if (scope_get(extern_name(ast_id))->is_used) externs_used++;
+	}
+	printf("call graph: %u of %u procs and funcs, %u of %u externs reachable\n",
+				 vec_size(reachable), vec_size(scope.values),
+				 externs_used, vec_size(scope.externs));
+#endif
+}
+
+// Type check the body, and resolve what its codegen depends on
+INLINE void
+check_decl(Compiler *ctx, ast_id_t decl)
+{
+	if (ast_kind(decl) == AST_PROC) check_proc(ctx, decl);
+	else check_func(ctx, decl);
+}
+
+INLINE void
+emit_decl(Compiler *ctx, ast_id_t decl)
+{
+	if (ast_kind(decl) == AST_PROC) compile_proc(ctx, decl);
+	else compile_func(ctx, decl);
+}
+
+// Check and emit the body at once, when it is not planned ahead
+INLINE void
+compile_decl(Compiler *ctx, ast_id_t decl)
+{
+	check_decl(ctx, decl);
+	emit_decl(ctx, decl);
+}
+
+// Helpers called by the text of a cached body
+#define FUNC_USES_STRLEN (1u << 0)
+#define FUNC_USES_DMP_I64 (1u << 1)
+
+static bool func_cache_enabled = false;
+
+// Bytes a declaration is hashed from, the ones of an inline callee are appended past them
+static u8 *hash_bytes = NULL;
+static size_t hash_bytes_len = 0;
+static size_t hash_bytes_cap = 0;
+
+// Hashes of inline procs and funcs by name, 0 while the body is being hashed
+static sym_index_t inline_hashes = {0};
+static u64 *inline_hash_values = NULL;
+
+static void
+hash_append(const void *data, size_t len)
+{
+	if (hash_bytes_len + len > hash_bytes_cap) {
+		while (hash_bytes_len + len > hash_bytes_cap) {
+			hash_bytes_cap = hash_bytes_cap ? hash_bytes_cap * 2 : 4096;
 		}
+		hash_bytes = (u8 *) realloc(hash_bytes, hash_bytes_cap);
 	}
+
+	memcpy(hash_bytes + hash_bytes_len, data, len);
+	hash_bytes_len += len;
+}
+
+INLINE void
+hash_u8(u8 value)
+{
+	hash_append(&value, sizeof(value));
+}
+
+INLINE void
+hash_u64(u64 value)
+{
+	hash_append(&value, sizeof(value));
+}
+
+INLINE void
+hash_str(const char *str)
+{
+	hash_append(str, strlen(str) + 1);
 }
 
 static void
-print_externs(void)
+hash_signature(const arg_t *args, const value_kind_t *ret_types)
 {
-	for (ptrdiff_t i = 0; i < shlen(externs_map); ++i) {
-		const extern_decl_t *extern_decl = &astid(externs_map[i].value.ast_id).extern_decl;
+	hash_u64(vec_size(args));
+	for (u32 i = 0; i < vec_size(args); ++i) hash_u8((u8) args[i].kind);
+
+	hash_u64(vec_size(ret_types));
+	for (u32 i = 0; i < vec_size(ret_types); ++i) hash_u8((u8) ret_types[i]);
+}
+
+static u64
+decl_hash(Compiler *ctx, ast_id_t decl);
+
+// A name used by a body, with what it is bound to: the signature of a proc, func or extern,
+// the whole inline body, or the value of a const
+static void
+hash_binding(Compiler *ctx, sym_id_t sym)
+{
+	const binding_t *binding = scope_get(sym);
+	hash_str(symstr(sym));
+	hash_u8(binding->ast_kind);
+
+	if (binding->ast_kind == AST_PROC) {
+		const proc_stmt_t *proc_stmt = ast_proc(binding->ast_id);
+		if (proc_stmt->inlin) hash_u64(decl_hash(ctx, binding->ast_id));
+		else hash_signature(proc_stmt->args, NULL);
+	} else if (binding->ast_kind == AST_FUNC) {
+		const func_stmt_t *func_stmt = ast_func(binding->ast_id);
+		if (func_stmt->inlin) hash_u64(decl_hash(ctx, binding->ast_id));
+		else hash_signature(func_stmt->args, func_stmt->ret_types);
+	} else if (binding->ast_kind == AST_EXTERN) {
+		const extern_decl_t *extern_decl = ast_extern(binding->ast_id);
+		hash_u8((u8) extern_decl->kind);
 		switch (extern_decl->kind) {
-		case EXTERN_FUNC: {
-			wprintln(EXTERN " %s", extern_decl->func_stmt.name->str);
-		} break;
-		case EXTERN_PROC: {
-			wprintln(EXTERN " %s", extern_decl->proc_stmt.name->str);
-		} break;
+		case EXTERN_FUNC: hash_signature(extern_decl->func_stmt.args, extern_decl->func_stmt.ret_types); break;
+		case EXTERN_PROC: hash_signature(extern_decl->proc_stmt.args, NULL); break;
 		}
+	} else if (binding->ast_kind == AST_CONST) {
+		const consteval_value_t *value = &ctx->const_map->entries[binding->entry].value;
+		hash_u8((u8) value->kind);
+		hash_u64((u64) value->value);
+	} else if (binding->ast_kind == AST_VAR) {
+		hash_u8((u8) ctx->var_map->entries[binding->entry].value.kind);
 	}
 }
 
-void
-compiler_compile(Compiler *ctx)
+static void
+hash_block(Compiler *ctx, ast_id_t ast_id)
 {
-	stream = fopen(X86_64_OUTPUT, "w");
-	if (stream == NULL) {
-		eprintf("error: Failed to open file: %s\n", X86_64_OUTPUT);
-		exit(EXIT_FAILURE);
+	while (ast_id < asts_len) {
+		const ast_kind_t kind = ast_kind(ast_id);
+		hash_u8((u8) kind);
+
+		if (kind == AST_CALL || kind == AST_LITERAL || kind == AST_WRITE) {
+			hash_binding(ctx, ast_sym(ast_id));
+		} else if (kind == AST_SYSCALL) {
+			hash_u8(ast_syscall_args(ast_id));
+		} else if (kind == AST_PUSH) {
+			hash_u8((u8) ast_push(ast_id)->value_kind);
+			if (ast_push(ast_id)->value_kind == VALUE_KIND_STRING) hash_str(ast_push(ast_id)->str);
+			else hash_u64((u64) ast_push(ast_id)->integer);
+		} else if (kind == AST_IF) {
+			if (ast_if(ast_id)->then_body >= 0) hash_block(ctx, ast_if(ast_id)->then_body);
+			else hash_u8(AST_POISONED);
+			if (ast_if(ast_id)->else_body >= 0) hash_block(ctx, ast_if(ast_id)->else_body);
+			else hash_u8(AST_POISONED);
+		} else if (kind == AST_WHILE) {
+			if (ast_while(ast_id)->cond >= 0) hash_block(ctx, ast_while(ast_id)->cond);
+			else hash_u8(AST_POISONED);
+			if (ast_while(ast_id)->body >= 0) hash_block(ctx, ast_while(ast_id)->body);
+			else hash_u8(AST_POISONED);
+		}
+
+		if (ast_next(ast_id) < 0) break;
+		else ast_id = ast_next(ast_id);
 	}
 
-	wln(FORMAT_64BIT);
+	// Closes the block
+	hash_u8(AST_POISONED);
+}
 
-	print_defines();
-	wln(SECTION_TEXT_EXECUTABLE);
+// Everything the text compiled for the proc or func depends on, locations aside
+static u64
+decl_hash(Compiler *ctx, ast_id_t decl)
+{
+	const bool is_proc = ast_kind(decl) == AST_PROC;
+	const bool inlin = is_proc ? ast_proc(decl)->inlin : ast_func(decl)->inlin;
+	const token_t *name = is_proc ? ast_proc(decl)->name : ast_func(decl)->name;
+	const arg_t *args = is_proc ? ast_proc(decl)->args : ast_func(decl)->args;
+
+	i32 idx = -1;
+	if (inlin) {
+		idx = sym_index_get(&inline_hashes, name->sym);
+		if (idx != -1) return inline_hash_values[idx];
+
+		idx = (i32) vec_size(inline_hash_values);
+		vec_add(inline_hash_values, 0);
+		sym_index_put(&inline_hashes, name->sym, idx);
+	}
 
-	fill_maps(ctx);
-	print_externs();
+	const size_t start = hash_bytes_len;
+	hash_u8((u8) ast_kind(decl));
+	hash_u8(inlin);
+	hash_str(name->str);
+	hash_signature(args, is_proc ? NULL : ast_func(decl)->ret_types);
+	for (u32 i = 0; i < vec_size(args); ++i) hash_str(symstr(args[i].name));
 
-	ast_t ast = astid(ctx->ast_cur);
-	compile_func(ctx, &ast);
+	const ast_id_t body = parser_body(ctx->parser, decl);
+	if (body >= 0) hash_block(ctx, body);
+	else hash_u8(AST_POISONED);
 
-	wln(GLOBAL " _start");
-	wln("_start:");
+	const u64 hash = token_cache_hash((const char *) hash_bytes + start, hash_bytes_len - start);
+	hash_bytes_len = start;
 
-	wtln("call __" MAIN_FUNCTION "__");
+	if (inlin) inline_hash_values[idx] = hash;
+	return hash;
+}
 
-	print_exit();
+// Labels are numbered from the counters at the time, the cached ones from the bases
+INLINE void
+renumber_label(const func_cache_entry_t *entry, label_t *label)
+{
+	switch ((label_kind_t) label->kind) {
+	case LABEL_ELSE:
+	case LABEL_EDON:  label->number = label->number - entry->label_base + (u32) label_counter; break;
+	case LABEL_WHILE:
+	case LABEL_WDON:  label->number = label->number - entry->while_label_base + (u32) while_label_counter; break;
+	case LABEL_STR:   label->number = label->number - entry->str_base + (u32) string_literal_counter; break;
+	case LABEL_NONE:
+	case LABEL_NAME:
+	case LABEL_FUNC:
+	case LABEL_KIND_COUNT: break;
+	}
+}
+
+// Emit the cached records, as if the body was compiled now
+static void
+splice_cached(const func_cache_entry_t *entry)
+{
+	const u8 *c = (const u8 *) entry->insns;
+	const u8 *end = c + entry->insns_len;
+	while (c < end) {
+		insn_t insn;
+		c = insn_deserialize(c, &insn);
+		for (u32 i = 0; i < INSN_OPERANDS_MAX; ++i) renumber_label(entry, &insn.operands[i].label);
+		emit_insn(&insn);
+	}
+
+	const char *str = entry->str_data;
+	for (u32 i = 0; i < entry->strs; ++i) {
+		vec_add(strs, str);
+		str += strlen(str) + 1;
+	}
+
+	label_counter += entry->labels;
+	while_label_counter += entry->while_labels;
+	string_literal_counter += entry->strs;
+	if (entry->flags & FUNC_USES_STRLEN) used_strlen = true;
+	if (entry->flags & FUNC_USES_DMP_I64) used_dmp_i64 = true;
+}
+
+// Compile a body and keep its records in the cache
+static void
+compile_and_cache(Compiler *ctx, ast_id_t decl, u64 hash)
+{
+	const bool old_used_strlen = used_strlen;
+	const bool old_used_dmp_i64 = used_dmp_i64;
+	used_strlen = false;
+	used_dmp_i64 = false;
+
+	const size_t label_base = label_counter;
+	const size_t while_label_base = while_label_counter;
+	const size_t str_base = string_literal_counter;
+
+	insn_bytes_t insns = {0};
+	capture = &insns;
+	emit_decl(ctx, decl);
+	capture = NULL;
+
+	const u32 flags = (used_strlen ? FUNC_USES_STRLEN : 0) | (used_dmp_i64 ? FUNC_USES_DMP_I64 : 0);
+	used_strlen |= old_used_strlen;
+	used_dmp_i64 |= old_used_dmp_i64;
+
+	size_t str_data_len = 0;
+	for (size_t i = str_base; i < string_literal_counter; ++i) str_data_len += strlen(strs[i]) + 1;
+
+	char *str_data = (char *) malloc(str_data_len + 1);
+	char *str = str_data;
+	for (size_t i = str_base; i < string_literal_counter; ++i) {
+		const size_t len = strlen(strs[i]) + 1;
+		memcpy(str, strs[i], len);
+		str += len;
+	}
+
+	func_cache_put(&(func_cache_entry_t) {
+		.hash = hash,
+		.flags = flags,
+		.label_base = (u32) label_base,
+		.labels = (u32) (label_counter - label_base),
+		.while_label_base = (u32) while_label_base,
+		.while_labels = (u32) (while_label_counter - while_label_base),
+		.str_base = (u32) str_base,
+		.strs = (u32) (string_literal_counter - str_base),
+		.insns_len = (u32) insns.len,
+		.str_data_len = (u32) str_data_len,
+		.insns = (const char *) insns.bytes,
+		.str_data = str_data
+	});
+
+	free(str_data);
+	free(insns.bytes);
+}
+
+// Proc or func to emit: the text from the cache, if nothing it depends on changed,
+// or its checked body
+typedef struct {
+	ast_id_t decl;
+	u64 hash;
+	const func_cache_entry_t *cached;
+} planned_t;
+
+static planned_t *planned = NULL;
+
+static void
+plan_decl(Compiler *ctx, ast_id_t decl)
+{
+	planned_t plan = { .decl = decl };
+	if (func_cache_enabled) {
+		plan.hash = decl_hash(ctx, decl);
+		plan.cached = func_cache_get(plan.hash);
+	}
+
+	if (plan.cached == NULL) check_decl(ctx, decl);
+	vec_add(planned, plan);
+}
+
+// Proc or func with a body of its own, main aside
+INLINE bool
+is_standalone_decl(ast_id_t ast_id)
+{
+	if (ast_kind(ast_id) == AST_PROC) {
+		return !ast_proc(ast_id)->inlin;
+	} else if (ast_kind(ast_id) == AST_FUNC) {
+		return !ast_func(ast_id)->inlin && ast_func(ast_id)->name->sym != sym_main();
+	}
+	return false;
+}
+
+INLINE sym_id_t
+decl_name(ast_id_t decl)
+{
+	if (ast_kind(decl) == AST_PROC) return ast_proc(decl)->name->sym;
+	return ast_func(decl)->name->sym;
+}
+
+// Main, then the procs/funcs that are not inlined, in the order they are declared, so the
+// errors are reported in the same order. The unreachable ones are checked but not emitted,
+// with `reachable_only` their bodies are never parsed
+static void
+plan_funcs_and_procs(Compiler *ctx)
+{
+	// Checking a body marks what it uses, so the call graph decides what is emitted beforehand
+	bool *reachable_decls = (bool *) calloc(vec_size(scope.values) + 1, sizeof(bool));
+	for (u32 i = 0; i < vec_size(scope.values); ++i) {
+		const ast_id_t ast_id = scope.values[i];
+		reachable_decls[i] = is_standalone_decl(ast_id) && scope_get(decl_name(ast_id))->is_used;
+	}
+
+	plan_decl(ctx, ctx->ast_cur);
+
+	for (u32 i = 0; i < vec_size(scope.values); ++i) {
+		const ast_id_t ast_id = scope.values[i];
+		if (reachable_decls[i]) {
+			plan_decl(ctx, ast_id);
+		} else if (!ctx->reachable_only && is_standalone_decl(ast_id)) {
+			check_decl(ctx, ast_id);
+		}
+	}
+
+	free(reachable_decls);
+}
 
-	compile_funcs_and_procs(ctx);
+static void
+compile_planned(Compiler *ctx, const planned_t *plan)
+{
+	if (plan->cached != NULL) {
+		splice_cached(plan->cached);
+		func_cache_put(plan->cached);
+	} else if (func_cache_enabled) {
+		compile_and_cache(ctx, plan->decl, plan->hash);
+	} else {
+		emit_decl(ctx, plan->decl);
+	}
+}
+
+INLINE void
+print_extern(ast_id_t ast_id)
+{
+	const extern_decl_t *extern_decl = ast_extern(ast_id);
+	switch (extern_decl->kind) {
+	case EXTERN_FUNC: {
+		emit(insn_data(INSN_EXTERN, label_named(extern_decl->func_stmt.name->str), 0));
+	} break;
+	case EXTERN_PROC: {
+		emit(insn_data(INSN_EXTERN, label_named(extern_decl->proc_stmt.name->str), 0));
+	} break;
+	}
+}
+
+static void
+print_externs(void)
+{
+	FOREACH(ast_id_t, ast_id, scope.externs) {
+		if (scope_get(extern_name(ast_id))->is_used) print_extern(ast_id);
+	}
+}
+
+static void
+compiler_open(const Compiler *ctx)
+{
+#ifdef DEBUG
+	const bool text = true;
+#else
+	const bool text = ctx->external_asm;
+#endif
+
+	if (text) {
+		stream = fopen(X86_64_OUTPUT, "w");
+		if (stream == NULL) {
+			eprintf("error: Failed to open file: %s\n", X86_64_OUTPUT);
+			exit(EXIT_FAILURE);
+		}
+		fputs(FORMAT_64BIT "\n", stream);
+	}
 
+	assembling = !ctx->external_asm;
+	if (assembling) assembler_open();
+
+	emit(insn_section(SECTION_TEXT));
+}
+
+INLINE void
+print_start(void)
+{
+	const label_t start = label_named("_start");
+	emit(insn_data(INSN_GLOBAL, start, 0));
+	emit_label(start);
+
+	emit_op1(OP_CALL, operand_address(label_func(MAIN_FUNCTION)));
+
+	print_exit();
+}
+
+static void
+compiler_close(Compiler *ctx)
+{
 	if (used_dmp_i64) print_dmp_i64();
 	if (used_strlen) print_strlen();
 
 	print_data_section();
 
-	for (ptrdiff_t i = 0; i < shlen(ctx->var_map); ++i) {
-		wprintln("%s dq 0x%lX", ctx->var_map[i].key, ctx->var_map[i].value.value);
+	FOREACH(consteval_entry_t, entry, ctx->var_map->entries) {
+		emit(insn_data(INSN_QUAD, label_named(symstr(entry.key)), entry.value.value));
 	}
 
 	compile_comptime_string_literals();
+
+	// Cached string literals are used till here
+	func_cache_close();
+	sym_index_free(&inline_hashes);
+	inline_hash_values = NULL;
+	free(hash_bytes);
+	hash_bytes = NULL;
+	hash_bytes_len = 0;
+	hash_bytes_cap = 0;
+
 	compiler_deinit();
 }
 
+void
+compiler_compile(Compiler *ctx)
+{
+	compiler_open(ctx);
+
+	// Consts and vars are evaluated before, so they are bound first
+	scope_bind_map(ctx->const_map, AST_CONST);
+	scope_bind_map(ctx->var_map, AST_VAR);
+	fill_maps(ctx);
+	build_call_graph(ctx);
+	print_externs();
+
+	func_cache_enabled = func_cache_open(fileid(0).file_path.buf);
+	plan_funcs_and_procs(ctx);
+
+	compile_planned(ctx, &planned[0]);
+
+	print_start();
+
+	for (u32 i = 1; i < vec_size(planned); ++i) {
+		compile_planned(ctx, &planned[i]);
+	}
+
+	planned = NULL;
+	compiler_close(ctx);
+}
+
+void
+compiler_check(Compiler *ctx)
+{
+	scope_bind_map(ctx->const_map, AST_CONST);
+	scope_bind_map(ctx->var_map, AST_VAR);
+	fill_maps(ctx);
+
+	// Every body is checked, whether it is reachable or not, nothing is taken from the cache
+	check_decl(ctx, ctx->ast_cur);
+	FOREACH(ast_id_t, ast_id, scope.values) {
+		if (is_standalone_decl(ast_id)) check_decl(ctx, ast_id);
+	}
+
+	// Inline bodies are checked where they are expanded, the ones never expanded on their own
+	FOREACH(ast_id_t, ast_id, scope.values) {
+		if (ast_kind(ast_id) == AST_PROC && ast_proc(ast_id)->inlin && !scope_get(decl_name(ast_id))->is_used) {
+			check_inline(ctx, ast_id, true);
+		} else if (ast_kind(ast_id) == AST_FUNC && ast_func(ast_id)->inlin && !scope_get(decl_name(ast_id))->is_used) {
+			check_inline(ctx, ast_id, false);
+		}
+	}
+
+	compiler_deinit();
+}
+
+// Declaration waiting for `sym`, `next` is the next one waiting for the same symbol
+typedef struct {
+	ast_id_t decl;
+	i32 next;
+} deferred_t;
+
+#define STREAM_INLINE_DEPTH_MAX 64
+
+static deferred_t *deferred = NULL;
+static sym_index_t waiting = {0};
+static sym_index_t inline_resolved = {0};
+
+INLINE bool
+is_arg(const arg_t *args, sym_id_t sym)
+{
+	for (u32 i = 0; i < vec_size(args); ++i) {
+		if (args[i].name == sym) return true;
+	}
+	return false;
+}
+
+// First symbol in the body of the proc or func `decl`, or in the bodies of inline procs and
+// funcs it calls, that is not declared yet. `SYM_NONE` if the body can be compiled now.
+static sym_id_t
+missing_sym(Compiler *ctx, ast_id_t decl, u32 depth)
+{
+	const bool is_proc = ast_kind(decl) == AST_PROC;
+	if (depth > STREAM_INLINE_DEPTH_MAX) return SYM_NONE;
+	if (sym_index_get(&inline_resolved, decl_name(decl)) == decl) return SYM_NONE;
+
+	const arg_t *args = is_proc ? ast_proc(decl)->args : ast_func(decl)->args;
+	const ast_id_t end = ast_next(decl) < asts_len ? ast_next(decl) : asts_len;
+	for (ast_id_t ast_id = decl + 1; ast_id < end; ++ast_id) {
+		const ast_kind_t kind = ast_kind(ast_id);
+		if (kind != AST_CALL && kind != AST_LITERAL && kind != AST_WRITE) continue;
+
+		const sym_id_t sym = ast_sym(ast_id);
+		const binding_t *value = scope_get(sym);
+		if (kind == AST_WRITE) {
+			if (value->ast_kind == AST_VAR) continue;
+			return sym;
+		}
+
+		if (value->ast_kind == AST_POISONED) {
+			if (is_arg(args, sym)) continue;
+			return sym;
+		}
+
+		const bool inlin = (value->ast_kind == AST_PROC && ast_proc(value->ast_id)->inlin)
+			|| (value->ast_kind == AST_FUNC && ast_func(value->ast_id)->inlin);
+
+		if (kind == AST_CALL && inlin && value->ast_id != decl) {
+			const sym_id_t missing = missing_sym(ctx, value->ast_id, depth + 1);
+			if (missing != SYM_NONE) return missing;
+		}
+	}
+
+	// Maps only grow, so a resolved inline body stays resolved
+	const bool inlin = is_proc ? ast_proc(decl)->inlin : ast_func(decl)->inlin;
+	if (inlin) sym_index_put(&inline_resolved, decl_name(decl), decl);
+
+	return SYM_NONE;
+}
+
+static void
+defer(ast_id_t decl, sym_id_t sym)
+{
+	const i32 idx = (i32) vec_size(deferred);
+	vec_add(deferred, ((deferred_t) { .decl = decl, .next = sym_index_get(&waiting, sym) }));
+	sym_index_put(&waiting, sym, idx);
+}
+
+// Compile the declarations waiting for `sym`, or chain them to the next missing symbol
+static void
+wake(Compiler *ctx, sym_id_t sym)
+{
+	i32 idx = sym_index_get(&waiting, sym);
+	if (idx == -1) return;
+	sym_index_put(&waiting, sym, -1);
+
+	while (idx != -1) {
+		const ast_id_t decl = deferred[idx].decl;
+		const i32 next = deferred[idx].next;
+		deferred[idx].decl = -1;
+
+		const sym_id_t missing = missing_sym(ctx, decl, 0);
+		if (missing != SYM_NONE) defer(decl, missing);
+		else compile_decl(ctx, decl);
+
+		idx = next;
+	}
+}
+
+void
+compiler_stream_begin(Compiler *ctx)
+{
+	compiler_open(ctx);
+}
+
+void
+compiler_stream_declare(Compiler *ctx, ast_id_t decl)
+{
+	declare(ctx, decl);
+}
+
+bool
+compiler_stream_emit(Compiler *ctx, ast_id_t decl)
+{
+	bool done = true;
+	sym_id_t name = SYM_NONE;
+	switch (ast_kind(decl)) {
+	case AST_EXTERN: {
+		const extern_decl_t *extern_decl = ast_extern(decl);
+		name = extern_decl->kind == EXTERN_FUNC ? extern_decl->func_stmt.name->sym : extern_decl->proc_stmt.name->sym;
+		print_extern(decl);
+	} break;
+
+	case AST_CONST: name = ast_const(decl)->name->sym; break;
+	case AST_VAR:		name = ast_var(decl)->name->sym; break;
+
+	case AST_FUNC:
+	case AST_PROC: {
+		name = decl_name(decl);
+		const bool inlin = ast_kind(decl) == AST_PROC ? ast_proc(decl)->inlin : ast_func(decl)->inlin;
+		const sym_id_t missing = inlin ? SYM_NONE : missing_sym(ctx, decl, 0);
+		if (inlin) {
+			done = false;
+		} else if (missing != SYM_NONE) {
+			defer(decl, missing);
+			done = false;
+		} else {
+			compile_decl(ctx, decl);
+		}
+	} break;
+
+	case AST_POISONED:
+	case AST_IF:
+	case AST_WHILE:
+	case AST_DOT:
+	case AST_DUP:
+	case AST_BNOT:
+	case AST_BOR:
+	case AST_MOD:
+	case AST_PUSH:
+	case AST_MUL:
+	case AST_DIV:
+	case AST_MINUS:
+	case AST_PLUS:
+	case AST_LESS:
+	case AST_EQUAL:
+	case AST_CALL:
+	case AST_WRITE:
+	case AST_DROP:
+	case AST_GREATER:
+	case AST_GREATER_EQUAL:
+	case AST_LESS_EQUAL:
+	case AST_SYSCALL:
+	case AST_LITERAL: UNREACHABLE;
+	}
+
+	wake(ctx, name);
+	return done;
+}
+
+void
+compiler_stream_end(Compiler *ctx)
+{
+	// Symbols that never got declared are reported by compiling what waits for them
+	FOREACH(deferred_t, entry, deferred) {
+		if (entry.decl != -1) compile_decl(ctx, entry.decl);
+	}
+
+	print_start();
+
+	compiler_close(ctx);
+
+	sym_index_free(&waiting);
+	sym_index_free(&inline_resolved);
+	deferred = NULL;
+}
+
+void
+compiler_abort(void)
+{
+	assembler_abort();
+	if (stream == NULL) return;
+	fclose(stream);
+	stream = NULL;
+	remove(X86_64_OUTPUT);
+}
+
 /* TODO:
 	#3. Distinguish between compile-time strings and runtime strings, to reduce the amount of calls to strlen
 	#4. Introduce let-binding notion
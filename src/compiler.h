@@ -2,10 +2,15 @@
 #define COMPILER_H_
 
 #include "ast.h"
+#include "parser.h"
 #include "common.h"
 
 #define WORD_SIZE 8
 
+#define SYS_WRITE  1
+#define SYS_STDOUT 1
+#define SYS_EXIT   60
+
 #define OBJECT_OUTPUT "out.o"
 #define X86_64_OUTPUT "out.asm"
 #define EXECUTABLE_OUTPUT "out"
@@ -19,10 +24,8 @@
 
 #ifdef FASM
 	#define EXTERN "extrn"
-	#define DEFINE "define"
 	#define GLOBAL "public"
 	#define ASM_FLAGS EXECUTABLE_OUTPUT".tmp"
-	#define COMPTIME_EQU "="
 	#define RESERVE_QUAD "rq"
 	#define FORMAT_64BIT "format ELF64"
 	#define RESERVE_QUAD_WORD "rq"
@@ -32,9 +35,7 @@
 	#define SECTION_TEXT_EXECUTABLE "section '.text' executable"
 #else
 	#define EXTERN "extern"
-	#define DEFINE "%%define"
 	#define GLOBAL "global"
-	#define COMPTIME_EQU "equ"
 	#define RESERVE_QUAD "resq"
 	#define FORMAT_64BIT "BITS 64"
 	#define RESERVE_QUAD_WORD "resq"
@@ -45,17 +46,26 @@
 	#define SECTION_TEXT_EXECUTABLE "section .text"
 #endif // FASM
 
-#define MAX_STACK_TYPES_CAP 1024
-#define PROC_CTX_MAX_STACK_TYPES_CAP 512
-#define FUNC_CTX_MAX_STACK_TYPES_CAP 512
+// Registers the top values of the stack are cached in while a body is emitted. The peephole
+// pass relies on these being dead:
+// - after the register is pushed, it is pushed only to be used for another value
+// - after the arithmetic op or the compare it is the source of
+// - at a label, a jump, a conditional jump or a return, nothing is cached across them
+// A call is made with nothing cached, or to `dmp_i64` and `strlen` that leave them alone.
+#define TOS_REGISTERS_COUNT 2
+#define TOS_REGISTER_LIST { REG_R12, REG_R13 }
+
+#define STACK_TYPES_INIT_CAP 1024
 
+// Types of the values pushed by the body live in one stack shared by every body being compiled,
+// the ones of this body start at `stack_base`. An inline body starts at the top of the stack.
 typedef struct {
 	const proc_stmt_t *stmt;
 
 	bool called_funcptr;
 
+	size_t stack_base;
 	size_t stack_size;
-	value_kind_t stack_types[PROC_CTX_MAX_STACK_TYPES_CAP];
 } proc_ctx_t;
 
 typedef struct {
@@ -63,8 +73,8 @@ typedef struct {
 
 	bool called_funcptr;
 
+	size_t stack_base;
 	size_t stack_size;
-	value_kind_t stack_types[FUNC_CTX_MAX_STACK_TYPES_CAP];
 } func_ctx_t;
 
 // Consteval only for integers right now
@@ -75,28 +85,104 @@ typedef struct {
 } consteval_value_t;
 
 typedef struct {
-	const char *key;
+	sym_id_t key;
 	consteval_value_t value;
-} const_map_t;
+} consteval_entry_t;
 
+// Evaluated consts or vars by symbol id, `entries` keep the declaration order.
 typedef struct {
-	const char *key;
-	consteval_value_t value;
-} var_map_t;
+	sym_index_t index;
+	consteval_entry_t *entries;
+} consteval_map_t;
+
+consteval_value_t *
+consteval_map_get(const consteval_map_t *map, sym_id_t key);
+
+void
+consteval_map_put(consteval_map_t *map, sym_id_t key, consteval_value_t value);
+
+void
+consteval_map_free(consteval_map_t *map);
+
+// What a symbol is bound to. `ast_kind` is the kind of the top level declaration, `AST_POISONED`
+// if there is none, and `entry` indexes the map of a const or var. The argument of the body being
+// compiled shares the slot, it is current while `arg_scope` equals the one of the scope.
+// `effect` of a proc, func or extern is the index of its stack effect past one, 0 till it is needed.
+typedef struct {
+	u8 ast_kind;
+	u8 arg_kind;
+	bool is_used;
+	ast_id_t ast_id;
+	u32 entry;
+	u32 arg_scope;
+	u32 arg_offset;
+	u32 effect;
+} binding_t;
+
+// Bindings indexed by symbol id, so one lookup resolves a name, whatever it names.
+// Procs and funcs, and externs are also kept in the declaration order. Filled by the
+// compiler, the IR is built with the same bindings.
+typedef struct {
+	binding_t *bindings;
+	u32 cap;
+	u32 arg_scope;
+
+	ast_id_t *values;
+	ast_id_t *externs;
+} scope_t;
+
+extern scope_t scope;
+
+INLINE const binding_t *
+scope_get(sym_id_t sym)
+{
+	static const binding_t unbound = {0};
+	return sym < scope.cap ? &scope.bindings[sym] : &unbound;
+}
 
 typedef struct {
 	ast_id_t ast_cur;
+	Parser *parser;
 	proc_ctx_t proc_ctx;
 	func_ctx_t func_ctx;
 
-	var_map_t *var_map;
-	const_map_t *const_map;
+	const consteval_map_t *var_map;
+	const consteval_map_t *const_map;
+
+	// Bodies not reachable from main are left unparsed and unchecked by `compiler_compile`
+	bool reachable_only;
+	// The text goes to `X86_64_OUTPUT` for fasm or nasm, the built-in assembler gets nothing
+	bool external_asm;
 } Compiler;
 
 Compiler
-new_compiler(ast_id_t ast_cur, const_map_t *const_map, var_map_t *var_map);
+new_compiler(ast_id_t ast_cur, Parser *parser, const consteval_map_t *const_map, const consteval_map_t *var_map);
 
 void
 compiler_compile(Compiler *compiler);
 
+// Type check main and every proc and func, reachable or not, nothing is emitted or cached
+void
+compiler_check(Compiler *compiler);
+
+// Streaming compilation. Top level items are declared and emitted one by one, a proc or
+// func is compiled as soon as every symbol of its body is declared, until then it waits.
+void
+compiler_stream_begin(Compiler *compiler);
+
+void
+compiler_stream_declare(Compiler *compiler, ast_id_t decl);
+
+// Emit the item, false if its body is still needed: it is inline or waits for a symbol
+bool
+compiler_stream_emit(Compiler *compiler, ast_id_t decl);
+
+// Compile what still waits, the entry point and the data
+void
+compiler_stream_end(Compiler *compiler);
+
+// Close and remove the output, if an error stopped the compilation half way
+void
+compiler_abort(void);
+
 #endif // COMPILER_H_
@@ -1,12 +1,38 @@
+#include "lib.h"
 #include "ast.h"
 #include "lexer.h"
 #include "common.h"
 #include "consteval.h"
 
-#include "stb_ds.h"
+consteval_value_t *
+consteval_map_get(const consteval_map_t *map, sym_id_t key)
+{
+	const i32 idx = sym_index_get(&map->index, key);
+	return idx == -1 ? NULL : &map->entries[idx].value;
+}
+
+void
+consteval_map_put(consteval_map_t *map, sym_id_t key, consteval_value_t value)
+{
+	const i32 idx = sym_index_get(&map->index, key);
+	if (idx != -1) {
+		map->entries[idx].value = value;
+		return;
+	}
+
+	sym_index_put(&map->index, key, (i32) vec_size(map->entries));
+	vec_add(map->entries, ((consteval_entry_t) { .key = key, .value = value }));
+}
+
+void
+consteval_map_free(consteval_map_t *map)
+{
+	sym_index_free(&map->index);
+	map->entries = NULL;
+}
 
 Consteval
-new_consteval(const_map_t **const_map)
+new_consteval(const consteval_map_t *const_map)
 {
 	return (Consteval) {
 		.const_map = const_map,
@@ -86,9 +112,9 @@ last_two_binop(Consteval *consteval, op_t op)
 }
 
 static void
-simulate_ast(Consteval *consteval, const ast_t *ast)
+simulate_ast(Consteval *consteval, ast_id_t ast_id)
 {
-	switch (ast->ast_kind) {
+	switch (ast_kind(ast_id)) {
 	case AST_IF:
 	case AST_DOT:
 	case AST_FUNC:
@@ -103,13 +129,13 @@ simulate_ast(Consteval *consteval, const ast_t *ast)
 		report_error("%s error: unexpected operation, "
 								 "supported operations in constant evaluation:\n"
 								 "    `dup`, `push`, `drop`, `*`, `/`, `-`, `+`, `<`, `>`, `=`, `|` or another constant literal",
-								 loc_to_str(&locid(ast->loc_id)));
+								 loc_to_str(ast_loc(ast_id)));
 	} break;
 
 	case AST_DUP: {
 		if (consteval->stack_size < 1) {
 			report_error("%s error: stack underflow bruv",
-									 loc_to_str(&locid(ast->loc_id)));
+									 loc_to_str(ast_loc(ast_id)));
 		}
 
 		consteval->stack[consteval->stack_size] = consteval->stack[consteval->stack_size - 1];
@@ -119,7 +145,7 @@ simulate_ast(Consteval *consteval, const ast_t *ast)
 	case AST_BNOT: {
 		if (consteval->stack_size < 1) {
 			report_error("%s error: stack underflow bruv",
-									 loc_to_str(&locid(ast->loc_id)));
+									 loc_to_str(ast_loc(ast_id)));
 		}
 
 		consteval->stack[consteval->stack_size - 1].value =
@@ -127,21 +153,22 @@ simulate_ast(Consteval *consteval, const ast_t *ast)
 	}
 
 	case AST_PUSH: {
+		const push_stmt_t *push_stmt = ast_push(ast_id);
 		consteval_value_t value = {
 			.value = 0,
-			.kind = ast->push_stmt.value_kind,
-			.ast_id = ast->ast_id
+			.kind = push_stmt->value_kind,
+			.ast_id = ast_id
 		};
 
-		switch (ast->push_stmt.value_kind) {
+		switch (push_stmt->value_kind) {
 		case VALUE_KIND_BYTE: TODO break;
 
 		case VALUE_KIND_INTEGER: {
-			value.value = ast->push_stmt.integer;
+			value.value = push_stmt->integer;
 		} break;
 
 		case VALUE_KIND_STRING: {
-			value.value = (i64) ast->push_stmt.str;
+			value.value = (i64) push_stmt->str;
 		} break;
 
 		case VALUE_KIND_FUNCTION_POINTER:
@@ -165,11 +192,11 @@ simulate_ast(Consteval *consteval, const ast_t *ast)
 	case AST_MUL: {
 		if (consteval->stack_size < 2) {
 			report_error("%s error: stack underflow bruv",
-									 loc_to_str(&locid(ast->loc_id)));
+									 loc_to_str(ast_loc(ast_id)));
 		}
 
 		consteval->stack[consteval->stack_size - 1].value =
-			last_two_binop(consteval, op_from_ast_kind(ast->ast_kind));
+			last_two_binop(consteval, op_from_ast_kind(ast_kind(ast_id)));
 	} break;
 
 	case AST_DROP: {
@@ -177,18 +204,14 @@ simulate_ast(Consteval *consteval, const ast_t *ast)
 	} break;
 
 	case AST_LITERAL: {
-		const i32 const_idx = shgeti(*consteval->const_map, ast->literal.str);
-		if (const_idx == -1) {
+		const consteval_value_t *const_value = consteval_map_get(consteval->const_map, ast_sym(ast_id));
+		if (const_value == NULL) {
 			report_error("%s error: undefined literal: `%s`",
-						 loc_to_str(&locid(ast->loc_id)),
-						 ast->literal.str);
+						 loc_to_str(ast_loc(ast_id)),
+						 symstr(ast_sym(ast_id)));
 		}
 
-		consteval->stack[consteval->stack_size++] = (consteval_value_t) {
-			.value = (*consteval->const_map)[const_idx].value.value,
-			.kind = (*consteval->const_map)[const_idx].value.kind,
-			.ast_id = (*consteval->const_map)[const_idx].value.ast_id
-		};
+		consteval->stack[consteval->stack_size++] = *const_value;
 	} break;
 
 	case AST_POISONED: UNREACHABLE break;
@@ -196,25 +219,27 @@ simulate_ast(Consteval *consteval, const ast_t *ast)
 }
 
 consteval_value_t
-consteval_eval(Consteval *consteval, const ast_t *const_ast, bool is_var)
+consteval_eval(Consteval *consteval, ast_id_t const_ast, bool is_var)
 {
 	consteval->stack_size = 0;
-	ast_t ast = astid(is_var ? const_ast->var_stmt.body : const_ast->const_stmt.body);
-	while (ast.next <= ASTS_SIZE) {
-		simulate_ast(consteval, &ast);
-		if (ast.next < 0) {
-			simulate_ast(consteval, &ast);
+	ast_id_t ast_id = is_var ? ast_var(const_ast)->body : ast_const(const_ast)->body;
+	loc_id_t loc = 0;
+	while (ast_id >= 0 && ast_next(ast_id) <= asts_len) {
+		loc = ast_loc(ast_id);
+		simulate_ast(consteval, ast_id);
+		if (ast_next(ast_id) < 0) {
+			simulate_ast(consteval, ast_id);
 			break;
-		} else ast = astid(ast.next);
+		} else ast_id = ast_next(ast_id);
 	}
 
 	if (consteval->stack_size < 1) {
 		report_error("%s error: stack underflow, constevaluator needs "
 								 "the last value on the stack to set it to %s's name",
-								 loc_to_str(&locid(ast.loc_id)),
+								 loc_to_str(loc),
 								 is_var ? "variable" : "constant");
 	}
 
-	consteval->stack[consteval->stack_size - 1].ast_id = const_ast->ast_id;
+	consteval->stack[consteval->stack_size - 1].ast_id = const_ast;
 	return consteval->stack[consteval->stack_size - 1];
 }
@@ -0,0 +1,14 @@
+// Copyright (c) 2022 Christoffer Lerno. All rights reserved.
+// Use of this source code is governed by the GNU LGPLv3.0 license
+// a copy of which can be found in the LICENSE file.
+
+#include "lib.h"
+
+#include <unistd.h>
+
+int cpus(void)
+{
+	long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nprocs < 1) return 1;
+	return (int)nprocs;
+}
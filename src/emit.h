@@ -0,0 +1,74 @@
+#ifndef EMIT_H_
+#define EMIT_H_
+
+#include "ast.h"
+#include "insn.h"
+#include "common.h"
+
+// Records of the body being compiled, emitted from the asts by `compiler.c` or lowered from
+// the IR by `regalloc.c`. They go through the peephole pass at the end of the body.
+void
+emit(insn_t insn);
+
+INLINE void
+emit_op0(op_t op)
+{
+	emit(insn_op0(op));
+}
+
+INLINE void
+emit_op1(op_t op, operand_t operand)
+{
+	emit(insn_op1(op, operand));
+}
+
+INLINE void
+emit_op2(op_t op, operand_t dst, operand_t src)
+{
+	emit(insn_op2(op, dst, src));
+}
+
+INLINE void
+emit_jcc(cc_t cc, label_t label)
+{
+	emit(insn_jcc(cc, label));
+}
+
+INLINE void
+emit_label(label_t label)
+{
+	emit(insn_label(label));
+}
+
+#ifdef DEBUG
+void
+emit_comment(const char *fmt, ...);
+#endif
+
+// Arguments of the externs and the syscalls, and the results of a body in its epilogue
+#define CONVENTION_REGISTERS_COUNT 6
+extern const reg_t CONVENTION_REGISTERS[CONVENTION_REGISTERS_COUNT];
+
+// A proc or func takes its arguments on the stack, it pops them and pushes its results
+void
+emit_call(const char *name);
+
+// An extern takes its arguments in `CONVENTION_REGISTERS` and returns the result in `rax`
+void
+emit_extern_call(const char *name);
+
+// Label of a new string literal, its bytes are emitted with the data
+label_t
+string_literal(const char *str);
+
+// Register `print_value` takes the value printed by `.` of the kind in
+INLINE reg_t
+print_value_reg(value_kind_t kind)
+{
+	return kind == VALUE_KIND_STRING ? REG_RDI : REG_RAX;
+}
+
+void
+print_value(value_kind_t kind);
+
+#endif // EMIT_H_
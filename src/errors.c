@@ -7,16 +7,75 @@
 
 #include <stdarg.h>
 
+// Diagnostics held back by `errors_hold` till the first error or the exit
+static bool holding = false;
+static bool dropped = false;
+static bool (*reported_elsewhere)(void) = NULL;
+static char *held = NULL;
+static size_t held_len = 0;
+static size_t held_cap = 0;
+
+static void
+held_vprintf(const char *format, va_list list)
+{
+	va_list copy;
+	va_copy(copy, list);
+	const int len = vsnprintf(NULL, 0, format, copy);
+	va_end(copy);
+	if (len <= 0) return;
+
+	if (held_len + (size_t) len + 1 > held_cap) {
+		while (held_len + (size_t) len + 1 > held_cap) held_cap = held_cap ? held_cap * 2 : 1024;
+		held = (char *) realloc(held, held_cap);
+	}
+
+	vsnprintf(held + held_len, held_cap - held_len, format, list);
+	held_len += (size_t) len;
+}
+
+// Print what is held, unless `errors_hold` was given a check that reports the error itself
+static void
+errors_release(bool error)
+{
+	if (!holding) return;
+	holding = false;
+
+	if (error && reported_elsewhere != NULL && reported_elsewhere()) dropped = true;
+	else if (held_len > 0) fwrite(held, 1, held_len, stderr);
+
+	free(held);
+	held = NULL;
+	held_len = 0;
+	held_cap = 0;
+}
+
+static void
+errors_release_at_exit(void)
+{
+	errors_release(false);
+}
+
+void
+errors_hold(bool (*reported_elsewhere_)(void))
+{
+	if (holding) return;
+	holding = true;
+	reported_elsewhere = reported_elsewhere_;
+	atexit(errors_release_at_exit);
+}
+
 void evprintf(const char *format, va_list list)
 {
-	vfprintf(stderr, format, list);
+	if (dropped) return;
+	if (holding) held_vprintf(format, list);
+	else vfprintf(stderr, format, list);
 }
 
 void eprintf(const char *format, ...)
 {
 	va_list arglist;
 	va_start(arglist, format);
-	vfprintf(stderr, format, arglist);
+	evprintf(format, arglist);
 	va_end(arglist);
 }
 
@@ -24,6 +83,9 @@ void
 report_error_noexit(const char *func, const char *file,
 							const size_t line, const char *format, ...)
 {
+	errors_release(true);
+	if (dropped) return;
+
 #ifdef DEBUG
 	eprintf("%s:%d: in %s(...)\n", file, line, func);
 #else
@@ -42,6 +104,9 @@ NORETURN void
 report_error_(const char *func, const char *file,
 							const size_t line, const char *format, ...)
 {
+	errors_release(true);
+	if (dropped) exit(EXIT_FAILURE);
+
 #ifdef DEBUG
 	eprintf("%s:%d: in %s(...)\n", file, line, func);
 #else
@@ -59,6 +124,9 @@ report_error_(const char *func, const char *file,
 
 NORETURN void error_exit(const char *format, ...)
 {
+	errors_release(true);
+	if (dropped) exit(EXIT_FAILURE);
+
 	va_list arglist;
 	va_start(arglist, format);
 	vfprintf(stderr, format, arglist);
@@ -1,7 +1,9 @@
 #include "file.h"
 #include "common.h"
+#include "vmem.h"
 
 #include <string.h>
+#include <sys/mman.h>
 
 str_t
 new_str_t(const char *src)
@@ -23,9 +25,35 @@ file_t
 new_file_t(str_t file_path)
 {
 	return (file_t) {
-		.file_id = FILES_SIZE++,
-		.file_path = file_path
+		.file_id = files_alloc(1),
+		.file_path = file_path,
+		.src = NULL,
+		.src_len = 0,
+		.base = 0,
+		.lines = NULL,
+		.lines_count = 0,
+		.lines_cap = 0,
+		.dev = 0,
+		.ino = 0,
+		.lexed = false,
+		.cache = NULL,
+		.cache_len = 0
 	};
 }
 
+void
+files_release(void)
+{
+	for (file_id_t i = 0; i < files_len; ++i) {
+		if (fileid(i).cache != NULL) {
+			munmap(fileid(i).cache, fileid(i).cache_len);
+			fileid(i).cache = NULL;
+		}
+
+		if (fileid(i).src == NULL) continue;
+		munmap(fileid(i).src, fileid(i).src_len + 1);
+		fileid(i).src = NULL;
+	}
+}
+
 DECLARE_STATIC(file, FILE);
@@ -3,6 +3,8 @@
 
 #include "common.h"
 
+#include <stdbool.h>
+
 typedef struct {
 	u32 len;
 	char buf[124];
@@ -16,14 +18,44 @@ typedef u32 file_id_t;
 typedef struct {
 	file_id_t file_id;
 	str_t file_path;
+
+	// Source text, mapped privately for the whole compilation.
+	// `src[src_len]` is always a readable '\0'.
+	char *src;
+	size_t src_len;
+
+	// Offset of the first byte of the file among the sources of all the files,
+	// a location of a token is `base` + its offset in the file.
+	u32 base;
+
+	// Offsets of the starts of lines after the first one, appended by the lexer,
+	// so the row and column of a location are only computed when reported.
+	// The range is reserved by `new_lexer` for a line per byte of the source.
+	u32 *lines;
+	u32 lines_count;
+	u32 lines_cap;
+
+	// Identity of the file on disk, the same file reached by different paths is read once.
+	u64 dev;
+	u64 ino;
+
+	// Set once the file got lexed, including it again is a no-op.
+	bool lexed;
+
+	// Tokens of the file loaded from the cache, their strings point into this mapping.
+	void *cache;
+	size_t cache_len;
 } file_t;
 
 file_t
 new_file_t(str_t file_path);
 
-#define FILES_CAP 1024
-extern file_id_t FILES_SIZE;
-extern file_t FILES[FILES_CAP];
+// Unmap sources and cached tokens of all the files
+void
+files_release(void);
+
+#define FILES_ARENA_MB 64
+DECLARE_STATIC_EXTERN(file, FILE);
 
 #define fileid(id) (FILES[id])
 #define files_len (FILES_SIZE)
@@ -0,0 +1,303 @@
+#include "insn.h"
+#include "common.h"
+#include "compiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INSN_NAME_MAX 64
+#define INSN_BYTES_INIT_CAP 4096
+
+static const char *OP_NAMES[OP_COUNT] = {
+	[OP_MOV]     = "mov",
+	[OP_MOVZX]   = "movzx",
+	[OP_MOVSXD]  = "movsxd",
+	[OP_LEA]     = "lea",
+	[OP_ADD]     = "add",
+	[OP_OR]      = "or",
+	[OP_AND]     = "and",
+	[OP_SUB]     = "sub",
+	[OP_XOR]     = "xor",
+	[OP_CMP]     = "cmp",
+	[OP_TEST]    = "test",
+	[OP_IMUL]    = "imul",
+	[OP_NOT]     = "not",
+	[OP_DIV]     = "div",
+	[OP_IDIV]    = "idiv",
+	[OP_INC]     = "inc",
+	[OP_DEC]     = "dec",
+	[OP_PUSH]    = "push",
+	[OP_POP]     = "pop",
+	[OP_CALL]    = "call",
+	[OP_JMP]     = "jmp",
+	[OP_JCC]     = "j",
+	[OP_SETCC]   = "set",
+	[OP_ENTER]   = "enter",
+	[OP_LEAVE]   = "leave",
+	[OP_RET]     = "ret",
+	[OP_SYSCALL] = "syscall",
+	[OP_CDQE]    = "cdqe",
+	[OP_CQO]     = "cqo",
+};
+
+static const char *CONDITION_NAMES[16] = {
+	[CC_B] = "b", [CC_AE] = "ae", [CC_E]  = "e",  [CC_NE] = "ne", [CC_BE] = "be",
+	[CC_A] = "a", [CC_L]  = "l",  [CC_GE] = "ge", [CC_LE] = "le", [CC_G]  = "g",
+};
+
+static const char *REGISTER_NAMES[4][REG_COUNT] = {
+	{ "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+	  "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" },
+	{ "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+	  "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" },
+	{ "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+	  "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" },
+	{ "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	  "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" },
+};
+
+static const char *LABEL_FORMATS[LABEL_KIND_COUNT] = {
+	[LABEL_STR]   = "__str_%u__",
+	[LABEL_ELSE]  = "._else_%u",
+	[LABEL_EDON]  = "._edon_%u",
+	[LABEL_WHILE] = "._while_%u",
+	[LABEL_WDON]  = "._wdon_%u",
+};
+
+const char *
+op_name(op_t op)
+{
+	return OP_NAMES[op];
+}
+
+const char *
+label_name(label_t label, char *buf, size_t len)
+{
+	switch ((label_kind_t) label.kind) {
+	case LABEL_NAME: return label.name;
+	case LABEL_FUNC: snprintf(buf, len, "__%s__", label.name); break;
+	case LABEL_STR:
+	case LABEL_ELSE:
+	case LABEL_EDON:
+	case LABEL_WHILE:
+	case LABEL_WDON: snprintf(buf, len, LABEL_FORMATS[label.kind], label.number); break;
+	case LABEL_NONE:
+	case LABEL_KIND_COUNT: UNREACHABLE; break;
+	}
+	return buf;
+}
+
+INLINE const char *
+register_name(u8 reg, u8 size)
+{
+	switch (size) {
+	case 1: return REGISTER_NAMES[0][reg];
+	case 2: return REGISTER_NAMES[1][reg];
+	case 4: return REGISTER_NAMES[2][reg];
+	default: return REGISTER_NAMES[3][reg];
+	}
+}
+
+// Numbers past the 32-bit ones are printed the way they are stored
+static void
+print_number(FILE *stream, i64 value)
+{
+	if (value >= INT32_MIN && value <= INT32_MAX) fprintf(stream, "%ld", value);
+	else fprintf(stream, "0x%lX", (u64) value);
+}
+
+static void
+print_operand(FILE *stream, const operand_t *operand)
+{
+	char name[INSN_NAME_MAX];
+	switch ((operand_kind_t) operand->kind) {
+	case OPERAND_REG: fputs(register_name(operand->reg, operand->size), stream); break;
+
+	case OPERAND_IMM: {
+		if (operand->label.kind == LABEL_NONE) {
+			print_number(stream, operand->value);
+			break;
+		}
+
+		fputs(label_name(operand->label, name, sizeof(name)), stream);
+		if (operand->value != 0) fprintf(stream, " + %ld", operand->value);
+	} break;
+
+	case OPERAND_MEM: {
+		static const char *SIZES[9] = { [1] = "byte ", [2] = "word ", [4] = "dword ", [8] = "qword " };
+		if (operand->size != 0) fputs(SIZES[operand->size], stream);
+
+		fputc('[', stream);
+		bool first = true;
+		if (operand->label.kind != LABEL_NONE) {
+			fputs(label_name(operand->label, name, sizeof(name)), stream);
+			first = false;
+		}
+		if (operand->reg != REG_NONE) {
+			fputs(REGISTER_NAMES[3][operand->reg], stream);
+			first = false;
+		}
+		if (operand->index != REG_NONE) {
+			fprintf(stream, first ? "%s" : " + %s", REGISTER_NAMES[3][operand->index]);
+			if (operand->scale > 1) fprintf(stream, "*%u", operand->scale);
+			first = false;
+		}
+		if (first) fprintf(stream, "%ld", operand->value);
+		else if (operand->value > 0) fprintf(stream, " + %ld", operand->value);
+		else if (operand->value < 0) fprintf(stream, " - %lu", 0 - (u64) operand->value);
+		fputc(']', stream);
+	} break;
+
+	case OPERAND_NONE: UNREACHABLE; break;
+	}
+}
+
+// Bytes between the quotes, the others as numbers
+static void
+print_bytes(FILE *stream, const char *bytes, u32 len)
+{
+	bool quoted = false;
+	for (u32 i = 0; i < len; ++i) {
+		const char c = bytes[i];
+		const bool printable = c >= ' ' && c <= '~' && c != '"';
+		if (printable && !quoted) fputs(i > 0 ? ", \"" : "\"", stream);
+		else if (!printable && quoted) fputc('"', stream);
+
+		if (printable) fputc(c, stream);
+		else fprintf(stream, i > 0 ? ", 0x%X" : "0x%X", (u8) c);
+		quoted = printable;
+	}
+	if (quoted) fputc('"', stream);
+}
+
+void
+insn_print(FILE *stream, const insn_t *insn)
+{
+	static const char *SECTIONS[3] = {
+		[SECTION_TEXT] = SECTION_TEXT_EXECUTABLE,
+		[SECTION_DATA] = SECTION_DATA_WRITEABLE,
+		[SECTION_BSS]  = SECTION_BSS_WRITEABLE,
+	};
+
+	char name[INSN_NAME_MAX];
+	const char *label = insn->operands[0].kind == OPERAND_IMM && insn->operands[0].label.kind != LABEL_NONE
+		? label_name(insn->operands[0].label, name, sizeof(name))
+		: NULL;
+
+	switch ((insn_kind_t) insn->kind) {
+	case INSN_OP: {
+		fputc('\t', stream);
+		fputs(OP_NAMES[insn->op], stream);
+		if (insn->op == OP_JCC || insn->op == OP_SETCC) fputs(CONDITION_NAMES[insn->cc], stream);
+
+		const u32 count = insn_operands_count(insn);
+		for (u32 i = 0; i < count; ++i) {
+			fputs(i == 0 ? " " : ", ", stream);
+			print_operand(stream, &insn->operands[i]);
+		}
+	} break;
+
+	case INSN_LABEL:   fprintf(stream, "%s:", label); break;
+	case INSN_COMMENT: fprintf(stream, "; %.*s", insn->text_len, insn->text); break;
+	case INSN_SECTION: fputs(SECTIONS[insn->op], stream); break;
+	case INSN_GLOBAL:  fprintf(stream, GLOBAL " %s", label); break;
+	case INSN_EXTERN:  fprintf(stream, EXTERN " %s", label); break;
+
+	case INSN_BYTES: {
+		fprintf(stream, "%s db ", label);
+		print_bytes(stream, insn->text, insn->text_len);
+	} break;
+
+	case INSN_QUAD: {
+		fprintf(stream, "%s dq ", label);
+		print_operand(stream, &insn->operands[1]);
+	} break;
+
+	case INSN_RESERVE: fprintf(stream, "%s " RESERVE_QUAD_WORD " %ld", label, insn->operands[1].value); break;
+	}
+
+	fputc('\n', stream);
+}
+
+static void
+bytes_append(insn_bytes_t *out, const void *data, size_t len)
+{
+	if (out->len + len > out->cap) {
+		while (out->len + len > out->cap) out->cap = out->cap ? out->cap * 2 : INSN_BYTES_INIT_CAP;
+		out->bytes = (u8 *) realloc(out->bytes, out->cap);
+	}
+	memcpy(out->bytes + out->len, data, len);
+	out->len += len;
+}
+
+INLINE bool
+label_has_name(const label_t *label)
+{
+	return label->kind == LABEL_NAME || label->kind == LABEL_FUNC;
+}
+
+// kind, op, cc, count of the operands, `text_len`, then per operand kind, size, reg, index,
+// scale, kind of the label, its number and the value. The names of the labels with their
+// terminating zeros and the text come last.
+void
+insn_serialize(insn_bytes_t *out, const insn_t *insn)
+{
+	const u32 count = insn_operands_count(insn);
+	const u8 head[4] = { insn->kind, insn->op, insn->cc, (u8) count };
+	bytes_append(out, head, sizeof(head));
+	bytes_append(out, &insn->text_len, sizeof(insn->text_len));
+
+	for (u32 i = 0; i < count; ++i) {
+		const operand_t *operand = &insn->operands[i];
+		const u8 fields[6] = {
+			operand->kind, operand->size, operand->reg, operand->index, operand->scale, operand->label.kind
+		};
+		bytes_append(out, fields, sizeof(fields));
+		bytes_append(out, &operand->label.number, sizeof(operand->label.number));
+		bytes_append(out, &operand->value, sizeof(operand->value));
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		const label_t *label = &insn->operands[i].label;
+		if (label_has_name(label)) bytes_append(out, label->name, strlen(label->name) + 1);
+	}
+
+	if (insn->text_len > 0) bytes_append(out, insn->text, insn->text_len);
+}
+
+const u8 *
+insn_deserialize(const u8 *c, insn_t *insn)
+{
+	*insn = (insn_t) { .kind = c[0], .op = c[1], .cc = c[2] };
+	const u32 count = c[3];
+	c += 4;
+	memcpy(&insn->text_len, c, sizeof(insn->text_len));
+	c += sizeof(insn->text_len);
+
+	for (u32 i = 0; i < count; ++i) {
+		operand_t *operand = &insn->operands[i];
+		*operand = (operand_t) {
+			.kind = c[0], .size = c[1], .reg = c[2], .index = c[3], .scale = c[4], .label = { .kind = c[5] }
+		};
+		c += 6;
+		memcpy(&operand->label.number, c, sizeof(operand->label.number));
+		c += sizeof(operand->label.number);
+		memcpy(&operand->value, c, sizeof(operand->value));
+		c += sizeof(operand->value);
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		label_t *label = &insn->operands[i].label;
+		if (!label_has_name(label)) continue;
+		label->name = (const char *) c;
+		c += strlen(label->name) + 1;
+	}
+
+	if (insn->text_len > 0) {
+		insn->text = (const char *) c;
+		c += insn->text_len;
+	}
+
+	return c;
+}
@@ -0,0 +1,340 @@
+#ifndef INSN_H_
+#define INSN_H_
+
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Instructions and data are emitted as records, the peephole pass rewrites them and the
+// assembler encodes them. The text of fasm or nasm is printed from them for `--asm`.
+
+#define INSN_OPERANDS_MAX 2
+
+// Registers as they are numbered in the encoding
+typedef enum {
+	REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+	REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+	REG_COUNT,
+} reg_t;
+
+#define REG_NONE 0xFF
+
+typedef enum {
+	OP_MOV,
+	OP_MOVZX,
+	OP_MOVSXD,
+	OP_LEA,
+	OP_ADD,
+	OP_OR,
+	OP_AND,
+	OP_SUB,
+	OP_XOR,
+	OP_CMP,
+	OP_TEST,
+	OP_IMUL,
+	OP_NOT,
+	OP_DIV,
+	OP_IDIV,
+	OP_INC,
+	OP_DEC,
+	OP_PUSH,
+	OP_POP,
+	OP_CALL,
+	OP_JMP,
+	// `j<cc>` and `set<cc>`, the condition is `cc` of the record
+	OP_JCC,
+	OP_SETCC,
+	OP_ENTER,
+	OP_LEAVE,
+	OP_RET,
+	OP_SYSCALL,
+	OP_CDQE,
+	OP_CQO,
+	OP_COUNT,
+} op_t;
+
+// Conditions as they are encoded, the negation of one flips the lowest bit
+typedef enum {
+	CC_B  = 0x2,
+	CC_AE = 0x3,
+	CC_E  = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A  = 0x7,
+	CC_L  = 0xC,
+	CC_GE = 0xD,
+	CC_LE = 0xE,
+	CC_G  = 0xF,
+} cc_t;
+
+#define CC_NEGATE(cc) ((cc_t) ((cc) ^ 1))
+
+typedef enum {
+	LABEL_NONE,
+	// `name` as it is, the ones starting with `.` are local to the label before
+	LABEL_NAME,
+	// `__name__` of a proc or func
+	LABEL_FUNC,
+	// The numbered ones, `__str_N__`, `._else_N`, `._edon_N`, `._while_N` and `._wdon_N`
+	LABEL_STR,
+	LABEL_ELSE,
+	LABEL_EDON,
+	LABEL_WHILE,
+	LABEL_WDON,
+	LABEL_KIND_COUNT,
+} label_kind_t;
+
+typedef struct {
+	u8 kind;
+	u32 number;
+	const char *name;
+} label_t;
+
+typedef enum {
+	OPERAND_NONE,
+	OPERAND_REG,
+	// `value`, plus the address of `label` if there is one
+	OPERAND_IMM,
+	// `[reg + index * scale + value]`, or `[label + value]`
+	OPERAND_MEM,
+} operand_kind_t;
+
+// `size` is the one of the register, or the one memory is accessed with, 0 if it is
+// left to the other operand
+typedef struct {
+	u8 kind;
+	u8 size;
+	u8 reg;
+	u8 index;
+	u8 scale;
+	label_t label;
+	i64 value;
+} operand_t;
+
+typedef enum {
+	INSN_OP,
+	INSN_LABEL,
+	// Skipped by the peephole pass, only printed
+	INSN_COMMENT,
+	// `op` is the section of these
+	INSN_SECTION,
+	INSN_GLOBAL,
+	INSN_EXTERN,
+	// Labelled data: `text_len` bytes, a quad word of the immediate, or the quad words reserved
+	INSN_BYTES,
+	INSN_QUAD,
+	INSN_RESERVE,
+} insn_kind_t;
+
+typedef enum {
+	SECTION_TEXT,
+	SECTION_DATA,
+	SECTION_BSS,
+} section_t;
+
+// An instruction takes `operands` till the first `OPERAND_NONE`. A label, global or extern,
+// and the label of data are the first operand, the value of data the second one.
+typedef struct {
+	u8 kind;
+	u8 op;
+	u8 cc;
+	bool dead;
+	u32 text_len;
+	const char *text;
+	operand_t operands[INSN_OPERANDS_MAX];
+} insn_t;
+
+INLINE label_t
+label_named(const char *name)
+{
+	return (label_t) { .kind = LABEL_NAME, .name = name };
+}
+
+INLINE label_t
+label_func(const char *name)
+{
+	return (label_t) { .kind = LABEL_FUNC, .name = name };
+}
+
+INLINE label_t
+label_numbered(label_kind_t kind, size_t number)
+{
+	return (label_t) { .kind = (u8) kind, .number = (u32) number };
+}
+
+INLINE operand_t
+operand_reg_sized(reg_t reg, u8 size)
+{
+	return (operand_t) { .kind = OPERAND_REG, .size = size, .reg = (u8) reg, .index = REG_NONE };
+}
+
+INLINE operand_t
+operand_reg(reg_t reg)
+{
+	return operand_reg_sized(reg, 8);
+}
+
+INLINE operand_t
+operand_imm(i64 value)
+{
+	return (operand_t) { .kind = OPERAND_IMM, .reg = REG_NONE, .index = REG_NONE, .value = value };
+}
+
+INLINE operand_t
+operand_address(label_t label)
+{
+	return (operand_t) { .kind = OPERAND_IMM, .reg = REG_NONE, .index = REG_NONE, .label = label };
+}
+
+INLINE operand_t
+operand_mem_index(u8 size, reg_t base, u8 index, i64 disp)
+{
+	return (operand_t) {
+		.kind = OPERAND_MEM,
+		.size = size,
+		.reg = (u8) base,
+		.index = index,
+		.scale = 1,
+		.value = disp
+	};
+}
+
+INLINE operand_t
+operand_mem(u8 size, reg_t base, i64 disp)
+{
+	return operand_mem_index(size, base, REG_NONE, disp);
+}
+
+INLINE operand_t
+operand_mem_label(u8 size, label_t label)
+{
+	return (operand_t) { .kind = OPERAND_MEM, .size = size, .reg = REG_NONE, .index = REG_NONE, .label = label };
+}
+
+INLINE insn_t
+insn_op2(op_t op, operand_t dst, operand_t src)
+{
+	return (insn_t) { .kind = INSN_OP, .op = (u8) op, .operands = { dst, src } };
+}
+
+INLINE insn_t
+insn_op1(op_t op, operand_t operand)
+{
+	return (insn_t) { .kind = INSN_OP, .op = (u8) op, .operands = { operand } };
+}
+
+INLINE insn_t
+insn_op0(op_t op)
+{
+	return (insn_t) { .kind = INSN_OP, .op = (u8) op };
+}
+
+INLINE insn_t
+insn_jcc(cc_t cc, label_t label)
+{
+	return (insn_t) { .kind = INSN_OP, .op = OP_JCC, .cc = (u8) cc, .operands = { operand_address(label) } };
+}
+
+INLINE insn_t
+insn_setcc(cc_t cc, operand_t dst)
+{
+	return (insn_t) { .kind = INSN_OP, .op = OP_SETCC, .cc = (u8) cc, .operands = { dst } };
+}
+
+INLINE insn_t
+insn_label(label_t label)
+{
+	return (insn_t) { .kind = INSN_LABEL, .operands = { operand_address(label) } };
+}
+
+INLINE insn_t
+insn_section(section_t section)
+{
+	return (insn_t) { .kind = INSN_SECTION, .op = (u8) section };
+}
+
+// A global, an extern, a quad word of `value` or `value` quad words reserved at the label
+INLINE insn_t
+insn_data(insn_kind_t kind, label_t label, i64 value)
+{
+	return (insn_t) { .kind = (u8) kind, .operands = { operand_address(label), operand_imm(value) } };
+}
+
+INLINE insn_t
+insn_bytes(label_t label, const char *bytes, u32 len)
+{
+	return (insn_t) { .kind = INSN_BYTES, .text = bytes, .text_len = len, .operands = { operand_address(label) } };
+}
+
+INLINE u32
+insn_operands_count(const insn_t *insn)
+{
+	u32 count = 0;
+	while (count < INSN_OPERANDS_MAX && insn->operands[count].kind != OPERAND_NONE) count++;
+	return count;
+}
+
+INLINE bool
+label_eq(label_t a, label_t b)
+{
+	if (a.kind != b.kind) return false;
+	if (a.kind == LABEL_NAME || a.kind == LABEL_FUNC) return 0 == strcmp(a.name, b.name);
+	return a.number == b.number;
+}
+
+INLINE bool
+operand_eq(const operand_t *a, const operand_t *b)
+{
+	return a->kind == b->kind
+		&& a->size == b->size
+		&& a->reg == b->reg
+		&& a->index == b->index
+		&& a->scale == b->scale
+		&& a->value == b->value
+		&& label_eq(a->label, b->label);
+}
+
+INLINE bool
+operand_is_reg(const operand_t *operand, reg_t reg)
+{
+	return operand->kind == OPERAND_REG && operand->size == 8 && operand->reg == reg;
+}
+
+// The register is read by the operand: the register itself, or a register of the address
+INLINE bool
+operand_uses(const operand_t *operand, reg_t reg)
+{
+	if (operand->kind == OPERAND_REG) return operand->reg == reg;
+	if (operand->kind == OPERAND_MEM) return operand->reg == reg || operand->index == reg;
+	return false;
+}
+
+// Records written one after another, the way the func cache keeps them
+typedef struct {
+	u8 *bytes;
+	size_t len;
+	size_t cap;
+} insn_bytes_t;
+
+const char *
+op_name(op_t op);
+
+// Name of the label as it is printed, into `buf` of `len` bytes if it is numbered
+const char *
+label_name(label_t label, char *buf, size_t len);
+
+// Print the record as a line of fasm or nasm
+void
+insn_print(FILE *stream, const insn_t *insn);
+
+// Write the fields of the record, the names and the text follow it
+void
+insn_serialize(insn_bytes_t *out, const insn_t *insn);
+
+// Read the record at `c`, its names and text point into the bytes. Returns the end of it.
+const u8 *
+insn_deserialize(const u8 *c, insn_t *insn);
+
+#endif // INSN_H_
@@ -0,0 +1,525 @@
+#include "lib.h"
+#include "ir.h"
+#include "ast.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define IR_INSTR_STR_CAP 256
+
+static const char *IR_OP_NAMES[IR_OP_COUNT] = {
+	[IR_NOP]           = "nop",
+	[IR_PHI]           = "phi",
+	[IR_CONST]         = "const",
+	[IR_STRING]        = "string",
+	[IR_ADDRESS]       = "address",
+	[IR_ARG]           = "arg",
+	[IR_LOAD]          = "load",
+	[IR_STORE]         = "store",
+	[IR_PICK]          = "pick",
+	[IR_ADD]           = "add",
+	[IR_SUB]           = "sub",
+	[IR_MUL]           = "mul",
+	[IR_DIV]           = "div",
+	[IR_MOD]           = "mod",
+	[IR_OR]            = "or",
+	[IR_NOT]           = "not",
+	[IR_INDEX]         = "index",
+	[IR_EQUAL]         = "equal",
+	[IR_LESS]          = "less",
+	[IR_GREATER]       = "greater",
+	[IR_GREATER_EQUAL] = "greater_equal",
+	[IR_LESS_EQUAL]    = "less_equal",
+	[IR_DROP]          = "drop",
+	[IR_PRINT]         = "print",
+	[IR_SYSCALL]       = "syscall",
+	[IR_CALL]          = "call",
+	[IR_CALL_EXTERN]   = "call_extern",
+	[IR_COLLAPSE]      = "collapse",
+	[IR_JUMP]          = "jump",
+	[IR_BRANCH]        = "branch",
+	[IR_RETURN]        = "return",
+};
+
+static size_t phis_removed = 0;
+static size_t consts_folded = 0;
+static size_t values_dropped = 0;
+
+// Per value scratch of the passes
+static u32 *scratch = NULL;
+static u32 scratch_cap = 0;
+
+// Grow `items` to fit `len + count` of them
+static void *
+grow(void *items, u32 *cap, u32 len, u32 count, size_t size)
+{
+	if (len + count <= *cap) return items;
+	while (len + count > *cap) *cap = *cap ? *cap * 2 : IR_INIT_CAP;
+	return realloc(items, size * *cap);
+}
+
+static u32 *
+scratch_values(const ir_func_t *ir)
+{
+	scratch = (u32 *) grow(scratch, &scratch_cap, 0, ir->values_len, sizeof(u32));
+	return scratch;
+}
+
+void
+ir_reset(ir_func_t *ir)
+{
+	ir->instrs_len = 0;
+	ir->blocks_len = 0;
+	ir->operands_len = 0;
+	ir->stacks_len = 0;
+	ir->values_len = 0;
+	ir->ifs = 0;
+	ir->whiles = 0;
+}
+
+void
+ir_free(ir_func_t *ir)
+{
+	free(ir->instrs);
+	free(ir->blocks);
+	free(ir->operands);
+	free(ir->stacks);
+	free(ir->defs);
+	*ir = (ir_func_t) {0};
+
+	free(scratch);
+	scratch = NULL;
+	scratch_cap = 0;
+}
+
+u32
+ir_block_begin(ir_func_t *ir, u8 label, u32 label_number, const ir_value_t *stack, u32 stack_len)
+{
+	ir->blocks = (ir_block_t *) grow(ir->blocks, &ir->blocks_cap, ir->blocks_len, 1, sizeof(ir_block_t));
+	ir->stacks = (ir_value_t *) grow(ir->stacks, &ir->stacks_cap, ir->stacks_len, stack_len, sizeof(ir_value_t));
+
+	if (stack_len > 0) memcpy(ir->stacks + ir->stacks_len, stack, sizeof(ir_value_t) * stack_len);
+
+	ir->blocks[ir->blocks_len] = (ir_block_t) {
+		.first = ir->instrs_len,
+		.end = ir->instrs_len,
+		.stack = ir->stacks_len,
+		.stack_len = stack_len,
+		.label = label,
+		.label_number = label_number,
+	};
+
+	ir->stacks_len += stack_len;
+	return ir->blocks_len++;
+}
+
+void
+ir_block_add_pred(ir_func_t *ir, u32 block, u32 pred)
+{
+	ir_block_t *b = &ir->blocks[block];
+	if (b->preds_count == IR_PREDS_MAX) UNREACHABLE;
+	b->preds[b->preds_count++] = pred;
+}
+
+// Operands out of the pool, where the ones of a rewritten instruction go too
+static u32
+alloc_operands(ir_func_t *ir, const ir_value_t *operands, u32 count)
+{
+	ir->operands = (ir_value_t *) grow(ir->operands, &ir->operands_cap, ir->operands_len, count, sizeof(ir_value_t));
+	if (count > 0) memcpy(ir->operands + ir->operands_len, operands, sizeof(ir_value_t) * count);
+
+	const u32 start = ir->operands_len;
+	ir->operands_len += count;
+	return start;
+}
+
+ir_instr_t *
+ir_append(ir_func_t *ir, ir_op_t op, const ir_value_t *operands, u32 operands_count, u8 results_count)
+{
+	ir->instrs = (ir_instr_t *) grow(ir->instrs, &ir->instrs_cap, ir->instrs_len, 1, sizeof(ir_instr_t));
+	ir->defs = (u32 *) grow(ir->defs, &ir->values_cap, ir->values_len, results_count, sizeof(u32));
+
+	const u32 idx = ir->instrs_len++;
+	for (u8 i = 0; i < results_count; ++i) ir->defs[ir->values_len + i] = idx;
+
+	ir->instrs[idx] = (ir_instr_t) {
+		.op = (u8) op,
+		.results_count = results_count,
+		.operands = alloc_operands(ir, operands, operands_count),
+		.operands_count = operands_count,
+		.result = results_count > 0 ? ir->values_len : IR_NONE,
+		.targets = { IR_NONE, IR_NONE },
+	};
+
+	ir->values_len += results_count;
+	ir->blocks[ir->blocks_len - 1].end = ir->instrs_len;
+	return &ir->instrs[idx];
+}
+
+/* ------------------------------------------------------- */
+/* Passes                                                  */
+/* ------------------------------------------------------- */
+
+INLINE ir_value_t
+find(const u32 *repl, ir_value_t value)
+{
+	while (repl[value] != value) value = repl[value];
+	return value;
+}
+
+void
+ir_remove_trivial_phis(ir_func_t *ir)
+{
+	u32 *repl = scratch_values(ir);
+	for (ir_value_t v = 0; v < ir->values_len; ++v) repl[v] = v;
+
+	bool changed = true, removed = false;
+	while (changed) {
+		changed = false;
+		for (u32 i = 0; i < ir->instrs_len; ++i) {
+			ir_instr_t *instr = &ir->instrs[i];
+			if (instr->op != IR_PHI) continue;
+
+			ir_value_t same = IR_NONE;
+			bool trivial = true;
+			for (u32 j = 0; j < instr->operands_count && trivial; ++j) {
+				const ir_value_t operand = find(repl, ir_operands(ir, instr)[j]);
+				if (operand == instr->result || operand == same) continue;
+				if (same != IR_NONE) trivial = false;
+				same = operand;
+			}
+
+			if (!trivial || same == IR_NONE) continue;
+
+			repl[instr->result] = same;
+			instr->op = IR_NOP;
+			phis_removed++;
+			changed = removed = true;
+		}
+	}
+
+	if (!removed) return;
+
+	for (u32 i = 0; i < ir->operands_len; ++i) ir->operands[i] = find(repl, ir->operands[i]);
+	for (u32 i = 0; i < ir->stacks_len; ++i) ir->stacks[i] = find(repl, ir->stacks[i]);
+}
+
+// Uses of every value, a value on the stack at the start of a block is used by it
+static u32 *
+count_uses(const ir_func_t *ir)
+{
+	u32 *uses = scratch_values(ir);
+	memset(uses, 0, sizeof(u32) * ir->values_len);
+
+	for (u32 i = 0; i < ir->instrs_len; ++i) {
+		const ir_instr_t *instr = &ir->instrs[i];
+		if (instr->op == IR_NOP) continue;
+		for (u32 j = 0; j < instr->operands_count; ++j) uses[ir_operands(ir, instr)[j]]++;
+	}
+
+	for (u32 i = 0; i < ir->stacks_len; ++i) uses[ir->stacks[i]]++;
+	return uses;
+}
+
+INLINE bool
+is_const(const ir_func_t *ir, const u32 *uses, ir_value_t value)
+{
+	return ir_def(ir, value)->op == IR_CONST && uses[value] == 1;
+}
+
+// What the emitted instructions compute, the division is unsigned
+static bool
+fold(ir_op_t op, i64 a, i64 b, i64 *result)
+{
+	const u64 ua = (u64) a, ub = (u64) b;
+	switch (op) {
+	case IR_ADD:           *result = (i64) (ua + ub); return true;
+	case IR_SUB:           *result = (i64) (ua - ub); return true;
+	case IR_MUL:           *result = (i64) (ua * ub); return true;
+	case IR_OR:            *result = a | b; return true;
+	case IR_EQUAL:         *result = a == b; return true;
+	case IR_LESS:          *result = ua < ub; return true;
+	case IR_GREATER:       *result = a > b; return true;
+	case IR_GREATER_EQUAL: *result = a >= b; return true;
+	case IR_LESS_EQUAL:    *result = a <= b; return true;
+
+	case IR_DIV: {
+		if (ub == 0) return false;
+		*result = (i64) (ua / ub);
+	} return true;
+
+	case IR_MOD: {
+		if (ub == 0) return false;
+		*result = (i64) (ua % ub);
+	} return true;
+
+	case IR_NOP:
+	case IR_PHI:
+	case IR_CONST:
+	case IR_STRING:
+	case IR_ADDRESS:
+	case IR_ARG:
+	case IR_LOAD:
+	case IR_STORE:
+	case IR_PICK:
+	case IR_NOT:
+	case IR_INDEX:
+	case IR_DROP:
+	case IR_PRINT:
+	case IR_SYSCALL:
+	case IR_CALL:
+	case IR_CALL_EXTERN:
+	case IR_COLLAPSE:
+	case IR_JUMP:
+	case IR_BRANCH:
+	case IR_RETURN:
+	case IR_OP_COUNT: return false;
+	}
+
+	return false;
+}
+
+INLINE void
+make_const(ir_instr_t *instr, i64 value)
+{
+	instr->op = IR_CONST;
+	instr->operands_count = 0;
+	instr->imm = value;
+}
+
+// An op of consts used by nothing else is replaced with the const it computes, and
+// a copy of a const with the const. The consts are pushed where the op was.
+static bool
+fold_constants(ir_func_t *ir)
+{
+	bool changed = false;
+	u32 *uses = count_uses(ir);
+
+	for (u32 i = 0; i < ir->instrs_len; ++i) {
+		ir_instr_t *instr = &ir->instrs[i];
+		const ir_value_t *operands = ir_operands(ir, instr);
+
+		if (instr->op == IR_PICK && ir_def(ir, operands[0])->op == IR_CONST) {
+			uses[operands[0]]--;
+			make_const(instr, ir_def(ir, operands[0])->imm);
+		} else if (instr->op == IR_NOT && is_const(ir, uses, operands[0])) {
+			ir_instr_t *def = ir_def(ir, operands[0]);
+			uses[operands[0]]--;
+			def->op = IR_NOP;
+			make_const(instr, ~def->imm);
+		} else if (instr->operands_count == 2
+						&& instr->results_count == 1
+						&& is_const(ir, uses, operands[0])
+						&& is_const(ir, uses, operands[1]))
+		{
+			ir_instr_t *a = ir_def(ir, operands[0]);
+			ir_instr_t *b = ir_def(ir, operands[1]);
+			i64 value = 0;
+			if (!fold((ir_op_t) instr->op, a->imm, b->imm, &value)) continue;
+
+			uses[operands[0]]--;
+			uses[operands[1]]--;
+			a->op = IR_NOP;
+			b->op = IR_NOP;
+			make_const(instr, value);
+		} else {
+			continue;
+		}
+
+		consts_folded++;
+		changed = true;
+	}
+
+	return changed;
+}
+
+// Pure ops, the ones that can't fault
+static bool
+is_pure(ir_op_t op)
+{
+	switch (op) {
+	case IR_CONST:
+	case IR_STRING:
+	case IR_ADDRESS:
+	case IR_ARG:
+	case IR_LOAD:
+	case IR_PICK:
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+	case IR_OR:
+	case IR_NOT:
+	case IR_EQUAL:
+	case IR_LESS:
+	case IR_GREATER:
+	case IR_GREATER_EQUAL:
+	case IR_LESS_EQUAL: return true;
+
+	case IR_NOP:
+	case IR_PHI:
+	case IR_STORE:
+	case IR_DIV:
+	case IR_MOD:
+	case IR_INDEX:
+	case IR_DROP:
+	case IR_PRINT:
+	case IR_SYSCALL:
+	case IR_CALL:
+	case IR_CALL_EXTERN:
+	case IR_COLLAPSE:
+	case IR_JUMP:
+	case IR_BRANCH:
+	case IR_RETURN:
+	case IR_OP_COUNT: return false;
+	}
+
+	return false;
+}
+
+// A pure value only dropped is not computed, what it is computed from is dropped instead.
+// A drop is translated with one operand, so the ones it gets this way fit.
+static bool
+remove_dropped(ir_func_t *ir)
+{
+	bool changed = false;
+	u32 *uses = count_uses(ir);
+	ir_value_t dropped[IR_INIT_CAP];
+
+	for (u32 i = 0; i < ir->instrs_len; ++i) {
+		if (ir->instrs[i].op != IR_DROP) continue;
+
+		const ir_instr_t *drop = &ir->instrs[i];
+		u32 count = 0;
+		bool removed = false;
+		for (u32 j = 0; j < drop->operands_count; ++j) {
+			const ir_value_t operand = ir_operands(ir, drop)[j];
+			ir_instr_t *def = ir_def(ir, operand);
+			const u32 left = drop->operands_count - j - 1;
+
+			if (uses[operand] != 1
+			|| !is_pure((ir_op_t) def->op)
+			|| count + def->operands_count + left > IR_INIT_CAP)
+			{
+				dropped[count++] = operand;
+				continue;
+			}
+
+			// The operand of a pick stays where it is
+			if (def->op == IR_PICK) {
+				uses[ir_operands(ir, def)[0]]--;
+			} else {
+				memcpy(dropped + count, ir_operands(ir, def), sizeof(ir_value_t) * def->operands_count);
+				count += def->operands_count;
+			}
+
+			uses[operand] = 0;
+			def->op = IR_NOP;
+			values_dropped++;
+			removed = true;
+		}
+
+		if (!removed) continue;
+
+		if (count == 0) {
+			ir->instrs[i].op = IR_NOP;
+		} else {
+			const u32 operands = alloc_operands(ir, dropped, count);
+			ir->instrs[i].operands = operands;
+			ir->instrs[i].operands_count = count;
+		}
+		changed = true;
+	}
+
+	return changed;
+}
+
+void
+ir_optimize(ir_func_t *ir)
+{
+	ir_remove_trivial_phis(ir);
+
+	bool changed = true;
+	while (changed) {
+		changed = fold_constants(ir);
+		changed |= remove_dropped(ir);
+	}
+}
+
+/* ------------------------------------------------------- */
+/* Printing                                                */
+/* ------------------------------------------------------- */
+
+const char *
+ir_op_to_str(ir_op_t op)
+{
+	return op < IR_OP_COUNT ? IR_OP_NAMES[op] : "unknown";
+}
+
+const char *
+ir_instr_to_str(const ir_func_t *ir, const ir_instr_t *instr)
+{
+	static char buf[IR_INSTR_STR_CAP];
+	size_t len = 0;
+
+#define append(...) do { \
+	const int n_ = snprintf(buf + len, sizeof(buf) - len, __VA_ARGS__); \
+	if (n_ > 0) len = len + (size_t) n_ < sizeof(buf) ? len + (size_t) n_ : sizeof(buf) - 1; \
+} while (0)
+
+	for (u8 i = 0; i < instr->results_count; ++i) append("%sv%u", i ? ", " : "", instr->result + i);
+	if (instr->results_count > 0) append(" = ");
+
+	append("%s", ir_op_to_str((ir_op_t) instr->op));
+	for (u32 i = 0; i < instr->operands_count; ++i) append("%s v%u", i ? "," : "", ir_operands(ir, instr)[i]);
+
+	switch (instr->op) {
+	case IR_CONST:
+	case IR_ARG:
+	case IR_PRINT:
+	case IR_RETURN: append(" #%ld", instr->imm); break;
+
+	case IR_STRING:
+	case IR_ADDRESS:
+	case IR_LOAD:
+	case IR_STORE:
+	case IR_CALL:
+	case IR_CALL_EXTERN: append(" %s", instr->name); break;
+
+	case IR_JUMP: append(" b%u", instr->targets[0]); break;
+	case IR_BRANCH: append(" b%u, b%u", instr->targets[0], instr->targets[1]); break;
+
+	default: break;
+	}
+
+#undef append
+
+	return buf;
+}
+
+void
+ir_print(const ir_func_t *ir, const char *name)
+{
+	printf("ir of %s:\n", name);
+	for (u32 b = 0; b < ir->blocks_len; ++b) {
+		const ir_block_t *block = &ir->blocks[b];
+		printf("b%u:", b);
+		for (u32 i = 0; i < block->stack_len; ++i) printf(" v%u", ir_block_stack(ir, block)[i]);
+		if (block->preds_count > 0) printf(" <-");
+		for (u8 i = 0; i < block->preds_count; ++i) printf(" b%u", block->preds[i]);
+		printf("\n");
+
+		for (u32 i = block->first; i < block->end; ++i) {
+			if (ir->instrs[i].op == IR_NOP) continue;
+			printf("  %s\n", ir_instr_to_str(ir, &ir->instrs[i]));
+		}
+	}
+}
+
+void
+ir_print_stats(void)
+{
+	printf("ir: %zu phis removed, %zu consts folded, %zu dropped values removed\n",
+				 phis_removed, consts_folded, values_dropped);
+}
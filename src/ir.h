@@ -0,0 +1,220 @@
+#ifndef IR_H_
+#define IR_H_
+
+#include "common.h"
+#include "compiler.h"
+
+#include <stdbool.h>
+
+// Stack-to-SSA form of a proc or func body. Every value pushed on the stack is defined once,
+// by the instruction that pushes it, and the blocks are cut at the ifs and whiles. A value
+// on the stack at the start of a block that is not the same from every predecessor is a phi.
+//
+// The instructions keep the order of the stack they are translated from: the operands of one
+// are the values on the top, from the deepest, they are popped and then the results are pushed.
+// `IR_PICK` and `IR_PRINT` read their operand wherever it is and leave it on the stack. The
+// values are given registers by `regalloc.h`, the order tells which ones a call passes.
+
+typedef u32 ir_value_t;
+
+#define IR_NONE ((u32) -1)
+
+// Predecessors of a block: the ones of an if join, or of a while head
+#define IR_PREDS_MAX 2
+
+#define IR_INIT_CAP 256
+
+typedef enum {
+	// Removed by a pass
+	IR_NOP,
+
+	IR_PHI,
+	// `imm`
+	IR_CONST,
+	// Address of the string literal `name`
+	IR_STRING,
+	// Address of the proc or func labeled `name`
+	IR_ADDRESS,
+	// Word `imm` deep in the frame of the body: the return address, then the arguments from the last
+	IR_ARG,
+	// Var `name`
+	IR_LOAD,
+	IR_STORE,
+	// Copy of the operand
+	IR_PICK,
+
+	IR_ADD,
+	IR_SUB,
+	IR_MUL,
+	IR_DIV,
+	IR_MOD,
+	IR_OR,
+	IR_NOT,
+	// Byte at the address of the first operand plus the second
+	IR_INDEX,
+
+	IR_EQUAL,
+	// Unsigned, the others are signed
+	IR_LESS,
+	IR_GREATER,
+	IR_GREATER_EQUAL,
+	IR_LESS_EQUAL,
+
+	IR_DROP,
+	// Print the operand of the kind `imm`
+	IR_PRINT,
+	// The top operand is the number of the syscall
+	IR_SYSCALL,
+	// Proc or func labeled `name`, it pops the operands and pushes the results
+	IR_CALL,
+	IR_CALL_EXTERN,
+	// End of an inline body. The results are the top `results_count` operands, pushed in the
+	// reverse order, the rest is dropped with the frame of the body.
+	IR_COLLAPSE,
+
+	// Terminators, the last instruction of every block
+	IR_JUMP,
+	// To the second target if the operand is zero, the first one is right after the block
+	IR_BRANCH,
+	// The top `imm` operands are returned
+	IR_RETURN,
+
+	IR_OP_COUNT,
+} ir_op_t;
+
+typedef enum {
+	IR_LABEL_NONE,
+	IR_LABEL_ELSE,
+	IR_LABEL_EDON,
+	IR_LABEL_WHILE,
+	IR_LABEL_WDON,
+} ir_label_t;
+
+// The operands are `operands_count` values in the `operands` of the body starting at `operands`,
+// the results are `results_count` values starting at `result`
+typedef struct {
+	u8 op;
+	u8 results_count;
+	u32 operands;
+	u32 operands_count;
+	ir_value_t result;
+	i64 imm;
+	const char *name;
+	u32 targets[2];
+} ir_instr_t;
+
+// `stack_len` values on the stack at the start, in the `stacks` of the body. A label is numbered
+// by the if or while of the body it belongs to.
+typedef struct {
+	u32 first;
+	u32 end;
+	u32 stack;
+	u32 stack_len;
+	u32 preds[IR_PREDS_MAX];
+	u8 preds_count;
+	u8 label;
+	u32 label_number;
+} ir_block_t;
+
+typedef struct {
+	ir_instr_t *instrs;
+	u32 instrs_len;
+	u32 instrs_cap;
+
+	ir_block_t *blocks;
+	u32 blocks_len;
+	u32 blocks_cap;
+
+	ir_value_t *operands;
+	u32 operands_len;
+	u32 operands_cap;
+
+	ir_value_t *stacks;
+	u32 stacks_len;
+	u32 stacks_cap;
+
+	// Instruction defining the value
+	u32 *defs;
+	u32 values_len;
+	u32 values_cap;
+
+	// Ifs and whiles the labels are numbered by
+	u32 ifs;
+	u32 whiles;
+} ir_func_t;
+
+INLINE ir_value_t *
+ir_operands(const ir_func_t *ir, const ir_instr_t *instr)
+{
+	return ir->operands + instr->operands;
+}
+
+INLINE ir_instr_t *
+ir_def(const ir_func_t *ir, ir_value_t value)
+{
+	return &ir->instrs[ir->defs[value]];
+}
+
+INLINE bool
+ir_is_terminator(u8 op)
+{
+	return op == IR_JUMP || op == IR_BRANCH || op == IR_RETURN;
+}
+
+// Empty the body, the memory is kept for the next one
+void
+ir_reset(ir_func_t *ir);
+
+void
+ir_free(ir_func_t *ir);
+
+// New block with the values on the stack at its start, its instructions are the ones
+// appended till the next block starts
+u32
+ir_block_begin(ir_func_t *ir, u8 label, u32 label_number, const ir_value_t *stack, u32 stack_len);
+
+void
+ir_block_add_pred(ir_func_t *ir, u32 block, u32 pred);
+
+// Append an instruction to the current block, the pointer is valid till the next one
+ir_instr_t *
+ir_append(ir_func_t *ir, ir_op_t op, const ir_value_t *operands, u32 operands_count, u8 results_count);
+
+// Values on the stack at the start of the block
+INLINE ir_value_t *
+ir_block_stack(const ir_func_t *ir, const ir_block_t *block)
+{
+	return ir->stacks + block->stack;
+}
+
+// Translate the body, in `ir_build.c`. The top `ret_types_count` values of the stack it leaves
+// are returned. NULL if it can't be translated: the stack it leaves is not known, or not the
+// same from every side of a branch. The body is valid till the next one is built.
+ir_func_t *
+ir_build(Compiler *ctx, ast_id_t body, size_t ret_types_count);
+
+void
+ir_build_free(void);
+
+// Replace the phis that merge one value with it
+void
+ir_remove_trivial_phis(ir_func_t *ir);
+
+// Run the passes that keep the order of the stack
+void
+ir_optimize(ir_func_t *ir);
+
+const char *
+ir_op_to_str(ir_op_t op);
+
+// The instruction as `v3 = add v1, v2`, in a buffer reused by the next call
+const char *
+ir_instr_to_str(const ir_func_t *ir, const ir_instr_t *instr);
+
+void
+ir_print(const ir_func_t *ir, const char *name);
+
+void
+ir_print_stats(void);
+
+#endif // IR_H_
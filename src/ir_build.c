@@ -0,0 +1,406 @@
+#include "lib.h"
+#include "ir.h"
+#include "ast.h"
+#include "common.h"
+#include "compiler.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+// Body being translated, and the values on its stack
+static ir_func_t ir = {0};
+static ir_value_t *ir_stack = NULL;
+static u32 ir_stack_len = 0;
+static u32 ir_stack_cap = 0;
+
+static bool
+translate_block(Compiler *ctx, ast_id_t ast_id);
+
+INLINE void
+ir_push(ir_value_t value)
+{
+	if (unlikely(ir_stack_len >= ir_stack_cap)) {
+		ir_stack_cap = ir_stack_cap ? ir_stack_cap * 2 : IR_INIT_CAP;
+		ir_stack = (ir_value_t *) realloc(ir_stack, sizeof(ir_value_t) * ir_stack_cap);
+	}
+
+	ir_stack[ir_stack_len++] = value;
+}
+
+// Set the stack to the one the block starts with
+INLINE void
+ir_stack_restore(u32 block)
+{
+	ir_stack_len = 0;
+	for (u32 i = 0; i < ir.blocks[block].stack_len; ++i) {
+		ir_push(ir_block_stack(&ir, &ir.blocks[block])[i]);
+	}
+}
+
+INLINE u32
+ir_current_block(void)
+{
+	return ir.blocks_len - 1;
+}
+
+// Append the op of the top `operands_count` values, they are popped and the results pushed.
+// NULL if there are not enough of them, the body is not translated then.
+static ir_instr_t *
+translate_op(ir_op_t op, u32 operands_count, u8 results_count)
+{
+	if (ir_stack_len < operands_count) return NULL;
+
+	ir_stack_len -= operands_count;
+	ir_instr_t *instr = ir_append(&ir, op, ir_stack + ir_stack_len, operands_count, results_count);
+	for (u8 i = 0; i < results_count; ++i) ir_push(instr->result + i);
+	return instr;
+}
+
+// Append the op reading the value, which stays where it is
+static ir_instr_t *
+translate_read(ir_op_t op, ir_value_t value, u8 results_count)
+{
+	ir_instr_t *instr = ir_append(&ir, op, &value, 1, results_count);
+	for (u8 i = 0; i < results_count; ++i) ir_push(instr->result + i);
+	return instr;
+}
+
+// The argument is read from a value the body pushed, or from a word of the frame
+static void
+translate_argument(ast_id_t ast_id)
+{
+	const size_t stack_idx = ast_resolved(ast_id);
+	if (stack_idx < ir_stack_len) {
+		translate_read(IR_PICK, ir_stack[ir_stack_len - 1 - stack_idx], 1);
+	} else {
+		translate_op(IR_ARG, 0, 1)->imm = (i64) (stack_idx - ir_stack_len);
+	}
+}
+
+// An inline body is translated where it is called, its frame is what it pushes
+// on top of the arguments
+static bool
+translate_inline(Compiler *ctx, ast_id_t decl_ast, bool is_proc)
+{
+	const u32 args_count = vec_size(is_proc ? ast_proc(decl_ast)->args : ast_func(decl_ast)->args);
+	if (ir_stack_len < args_count) return false;
+	const u32 base = ir_stack_len - args_count;
+
+	const ast_id_t body = parser_body(ctx->parser, decl_ast);
+	if (body >= 0 && !translate_block(ctx, body)) return false;
+
+	const u32 ret_types_count = is_proc ? 0 : vec_size(ast_func(decl_ast)->ret_types);
+	if (ir_stack_len < base + args_count || ir_stack_len - base < ret_types_count) return false;
+
+	return translate_op(IR_COLLAPSE, ir_stack_len - base, (u8) ret_types_count) != NULL;
+}
+
+static bool
+translate_function_call(Compiler *ctx, const binding_t *value)
+{
+	const ast_id_t decl_ast = value->ast_id;
+	ir_instr_t *instr = NULL;
+	if (value->ast_kind == AST_PROC) {
+		const proc_stmt_t *proc = ast_proc(decl_ast);
+		if (proc->inlin) return translate_inline(ctx, decl_ast, true);
+		instr = translate_op(IR_CALL, vec_size(proc->args), 0);
+		if (instr != NULL) instr->name = proc->name->str;
+	} else if (value->ast_kind == AST_FUNC) {
+		const func_stmt_t *func = ast_func(decl_ast);
+		if (func->inlin) return translate_inline(ctx, decl_ast, false);
+		instr = translate_op(IR_CALL, vec_size(func->args), (u8) vec_size(func->ret_types));
+		if (instr != NULL) instr->name = func->name->str;
+	} else if (value->ast_kind == AST_EXTERN) {
+		switch (ast_extern(decl_ast)->kind) {
+		case EXTERN_FUNC: {
+			// Only for integrals now
+			instr = translate_op(IR_CALL_EXTERN, vec_size(ast_extern(decl_ast)->func_stmt.args), 1);
+			if (instr != NULL) instr->name = ast_extern(decl_ast)->func_stmt.name->str;
+		} break;
+		case EXTERN_PROC: {
+			instr = translate_op(IR_CALL_EXTERN, vec_size(ast_extern(decl_ast)->proc_stmt.args), 0);
+			if (instr != NULL) instr->name = ast_extern(decl_ast)->proc_stmt.name->str;
+		} break;
+		}
+	} else {
+		UNREACHABLE
+	}
+
+	return instr != NULL;
+}
+
+// Jump from the end of the current block, the target is set once it begins
+INLINE u32
+translate_jump(void)
+{
+	translate_op(IR_JUMP, 0, 0);
+	return ir.instrs_len - 1;
+}
+
+// Both ends of the if have to leave as many values, the ones they leave different are merged
+// by the phis at the start of the join
+static bool
+translate_if(Compiler *ctx, ast_id_t ast_id)
+{
+	const ast_id_t then_body = ast_if(ast_id)->then_body;
+	const ast_id_t else_body = ast_if(ast_id)->else_body;
+
+	// Without the then body, the else one follows whatever the condition is
+	if (then_body < 0) {
+		if (translate_op(IR_DROP, 1, 0) == NULL) return false;
+		return else_body < 0 || translate_block(ctx, else_body);
+	}
+
+	const u32 number = ir.ifs++;
+	const u32 branch = ir.instrs_len;
+	if (translate_op(IR_BRANCH, 1, 0) == NULL) return false;
+	const u32 cond_block = ir_current_block();
+
+	const u32 then_block = ir_block_begin(&ir, IR_LABEL_NONE, 0, ir_stack, ir_stack_len);
+	ir_block_add_pred(&ir, then_block, cond_block);
+	if (!translate_block(ctx, then_body)) return false;
+
+	const u32 then_exit = ir_current_block();
+	const u32 then_jump = translate_jump();
+
+	const u32 join_len = ir_stack_len;
+	ir_value_t *then_stack = (ir_value_t *) malloc(sizeof(ir_value_t) * (join_len + 1));
+	memcpy(then_stack, ir_stack, sizeof(ir_value_t) * join_len);
+
+	ir_stack_restore(then_block);
+	const u32 else_block = ir_block_begin(&ir, IR_LABEL_ELSE, number, ir_stack, ir_stack_len);
+	ir_block_add_pred(&ir, else_block, cond_block);
+	ir.instrs[branch].targets[0] = then_block;
+	ir.instrs[branch].targets[1] = else_block;
+
+	if ((else_body >= 0 && !translate_block(ctx, else_body)) || ir_stack_len != join_len) {
+		free(then_stack);
+		return false;
+	}
+
+	const u32 else_exit = ir_current_block();
+	const u32 else_jump = translate_jump();
+
+	const u32 join = ir_block_begin(&ir, IR_LABEL_EDON, number, ir_stack, ir_stack_len);
+	ir_block_add_pred(&ir, join, then_exit);
+	ir_block_add_pred(&ir, join, else_exit);
+	ir.instrs[then_jump].targets[0] = join;
+	ir.instrs[else_jump].targets[0] = join;
+
+	for (u32 i = 0; i < join_len; ++i) {
+		const ir_value_t merged[2] = { then_stack[i], ir_stack[i] };
+		if (merged[0] == merged[1]) continue;
+
+		const ir_value_t phi = ir_append(&ir, IR_PHI, merged, 2, 1)->result;
+		ir_block_stack(&ir, &ir.blocks[join])[i] = phi;
+		ir_stack[i] = phi;
+	}
+
+	free(then_stack);
+	return true;
+}
+
+// Every value on the stack at the head of the loop gets a phi, the ones the body leaves
+// as they were are removed once it is translated. The body has to leave as many values.
+static bool
+translate_while(Compiler *ctx, ast_id_t ast_id)
+{
+	const u32 number = ir.whiles++;
+	const u32 pre_exit = ir_current_block();
+	const u32 pre_jump = translate_jump();
+
+	const u32 head = ir_block_begin(&ir, IR_LABEL_WHILE, number, ir_stack, ir_stack_len);
+	ir_block_add_pred(&ir, head, pre_exit);
+	ir.instrs[pre_jump].targets[0] = head;
+
+	const u32 head_len = ir_stack_len;
+	const u32 first_phi = ir.instrs_len;
+	for (u32 i = 0; i < head_len; ++i) {
+		const ir_value_t merged[2] = { ir_stack[i], IR_NONE };
+		const ir_value_t phi = ir_append(&ir, IR_PHI, merged, 2, 1)->result;
+		ir_block_stack(&ir, &ir.blocks[head])[i] = phi;
+		ir_stack[i] = phi;
+	}
+
+	const ast_id_t cond = ast_while(ast_id)->cond;
+	u32 cond_exit = 0, cond_jump = 0;
+	if (cond >= 0) {
+		if (!translate_block(ctx, cond)) return false;
+		cond_exit = ir_current_block();
+		cond_jump = ir.instrs_len;
+		if (translate_op(IR_BRANCH, 1, 0) == NULL) return false;
+	} else {
+		cond_exit = ir_current_block();
+		cond_jump = translate_jump();
+	}
+
+	const u32 body_block = ir_block_begin(&ir, IR_LABEL_NONE, 0, ir_stack, ir_stack_len);
+	ir_block_add_pred(&ir, body_block, cond_exit);
+	ir.instrs[cond_jump].targets[0] = body_block;
+
+	const ast_id_t body = ast_while(ast_id)->body;
+	if (body >= 0 && !translate_block(ctx, body)) return false;
+	if (ir_stack_len != head_len) return false;
+
+	const u32 body_exit = ir_current_block();
+	translate_jump();
+	ir.instrs[ir.instrs_len - 1].targets[0] = head;
+	ir_block_add_pred(&ir, head, body_exit);
+
+	for (u32 i = 0; i < head_len; ++i) {
+		const ir_instr_t *phi = &ir.instrs[first_phi + i];
+		ir_operands(&ir, phi)[1] = ir_stack[i];
+	}
+
+	// Without the condition, nothing gets past the loop
+	ir_stack_restore(body_block);
+	const u32 exit = ir_block_begin(&ir, IR_LABEL_WDON, number, ir_stack, ir_stack_len);
+	if (cond >= 0) {
+		ir_block_add_pred(&ir, exit, cond_exit);
+		ir.instrs[cond_jump].targets[1] = exit;
+	}
+
+	return true;
+}
+
+// Translate the ast into the current block, false if it can't be: the stack
+// it leaves is not known, or not the same from every side of a branch
+static bool
+translate_ast(Compiler *ctx, ast_id_t ast_id)
+{
+	switch (ast_kind(ast_id)) {
+	// These are handled in different place
+	case AST_VAR:
+	case AST_FUNC:
+	case AST_CONST:
+	case AST_EXTERN:
+	case AST_PROC: return true;
+
+	case AST_IF: return translate_if(ctx, ast_id);
+	case AST_WHILE: return translate_while(ctx, ast_id);
+
+	case AST_WRITE: {
+		ir_instr_t *instr = translate_op(IR_STORE, 1, 0);
+		if (instr == NULL) return false;
+		instr->name = symstr(ast_sym(ast_id));
+	} return true;
+
+	case AST_SYSCALL: {
+		return translate_op(IR_SYSCALL, ast_syscall_args(ast_id) + 1, 0) != NULL;
+	}
+
+	case AST_LITERAL: {
+		const binding_t *binding = scope_get(ast_sym(ast_id));
+		if (binding->ast_kind == AST_CONST) {
+			translate_op(IR_CONST, 0, 1)->imm = ctx->const_map->entries[binding->entry].value.value;
+		} else if (binding->ast_kind == AST_VAR) {
+			translate_op(IR_LOAD, 0, 1)->name = symstr(ast_sym(ast_id));
+		} else if (binding->ast_kind == AST_PROC) {
+			translate_op(IR_ADDRESS, 0, 1)->name = ast_proc(binding->ast_id)->name->str;
+		} else if (binding->ast_kind == AST_FUNC) {
+			translate_op(IR_ADDRESS, 0, 1)->name = ast_func(binding->ast_id)->name->str;
+		} else {
+			translate_argument(ast_id);
+		}
+	} return true;
+
+	case AST_CALL: {
+		const binding_t *binding = scope_get(ast_sym(ast_id));
+		if (binding->ast_kind == AST_PROC
+		|| binding->ast_kind == AST_FUNC
+		|| binding->ast_kind == AST_EXTERN)
+		{
+			return translate_function_call(ctx, binding);
+		} else if (binding->ast_kind == AST_VAR) {
+			translate_op(IR_LOAD, 0, 1)->name = symstr(ast_sym(ast_id));
+		} else {
+			translate_argument(ast_id);
+		}
+	} return true;
+
+	case AST_PUSH: {
+		switch (ast_push(ast_id)->value_kind) {
+		case VALUE_KIND_INTEGER: {
+			translate_op(IR_CONST, 0, 1)->imm = ast_push(ast_id)->integer;
+		} break;
+
+		case VALUE_KIND_STRING: {
+			translate_op(IR_STRING, 0, 1)->name = ast_push(ast_id)->str;
+		} break;
+
+		// Byte pushes stop at the check
+		case VALUE_KIND_BYTE:
+		case VALUE_KIND_FUNCTION_POINTER:
+		case VALUE_KIND_POISONED:
+		case VALUE_KIND_LAST:	UNREACHABLE; break;
+		}
+	} return true;
+
+	case AST_PLUS: {
+		const ir_op_t op = ast_resolved(ast_id) == VALUE_KIND_INTEGER ? IR_ADD : IR_INDEX;
+		return translate_op(op, 2, 1) != NULL;
+	}
+
+	case AST_BNOT:          return translate_op(IR_NOT, 1, 1) != NULL;
+	case AST_BOR:           return translate_op(IR_OR, 2, 1) != NULL;
+	case AST_MINUS:         return translate_op(IR_SUB, 2, 1) != NULL;
+	case AST_DIV:           return translate_op(IR_DIV, 2, 1) != NULL;
+	case AST_MOD:           return translate_op(IR_MOD, 2, 1) != NULL;
+	case AST_MUL:           return translate_op(IR_MUL, 2, 1) != NULL;
+	case AST_EQUAL:         return translate_op(IR_EQUAL, 2, 1) != NULL;
+	case AST_LESS:          return translate_op(IR_LESS, 2, 1) != NULL;
+	case AST_GREATER:       return translate_op(IR_GREATER, 2, 1) != NULL;
+	case AST_GREATER_EQUAL: return translate_op(IR_GREATER_EQUAL, 2, 1) != NULL;
+	case AST_LESS_EQUAL:    return translate_op(IR_LESS_EQUAL, 2, 1) != NULL;
+	case AST_DROP:          return translate_op(IR_DROP, 1, 0) != NULL;
+
+	case AST_DUP: {
+		if (ir_stack_len == 0) return false;
+		translate_read(IR_PICK, ir_stack[ir_stack_len - 1], 1);
+	} return true;
+
+	case AST_DOT: {
+		const value_kind_t last_type = (value_kind_t) ast_resolved(ast_id);
+		if (ir_stack_len == 0) return false;
+		translate_read(IR_PRINT, ir_stack[ir_stack_len - 1], 0)->imm = last_type;
+	} return true;
+
+	case AST_POISONED: UNREACHABLE;
+	}
+
+	return false;
+}
+
+static bool
+translate_block(Compiler *ctx, ast_id_t ast_id)
+{
+	while (ast_id < asts_len) {
+		if (!translate_ast(ctx, ast_id)) return false;
+		if (ast_next(ast_id) < 0) break;
+		else ast_id = ast_next(ast_id);
+	}
+	return true;
+}
+
+ir_func_t *
+ir_build(Compiler *ctx, ast_id_t body, size_t ret_types_count)
+{
+	ir_reset(&ir);
+	ir_stack_len = 0;
+	ir_block_begin(&ir, IR_LABEL_NONE, 0, NULL, 0);
+
+	if (!translate_block(ctx, body) || ir_stack_len < ret_types_count) return NULL;
+
+	translate_op(IR_RETURN, ir_stack_len, 0)->imm = (i64) ret_types_count;
+	return &ir;
+}
+
+void
+ir_build_free(void)
+{
+	ir_free(&ir);
+	free(ir_stack);
+	ir_stack = NULL;
+	ir_stack_len = 0;
+	ir_stack_cap = 0;
+}
@@ -1,21 +1,49 @@
 #include "file.h"
 #include "lib.h"
 #include "lexer.h"
+#include "cache.h"
 #include "common.h"
+#include "vmem.h"
 
 #include <time.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-size_t lines_pool_count = 0;
-lines_t lines_pool[LINES_POOL_CAP];
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(LEXER_NO_SIMD)
+	#define LEXER_SIMD 1
+	#include <immintrin.h>
+#else
+	#define LEXER_SIMD 0
+#endif
 
+static Vmem tokens_pool_arena;
 size_t tokens_pool_count;
-tokens_t tokens_pool[TOKENS_POOL_CAP];
+tokens_t *tokens_pool = NULL;
 
-DECLARE_STATIC(loc, LOC);
+u32
+tokens_pool_alloc(void)
+{
+	if (tokens_pool == NULL) {
+		vmem_init(&tokens_pool_arena, TOKENS_POOL_ARENA_MB);
+		tokens_pool = (tokens_t *) tokens_pool_arena.ptr;
+	}
+	vmem_alloc(&tokens_pool_arena, sizeof(tokens_t));
+	return (u32) tokens_pool_count++;
+}
+
+void
+tokens_pool_arena_free(void)
+{
+	vmem_free(&tokens_pool_arena);
+	tokens_pool = NULL;
+	tokens_pool_count = 0;
+}
 
 const char *KEYWORDS[KEYWORDS_SIZE] = {
 	[TOKEN_IF]				= "if",
@@ -131,10 +159,37 @@ token_kind_to_str_pretty(const token_kind_t token_kind)
 	}
 }
 
+// Bases of the files grow with their ids, so the file is the last one starting at or before `loc`
+static const file_t *
+loc_file(loc_id_t loc)
+{
+	file_id_t lo = 0, hi = files_len;
+	while (hi - lo > 1) {
+		const file_id_t mid = lo + (hi - lo) / 2;
+		if (fileid(mid).base <= loc) lo = mid;
+		else hi = mid;
+	}
+	return &fileid(lo);
+}
+
 const char *
-loc_to_str(const loc_t *loc)
+loc_to_str(loc_id_t loc)
 {
-	const str_t file_path = fileid(loc->file_id).file_path;
+	const file_t *file = loc_file(loc);
+	const u32 offset = loc - file->base;
+
+	// Amount of lines starting at or before the offset is the row
+	u32 lo = 0, hi = file->lines_count;
+	while (lo < hi) {
+		const u32 mid = lo + (hi - lo) / 2;
+		if (file->lines[mid] <= offset) lo = mid + 1;
+		else hi = mid;
+	}
+
+	const u32 row = lo;
+	const u32 col = offset - (row > 0 ? file->lines[row - 1] : 0);
+
+	const str_t file_path = file->file_path;
 	const size_t len = file_path.len
 		+ 11 * 2 // two 32bit integers
 		+ 3			 // 3 colons
@@ -144,8 +199,8 @@ loc_to_str(const loc_t *loc)
 	snprintf(ret, len,
 					 "%s:%d:%d:",
 					 file_path.buf,
-					 loc->row + 1,
-					 loc->col + 1);
+					 row + 1,
+					 col + 1);
 
 	return ret;
 }
@@ -153,7 +208,7 @@ loc_to_str(const loc_t *loc)
 const char *
 token_to_str(const token_t *token)
 {
-	const char *token_loc = loc_to_str(&locid(token->loc_id));
+	const char *token_loc = loc_to_str(token->loc_id);
 	const char *token_kind = token_kind_to_str(token->kind);
 	const size_t len = strlen(token_loc) + strlen(token_kind) + strlen(token->str)
 		+ 2  // 2 spaces
@@ -170,83 +225,276 @@ token_to_str(const token_t *token)
 	return ret;
 }
 
-Lexer
-new_lexer(file_id_t file_id, lines_t lines)
+typedef enum {
+	CHAR_CLASS_OTHER,
+	CHAR_CLASS_SPACE,
+	CHAR_CLASS_NEWLINE,
+	CHAR_CLASS_COMMENT,
+	CHAR_CLASS_SINGLE_QUOTE,
+	CHAR_CLASS_DOUBLE_QUOTE,
+} char_class_t;
+
+static const u8 CHAR_CLASSES[256] = {
+	[' ']		= CHAR_CLASS_SPACE,
+	['\t']	= CHAR_CLASS_SPACE,
+	['\r']	= CHAR_CLASS_SPACE,
+	['\v']	= CHAR_CLASS_SPACE,
+	['\f']	= CHAR_CLASS_SPACE,
+	['\n']	= CHAR_CLASS_NEWLINE,
+	['#']		= CHAR_CLASS_COMMENT,
+	['\'']	= CHAR_CLASS_SINGLE_QUOTE,
+	['"']		= CHAR_CLASS_DOUBLE_QUOTE,
+};
+
+typedef const char *(*scan_special_t)(const char *cur, const char *end);
+
+// Find the first byte in [cur, end) that is not `CHAR_CLASS_OTHER`,
+// i.e. a whitespace, `#` or a quote, or return `end` if there's none.
+static const char *
+scan_special_scalar(const char *cur, const char *end)
 {
-	return (Lexer) {
-		.row = 0,
-		.lines = lines,
-		.file_id = file_id,
-	};
+	while (cur < end && CHAR_CLASSES[(u8) *cur] == CHAR_CLASS_OTHER) cur++;
+	return cur;
 }
 
-token_t
-new_token(loc_t loc, token_kind_t token_kind, const char *str)
+#if LEXER_SIMD
+// Whitespaces are `\t`..`\r` and space, so one range check and four compares
+// cover all the special bytes. Tails shorter than a vector go to the scalar path,
+// so we never read past the mapping.
+static const char *
+scan_special_sse2(const char *cur, const char *end)
 {
-	append_loc(loc);
-	return (token_t) {
-		.loc_id = locs_len - 1,
-		.kind = token_kind,
-		.str = str,
-	};
+	const __m128i tab						= _mm_set1_epi8('\t');
+	const __m128i ws_range			= _mm_set1_epi8('\r' - '\t');
+	const __m128i space					= _mm_set1_epi8(' ');
+	const __m128i hash					= _mm_set1_epi8('#');
+	const __m128i single_quote	= _mm_set1_epi8('\'');
+	const __m128i double_quote	= _mm_set1_epi8('"');
+
+	for (; cur + 16 <= end; cur += 16) {
+		const __m128i chunk = _mm_loadu_si128((const __m128i *) cur);
+		const __m128i ws = _mm_sub_epi8(chunk, tab);
+
+		__m128i mask = _mm_cmpeq_epi8(_mm_min_epu8(ws, ws_range), ws);
+		mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, space));
+		mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, hash));
+		mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, single_quote));
+		mask = _mm_or_si128(mask, _mm_cmpeq_epi8(chunk, double_quote));
+
+		const u32 bits = _mm_movemask_epi8(mask);
+		if (bits) return cur + __builtin_ctz(bits);
+	}
+
+	return scan_special_scalar(cur, end);
 }
 
-tokens_t
-lexer_lex(Lexer *lexer)
+__attribute__((target("avx2")))
+static const char *
+scan_special_avx2(const char *cur, const char *end)
 {
-#ifdef DEBUG
-	set_time;
+	const __m256i tab						= _mm256_set1_epi8('\t');
+	const __m256i ws_range			= _mm256_set1_epi8('\r' - '\t');
+	const __m256i space					= _mm256_set1_epi8(' ');
+	const __m256i hash					= _mm256_set1_epi8('#');
+	const __m256i single_quote	= _mm256_set1_epi8('\'');
+	const __m256i double_quote	= _mm256_set1_epi8('"');
+
+	for (; cur + 32 <= end; cur += 32) {
+		const __m256i chunk = _mm256_loadu_si256((const __m256i *) cur);
+		const __m256i ws = _mm256_sub_epi8(chunk, tab);
+
+		__m256i mask = _mm256_cmpeq_epi8(_mm256_min_epu8(ws, ws_range), ws);
+		mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(chunk, space));
+		mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(chunk, hash));
+		mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(chunk, single_quote));
+		mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(chunk, double_quote));
+
+		const u32 bits = _mm256_movemask_epi8(mask);
+		if (bits) return cur + __builtin_ctz(bits);
+	}
+
+	return scan_special_sse2(cur, end);
+}
+#endif // LEXER_SIMD
+
+static scan_special_t scan_special_ = scan_special_scalar;
+
+static void
+scan_special_init(void)
+{
+#if LEXER_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan_special_ = scan_special_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		scan_special_ = scan_special_sse2;
+	}
 #endif
-	tokens_t tokens = {
-		.tokens = (token_t *) malloc(sizeof(token_t)
-																 * MAXIMUM_TOKENS_AMOUNT_PER_LINE
-																 * lexer->lines.count),
-		.count = 0
-	};
+}
 
+INLINE const char *
+scan_special(const char *cur, const char *end)
+{
+	const char *ret = scan_special_(cur, end);
 #ifdef DEBUG
-	dbg_time("allocation in `lexer_lex()`");
-	set_time;
+	ASSERT(ret == scan_special_scalar(cur, end), "Vectorized scan disagrees with the scalar one");
 #endif
-	for (size_t i = 0; i < lexer->lines.count; ++i) {
-		lexer_lex_line(lexer, lexer->lines.lines[i], &tokens);
-		lexer->row++;
+	return ret;
+}
+
+// Perfect hash table of the keywords, filled from the `KEYWORDS` array in `keywords_init`,
+// so it can't get out of sync with `token_kind_t`. `KEYWORDS_SEED` puts every keyword into
+// a slot of its own, a keyword that is added or renamed may need another one.
+#define KEYWORDS_TABLE_SIZE 64
+#define KEYWORDS_SEED 18
+
+static u8 KEYWORDS_LENS[KEYWORDS_SIZE];
+static u8 KEYWORDS_TABLE[KEYWORDS_TABLE_SIZE];
+
+INLINE u32
+keyword_hash(const char *str, u32 len, u32 seed)
+{
+	return ((u8) str[0] * seed + (u8) str[len - 1] * 31 + len) & (KEYWORDS_TABLE_SIZE - 1);
+}
+
+// Returns false if two keywords fall into the same slot
+static bool
+keywords_fill(u32 seed)
+{
+	memset(KEYWORDS_TABLE, 0, sizeof(KEYWORDS_TABLE));
+
+	for (size_t i = 0; i < KEYWORDS_SIZE; ++i) {
+		ASSERT(KEYWORDS[i] != NULL, "Keyword is missing in the `KEYWORDS` array");
+		KEYWORDS_LENS[i] = strlen(KEYWORDS[i]);
+
+		u8 *slot = &KEYWORDS_TABLE[keyword_hash(KEYWORDS[i], KEYWORDS_LENS[i], seed)];
+		if (*slot) return false;
+
+		// Store indexes plus one to keep zero for empty slots
+		*slot = i + 1;
+	}
+
+	return true;
+}
+
+#ifdef DEBUG
+#define KEYWORDS_SEED_MAX 1024
+
+// Seed to put in `KEYWORDS_SEED`, 0 if there is none below `KEYWORDS_SEED_MAX`
+static u32
+keywords_find_seed(void)
+{
+	for (u32 seed = 1; seed < KEYWORDS_SEED_MAX; ++seed) {
+		if (keywords_fill(seed)) return seed;
 	}
+	return 0;
+}
+#endif
+
+static void
+keywords_init(void)
+{
+	if (keywords_fill(KEYWORDS_SEED)) return;
+
 #ifdef DEBUG
-	dbg_time("lexing_lines in `lexer_lex()`");
+	const u32 seed = keywords_find_seed();
+	if (seed != 0) eprintf("note: a perfect hash table of the keywords has `KEYWORDS_SEED` %u\n", seed);
 #endif
-	append_tokens(tokens);
-	return tokens;
+
+	FATAL_ERROR("`KEYWORDS_SEED` doesn't give a perfect hash table of the keywords");
 }
 
 INLINE i32
-check_for_keywords(const char *str)
+check_for_keywords(const char *str, u32 len)
 {
-	for (size_t i = 0; i < KEYWORDS_SIZE; ++i) {
-		if (0 == strcmp(str, KEYWORDS[i])) return i;
+	const i32 idx = KEYWORDS_TABLE[keyword_hash(str, len, KEYWORDS_SEED)] - 1;
+	if (idx >= 0 && KEYWORDS_LENS[idx] == len && 0 == memcmp(str, KEYWORDS[idx], len)) {
+		return idx;
 	}
 	return -1;
 }
 
-token_kind_t
-type_token(const char *str, const loc_t *loc)
+static void
+lexer_init(void)
 {
-	const i32 keyword_idx = check_for_keywords(str);
-	if (keyword_idx >= 0) return (token_kind_t) keyword_idx;
+	static bool initialized = false;
+	if (initialized) return;
 
-	const char first = str[0];
+	keywords_init();
+	scan_special_init();
+	initialized = true;
+}
 
-	switch (first) {
-	case NUMBER_CHAR_CASE: return TOKEN_INTEGER; break;
+Lexer
+new_lexer(file_id_t file_id)
+{
+	lexer_init();
+	fileid(file_id).lexed = true;
+
+	// Every line but the last one ends with a newline of the source
+	file_t *file = &fileid(file_id);
+	if (file->lines == NULL) {
+		file->lines_cap = (u32) file->src_len + 1;
+		file->lines = (u32 *) reserve_range(sizeof(u32) * file->lines_cap);
+	}
+
+	return (Lexer) {
+		.cur = fileid(file_id).src,
+		.end = fileid(file_id).src + fileid(file_id).src_len,
+		.src = fileid(file_id).src,
+		.file = &fileid(file_id),
+		.file_id = file_id,
+		.syms = {
+			.syms = NULL,
+			.size = 0,
+			.cap = 0,
+			.slots = NULL,
+			.slots_cap = 0,
+			.copy = false
+		}
+	};
+}
+
+token_t
+new_token(loc_id_t loc_id, token_kind_t token_kind, const char *str, u32 len, sym_id_t sym)
+{
+	return (token_t) {
+		.loc_id = loc_id,
+		.kind = token_kind,
+		.sym = sym,
+		.len = len,
+		.str = str,
+	};
+}
+
+// The range is reserved for the most tokens the file can have, see `lex_unit_add`
+INLINE void
+tokens_append(tokens_t *tokens, token_t token)
+{
+#ifdef DEBUG
+	ASSERT(tokens->count < tokens->capacity, "More tokens than the range reserved for the file");
+#endif
+	tokens->tokens[tokens->count++] = token;
+}
+
+token_kind_t
+type_token(const char *str, u32 len, loc_id_t loc)
+{
+	switch (str[0]) {
+	case NUMBER_CHAR_CASE: return TOKEN_INTEGER;
 
 	case '_':
 	case LOWER_CHAR_CASE:
-	case UPPER_CHAR_CASE: return TOKEN_LITERAL; break;
+	case UPPER_CHAR_CASE: {
+		const i32 keyword_idx = check_for_keywords(str, len);
+		if (keyword_idx >= 0) return (token_kind_t) keyword_idx;
+		return TOKEN_LITERAL;
+	}
 
 	case '.': return TOKEN_DOT;
 	case '!': return TOKEN_WRITE;
-	case '>': if (str + 1 != NULL && str[1] == '=') return TOKEN_GREATER_EQUAL; else return TOKEN_GREATER;
-	case '<': if (str + 1 != NULL && str[1] == '=') return TOKEN_LESS_EQUAL;		else return TOKEN_LESS;
+	case '>': if (len > 1 && str[1] == '=') return TOKEN_GREATER_EQUAL; else return TOKEN_GREATER;
+	case '<': if (len > 1 && str[1] == '=') return TOKEN_LESS_EQUAL;		else return TOKEN_LESS;
 	case '+': return TOKEN_PLUS;
 	case '-': return TOKEN_MINUS;
 	case '/': return TOKEN_DIV;
@@ -260,15 +508,47 @@ type_token(const char *str, const loc_t *loc)
 	report_error("%s error: unexpected literal: '%s'", loc_to_str(loc), str);
 }
 
+// Map the file privately, so the lexer can terminate tokens in place without
+// touching the file on disk. The mapping is laid over an anonymous one that is
+// one byte longer, so there is always a '\0' right after the last byte.
+static char *
+map_entire_file(int fd, size_t len)
+{
+	char *src = mmap(NULL, len + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (src == MAP_FAILED) return NULL;
+	if (len == 0) return src;
+
+	if (MAP_FAILED == mmap(src, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0)) {
+		munmap(src, len + 1);
+		return NULL;
+	}
+
+	return src;
+}
+
 file_t
-read_entire_file(const char *file_path, const loc_t *report_loc)
+read_entire_file(const char *file_path, loc_id_t report_loc)
 {
-	const file_t file = new_file_t(new_str_t(file_path));
-	append_file(file);
+	// Sum of the sizes of all the files read so far, plus one for each
+	static u64 sources_len = 0;
+
+	struct stat st;
+	const int fd = open(file_path, O_RDONLY);
+	char *src = NULL;
+	if (fd >= 0 && fstat(fd, &st) >= 0) {
+		// The file was already read through this or another path
+		for (file_id_t i = 0; i < files_len; ++i) {
+			if (fileid(i).dev == (u64) st.st_dev && fileid(i).ino == (u64) st.st_ino) {
+				close(fd);
+				return fileid(i);
+			}
+		}
 
-	FILE *stream = fopen(file_path, "r");
-	if (stream == NULL) {
-		if (report_loc != NULL) {
+		src = map_entire_file(fd, st.st_size);
+	}
+
+	if (src == NULL) {
+		if (report_loc != LOC_NONE) {
 			eprintf("%s error: failed to open file: %s\n",
 							loc_to_str(report_loc),
 							file_path);
@@ -278,197 +558,668 @@ read_entire_file(const char *file_path, const loc_t *report_loc)
 		exit(EXIT_FAILURE);
 	}
 
-	char line[LINE_CAP];
-	lines_t lines = {
-		.lines = (line_t *) malloc(sizeof(lines_t *) * LINES_CAP),
-		.count = 0
-	};
+	close(fd);
 
-	while (fgets(line, sizeof(line), stream) != NULL) {
-		lines.lines[lines.count++] = split(line, ' ');
+	// Every file takes one more byte, so even an empty file has its own location
+	if (sources_len + st.st_size + 1 >= LOC_NONE) {
+		eprintf("error: sources are too big to be located: %s\n", file_path);
+		exit(EXIT_FAILURE);
 	}
 
-	append_lines(lines);
-	fclose(stream);
+	file_t file = new_file_t(new_str_t(file_path));
+	file.base = (u32) sources_len;
+	sources_len += st.st_size + 1;
+	file.src = src;
+	file.src_len = st.st_size;
+	file.dev = st.st_dev;
+	file.ino = st.st_ino;
+	append_file(file);
 	return file;
 }
 
-static void
-handle_include(Lexer *lexer, line_t line,
-							 const loc_t *loc_, tokens_t *tokens)
+INLINE void
+lexer_add_line(Lexer *lexer, const char *line_start)
 {
-	const loc_t *loc = loc_;
-	if (line.count < 2) goto include_failed;
+	file_t *file = lexer->file;
+	file->lines[file->lines_count++] = (u32) (line_start - lexer->src);
+}
 
-	const ss_t ss = line.items[1];
-	const loc_t str_loc = (loc_t) {
-		.row = lexer->row,
-		.col = ss.col,
-		.file_id = lexer->file_id
-	};
+// Scan the next token, terminate it in place and return its kind,
+// or `TOKEN_KEYWORDS_END` when the end of the file is reached.
+static token_kind_t
+lexer_next(Lexer *lexer, token_t *token)
+{
+	char *cur = lexer->cur;
 
-	loc = &str_loc;
-	const token_kind_t kind = type_token(ss.str, loc);
-	if (kind != TOKEN_STRING_LITERAL) goto include_failed;
+	for (;;) {
+		if (cur >= lexer->end) {
+			lexer->cur = cur;
+			return TOKEN_KEYWORDS_END;
+		}
 
-	if (ss.str[2] == '\0') {
-		report_error("%s error: `include` with an empty string literal after",
-								 loc_to_str(loc));
+		switch ((char_class_t) CHAR_CLASSES[(u8) *cur]) {
+		case CHAR_CLASS_SPACE: cur++; continue;
+
+		case CHAR_CLASS_NEWLINE: lexer_add_line(lexer, ++cur); continue;
+
+		case CHAR_CLASS_COMMENT: {
+			cur = memchr(cur, '\n', lexer->end - cur);
+			if (cur == NULL) cur = lexer->end;
+		} continue;
+
+		case CHAR_CLASS_OTHER:
+		case CHAR_CLASS_SINGLE_QUOTE:
+		case CHAR_CLASS_DOUBLE_QUOTE: break;
+		}
+		break;
 	}
 
-	// Get file path from quotes
-	scratch_buffer_clear();
-	scratch_buffer_append(ss.str + 1);
-	scratch_buffer.len--;
+	char *start = cur;
 
-	const char *file_path = scratch_buffer_copy();
-	const file_t file = read_entire_file(file_path, loc);
-	append_file(file);
+	// Only single line string literals are supported, so quotes are
+	// tracked till the end of the line.
+	bool in_single_quote = false;
+	bool in_double_quote = false;
+
+	for (; (cur = (char *) scan_special(cur, lexer->end)) < lexer->end; ++cur) {
+		const char_class_t class = (char_class_t) CHAR_CLASSES[(u8) *cur];
+		if (class == CHAR_CLASS_SINGLE_QUOTE && !in_double_quote) {
+			in_single_quote = !in_single_quote;
+		} else if (class == CHAR_CLASS_DOUBLE_QUOTE && !in_single_quote) {
+			in_double_quote = !in_double_quote;
+		} else if (class == CHAR_CLASS_NEWLINE
+					 || ((class == CHAR_CLASS_SPACE || class == CHAR_CLASS_COMMENT)
+						 && !in_single_quote && !in_double_quote))
+		{
+			break;
+		}
+	}
+
+	const loc_id_t loc = lexer->file->base + (u32) (start - lexer->src);
 
-	Lexer lexer_ = new_lexer(file.file_id, last_lines);
-	const tokens_t tokens_ = lexer_lex(&lexer_);
+	const u32 len = cur - start;
 
-	// Append new tokens right after the old ones
-	memcpy(tokens->tokens + sizeof(token_t) * tokens->count,
-				 tokens_.tokens, tokens_.count * sizeof(token_t));
+	// Terminate the token, but keep the delimiter for the next scan
+	const char delim = *cur;
+	*cur = '\0';
 
-	tokens->count += tokens_.count;
-	return;
+	const token_kind_t kind = type_token(start, len, loc);
 
-include_failed:
-	report_error("%s error: expected string literal after `include` keyword",
-							 loc_to_str(loc));
+	if (kind == TOKEN_STRING_LITERAL && (len < 2 || start[len - 1] != '"')) {
+		eprintf("%s error: no closing quote found bruv", loc_to_str(loc));
+		report_error("note: only single line string literals are supported yet..", "");
+	}
+
+	sym_id_t sym = SYM_NONE;
+	if (kind == TOKEN_LITERAL) {
+		const u32 sym_len = start[len - 1] == '!' ? len - 1 : len;
+		sym = symtab_intern(&lexer->syms, start, sym_len, fnv1a(start, sym_len));
+	} else if (kind == TOKEN_WRITE) {
+		sym = symtab_intern(&lexer->syms, start + 1, len - 1, fnv1a(start + 1, len - 1));
+	}
+
+	*token = new_token(loc, kind, start, len, sym);
+
+	switch ((char_class_t) CHAR_CLASSES[(u8) delim]) {
+	case CHAR_CLASS_NEWLINE: lexer_add_line(lexer, ++cur); break;
+
+	case CHAR_CLASS_COMMENT: {
+		cur = memchr(cur + 1, '\n', lexer->end - cur - 1);
+		if (cur == NULL) cur = lexer->end;
+	} break;
+
+	case CHAR_CLASS_SPACE: cur++; break;
+
+	case CHAR_CLASS_OTHER:
+	case CHAR_CLASS_SINGLE_QUOTE:
+	case CHAR_CLASS_DOUBLE_QUOTE: break;
+	}
+
+	lexer->cur = cur;
+	return kind;
 }
 
-void
-lexer_lex_line(Lexer *lexer, line_t line, tokens_t *tokens)
+// Lexer of a file of the stream. Its symbols are copied out of the source and mapped to
+// `SYMBOLS` on the first use, so nothing points into the part of the source already consumed.
+typedef struct {
+	Lexer lexer;
+	sym_id_t *syms;
+	u32 syms_cap;
+	size_t released;
+} stream_lexer_t;
+
+// Lexed file, its tokens are before `end` in the stream
+typedef struct {
+	file_id_t file_id;
+	size_t end;
+	size_t released;
+} stream_file_t;
+
+// Tokens live in chunks of `TOKEN_CHUNK_SIZE`, `first_chunk` is the number of `chunks[0]`.
+// Files being lexed are on the `stack`, the included one on the top.
+struct token_source_t {
+	token_t **chunks;
+	u32 chunks_count;
+	u32 chunks_cap;
+	size_t first_chunk;
+
+	stream_lexer_t *stack;
+	u32 stack_count;
+	u32 stack_cap;
+
+	stream_file_t *lexed;
+	u32 lexed_count;
+	u32 lexed_cap;
+};
+
+INLINE const token_t *
+token_source_at(const token_source_t *source, size_t idx)
 {
-	for (size_t i = 0; i < line.count; ++i) {
-		const ss_t ss = line.items[i];
-		if (ss.str == NULL || *ss.str == '\0' || *ss.str == '#') continue;
+	return &source->chunks[idx / TOKEN_CHUNK_SIZE - source->first_chunk][idx % TOKEN_CHUNK_SIZE];
+}
 
-		const loc_t loc = (loc_t) {
-			.row = lexer->row,
-			.col = ss.col,
-			.file_id = lexer->file_id
-		};
+const token_t *
+token_stream_at(token_stream_t *ts, size_t idx)
+{
+	static const token_t eof = {
+		.loc_id = 0,
+		.kind = TOKEN_KEYWORDS_END,
+		.sym = SYM_NONE,
+		.len = 5,
+		.str = "<eof>"
+	};
 
-		const token_kind_t kind = type_token(ss.str, &loc);
+	if (idx >= ts->count) return &eof;
 
-		if (kind == TOKEN_STRING_LITERAL && ss.str[strlen(ss.str) - 1] != '"') {
-			eprintf("%s error: no closing quote found bruv", loc_to_str(&loc));
-			report_error("note: only single line string literals are supported yet..", "");
-		}
+	if (ts->source != NULL) return token_source_at(ts->source, idx);
 
-		if (kind == TOKEN_LITERAL && 0 == strcmp(ss.str, "include")) {
-			handle_include(lexer, line, &loc, tokens);
-			return;
+	// Tokens are mostly accessed in order, so start from the last span
+	const token_span_t *span = &ts->spans[ts->span_cur];
+	if (idx < span->start || idx >= span->start + span->count) {
+		size_t lo = 0, hi = vec_size(ts->spans);
+		while (hi - lo > 1) {
+			const size_t mid = lo + (hi - lo) / 2;
+			if (ts->spans[mid].start <= idx) lo = mid;
+			else hi = mid;
 		}
 
-		token_t token = new_token(loc, kind, ss.str);
-		tokens->tokens[tokens->count++] = token;
+		ts->span_cur = lo;
+		span = &ts->spans[lo];
 	}
+
+	return &tokens_pool[span->pool_idx].tokens[span->first + (idx - span->start)];
 }
 
-INLINE size_t utf8_char_len(unsigned char c)
+static void
+token_stream_add_span(token_stream_t *ts, u32 pool_idx, u32 first, u32 count)
 {
-	if ((u32) c < 0x80)    return 1;
-	if ((u32) c < 0x800)   return 2;
-	if ((u32) c < 0x10000) return 3;
-	return 4;
+	if (count == 0) return;
+
+	const token_span_t span = {
+		.pool_idx = pool_idx,
+		.first = first,
+		.count = count,
+		.start = (u32) ts->count
+	};
+
+	vec_add(ts->spans, span);
+	ts->count += count;
 }
 
-line_t
-split(char *input, char delim)
+static bool token_cache_enabled = false;
+
+// Units by file id, every file is lexed only once
+static lex_unit_t *lex_units = NULL;
+static u32 lex_units_cap = 0;
+
+static void
+lex_unit_add(Lexer lexer)
 {
-	// trim newline from `fgets`
-	size_t len_ = strlen(input);
-	if (len_ > 0 && input[len_ - 1] == '\n') {
-		input[--len_] = '\0';
+	if (lexer.file_id >= lex_units_cap) {
+		const u32 cap = lex_units_cap ? lex_units_cap * 2 : 64;
+		lex_units = (lex_unit_t *) realloc(lex_units, sizeof(lex_unit_t) * cap);
+		lex_units_cap = cap;
 	}
 
-	for (size_t i = 0; i < len_; ++i) {
-		if (input[i] == '#') {
-			input[i] = '\0';
-			len_ = i - 1;
-			break;
+	// At most one token per two bytes of the source: `lexer_next` ends a token only at a space,
+	// a newline or a comment, so every token but the last one takes at least a byte and its
+	// delimiter. `tokens_append` does not grow the range, and a unit loaded by the token cache
+	// has to fit in it as well.
+	const size_t capacity = lexer.file->src_len / 2 + 1;
+	const u32 pool_idx = tokens_pool_alloc();
+	tokens_pool[pool_idx] = (tokens_t) {
+		.tokens = (token_t *) reserve_range(sizeof(token_t) * capacity),
+		.capacity = capacity,
+		.count = 0
+	};
+
+	lex_units[lexer.file_id] = (lex_unit_t) {
+		.lexer = lexer,
+		.pool_idx = pool_idx,
+		.cached = false,
+		.spliced = false,
+		.includes = NULL,
+		.includes_count = 0,
+		.includes_cap = 0
+	};
+}
+
+// Read the string literal after the `include` keyword into `path`
+static void
+lexer_include_path(Lexer *lexer, const token_t *include, token_t *path)
+{
+	if (TOKEN_STRING_LITERAL != lexer_next(lexer, path)) {
+		report_error("%s error: expected string literal after `include` keyword",
+								 loc_to_str(include->loc_id));
+	}
+
+	if (path->len == 2) {
+		report_error("%s error: `include` with an empty string literal after",
+								 loc_to_str(path->loc_id));
+	}
+}
+
+static void
+lex_unit_include(lex_unit_t *unit, const token_t *include)
+{
+	token_t token;
+	lexer_include_path(&unit->lexer, include, &token);
+
+	if (unit->includes_count >= unit->includes_cap) {
+		unit->includes_cap = unit->includes_cap ? unit->includes_cap * 2 : 8;
+		unit->includes = (include_t *) realloc(unit->includes, sizeof(include_t) * unit->includes_cap);
+	}
+
+	unit->includes[unit->includes_count++] = (include_t) {
+		.at = (u32) tokens_pool[unit->pool_idx].count,
+		.path_loc_id = token.loc_id,
+		.path = token.str + 1,
+		.path_len = token.len - 2,
+		.file_id = 0
+	};
+}
+
+// Runs on worker threads, touches only the unit and its own slot in the `tokens_pool`
+static void
+lex_unit_task(void *arg)
+{
+	lex_unit_t *unit = (lex_unit_t *) arg;
+	tokens_t *tokens = &tokens_pool[unit->pool_idx];
+
+	// Hash the source before it gets terminated in place
+	u64 hash = 0;
+	if (unit->cached) {
+		const file_t *file = &fileid(unit->lexer.file_id);
+		hash = token_cache_hash(file->src, file->src_len);
+		if (token_cache_load(unit, hash)) return;
+	}
+
+	token_t token;
+	token_kind_t kind;
+	while (TOKEN_KEYWORDS_END != (kind = lexer_next(&unit->lexer, &token))) {
+		if (kind == TOKEN_LITERAL && token.len == 7 && 0 == memcmp(token.str, "include", 7)) {
+			lex_unit_include(unit, &token);
+			continue;
 		}
+
+		tokens_append(tokens, token);
+	}
+
+	if (unit->cached) token_cache_store(unit, hash);
+}
+
+static void
+lex_wave(file_id_t *wave, int threads)
+{
+	const u32 count = vec_size(wave);
+	if (threads <= 1 || count == 1) {
+		FOREACH(file_id_t, file_id, wave) lex_unit_task(&lex_units[file_id]);
+		return;
 	}
 
-	// do rtrim
-	while (isspace(input[len_])) {
-		input[len_] = '\0';
-		len_ -= 1;
+	Task *tasks = (Task *) malloc(sizeof(Task) * count);
+	Task **task_list = NULL;
+	FOREACH_IDX(i, file_id_t, file_id, wave) {
+		tasks[i] = (Task) { .task = lex_unit_task, .arg = &lex_units[file_id] };
+		vec_add(task_list, &tasks[i]);
 	}
 
-	// do ltrim
-	size_t lspace_count = 0;
-	while (isspace(*input)) {
-		input++;
-		lspace_count++;
+	taskqueue_run(threads < (int) count ? threads : (int) count, task_list);
+	free(tasks);
+}
+
+// Read the files included by the unit, and queue the ones that were never lexed
+static void
+lex_unit_resolve(file_id_t unit_id, file_id_t **next_wave)
+{
+	for (u32 i = 0; i < lex_units[unit_id].includes_count; ++i) {
+		include_t *include = &lex_units[unit_id].includes[i];
+
+		scratch_buffer_clear();
+		scratch_buffer_append_len(include->path, include->path_len);
+
+		const file_t file = read_entire_file(scratch_buffer_to_string(), include->path_loc_id);
+		include->file_id = file.file_id;
+		if (fileid(file.file_id).lexed) continue;
+
+		// `include` may point into the old units after this
+		lex_unit_add(new_lexer(file.file_id));
+		lex_units[file.file_id].cached = token_cache_enabled;
+		vec_add(*next_wave, file.file_id);
+	}
+}
+
+// Move symbols of the unit into `SYMBOLS`
+static void
+lex_unit_merge(lex_unit_t *unit)
+{
+	Lexer *lexer = &unit->lexer;
+
+	sym_id_t *syms = (sym_id_t *) malloc(sizeof(sym_id_t) * (lexer->syms.size + 1));
+	syms[SYM_NONE] = SYM_NONE;
+	for (sym_id_t id = SYM_NONE + 1; id < lexer->syms.size; ++id) {
+		const symbol_t *sym = &lexer->syms.syms[id];
+		syms[id] = symtab_intern(&SYMBOLS, sym->str, sym->len, sym->hash);
 	}
 
-	const size_t len = strlen(input);
+	tokens_t *tokens = &tokens_pool[unit->pool_idx];
+	for (size_t i = 0; i < tokens->count; ++i) {
+		tokens->tokens[i].sym = syms[tokens->tokens[i].sym];
+	}
 
-	line_t ret = {
+	free(syms);
+	symtab_free(&lexer->syms);
+}
+
+// Splice the tokens of the unit into the stream, with included files in place of their `include`s,
+// in the same order the files would be lexed serially.
+static void
+lex_unit_splice(file_id_t unit_id, token_stream_t *ts)
+{
+	lex_unit_t *unit = &lex_units[unit_id];
+	unit->spliced = true;
+	lex_unit_merge(unit);
+
+	u32 first = 0;
+	for (u32 i = 0; i < unit->includes_count; ++i) {
+		const include_t *include = &unit->includes[i];
+		token_stream_add_span(ts, unit->pool_idx, first, include->at - first);
+		if (!lex_units[include->file_id].spliced) lex_unit_splice(include->file_id, ts);
+		first = include->at;
+	}
+
+	token_stream_add_span(ts, unit->pool_idx, first, tokens_pool[unit->pool_idx].count - first);
+	free(unit->includes);
+	unit->includes = NULL;
+}
+
+// Lex the file and everything it includes. Files of the include graph are discovered in waves,
+// files of one wave are lexed in parallel, and then merged serially so the result doesn't
+// depend on the amount of threads. The parser reads the merged stream on one thread.
+token_stream_t
+lexer_lex(Lexer *lexer)
+{
+	const file_id_t root = lexer->file_id;
+	lex_unit_add(*lexer);
+
+	// Only included files are cached, the root file is the one that is being edited
+#ifndef NO_TOKEN_CACHE
+	token_cache_enabled = token_cache_init();
+#endif
+
+#ifdef LEXER_THREADS
+	const int threads = LEXER_THREADS;
+#else
+	const int threads = cpus();
+#endif
+
+	file_id_t *wave = NULL;
+	file_id_t *next_wave = NULL;
+	vec_add(wave, root);
+
+	while (vec_size(wave) > 0) {
+		lex_wave(wave, threads);
+
+		vec_resize(next_wave, 0);
+		FOREACH(file_id_t, file_id, wave) lex_unit_resolve(file_id, &next_wave);
+
+		file_id_t *tmp = wave;
+		wave = next_wave;
+		next_wave = tmp;
+	}
+
+	token_stream_t ts = {
+		.spans = NULL,
+		.span_cur = 0,
 		.count = 0,
-		.items = (sss_t) malloc(sizeof(ss_t) * 1024)
+		.source = NULL
 	};
 
-	size_t s = 0;
-	size_t e = 0;
-	size_t i = 0;
+	lex_unit_splice(root, &ts);
 
-	bool in_single_quote = false;
-	bool in_double_quote = false;
+	free(lex_units);
+	lex_units = NULL;
+	lex_units_cap = 0;
 
-	for (; i < len; ++i) {
-		char c = input[i];
+	return ts;
+}
 
-		if (c == '\'' && !in_double_quote) {
-			in_single_quote = !in_single_quote;
-		} else if (c == '"' && !in_single_quote) {
-			in_double_quote = !in_double_quote;
-		} else if (c == delim && !in_single_quote && !in_double_quote) {
-			if (s < i) {
-				scratch_buffer_clear();
-				for (size_t i_ = s; i_ < i; ++i_) {
-					scratch_buffer_append_char(input[i_]);
-				}
-
-				ret.items[ret.count++] = (ss_t) {
-					.col = s + lspace_count,
-					.str = scratch_buffer_copy(),
-				};
-
-				s = i + utf8_char_len(c);
-
-				// Skip consecutive delimiters
-				while (s < len && input[s] == delim) s++;
-				i = s - 1;
-			} else {
-				e = i + utf8_char_len(c);
+static void
+token_source_push(token_source_t *source, file_id_t file_id)
+{
+	if (source->stack_count >= source->stack_cap) {
+		source->stack_cap = source->stack_cap ? source->stack_cap * 2 : 8;
+		source->stack = (stream_lexer_t *) realloc(source->stack, sizeof(stream_lexer_t) * source->stack_cap);
+	}
+
+	Lexer lexer = new_lexer(file_id);
+	lexer.syms.copy = true;
+
+	source->stack[source->stack_count++] = (stream_lexer_t) {
+		.lexer = lexer,
+		.syms = NULL,
+		.syms_cap = 0,
+		.released = 0
+	};
+}
+
+INLINE sym_id_t
+stream_lexer_sym(stream_lexer_t *lexer, sym_id_t sym)
+{
+	if (sym == SYM_NONE) return SYM_NONE;
+
+	if (sym >= lexer->syms_cap) {
+		u32 cap = lexer->syms_cap ? lexer->syms_cap : 256;
+		while (cap <= sym) cap *= 2;
+
+		lexer->syms = (sym_id_t *) realloc(lexer->syms, sizeof(sym_id_t) * cap);
+		memset(lexer->syms + lexer->syms_cap, 0, sizeof(sym_id_t) * (cap - lexer->syms_cap));
+		lexer->syms_cap = cap;
+	}
+
+	if (lexer->syms[sym] == SYM_NONE) {
+		const symbol_t *symbol = &lexer->lexer.syms.syms[sym];
+		lexer->syms[sym] = symtab_intern(&SYMBOLS, symbol->str, symbol->len, symbol->hash);
+	}
+
+	return lexer->syms[sym];
+}
+
+// Give back the pages of the source between `*released` and `to`, they are read from the file
+// again if touched. Offsets are rounded down to pages, so the page of `to` stays.
+static void
+release_source(const file_t *file, size_t *released, size_t to)
+{
+	static size_t page_size = 0;
+	if (page_size == 0) page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+	to &= ~(page_size - 1);
+	if (to <= *released) return;
+
+	madvise(file->src + *released, to - *released, MADV_DONTNEED);
+	*released = to;
+}
+
+static void
+token_source_pop(token_source_t *source, size_t end)
+{
+	stream_lexer_t *lexer = &source->stack[--source->stack_count];
+
+	if (source->lexed_count >= source->lexed_cap) {
+		source->lexed_cap = source->lexed_cap ? source->lexed_cap * 2 : 8;
+		source->lexed = (stream_file_t *) realloc(source->lexed, sizeof(stream_file_t) * source->lexed_cap);
+	}
+
+	source->lexed[source->lexed_count++] = (stream_file_t) {
+		.file_id = lexer->lexer.file_id,
+		.end = end,
+		.released = lexer->released
+	};
+
+	free(lexer->syms);
+	symtab_free(&lexer->lexer.syms);
+}
+
+// Lex the next token of the program into the stream, false at the end of the program
+static bool
+token_stream_lex(token_stream_t *ts)
+{
+	token_source_t *source = ts->source;
+
+	token_t token;
+	while (source->stack_count > 0) {
+		stream_lexer_t *top = &source->stack[source->stack_count - 1];
+
+		const token_kind_t kind = lexer_next(&top->lexer, &token);
+		if (kind == TOKEN_KEYWORDS_END) {
+			token_source_pop(source, ts->count);
+			continue;
+		}
+
+		if (kind == TOKEN_LITERAL && token.len == 7 && 0 == memcmp(token.str, "include", 7)) {
+			token_t path;
+			lexer_include_path(&top->lexer, &token, &path);
+
+			scratch_buffer_clear();
+			scratch_buffer_append_len(path.str + 1, path.len - 2);
+
+			const file_t file = read_entire_file(scratch_buffer_to_string(), path.loc_id);
+			if (!fileid(file.file_id).lexed) token_source_push(source, file.file_id);
+			continue;
+		}
+
+		token.sym = stream_lexer_sym(top, token.sym);
+
+		if (ts->count % TOKEN_CHUNK_SIZE == 0) {
+			if (source->chunks_count >= source->chunks_cap) {
+				source->chunks_cap = source->chunks_cap ? source->chunks_cap * 2 : 16;
+				source->chunks = (token_t **) realloc(source->chunks, sizeof(token_t *) * source->chunks_cap);
 			}
+			source->chunks[source->chunks_count++] = (token_t *) malloc(sizeof(token_t) * TOKEN_CHUNK_SIZE);
 		}
+
+		source->chunks[ts->count / TOKEN_CHUNK_SIZE - source->first_chunk][ts->count % TOKEN_CHUNK_SIZE] = token;
+		ts->count++;
+		return true;
 	}
 
-	if (s + e == 0 && i > 0) {
-		scratch_buffer_clear();
-		scratch_buffer_append(input);
-		ret.items[ret.count++] = (ss_t) {
-			.col = s + lspace_count,
-			.str = scratch_buffer_copy(),
-		};
-	} else if (s != e) {
-		scratch_buffer_clear();
-		for (size_t i = s; i < len; ++i) {
-			scratch_buffer_append_char(input[i]);
+	return false;
+}
+
+token_stream_t
+token_stream_open(file_id_t root)
+{
+	token_source_t *source = (token_source_t *) calloc(1, sizeof(token_source_t));
+	token_source_push(source, root);
+
+	return (token_stream_t) {
+		.spans = NULL,
+		.span_cur = 0,
+		.count = 0,
+		.source = source
+	};
+}
+
+bool
+token_stream_fill(token_stream_t *ts, size_t idx)
+{
+	// `inline` and `extern` only prefix the declaration, the rest is balanced by `end`s
+	u32 depth = 0;
+	size_t i = idx;
+	for (;; ++i) {
+		if (i >= ts->count && !token_stream_lex(ts)) break;
+
+		const token_kind_t kind = token_source_at(ts->source, i)->kind;
+		if (kind == TOKEN_INLINE || kind == TOKEN_EXTERN) continue;
+
+		if (token_opens_block(kind)) depth++;
+		else if (kind == TOKEN_END && depth > 0) depth--;
+
+		if (depth == 0) break;
+	}
+
+	while (ts->count < i + 3 && token_stream_lex(ts));
+
+	return idx < ts->count;
+}
+
+void
+token_stream_release(token_stream_t *ts, size_t idx)
+{
+	token_source_t *source = ts->source;
+	if (source == NULL) return;
+
+	const size_t drop = idx / TOKEN_CHUNK_SIZE - source->first_chunk;
+	if (drop > 0) {
+		for (size_t i = 0; i < drop; ++i) free(source->chunks[i]);
+		memmove(source->chunks, source->chunks + drop, sizeof(token_t *) * (source->chunks_count - drop));
+		source->chunks_count -= drop;
+		source->first_chunk += drop;
+	}
+
+	u32 kept = 0;
+	for (u32 i = 0; i < source->lexed_count; ++i) {
+		stream_file_t *file = &source->lexed[i];
+		if (file->end <= idx) {
+			release_source(&fileid(file->file_id), &file->released, fileid(file->file_id).src_len);
+		} else {
+			source->lexed[kept++] = *file;
 		}
-		ret.items[ret.count++] = (ss_t) {
-			.col = s + lspace_count,
-			.str = scratch_buffer_copy(),
-		};
 	}
+	source->lexed_count = kept;
 
-	return ret;
+	// Files being lexed are given back till the first token still in the stream. Files under
+	// its one are given back till where their lexer is, their remaining tokens come later.
+	const token_t *first = idx < ts->count ? token_source_at(source, idx) : NULL;
+	u32 until = first == NULL ? source->stack_count : 0;
+	for (u32 i = 0; i < source->stack_count && first != NULL; ++i) {
+		const Lexer *lexer = &source->stack[i].lexer;
+		if (first->str >= lexer->src && first->str < lexer->end) until = i + 1;
+	}
+
+	for (u32 i = 0; i < until; ++i) {
+		stream_lexer_t *lexer = &source->stack[i];
+		const char *to = lexer->lexer.cur;
+		if (i + 1 == until && first != NULL) to = first->str;
+		release_source(lexer->lexer.file, &lexer->released, to - lexer->lexer.src);
+	}
+}
+
+void
+token_stream_free(token_stream_t *ts)
+{
+	token_source_t *source = ts->source;
+	if (source == NULL) return;
+
+	for (u32 i = 0; i < source->chunks_count; ++i) free(source->chunks[i]);
+	for (u32 i = 0; i < source->stack_count; ++i) {
+		free(source->stack[i].syms);
+		symtab_free(&source->stack[i].lexer.syms);
+	}
+
+	free(source->chunks);
+	free(source->stack);
+	free(source->lexed);
+	free(source);
+	ts->source = NULL;
 }
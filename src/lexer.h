@@ -3,16 +3,12 @@
 
 #include "lib.h"
 #include "file.h"
+#include "symbol.h"
 #include "common.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 
-#define LINE_CAP (1024 * 5)
-#define LINES_CAP (1024 * 500)
-#define TOKENS_LINE_CAP 1024
-#define TOKENS_CAP (1024 * 500)
-#define MAXIMUM_TOKENS_AMOUNT_PER_LINE 100
 
 // NOTE: If you added a new keyword, update `KEYWORDS` array at the top of the `lexer.c` file.
 typedef enum {
@@ -64,21 +60,24 @@ typedef enum {
 #define KEYWORDS_SIZE TOKEN_KEYWORDS_END
 extern const char *KEYWORDS[KEYWORDS_SIZE];
 
-typedef struct {
-	u32 row, col;
-	file_id_t file_id;
-} loc_t;
-
+// Location is a byte offset among the sources of all the files, see `file_t.base`
 typedef u32 loc_id_t;
 
+#define LOC_NONE ((loc_id_t) -1)
+
+// `str` is a view into the source mapping of the file, `len` bytes long,
+// and terminated by the lexer in place.
+// `sym` is the interned name of literals, calls (`name!`) and writes (`!name`).
 typedef struct {
 	loc_id_t loc_id;
 	token_kind_t kind;
+	sym_id_t sym;
+	u32 len;
 	const char *str;
 } token_t;
 
 token_t
-new_token(loc_t loc, token_kind_t token_kind, const char *str);
+new_token(loc_id_t loc_id, token_kind_t token_kind, const char *str, u32 len, sym_id_t sym);
 
 const char *
 token_kind_to_str(token_kind_t token_kind);
@@ -86,81 +85,136 @@ token_kind_to_str(token_kind_t token_kind);
 const char *
 token_kind_to_str_pretty(const token_kind_t token_kind);
 
+// Format the location as `path:row:col:`, row and column are looked up only here
 const char *
-loc_to_str(const loc_t *loc);
+loc_to_str(loc_id_t loc);
 
 const char *
 token_to_str(const token_t *token);
 
-typedef struct {
-	u32 col;
-	const char *str;
-} ss_t;
-
-typedef ss_t *sss_t;
-typedef ss_t **sss2D_t;
-
+// Tokens of a single file, every file is lexed only once. `tokens` is a range of the
+// `reserve_range` arena with room for as many tokens as the file can have.
 typedef struct {
 	size_t count;
+	size_t capacity;
 	token_t *tokens;
 } tokens_t;
 
+// Range of tokens of the file from the `tokens_pool` spliced into the stream,
+// `start` is the index of the first token of the span in the stream.
 typedef struct {
-	sss_t items;
-	size_t count;
-} line_t;
+	u32 pool_idx;
+	u32 first;
+	u32 count;
+	u32 start;
+} token_span_t;
+
+typedef struct token_source_t token_source_t;
 
+// Tokens of the whole program, as a sequence of spans in the order of includes.
+// In the streaming mode `source` is set instead, and `count` is the amount of tokens lexed so far.
 typedef struct {
+	token_span_t *spans;
+	size_t span_cur;
 	size_t count;
-	line_t *lines;
-} lines_t;
 
+	token_source_t *source;
+} token_stream_t;
+
+// Token at `idx` of the stream, or an `eof` token with `TOKEN_KEYWORDS_END` kind if out of range.
+const token_t *
+token_stream_at(token_stream_t *ts, size_t idx);
+
+// Tokens closed by an `end`, `do` of `while`, `func` and `proc` shares the `end` of its opener
+INLINE bool
+token_opens_block(token_kind_t kind)
+{
+	return kind == TOKEN_IF
+		|| kind == TOKEN_WHILE
+		|| kind == TOKEN_FUNC
+		|| kind == TOKEN_PROC
+		|| kind == TOKEN_CONST
+		|| kind == TOKEN_VAR;
+}
+
+#define TOKEN_CHUNK_SIZE 4096
+
+// Stream of the program lexed on demand, starting with the `root` file
+token_stream_t
+token_stream_open(file_id_t root);
+
+// Lex till the whole top level declaration starting at `idx` is in the stream, with a few
+// tokens after it for the lookahead of the parser. Returns false if there is no token at `idx`.
+bool
+token_stream_fill(token_stream_t *ts, size_t idx);
+
+// Drop the tokens before `idx`, and the sources under them
+void
+token_stream_release(token_stream_t *ts, size_t idx);
+
+void
+token_stream_free(token_stream_t *ts);
+
+#define tokenat(ts_, idx_) (*token_stream_at(&(ts_), idx_))
+
+// Symbols of the tokens are local to the lexer, so files can be lexed on worker threads.
+// They are merged into `SYMBOLS` in the order of includes. Line starts go right into
+// the `file`, nothing else touches it while the file is being lexed.
 typedef struct {
-	u32 row;
-	lines_t lines;
+	char *cur;
+	char *end;
+	const char *src;
+	file_t *file;
 	file_id_t file_id;
+
+	symtab_t syms;
 } Lexer;
 
 Lexer
-new_lexer(file_id_t file_id, lines_t lines);
-
-tokens_t
-lexer_lex(Lexer *lexer);
+new_lexer(file_id_t file_id);
 
-line_t
-split(char *input, char delim);
+// `include` of the file, spliced into the stream right before the token `at`
+typedef struct {
+	u32 at;
+	loc_id_t path_loc_id;
+	const char *path;
+	u32 path_len;
+	file_id_t file_id;
+} include_t;
 
-token_kind_t
-type_token(const char *str, const loc_t *loc);
+// A file lexed on its own, locations and symbols of its tokens are local to it until merged
+typedef struct {
+	Lexer lexer;
+	u32 pool_idx;
+	bool cached;
+	bool spliced;
 
-void
-lexer_lex_line(Lexer *lexer, line_t line, tokens_t *ret);
+	include_t *includes;
+	u32 includes_count;
+	u32 includes_cap;
+} lex_unit_t;
 
-// read entire file into the global lines pool
-file_t
-read_entire_file(const char *file_path, const loc_t *report_loc);
+token_stream_t
+lexer_lex(Lexer *lexer);
 
-#define LINES_POOL_CAP 1024
-extern size_t lines_pool_count;
-extern lines_t lines_pool[LINES_POOL_CAP];
+token_kind_t
+type_token(const char *str, u32 len, loc_id_t loc);
 
-#define last_lines (lines_pool[lines_pool_count - 1])
-#define append_lines(lines_) (lines_pool[lines_pool_count++] = lines_)
+// map entire file into the global files pool, `report_loc` may be `LOC_NONE`
+file_t
+read_entire_file(const char *file_path, loc_id_t report_loc);
 
-#define TOKENS_POOL_CAP 1024
+#define TOKENS_POOL_ARENA_MB 64
 extern size_t tokens_pool_count;
-extern tokens_t tokens_pool[TOKENS_POOL_CAP];
+extern tokens_t *tokens_pool;
 
-#define last_tokens (tokens_pool[tokens_pool_count - 1])
-#define append_tokens(tokens_) (tokens_pool[tokens_pool_count++] = tokens_)
+// Reserve the slot for tokens of one file in the `tokens_pool`
+u32
+tokens_pool_alloc(void);
 
-#define LOCS_CAP (1024 * 500)
-extern loc_id_t LOCS_SIZE;
-extern loc_t LOCS[LOCS_CAP];
+void
+tokens_pool_arena_free(void);
 
-#define locid(id) (LOCS[id])
-#define locs_len (LOCS_SIZE)
-#define last_loc (LOCS[LOCS_SIZE - 1])
-#define append_loc(loc_) (LOCS[LOCS_SIZE++] = loc_)
+#define last_tokens (tokens_pool[tokens_pool_count - 1])
 
 #endif // LEXER_H_
@@ -105,6 +105,7 @@ void memory_release(void);
 #define idptr(id_) ((void*)(((uintptr_t)id_) * 16 + arena_zero))
 void *calloc_arena(size_t mem);
 char *calloc_string(size_t len);
+void *reserve_range(size_t size);
 #ifdef NDEBUG
 #define malloc_string calloc_string
 #define malloc_arena calloc_arena
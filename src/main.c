@@ -3,15 +3,17 @@
 #include "ast.h"
 #include "vmem.h"
 #include "file.h"
+#include "cache.h"
 #include "lexer.h"
 #include "parser.h"
 #include "common.h"
 #include "compiler.h"
+#include "peephole.h"
+#include "ir.h"
+#include "regalloc.h"
+#include "assembler.h"
 #include "consteval.h"
 
-#define STB_DS_IMPLEMENTATION
-#include "stb_ds.h"
-
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
@@ -20,59 +22,77 @@
 // global variable to time using `set_time` and `dbg_time` macros from `common.h`
 clock_t _time = 0;
 
-static var_map_t *var_map = NULL;
-static const_map_t *const_map = NULL;
+static consteval_map_t var_map = {0};
+static consteval_map_t const_map = {0};
+
+// Kept till the end, bodies of procs and funcs are parsed when the compiler gets to them
+static Parser parser = {0};
+
+// Assemble with fasm or nasm instead of the built-in assembler
+static bool external_asm = false;
+
+// Parse and check only the bodies reachable from main, the others can hide errors
+static bool reachable_only = false;
 
 void
 main_deinit(void)
 {
-	for (size_t i = 0; i < tokens_pool_count; ++i) {
-		free(tokens_pool[i].tokens);
-	}
-	for (size_t i = 0; i < lines_pool_count; ++i) {
-		free(lines_pool[i].lines);
-	}
-	shfree(var_map);
-	shfree(const_map);
+	consteval_map_free(&var_map);
+	consteval_map_free(&const_map);
+	compiler_abort();
+	token_stream_free(&parser.ts);
+	parser_free(&parser);
+	tokens_pool_arena_free();
+	files_release();
+	files_arena_free();
+	ast_store_free(&ASTS);
+	symbols_release();
 	memory_release();
 }
 
+static void
+check_main_signature(void)
+{
+	const func_stmt_t *main_stmt = ast_func(main_function);
+	if (*main_stmt->ret_types != VALUE_KIND_INTEGER
+	|| vec_size(main_stmt->args) != 0)
+	{
+		report_error("%s error: main function has wrong signature. \n"
+								 "  note: expected signature: func int do <...> end",
+								 loc_to_str(ast_loc(main_function)));
+	}
+}
+
 static void
 check_for_main_function(const char *file_path)
 {
-	main_function_check(true, astid(0));
+	main_function_check(true, 0);
 	if(main_function == -1) {
 		report_error("%s:0:0: no main at top level function found", file_path);
 	}
 
-	if (*astid(main_function).func_stmt.ret_types != VALUE_KIND_INTEGER
-	|| vec_size(astid(main_function).func_stmt.args) != 0)
-	{
-		report_error("%s error: main function has wrong signature. \n"
-								 "  note: expected signature: func int do <...> end",
-								 loc_to_str(&locid(astid(main_function).loc_id)));
-	}
+	check_main_signature();
 }
 
 static void
 consteval_step(void)
 {
-	ast_t ast = astid(0);
+	ast_id_t ast_id = 0;
 	Consteval consteval = new_consteval(&const_map);
 
 #ifdef DEBUG
 	set_time;
 #endif
 
-	while (ast.next && ast.next <= ASTS_SIZE) {
-		if (ast.ast_kind == AST_CONST) {
-			const consteval_value_t value = consteval_eval(&consteval, &ast, false);
-			shput(const_map, ast.const_stmt.name->str, value);
-		} else if (ast.ast_kind == AST_VAR) {
-			const consteval_value_t value = consteval_eval(&consteval, &ast, true);
-			shput(var_map, ast.var_stmt.name->str, value);
+	while (ast_next(ast_id) && ast_next(ast_id) <= asts_len) {
+		if (ast_kind(ast_id) == AST_CONST) {
+			const consteval_value_t value = consteval_eval(&consteval, ast_id, false);
+			consteval_map_put(&const_map, ast_const(ast_id)->name->sym, value);
+		} else if (ast_kind(ast_id) == AST_VAR) {
+			const consteval_value_t value = consteval_eval(&consteval, ast_id, true);
+			consteval_map_put(&var_map, ast_var(ast_id)->name->sym, value);
 		}
-		ast = astid(ast.next);
+		ast_id = ast_next(ast_id);
 	}
 
 #ifdef DEBUG
@@ -80,33 +100,42 @@ consteval_step(void)
 #endif
 }
 
-static tokens_t
+static token_stream_t
 lex_step(const char *file_path)
 {
-	const file_t file = read_entire_file(file_path, NULL);
-	Lexer lexer = new_lexer(file.file_id, last_lines);
+	const file_t file = read_entire_file(file_path, LOC_NONE);
+	Lexer lexer = new_lexer(file.file_id);
 
 #ifdef DEBUG
 	set_time;
 #endif
 
-	tokens_t tokens = lexer_lex(&lexer);
+	token_stream_t tokens = lexer_lex(&lexer);
 
 #ifdef PRINT_TOKENS
-	for (size_t i = 0; i < lexer.tokens.count; ++i) printf("%s\n", token_to_str(&tokens.tokens[i]));
+	for (size_t i = 0; i < tokens.count; ++i) printf("%s\n", token_to_str(token_stream_at(&tokens, i)));
 #endif
 
 #ifdef DEBUG
 	dbg_time("lexing");
+
+	size_t bytes_lexed = 0;
+	for (file_id_t i = 0; i < files_len; ++i) bytes_lexed += fileid(i).src_len;
+	print_throughput(_time, clock(), bytes_lexed, "lexing");
+	token_cache_print_stats();
 #endif
 
 	return tokens;
 }
 
+// Parsing stays serial, unlike lexing. The files are spliced into one token stream at their
+// include sites and the AST ids are indices into the one global store, in source order, so
+// parsing the files apart would mean remapping every id on the merge. Only the top level is
+// parsed here anyway, the bodies are parsed lazily by the compiler.
 static void
-parse_step(const tokens_t tokens)
+parse_step(token_stream_t tokens)
 {
-	Parser parser = new_parser(tokens);
+	parser = new_parser(tokens, &ASTS);
 
 #ifdef DEBUG
 	set_time;
@@ -115,7 +144,7 @@ parse_step(const tokens_t tokens)
 	parser_parse(&parser);
 
 #ifdef PRINT_ASTS
-	for (ast_id_t i = 0; i < asts_len; ++i) print_ast(&astid(i));
+	for (ast_id_t i = 0; i < asts_len; ++i) print_ast(i);
 #endif
 
 #ifdef DEBUG
@@ -126,7 +155,9 @@ parse_step(const tokens_t tokens)
 static void
 compile_step(void)
 {
-	Compiler compiler = new_compiler(main_function, const_map, var_map);
+	Compiler compiler = new_compiler(main_function, &parser, &const_map, &var_map);
+	compiler.reachable_only = reachable_only;
+	compiler.external_asm = external_asm;
 
 #ifdef DEBUG
 	set_time;
@@ -136,11 +167,31 @@ compile_step(void)
 
 #ifdef DEBUG
 	dbg_time("compiling");
+	func_cache_print_stats();
+	ir_print_stats();
+	regalloc_print_stats();
+	peephole_print_stats();
 #endif
 }
 
 static void
-compile_asm_step(void)
+check_step(void)
+{
+	Compiler compiler = new_compiler(main_function, &parser, &const_map, &var_map);
+
+#ifdef DEBUG
+	set_time;
+#endif
+
+	compiler_check(&compiler);
+
+#ifdef DEBUG
+	dbg_time("checking");
+#endif
+}
+
+static void
+external_asm_step(void)
 {
 	Nob_Cmd cmd = {0};
 
@@ -167,6 +218,112 @@ compile_asm_step(void)
 	nob_cmd_free(cmd);
 }
 
+// The records are encoded while compiling, the executable is written directly, only
+// a program with externs is linked by `ld`
+static void
+assemble_step(void)
+{
+#ifdef DEBUG
+	set_time;
+#endif
+
+	const bool linked = assembler_close(EXECUTABLE_OUTPUT, OBJECT_OUTPUT);
+
+#ifdef DEBUG
+	dbg_time("assembling");
+#endif
+
+	if (linked) return;
+
+	Nob_Cmd cmd = {0};
+	nob_cmd_append(&cmd, PATH_TO_LD_EXECUTABLE, OBJECT_OUTPUT, LD_OUTPUT_FLAGS);
+	nob_cmd_run_sync(cmd, 1);
+	nob_cmd_free(cmd);
+}
+
+static void
+compile_asm_step(void)
+{
+	if (external_asm) external_asm_step();
+	else assemble_step();
+}
+
+static const char *stream_file_path = NULL;
+
+// Streaming sees a top level item before the ones after it, so its first error can differ from
+// the one batch mode reports for the same file. On an error the file is checked in batch mode,
+// which reports the error instead when it finds one.
+static bool
+stream_error_reported_by_check(void)
+{
+	Nob_Cmd cmd = {0};
+	nob_cmd_append(&cmd, "/proc/self/exe", "--check", stream_file_path);
+	const bool failed = !nob_cmd_run_sync(cmd, false);
+	nob_cmd_free(cmd);
+	return failed;
+}
+
+// Lex, parse, evaluate and compile one top level item at a time. Bodies of the compiled
+// items are dropped and the consumed tokens and source given back, so the memory does not
+// grow with the size of the bodies.
+static void
+stream_step(const char *file_path)
+{
+	const file_t file = read_entire_file(file_path, LOC_NONE);
+
+	stream_file_path = file_path;
+	errors_hold(stream_error_reported_by_check);
+
+#ifdef DEBUG
+	set_time;
+#endif
+
+	parser = new_parser(token_stream_open(file.file_id), &ASTS);
+	parser.stream = true;
+
+	Compiler compiler = new_compiler(-1, &parser, &const_map, &var_map);
+	compiler.external_asm = external_asm;
+	Consteval consteval = new_consteval(&const_map);
+
+	ast_id_t ast_id = parser_parse_next(&parser);
+	if (ast_id == -1) return;
+
+	compiler_stream_begin(&compiler);
+
+	for (; ast_id != -1; ast_id = parser_parse_next(&parser)) {
+		if (top_level_check(ast_id)) check_main_signature();
+
+		if (ast_kind(ast_id) == AST_CONST) {
+			const consteval_value_t value = consteval_eval(&consteval, ast_id, false);
+			consteval_map_put(&const_map, ast_const(ast_id)->name->sym, value);
+		} else if (ast_kind(ast_id) == AST_VAR) {
+			const consteval_value_t value = consteval_eval(&consteval, ast_id, true);
+			consteval_map_put(&var_map, ast_var(ast_id)->name->sym, value);
+		}
+
+		// Consts and vars are bound to their evaluated entries
+		compiler_stream_declare(&compiler, ast_id);
+
+		if (compiler_stream_emit(&compiler, ast_id)) parser_drop_body(&parser, ast_id);
+		token_stream_release(&parser.ts, parser.token_idx);
+	}
+
+	if (main_function == -1) {
+		report_error("%s:0:0: no main at top level function found", file_path);
+	}
+
+	compiler_stream_end(&compiler);
+
+#ifdef DEBUG
+	dbg_time("streaming");
+	ir_print_stats();
+	regalloc_print_stats();
+	peephole_print_stats();
+#endif
+
+	compile_asm_step();
+}
+
 UNUSED
 void print_elapsed(clock_t start, clock_t end, const char *what)
 {
@@ -174,25 +331,59 @@ void print_elapsed(clock_t start, clock_t end, const char *what)
 	printf("%s took: %.0fus\n", what, elapsed * 1000000);
 }
 
+UNUSED
+void print_throughput(clock_t start, clock_t end, size_t bytes, const char *what)
+{
+	double elapsed = (double) (end - start) / CLOCKS_PER_SEC;
+	if (elapsed <= 0) return;
+	printf("%s throughput: %.2f MB/s (%zu bytes)\n", what, bytes / elapsed / (1024 * 1024), bytes);
+}
+
 int
 main(int argc, const char *argv[])
 {
-	if (argc < 2) {
-		eprintf("Usage: %s <file_path>\n", argv[0]);
+	bool stream = false, check = false, usage = false;
+	const char *file_path = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "--stream")) stream = true;
+		else if (0 == strcmp(argv[i], "--check")) check = true;
+		else if (0 == strcmp(argv[i], "--reachable-only")) reachable_only = true;
+		else if (0 == strcmp(argv[i], "--asm")) external_asm = true;
+		else if (file_path == NULL) file_path = argv[i];
+		else usage = true;
+	}
+
+	if (usage || file_path == NULL || stream + check + reachable_only > 1) {
+		eprintf("Usage: %s [--stream | --check | --reachable-only] [--asm] <file_path>\n", argv[0]);
 		exit(1);
 	}
 
-	const char *file_path = argv[1];
-	memory_init(3);
-	const tokens_t tokens = lex_step(file_path);
+	memory_init(0);
+
+	if (stream) {
+		stream_step(file_path);
+		goto ret;
+	}
+
+	const token_stream_t tokens = lex_step(file_path);
 	parse_step(tokens);
 	if (asts_len == 0) goto ret;
 	check_for_main_function(file_path);
 	consteval_step();
+
+	// Only report the errors, nothing is compiled
+	if (check) {
+		check_step();
+		goto ret;
+	}
+
 	compile_step();
 	compile_asm_step();
 
 ret:
+#ifdef DEBUG
+	print_arena_status();
+#endif
 	main_deinit();
 	return 0;
 }
@@ -12,18 +12,26 @@
 #define KB 1024ul
 // Use 1MB at a time.
 #define MB (KB * 1024ul)
+#define RANGE_ARENA_MB 16384
 
 static int allocations_done;
 static Vmem arena;
 uintptr_t arena_zero;
 static Vmem char_arena;
 
+// Containers of a file that grow in place, each one gets a range sized for its worst case.
+// Pages are backed only once touched, and everything goes with a single munmap.
+static int ranges_reserved;
+static Vmem range_arena;
+
 void memory_init(size_t max_mem)
 {
 	if (max_mem) vmem_set_max_limit(max_mem);
 	vmem_init(&arena, 2048);
 	vmem_init(&char_arena, 512);
+	vmem_init(&range_arena, RANGE_ARENA_MB);
 	allocations_done = 0;
+	ranges_reserved = 0;
 	arena_zero = (uintptr_t) arena.ptr;
 	vmem_alloc(&arena, 16);
 }
@@ -32,6 +40,7 @@ void memory_release(void)
 {
 	vmem_free(&arena);
 	vmem_free(&char_arena);
+	vmem_free(&range_arena);
 }
 
 void *calloc_string(size_t len)
@@ -51,12 +60,22 @@ void *calloc_arena(size_t mem)
 	return vmem_alloc(&arena, mem);
 }
 
+// Rounded to pages, so the ranges filled by different threads never share one
+void *reserve_range(size_t size)
+{
+	assert(size > 0);
+	size = (size + 4095U) & ~4095ULL;
+	ranges_reserved++;
+	return vmem_alloc(&range_arena, size);
+}
+
 void print_arena_status(void)
 {
 	printf("-- ARENA INFO -- \n");
 	printf(" * Memory used:  %zu Kb\n", arena.allocated / 1024);
 	printf(" * Allocations: %d\n", allocations_done);
 	printf(" * String memory used:  %zu Kb\n", char_arena.allocated / 1024);
+	printf(" * Ranges reserved: %d (%zu Kb)\n", ranges_reserved, range_arena.allocated / 1024);
 }
 
 void free_arena(void)
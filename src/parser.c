@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 #undef report_error
 #define report_error(fmt, ...) do { \
@@ -31,42 +32,195 @@ parse_int(const char *str)
 	return ret;
 }
 
+// Type named by the token, -1 if the token does not name a type
+INLINE i32
+token_value_kind(const token_t *token)
+{
+	if (token->kind != TOKEN_LITERAL || token->str[token->len - 1] == '!') return -1;
+	return value_kind_try_from_sym(token->sym);
+}
+
 Parser
-new_parser(const tokens_t ts)
+new_parser(token_stream_t ts, ast_store_t *asts)
 {
 	return (Parser) {
 		.ts = ts,
+		.asts = asts,
+		.next = asts->size,
+		.token_idx = 0,
+		.cond_is_not_empty = false,
+		.if_count = 0,
+		.else_count = 0,
+		.blocks = NULL,
+		.blocks_count = 0,
+		.blocks_cap = 0,
+		.stream = false,
+		.item = ast_store_mark(asts)
 	};
 }
 
-static ast_id_t next = 0;
-static size_t token_idx = 0;
+INLINE const char *
+parser_keep_str(const Parser *parser, const token_t *token)
+{
+	if (!parser->stream) return token->str;
+
+	char *str = calloc_string(token->len + 1);
+	memcpy(str, token->str, token->len);
+	return str;
+}
+
+// Tokens of a stream are freed once parsed, so the ones kept in the tree are copied out
+static const token_t *
+parser_keep_token(Parser *parser, const token_t *token)
+{
+	if (!parser->stream) return token;
+
+	token_t *copy = (token_t *) calloc_arena(sizeof(token_t));
+	*copy = *token;
+	copy->str = parser_keep_str(parser, token);
+	return copy;
+}
+
+void
+parser_free(Parser *parser)
+{
+	free(parser->blocks);
+	parser->blocks = NULL;
+	parser->blocks_count = 0;
+	parser->blocks_cap = 0;
+}
+
+INLINE u32
+parser_add_block(Parser *parser, u32 open)
+{
+	if (parser->blocks_count >= parser->blocks_cap) {
+		parser->blocks_cap = parser->blocks_cap ? parser->blocks_cap * 2 : 256;
+		parser->blocks = (block_t *) realloc(parser->blocks, sizeof(block_t) * parser->blocks_cap);
+	}
+
+	parser->blocks[parser->blocks_count] = (block_t) { .open = open, .end = BLOCK_END_NONE };
+	return parser->blocks_count++;
+}
+
+// `do` of `while`, `func` and `proc` is closed by the `end` of its opener, so every open
+// block remembers the block of its `do`. Unbalanced `end`s are left for the parser to report.
+void
+parser_match_blocks(Parser *parser)
+{
+	typedef struct {
+		u32 block;
+		u32 do_block;
+	} open_block_t;
+
+	open_block_t *stack = NULL;
+	u32 stack_size = 0, stack_cap = 0;
+
+	parser->blocks_count = 0;
+	FOREACH(token_span_t, span, parser->ts.spans) {
+		const token_t *tokens = &tokens_pool[span.pool_idx].tokens[span.first];
+		for (u32 i = 0; i < span.count; ++i) {
+			const u32 idx = span.start + i;
+			const token_kind_t kind = tokens[i].kind;
+			if (token_opens_block(kind)) {
+				if (stack_size >= stack_cap) {
+					stack_cap = stack_cap ? stack_cap * 2 : 64;
+					stack = (open_block_t *) realloc(stack, sizeof(open_block_t) * stack_cap);
+				}
+				stack[stack_size++] = (open_block_t) {
+					.block = parser_add_block(parser, idx),
+					.do_block = BLOCK_END_NONE
+				};
+			} else if (kind == TOKEN_DO) {
+				if (stack_size > 0 && stack[stack_size - 1].do_block == BLOCK_END_NONE) {
+					stack[stack_size - 1].do_block = parser_add_block(parser, idx);
+				}
+			} else if (kind == TOKEN_END && stack_size > 0) {
+				const open_block_t block = stack[--stack_size];
+				parser->blocks[block.block].end = idx;
+				if (block.do_block != BLOCK_END_NONE) parser->blocks[block.do_block].end = idx;
+			}
+		}
+	}
+
+	free(stack);
+}
+
+u32
+parser_block_end(const Parser *parser, u32 open)
+{
+	u32 lo = 0, hi = parser->blocks_count;
+	while (lo < hi) {
+		const u32 mid = lo + (hi - lo) / 2;
+		if (parser->blocks[mid].open < open) lo = mid + 1;
+		else hi = mid;
+	}
+
+	if (lo < parser->blocks_count && parser->blocks[lo].open == open) return parser->blocks[lo].end;
+	return BLOCK_END_NONE;
+}
 
 void
 parser_parse(Parser *parser)
 {
-	while (token_idx < parser->ts.count) {
-		const ast_t ast = ast_token(parser, &parser->ts.tokens[token_idx], false);
-		append_ast(ast);
-		token_idx++;
+	parser_match_blocks(parser);
+
+	while (parser->token_idx < parser->ts.count) {
+		const ast_t ast = ast_token(parser, token_stream_at(&parser->ts, parser->token_idx), false);
+		ast_store_append(parser->asts, &ast);
+		parser->token_idx++;
+	}
+
+	// Walks over the top level stop at a `next` of 0, the bodies parsed later go after it
+	if (parser->asts->size > 0) {
+		const ast_t ast = make_ast(parser->asts, 0, 0, AST_POISONED, .call = {0});
+		parser->next++;
+		ast_store_append(parser->asts, &ast);
 	}
 }
 
-static bool cond_is_not_empty = false;
+ast_id_t
+parser_parse_next(Parser *parser)
+{
+	if (!token_stream_fill(&parser->ts, parser->token_idx)) return -1;
+
+	parser->item = ast_store_mark(parser->asts);
 
-static size_t if_count = 0;
-static size_t else_count = 0;
+	const ast_t ast = ast_token(parser, token_stream_at(&parser->ts, parser->token_idx), false);
+	ast_store_append(parser->asts, &ast);
+	parser->token_idx++;
+	return ast.ast_id;
+}
+
+void
+parser_drop_body(Parser *parser, ast_id_t decl)
+{
+	ast_store_t *asts = parser->asts;
+	const ast_kind_t kind = (ast_kind_t) asts->kinds[decl];
+	if (kind == AST_PROC) {
+		ast_table_at(asts->procs, proc_stmt_t, asts->data[decl])->body = -1;
+	} else if (kind == AST_FUNC) {
+		ast_table_at(asts->funcs, func_stmt_t, asts->data[decl])->body = -1;
+	} else if (kind == AST_CONST) {
+		ast_table_at(asts->consts, const_stmt_t, asts->data[decl])->body = -1;
+	} else if (kind == AST_VAR) {
+		ast_table_at(asts->vars, var_stmt_t, asts->data[decl])->body = -1;
+	}
+
+	ast_store_truncate(asts, decl + 1, parser->item);
+	asts->nexts[decl] = decl + 1;
+	parser->next = asts->size;
+}
 
 static void
 parse_proc_signature(Parser *parser, proc_stmt_t *proc_stmt, bool expect_end)
 {
-	while (token_idx < parser->ts.count) {
-		const token_t token_ = parser->ts.tokens[token_idx++];
+	while (parser->token_idx < parser->ts.count) {
+		const token_t token_ = tokenat(parser->ts, parser->token_idx++);
 
 		if (token_.kind == TOKEN_DO) {
 			if (expect_end) {
 				report_error("%s error: expected `end` keyword at the end, but got: `do`",
-										 loc_to_str(&locid(token_.loc_id)));
+										 loc_to_str(token_.loc_id));
 			} else {
 				break;
 			}
@@ -74,81 +228,81 @@ parse_proc_signature(Parser *parser, proc_stmt_t *proc_stmt, bool expect_end)
 			break;
 		}
 
-		const i32 kind_ = value_kind_try_from_str(token_.str);
+		const i32 kind_ = token_value_kind(&token_);
 		if (kind_ < 0) {
 			report_error("%s error: invalid type: %s",
-									 loc_to_str(&locid(token_.loc_id)),
+									 loc_to_str(token_.loc_id),
 									 token_.str);
 		}
 
 		const value_kind_t kind = (value_kind_t) kind_;
 
-		if (token_idx > parser->ts.count || parser->ts.tokens[token_idx].kind == TOKEN_DO) {
+		if (parser->token_idx > parser->ts.count || tokenat(parser->ts, parser->token_idx).kind == TOKEN_DO) {
 			report_error("%s error: expected a name after the type",
-									 loc_to_str(&locid(token_.loc_id)));
+									 loc_to_str(token_.loc_id));
 		}
 
 		arg_t proc_arg = {
 			.kind = kind,
 			.loc_id = token_.loc_id,
-			.name = NULL
+			.name = SYM_NONE
 		};
 
-		const token_t name_token = parser->ts.tokens[token_idx++];
-		if ((token_idx > parser->ts.count
+		const token_t name_token = tokenat(parser->ts, parser->token_idx++);
+		if ((parser->token_idx > parser->ts.count
 			|| name_token.kind != TOKEN_LITERAL)
 				|| (name_token.kind == TOKEN_LITERAL
-					&& -1 != value_kind_try_from_str(name_token.str)))
+					&& -1 != token_value_kind(&name_token)))
 		{
-			report_error("%s error: argument without a name", loc_to_str(&locid(token_.loc_id)));
+			report_error("%s error: argument without a name", loc_to_str(token_.loc_id));
 		}
 
-		proc_arg.name = name_token.str;
+		proc_arg.name = name_token.sym;
 
-		vec_add(proc_stmt->args, proc_arg);
+		ast_store_vec_add(parser->asts, proc_stmt->args, proc_arg);
 	}
 }
 
 static void
 parse_func_signature(Parser *parser, const token_t *ret_type_token, func_stmt_t *func_stmt, loc_id_t ast_loc_id, bool expect_end)
 {
-	i32 ret_type_ = value_kind_try_from_str(ret_type_token->str);
+	i32 ret_type_ = token_value_kind(ret_type_token);
 	if (ret_type_ < 0) {
 		eprintf("%s error: expected return type after the name of the function, but got: %s\n",
-						loc_to_str(&locid(ret_type_token->loc_id)),
+						loc_to_str(ret_type_token->loc_id),
 						ret_type_token->str);
 
 		report_error("%s note: this function",
-								 loc_to_str(&locid(ast_loc_id)));
+								 loc_to_str(ast_loc_id));
 	}
 
-	vec_add(func_stmt->ret_types, (value_kind_t) ret_type_);
-	while (token_idx + 1 < parser->ts.count
-	&& (ret_type_ = value_kind_try_from_str(parser->ts.tokens[token_idx].str))
+	ast_store_vec_add(parser->asts, func_stmt->ret_types, (value_kind_t) ret_type_);
+	while (parser->token_idx + 1 < parser->ts.count
+	&& (ret_type_ = token_value_kind(token_stream_at(&parser->ts, parser->token_idx)))
 	&&  -1 != ret_type_
-	&& (-1 != value_kind_try_from_str(parser->ts.tokens[token_idx + 1].str)))
+	&& (-1 != token_value_kind(token_stream_at(&parser->ts, parser->token_idx + 1))))
 	{
-		vec_add(func_stmt->ret_types, (value_kind_t) ret_type_);
-		token_idx++;
+		ast_store_vec_add(parser->asts, func_stmt->ret_types, (value_kind_t) ret_type_);
+		parser->token_idx++;
 	}
 
-	if ((ret_type_ = value_kind_try_from_str(parser->ts.tokens[token_idx + 1].str))
+	if ((ret_type_ = token_value_kind(token_stream_at(&parser->ts, parser->token_idx + 1)))
 	&&  -1 != ret_type_
-	&&  token_idx + 2 < parser->ts.count
-	&&  (parser->ts.tokens[token_idx + 1].kind == TOKEN_DO
-		|| parser->ts.tokens[token_idx + 1].kind == TOKEN_END))
+	&&  parser->token_idx + 2 < parser->ts.count
+	&&  (tokenat(parser->ts, parser->token_idx + 1).kind == TOKEN_DO
+		|| tokenat(parser->ts, parser->token_idx + 1).kind == TOKEN_END))
 	{
-		vec_add(func_stmt->ret_types, (value_kind_t) ret_type_);
-		token_idx++;
+		ast_store_vec_add(parser->asts, func_stmt->ret_types, (value_kind_t) ret_type_);
+		parser->token_idx++;
 	}
 
-	while (token_idx < parser->ts.count) {
-		const token_t token_ = parser->ts.tokens[token_idx++];
+	while (parser->token_idx < parser->ts.count) {
+		const token_t token_ = tokenat(parser->ts, parser->token_idx++);
 
 		if (token_.kind == TOKEN_DO) {
 			if (expect_end) {
 				report_error("%s error: expected `end` keyword at the end of the declaration, but got: `do`",
-										 loc_to_str(&locid(token_.loc_id)));
+										 loc_to_str(token_.loc_id));
 			} else {
 				break;
 			}
@@ -156,9 +310,9 @@ parse_func_signature(Parser *parser, const token_t *ret_type_token, func_stmt_t
 			break;
 		}
 
-		const i32 kind_ = value_kind_try_from_str(token_.str);
+		const i32 kind_ = token_value_kind(&token_);
 		if (kind_ < 0) {
-			eprintf("%s error: invalid type: %s\n", loc_to_str(&locid(token_.loc_id)), token_.str);
+			eprintf("%s error: invalid type: %s\n", loc_to_str(token_.loc_id), token_.str);
 			report_error("  note: You could've forgot to specify return type of the function.\n"
 									 "    For example: "
 									 "'func %s <return types...> <args...> do <body...> end'",
@@ -169,22 +323,101 @@ parse_func_signature(Parser *parser, const token_t *ret_type_token, func_stmt_t
 		arg_t func_arg = {
 			.kind = kind,
 			.loc_id = token_.loc_id,
-			.name = NULL
+			.name = SYM_NONE
 		};
 
-		const token_t name_token = parser->ts.tokens[token_idx++];
-		if ((token_idx > parser->ts.count
+		const token_t name_token = tokenat(parser->ts, parser->token_idx++);
+		if ((parser->token_idx > parser->ts.count
 			|| name_token.kind != TOKEN_LITERAL)
 				|| (name_token.kind == TOKEN_LITERAL
-					&& -1 != value_kind_try_from_str(name_token.str)))
+					&& -1 != token_value_kind(&name_token)))
 		{
-			report_error("%s error: argument without a name", loc_to_str(&locid(token_.loc_id)));
+			report_error("%s error: argument without a name", loc_to_str(token_.loc_id));
 		}
 
-		func_arg.name = name_token.str;
+		func_arg.name = name_token.sym;
+
+		ast_store_vec_add(parser->asts, func_stmt->args, func_arg);
+	}
+}
+
+// Statements of a proc or func till its `end`, returns the first of them or -1
+static ast_id_t
+parse_body(Parser *parser, loc_id_t decl_loc_id)
+{
+	ast_id_t body = -1;
+	bool done = false;
+	while (parser->token_idx < parser->ts.count) {
+		const token_t token_ = tokenat(parser->ts, parser->token_idx);
+		if (token_.kind == TOKEN_END) {
+			done = true;
+			break;
+		} else if (body < 0) {
+			body = parser->next;
+		}
+
+		ast_t ast = ast_token(parser, token_stream_at(&parser->ts, parser->token_idx), true);
+		parser->token_idx++;
+
+		if (tokenat(parser->ts, parser->token_idx).kind == TOKEN_END
+		&& (ast.ast_kind == AST_IF || ast.ast_kind == AST_WHILE))
+		{
+			ast.next = -1;
+		}
+
+		ast_store_append(parser->asts, &ast);
+	}
+
+	if (!done) {
+		report_error("%s error: no closing end found", loc_to_str(decl_loc_id));
+	}
+
+	return body;
+}
+
+// Skip the body of a top level declaration opened at `decl_idx`, if its `end` is known
+static bool
+skip_body(Parser *parser, size_t decl_idx, ast_id_t *body, u32 *body_token)
+{
+	const u32 end = parser_block_end(parser, (u32) decl_idx);
+	if (end == BLOCK_END_NONE || end <= parser->token_idx) return false;
+
+	*body = AST_BODY_LAZY;
+	*body_token = (u32) parser->token_idx;
+	parser->token_idx = end;
+	return true;
+}
 
-		vec_add(func_stmt->args, func_arg);
+ast_id_t
+parser_body(Parser *parser, ast_id_t decl)
+{
+	ast_store_t *asts = parser->asts;
+	ast_id_t *body = NULL;
+	u32 body_token = 0;
+	if (asts->kinds[decl] == AST_PROC) {
+		proc_stmt_t *proc_stmt = ast_table_at(asts->procs, proc_stmt_t, asts->data[decl]);
+		body = &proc_stmt->body;
+		body_token = proc_stmt->body_token;
+	} else {
+		func_stmt_t *func_stmt = ast_table_at(asts->funcs, func_stmt_t, asts->data[decl]);
+		body = &func_stmt->body;
+		body_token = func_stmt->body_token;
 	}
+
+	if (*body != AST_BODY_LAZY) return *body;
+
+	const size_t token_idx = parser->token_idx;
+	parser->token_idx = body_token;
+	parser->if_count = 0;
+	parser->else_count = 0;
+
+	*body = parse_body(parser, asts->locs[decl]);
+
+	// indicate the end of the body
+	last_ast_next(asts) = -1;
+
+	parser->token_idx = token_idx;
+	return *body;
 }
 
 ast_t
@@ -194,25 +427,25 @@ ast_token(Parser *parser, const token_t *token, bool rec)
 	case TOKEN_VAR:
 	case TOKEN_CONST: {
 		// Skip `const` keyword
-		token_idx++;
+		parser->token_idx++;
 
-		if (token_idx > parser->ts.count || parser->ts.tokens[token_idx].kind == TOKEN_END) {
+		if (parser->token_idx > parser->ts.count || tokenat(parser->ts, parser->token_idx).kind == TOKEN_END) {
 			report_error("%s error: %s without a name",
-									 loc_to_str(&locid(token->loc_id)),
+									 loc_to_str(token->loc_id),
 									 token->kind == TOKEN_VAR ? "var" : "const");
 		}
 
-		if (parser->ts.tokens[token_idx].kind != TOKEN_LITERAL) {
+		if (tokenat(parser->ts, parser->token_idx).kind != TOKEN_LITERAL) {
 			report_error("%s error: expected name of the %s to be non-keyword `literal`, but got: `%s`",
-									 loc_to_str(&locid(parser->ts.tokens[token_idx].loc_id)),
-									 token_kind_to_str_pretty(parser->ts.tokens[token_idx].kind),
+									 loc_to_str(tokenat(parser->ts, parser->token_idx).loc_id),
+									 token_kind_to_str_pretty(tokenat(parser->ts, parser->token_idx).kind),
 									 token->kind == TOKEN_VAR ? "variable" : "constant");
 		}
 
-		ast_t ast = make_ast(token->loc_id, ++next,
+		ast_t ast = make_ast(parser->asts, token->loc_id, ++parser->next,
 												 token->kind == TOKEN_VAR ? AST_VAR : AST_CONST,
 			.const_stmt = {
-				.name = &parser->ts.tokens[token_idx++],
+				.name = parser_keep_token(parser, token_stream_at(&parser->ts, parser->token_idx++)),
 				.body = -1,
 				.constexpr = false,
 			}
@@ -220,59 +453,59 @@ ast_token(Parser *parser, const token_t *token, bool rec)
 
 		bool done = false;
 		size_t token_count = 0;
-		while (token_idx < parser->ts.count) {
-			const token_t token_ = parser->ts.tokens[token_idx];
+		while (parser->token_idx < parser->ts.count) {
+			const token_t token_ = tokenat(parser->ts, parser->token_idx);
 			if (token_.kind == TOKEN_END) {
 				done = true;
 				break;
 			} else if (token_count == 0) {
 				if (token->kind == TOKEN_VAR) {
-					ast.var_stmt.body = next;
+					ast.var_stmt.body = parser->next;
 				} else {
-					ast.const_stmt.body = next;
+					ast.const_stmt.body = parser->next;
 				}
 			}
 
-			ast_t ast = ast_token(parser, &parser->ts.tokens[token_idx], true);
-			token_idx++;
+			ast_t ast = ast_token(parser, token_stream_at(&parser->ts, parser->token_idx), true);
+			parser->token_idx++;
 
-			if (parser->ts.tokens[token_idx].kind == TOKEN_END) {
+			if (tokenat(parser->ts, parser->token_idx).kind == TOKEN_END) {
 				ast.next = -1;
 			}
 
-			append_ast(ast);
+			ast_store_append(parser->asts, &ast);
 			token_count++;
 		}
 
 		if (!done) {
-			report_error("%s error: no closing end found", loc_to_str(&locid(token->loc_id)));
+			report_error("%s error: no closing end found", loc_to_str(token->loc_id));
 		}
 
-		if (last_ast.next > 0) {
-			ast.next = last_ast.next;
+		if (last_ast_next(parser->asts) > 0) {
+			ast.next = last_ast_next(parser->asts);
 		} else {
-			ast.next = next;
+			ast.next = parser->next;
 		}
 
 		// indicate the end of the body
-		last_ast.next = -1;
+		last_ast_next(parser->asts) = -1;
 
 		return ast;
 	} break;
 
 	case TOKEN_INLINE: {
-		if (token_idx + 1 >= parser->ts.count
-		|| (parser->ts.tokens[token_idx + 1].kind != TOKEN_PROC
-		 && parser->ts.tokens[token_idx + 1].kind != TOKEN_FUNC))
+		if (parser->token_idx + 1 >= parser->ts.count
+		|| (tokenat(parser->ts, parser->token_idx + 1).kind != TOKEN_PROC
+		 && tokenat(parser->ts, parser->token_idx + 1).kind != TOKEN_FUNC))
 		{
 			report_error("%s error: expected `proc` or `func` after "
 									 "the inline keyword, but got %s",
-									 loc_to_str(&locid(token->loc_id)),
-									 token_idx + 1 >= parser->ts.count ? "<eof>" : parser->ts.tokens[token_idx + 1].str);
+									 loc_to_str(token->loc_id),
+									 parser->token_idx + 1 >= parser->ts.count ? "<eof>" : tokenat(parser->ts, parser->token_idx + 1).str);
 		}
 
-		token_idx++;
-		ast_t ast = ast_token(parser, &parser->ts.tokens[token_idx], false);
+		parser->token_idx++;
+		ast_t ast = ast_token(parser, token_stream_at(&parser->ts, parser->token_idx), false);
 
 		if (ast.ast_kind == AST_PROC) {
 			ast.proc_stmt.inlin = true;
@@ -284,22 +517,22 @@ ast_token(Parser *parser, const token_t *token, bool rec)
 	} break;
 
 	case TOKEN_EXTERN: {
-		if (token_idx + 1 >= parser->ts.count
-		|| (parser->ts.tokens[token_idx + 1].kind != TOKEN_PROC
-		 && parser->ts.tokens[token_idx + 1].kind != TOKEN_FUNC))
+		if (parser->token_idx + 1 >= parser->ts.count
+		|| (tokenat(parser->ts, parser->token_idx + 1).kind != TOKEN_PROC
+		 && tokenat(parser->ts, parser->token_idx + 1).kind != TOKEN_FUNC))
 		{
 			report_error("%s error: expected `proc` or `func` after "
 									 "the extern keyword, but got %s",
-									 loc_to_str(&locid(token->loc_id)),
-									 token_idx + 1 >= parser->ts.count ? "<eof>" : parser->ts.tokens[token_idx + 1].str);
+									 loc_to_str(token->loc_id),
+									 parser->token_idx + 1 >= parser->ts.count ? "<eof>" : tokenat(parser->ts, parser->token_idx + 1).str);
 		}
 
-		ast_t ast = make_ast(token->loc_id, ++next, AST_EXTERN, .extern_decl = {0});
+		ast_t ast = make_ast(parser->asts, token->loc_id, ++parser->next, AST_EXTERN, .extern_decl = {0});
 
-		token_idx++;
-		const token_t next_token = parser->ts.tokens[token_idx++];
-		const token_t *name = &parser->ts.tokens[token_idx++];
-		const token_t ret_type_token = parser->ts.tokens[token_idx];
+		parser->token_idx++;
+		const token_t next_token = tokenat(parser->ts, parser->token_idx++);
+		const token_t *name = parser_keep_token(parser, token_stream_at(&parser->ts, parser->token_idx++));
+		const token_t ret_type_token = tokenat(parser->ts, parser->token_idx);
 
 		if (next_token.kind == TOKEN_PROC) {
 			parse_proc_signature(parser,
@@ -310,7 +543,7 @@ ast_token(Parser *parser, const token_t *token, bool rec)
 			ast.extern_decl.proc_stmt.inlin = false;
 			ast.extern_decl.proc_stmt.name = name;
 		} else if (next_token.kind == TOKEN_FUNC) {
-			token_idx++;
+			parser->token_idx++;
 			parse_func_signature(parser,
 													 &ret_type_token,
 													 &ast.extern_decl.func_stmt,
@@ -324,157 +557,121 @@ ast_token(Parser *parser, const token_t *token, bool rec)
 			UNREACHABLE;
 		}
 
-		token_idx--;
+		parser->token_idx--;
 		return ast;
 	} break;
 
 	case TOKEN_PROC: {
+		const size_t decl_idx = parser->token_idx;
+
 		// Skip `proc` keyword
-		token_idx++;
+		parser->token_idx++;
 
-		if ((token_idx > parser->ts.count
-			|| parser->ts.tokens[token_idx].kind != TOKEN_LITERAL)
-				|| (parser->ts.tokens[token_idx].kind == TOKEN_LITERAL
-					&& value_kind_try_from_str(parser->ts.tokens[token_idx].str) != -1))
+		if ((parser->token_idx > parser->ts.count
+			|| tokenat(parser->ts, parser->token_idx).kind != TOKEN_LITERAL)
+				|| (tokenat(parser->ts, parser->token_idx).kind == TOKEN_LITERAL
+					&& token_value_kind(token_stream_at(&parser->ts, parser->token_idx)) != -1))
 		{
-			report_error("%s error: proc without a name", loc_to_str(&locid(token->loc_id)));
+			report_error("%s error: proc without a name", loc_to_str(token->loc_id));
 		}
 
-		ast_t ast = make_ast(token->loc_id, ++next, AST_PROC,
+		ast_t ast = make_ast(parser->asts, token->loc_id, ++parser->next, AST_PROC,
 			.proc_stmt = {
-				.name = &parser->ts.tokens[token_idx++],
+				.name = parser_keep_token(parser, token_stream_at(&parser->ts, parser->token_idx++)),
 				.args = NULL,
 				.body = -1,
+				.body_token = 0,
 				.inlin = false
 			}
 		);
 
 		parse_proc_signature(parser, &ast.proc_stmt, false);
 
-		bool done = false;
-		size_t token_count = 0;
-		while (token_idx < parser->ts.count) {
-			const token_t token_ = parser->ts.tokens[token_idx];
-			if (token_.kind == TOKEN_END) {
-				done = true;
-				break;
-			} else if (token_count == 0) {
-				ast.proc_stmt.body = next;
-			}
-
-			ast_t ast = ast_token(parser, &parser->ts.tokens[token_idx], true);
-			token_idx++;
-
-			if (parser->ts.tokens[token_idx].kind == TOKEN_END
-			&& (ast.ast_kind == AST_IF || ast.ast_kind == AST_WHILE))
-			{
-				ast.next = -1;
-			}
-
-			append_ast(ast);
-			token_count++;
+		if (!rec && skip_body(parser, decl_idx, &ast.proc_stmt.body, &ast.proc_stmt.body_token)) {
+			ast.next = parser->next;
+			return ast;
 		}
 
-		if (!done) {
-			report_error("%s error: no closing end found", loc_to_str(&locid(token->loc_id)));
-		}
+		ast.proc_stmt.body = parse_body(parser, token->loc_id);
 
-		if (last_ast.next > 0) {
-			ast.next = last_ast.next;
+		if (last_ast_next(parser->asts) > 0) {
+			ast.next = last_ast_next(parser->asts);
 		} else {
-			ast.next = next;
+			ast.next = parser->next;
 		}
 
-		if (token_count > 0) {
+		if (ast.proc_stmt.body >= 0) {
 			// indicate the end of the body
-			last_ast.next = -1;
+			last_ast_next(parser->asts) = -1;
 		}
 
 		return ast;
 	} break;
 
 	case TOKEN_FUNC: {
+		const size_t decl_idx = parser->token_idx;
+
 		// Skip `func` keyword
-		token_idx++;
+		parser->token_idx++;
 
-		if ((token_idx > parser->ts.count
-			|| parser->ts.tokens[token_idx].kind != TOKEN_LITERAL)
-				|| (parser->ts.tokens[token_idx].kind == TOKEN_LITERAL
-					&& value_kind_try_from_str(parser->ts.tokens[token_idx].str) != -1))
+		if ((parser->token_idx > parser->ts.count
+			|| tokenat(parser->ts, parser->token_idx).kind != TOKEN_LITERAL)
+				|| (tokenat(parser->ts, parser->token_idx).kind == TOKEN_LITERAL
+					&& token_value_kind(token_stream_at(&parser->ts, parser->token_idx)) != -1))
 		{
-			report_error("%s error: func without a name", loc_to_str(&locid(token->loc_id)));
+			report_error("%s error: func without a name", loc_to_str(token->loc_id));
 		}
 
-		ast_t ast = make_ast(token->loc_id, ++next, AST_FUNC,
+		ast_t ast = make_ast(parser->asts, token->loc_id, ++parser->next, AST_FUNC,
 			.func_stmt = {
-				.name = &parser->ts.tokens[token_idx++],
+				.name = parser_keep_token(parser, token_stream_at(&parser->ts, parser->token_idx++)),
 				.body = -1,
+				.body_token = 0,
 				.args = NULL,
 				.inlin = false,
 				.ret_types = NULL
 			}
 		);
 
-		const token_t ret_type_token = parser->ts.tokens[token_idx++];
+		const token_t ret_type_token = tokenat(parser->ts, parser->token_idx++);
 
 		parse_func_signature(parser, &ret_type_token, &ast.func_stmt, ast.loc_id, false);
 
-		bool done = false;
-		size_t token_count = 0;
-		while (token_idx < parser->ts.count) {
-			const token_t token_ = parser->ts.tokens[token_idx];
-			if (token_.kind == TOKEN_END) {
-				done = true;
-				break;
-			} else if (token_count == 0) {
-				ast.func_stmt.body = next;
-			}
-
-			ast_t ast = ast_token(parser, &parser->ts.tokens[token_idx], true);
-			token_idx++;
-
-			if (parser->ts.tokens[token_idx].kind == TOKEN_END
-			&& (ast.ast_kind == AST_IF || ast.ast_kind == AST_WHILE))
-			{
-				ast.next = -1;
-			}
-
-			append_ast(ast);
-			token_count++;
-		}
-
-		if (!done) {
-			report_error("%s error: no closing end found", loc_to_str(&locid(token->loc_id)));
-		}
-
 		if (vec_size(ast.func_stmt.ret_types) > 6) {
 			report_error("%s error: naah bruh, too many return values.\n"
 									 "%s note: The maximum amount of values that you can return from function is 6",
-									 loc_to_str(&locid(token->loc_id)),
-									 loc_to_str(&locid(ret_type_token.loc_id)));
+									 loc_to_str(token->loc_id),
+									 loc_to_str(ret_type_token.loc_id));
+		}
+
+		if (!rec && skip_body(parser, decl_idx, &ast.func_stmt.body, &ast.func_stmt.body_token)) {
+			ast.next = parser->next;
+			return ast;
 		}
 
-		if (last_ast.next > 0) {
-			ast.next = last_ast.next;
+		ast.func_stmt.body = parse_body(parser, token->loc_id);
+
+		if (last_ast_next(parser->asts) > 0) {
+			ast.next = last_ast_next(parser->asts);
 		} else {
-			ast.next = next;
+			ast.next = parser->next;
 		}
 
 		// indicate the end of the body
-		last_ast.next = -1;
+		last_ast_next(parser->asts) = -1;
 
 		return ast;
 	} break;
 
 	case TOKEN_WHILE: {
 		if (!rec) {
-			cond_is_not_empty = false;
+			parser->cond_is_not_empty = false;
 		}
 
 		// Skip `while` keyword
-		token_idx++;
+		parser->token_idx++;
 
-		ast_t ast = make_ast(token->loc_id, ++next, AST_WHILE,
+		ast_t ast = make_ast(parser->asts, token->loc_id, ++parser->next, AST_WHILE,
 			.while_stmt = {
 				.cond = -1,
 				.body = -1,
@@ -482,83 +679,83 @@ ast_token(Parser *parser, const token_t *token, bool rec)
 		);
 
 		size_t token_count = 0;
-		size_t start = token_idx;
+		size_t start = parser->token_idx;
 
-		while (token_idx < parser->ts.count) {
-			const token_t token_ = parser->ts.tokens[token_idx];
+		while (parser->token_idx < parser->ts.count) {
+			const token_t token_ = tokenat(parser->ts, parser->token_idx);
 			if (token_.kind == TOKEN_DO) {
-				if (token_idx > start) {
-					cond_is_not_empty = true;
+				if (parser->token_idx > start) {
+					parser->cond_is_not_empty = true;
 				}
-				token_idx++;
+				parser->token_idx++;
 				break;
 			} else if (token_count == 0) {
-				ast.while_stmt.cond = next;
+				ast.while_stmt.cond = parser->next;
 			}
 
-			const ast_t ast = ast_token(parser, &parser->ts.tokens[token_idx], true);
-			append_ast(ast);
-			token_idx++;
+			const ast_t ast = ast_token(parser, token_stream_at(&parser->ts, parser->token_idx), true);
+			ast_store_append(parser->asts, &ast);
+			parser->token_idx++;
 			token_count++;
 		}
 
-		if (cond_is_not_empty) {
-			last_ast.next = -1;
+		if (parser->cond_is_not_empty) {
+			last_ast_next(parser->asts) = -1;
 		}
 
 		token_count = 0;
 
 		bool done = false;
-		while (token_idx < parser->ts.count) {
-			const token_t token_ = parser->ts.tokens[token_idx];
+		while (parser->token_idx < parser->ts.count) {
+			const token_t token_ = tokenat(parser->ts, parser->token_idx);
 			if (token_.kind == TOKEN_END) {
 				done = true;
 				break;
 			} else if (token_count == 0) {
-				ast.while_stmt.body = next;
+				ast.while_stmt.body = parser->next;
 			}
 
-			ast_t ast = ast_token(parser, &parser->ts.tokens[token_idx], true);
-			token_idx++;
+			ast_t ast = ast_token(parser, token_stream_at(&parser->ts, parser->token_idx), true);
+			parser->token_idx++;
 
-			if (parser->ts.tokens[token_idx].kind == TOKEN_END
+			if (tokenat(parser->ts, parser->token_idx).kind == TOKEN_END
 			&& (ast.ast_kind == AST_IF || ast.ast_kind == AST_WHILE))
 			{
 				ast.next = -1;
 			}
 
-			append_ast(ast);
+			ast_store_append(parser->asts, &ast);
 			token_count++;
 		}
 
 		if (!done) {
-			report_error("%s error: no closing end found", loc_to_str(&locid(token->loc_id)));
+			report_error("%s error: no closing end found", loc_to_str(token->loc_id));
 		}
 
-		if (last_ast.next > 0) {
-			ast.next = last_ast.next;
+		if (last_ast_next(parser->asts) > 0) {
+			ast.next = last_ast_next(parser->asts);
 		} else {
-			ast.next = next;
+			ast.next = parser->next;
 		}
 
 		// indicate the end of the body
-		last_ast.next = -1;
+		last_ast_next(parser->asts) = -1;
 
 		return ast;
 	} break;
 
 	case TOKEN_IF: {
 		if (!rec) {
-			if_count = 0;
-			else_count = 0;
+			parser->if_count = 0;
+			parser->else_count = 0;
 		}
 
-		if_count++;
+		parser->if_count++;
 
 		// Skip `if` keyword
-		token_idx++;
+		parser->token_idx++;
 
-		ast_t ast = make_ast(token->loc_id, ++next, AST_IF,
+		ast_t ast = make_ast(parser->asts, token->loc_id, ++parser->next, AST_IF,
 			.if_stmt = {
 				.then_body = -1,
 				.else_body = -1,
@@ -568,58 +765,65 @@ ast_token(Parser *parser, const token_t *token, bool rec)
 		bool done = false;
 		bool is_else = false;
 		size_t token_count = 0;
-		while (token_idx < parser->ts.count) {
-			const token_t token_ = parser->ts.tokens[token_idx];
+		while (parser->token_idx < parser->ts.count) {
+			const token_t token_ = tokenat(parser->ts, parser->token_idx);
 			if (token_.kind == TOKEN_END) {
 				done = true;
 				break;
 			} else if (token_.kind == TOKEN_ELSE) {
-				if (if_count < ++else_count) {
-					report_error("%s error: too many elses in one if", loc_to_str(&locid(token_.loc_id)));
-				} else if (asts_len > 0 && token_count > 0) {
-					last_ast.next = -1;
+				if (parser->if_count < ++parser->else_count) {
+					report_error("%s error: too many elses in one if", loc_to_str(token_.loc_id));
+				} else if (parser->asts->size > 0 && token_count > 0) {
+					last_ast_next(parser->asts) = -1;
 				}
-				token_idx++;
+				parser->token_idx++;
 				is_else = true;
-				ast.if_stmt.else_body = next;
+				ast.if_stmt.else_body = parser->next;
 				continue;
 			} else if (token_count == 0 && !is_else) {
-				ast.if_stmt.then_body = next;
+				ast.if_stmt.then_body = parser->next;
 			}
 
-			ast_t ast = ast_token(parser, &parser->ts.tokens[token_idx], true);
+			ast_t ast = ast_token(parser, token_stream_at(&parser->ts, parser->token_idx), true);
+
+			if (token_.kind != TOKEN_ELSE) parser->token_idx++;
+
+			// A nested block that ends the branch is the last of it, not followed by what follows the if
+			if (parser->token_idx < parser->ts.count && (ast.ast_kind == AST_IF || ast.ast_kind == AST_WHILE)) {
+				const token_kind_t after = tokenat(parser->ts, parser->token_idx).kind;
+				if (after == TOKEN_END || after == TOKEN_ELSE) ast.next = -1;
+			}
 
-			if (token_.kind != TOKEN_ELSE) token_idx++;
-			append_ast(ast);
+			ast_store_append(parser->asts, &ast);
 			token_count++;
 		}
 
 		if (!done) {
-			report_error("%s error: no closing end found", loc_to_str(&locid(token->loc_id)));
+			report_error("%s error: no closing end found", loc_to_str(token->loc_id));
 		}
 
-		if (token_idx + 1 < parser->ts.count && parser->ts.tokens[token_idx + 1].kind == TOKEN_END) {
+		if (parser->token_idx + 1 < parser->ts.count && tokenat(parser->ts, parser->token_idx + 1).kind == TOKEN_END) {
 			ast.next = -1;
-		} else if (last_ast.next > 0) {
-			ast.next = last_ast.next;
+		} else if (last_ast_next(parser->asts) > 0) {
+			ast.next = last_ast_next(parser->asts);
 		} else {
-			ast.next = next;
+			ast.next = parser->next;
 		}
 
 		// indicate the end of the body
-		last_ast.next = -1;
+		last_ast_next(parser->asts) = -1;
 
 		return ast;
 	} break;
 
-	case TOKEN_DO:		report_error("%s error: do without while, func or proc context", loc_to_str(&locid(token->loc_id)));
-	case TOKEN_ELSE:	report_error("%s error: else outside of if scope", loc_to_str(&locid(token->loc_id)));
-	case TOKEN_END:		report_error("%s error: no matching if, proc, const, func or do found", loc_to_str(&locid(token->loc_id)));
+	case TOKEN_DO:		report_error("%s error: do without while, func or proc context", loc_to_str(token->loc_id));
+	case TOKEN_ELSE:	report_error("%s error: else outside of if scope", loc_to_str(token->loc_id));
+	case TOKEN_END:		report_error("%s error: no matching if, proc, const, func or do found", loc_to_str(token->loc_id));
 
 	case TOKEN_KEYWORDS_END: break;
 
 	case TOKEN_INTEGER: {
-		ast_t ast = make_ast(token->loc_id, ++next, AST_PUSH,
+		ast_t ast = make_ast(parser->asts, token->loc_id, ++parser->next, AST_PUSH,
 			.push_stmt = {
 				.value_kind = VALUE_KIND_INTEGER,
 				.integer = parse_int(token->str),
@@ -629,61 +833,53 @@ ast_token(Parser *parser, const token_t *token, bool rec)
 	} break;
 
 	case TOKEN_STRING_LITERAL: {
-		ast_t ast = make_ast(token->loc_id, ++next, AST_PUSH,
+		ast_t ast = make_ast(parser->asts, token->loc_id, ++parser->next, AST_PUSH,
 			.push_stmt = {
 				.value_kind = VALUE_KIND_STRING,
-				.str = token->str,
+				.str = parser_keep_str(parser, token),
 			}
 		);
 		return ast;
 	} break;
 
 	case TOKEN_LITERAL: {
-		scratch_buffer_clear();
-		scratch_buffer_append(token->str);
-
-		bool is_call = false;
-		if (scratch_buffer.str[scratch_buffer.len - 1] == '!') {
-			scratch_buffer.str[--scratch_buffer.len] = '\0';
-			is_call = true;
-		}
-
-		if (is_call) {
-			return (ast_t) make_ast(token->loc_id, ++next, AST_CALL, .call = { .str = scratch_buffer_copy() });
+		// The lexer interns `name!` as `name`
+		if (token->str[token->len - 1] == '!') {
+			return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_CALL, .call = { .sym = token->sym });
 		} else {
-			return (ast_t) make_ast(token->loc_id, ++next, AST_LITERAL, .literal = { .str = token->str });
+			return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_LITERAL, .literal = { .sym = token->sym });
 		}
 	} break;
 
 	case TOKEN_WRITE: {
 		if (token->str + 1 == NULL || *(token->str + 1) == '\0') {
-			report_error("%s error: invalid write statement", loc_to_str(&locid(token->loc_id)));
+			report_error("%s error: invalid write statement", loc_to_str(token->loc_id));
 		}
-		return (ast_t) make_ast(token->loc_id, ++next, AST_WRITE, .write_stmt = {token});
+		return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_WRITE, .write_stmt = { .sym = token->sym });
 	} break;
 
-	case TOKEN_DROP:					return (ast_t) make_ast(token->loc_id, ++next, AST_DROP,					.drop_stmt					= {0});
-	case TOKEN_DUP:						return (ast_t) make_ast(token->loc_id, ++next, AST_DUP,						.dup_stmt						= {0});
-	case TOKEN_EQUAL:					return (ast_t) make_ast(token->loc_id, ++next, AST_EQUAL,					.equal_stmt					= {0});
-	case TOKEN_GREATER:				return (ast_t) make_ast(token->loc_id, ++next, AST_GREATER,				.greater_stmt				= {0});
-	case TOKEN_GREATER_EQUAL:	return (ast_t) make_ast(token->loc_id, ++next, AST_GREATER_EQUAL,	.greater_equal_stmt = {0});
-	case TOKEN_LESS_EQUAL:		return (ast_t) make_ast(token->loc_id, ++next, AST_LESS_EQUAL,		.less_equal_stmt		= {0});
-	case TOKEN_LESS:					return (ast_t) make_ast(token->loc_id, ++next, AST_LESS,					.less_stmt					= {0});
-	case TOKEN_SYSCALL:				return (ast_t) make_ast(token->loc_id, ++next, AST_SYSCALL,				.syscall						= {0});
-	case TOKEN_SYSCALL1:			return (ast_t) make_ast(token->loc_id, ++next, AST_SYSCALL,				.syscall						= {1});
-	case TOKEN_SYSCALL2:			return (ast_t) make_ast(token->loc_id, ++next, AST_SYSCALL,				.syscall						= {2});
-	case TOKEN_SYSCALL3:			return (ast_t) make_ast(token->loc_id, ++next, AST_SYSCALL,				.syscall						= {3});
-	case TOKEN_SYSCALL4:			return (ast_t) make_ast(token->loc_id, ++next, AST_SYSCALL,				.syscall						= {4});
-	case TOKEN_SYSCALL5:			return (ast_t) make_ast(token->loc_id, ++next, AST_SYSCALL,				.syscall						= {5});
-	case TOKEN_SYSCALL6:			return (ast_t) make_ast(token->loc_id, ++next, AST_SYSCALL,				.syscall						= {6});
-	case TOKEN_BOR:						return (ast_t) make_ast(token->loc_id, ++next, AST_BOR,						.bor_stmt						= {0});
-	case TOKEN_MUL:						return (ast_t) make_ast(token->loc_id, ++next, AST_MUL,						.mul_stmt						= {0});
-	case TOKEN_DIV:						return (ast_t) make_ast(token->loc_id, ++next, AST_DIV,						.div_stmt						= {0});
-	case TOKEN_MINUS:					return (ast_t) make_ast(token->loc_id, ++next, AST_MINUS,					.minus_stmt					= {0});
-	case TOKEN_PLUS:					return (ast_t) make_ast(token->loc_id, ++next, AST_PLUS,					.plus_stmt					= {0});
-	case TOKEN_MOD:						return (ast_t) make_ast(token->loc_id, ++next, AST_MOD,						.mod_stmt						= {0});
-	case TOKEN_DOT:						return (ast_t) make_ast(token->loc_id, ++next, AST_DOT,						.dot_stmt						= {0});
-	case TOKEN_BNOT:					return (ast_t) make_ast(token->loc_id, ++next, AST_BNOT,					.bnot_stmt					= {0});
+	case TOKEN_DROP:					return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_DROP,					.drop_stmt					= {0});
+	case TOKEN_DUP:						return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_DUP,						.dup_stmt						= {0});
+	case TOKEN_EQUAL:					return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_EQUAL,					.equal_stmt					= {0});
+	case TOKEN_GREATER:				return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_GREATER,				.greater_stmt				= {0});
+	case TOKEN_GREATER_EQUAL:	return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_GREATER_EQUAL,	.greater_equal_stmt = {0});
+	case TOKEN_LESS_EQUAL:		return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_LESS_EQUAL,		.less_equal_stmt		= {0});
+	case TOKEN_LESS:					return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_LESS,					.less_stmt					= {0});
+	case TOKEN_SYSCALL:				return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_SYSCALL,				.syscall						= {0});
+	case TOKEN_SYSCALL1:			return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_SYSCALL,				.syscall						= {1});
+	case TOKEN_SYSCALL2:			return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_SYSCALL,				.syscall						= {2});
+	case TOKEN_SYSCALL3:			return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_SYSCALL,				.syscall						= {3});
+	case TOKEN_SYSCALL4:			return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_SYSCALL,				.syscall						= {4});
+	case TOKEN_SYSCALL5:			return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_SYSCALL,				.syscall						= {5});
+	case TOKEN_SYSCALL6:			return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_SYSCALL,				.syscall						= {6});
+	case TOKEN_BOR:						return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_BOR,						.bor_stmt						= {0});
+	case TOKEN_MUL:						return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_MUL,						.mul_stmt						= {0});
+	case TOKEN_DIV:						return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_DIV,						.div_stmt						= {0});
+	case TOKEN_MINUS:					return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_MINUS,					.minus_stmt					= {0});
+	case TOKEN_PLUS:					return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_PLUS,					.plus_stmt					= {0});
+	case TOKEN_MOD:						return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_MOD,						.mod_stmt						= {0});
+	case TOKEN_DOT:						return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_DOT,						.dot_stmt						= {0});
+	case TOKEN_BNOT:					return (ast_t) make_ast(parser->asts, token->loc_id, ++parser->next, AST_BNOT,					.bnot_stmt					= {0});
 	}
 	__builtin_unreachable();
 }
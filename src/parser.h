@@ -4,15 +4,63 @@
 #include "ast.h"
 #include "lexer.h"
 
+#define BLOCK_END_NONE ((u32) -1)
+
+// Token index of a block opener and of its matching `end`
+typedef struct {
+	u32 open;
+	u32 end;
+} block_t;
+
+// Whole state of one parse, so several parses can run at the same time
 typedef struct {
-	const tokens_t ts;
+	token_stream_t ts;
+	ast_store_t *asts;
+
+	ast_id_t next;
+	size_t token_idx;
+	bool cond_is_not_empty;
+	size_t if_count;
+	size_t else_count;
+
+	// Filled by `parser_match_blocks`, sorted by `open`
+	block_t *blocks;
+	u32 blocks_count;
+	u32 blocks_cap;
+
+	// Set for a stream opened by `token_stream_open`, the store is marked before each item
+	bool stream;
+	ast_store_mark_t item;
 } Parser;
 
 void
 parser_parse(Parser *parser);
 
 Parser
-new_parser(const tokens_t ts);
+new_parser(token_stream_t ts, ast_store_t *asts);
+
+void
+parser_free(Parser *parser);
+
+// Record the matching `end` of every `do`, `if`, `while`, `func`, `proc`, `const` and `var`
+void
+parser_match_blocks(Parser *parser);
+
+// Index of the `end` closing the block opened at `open`, `BLOCK_END_NONE` if there is none
+u32
+parser_block_end(const Parser *parser, u32 open);
+
+// Body of the proc or func `decl`, it is parsed here if it was skipped by `parser_parse`
+ast_id_t
+parser_body(Parser *parser, ast_id_t decl);
+
+// Parse the next top level item of a stream with its body, -1 at the end of the stream
+ast_id_t
+parser_parse_next(Parser *parser);
+
+// Drop the body of the last item returned by `parser_parse_next`, once nothing needs it
+void
+parser_drop_body(Parser *parser, ast_id_t decl);
 
 ast_t
 ast_token(Parser *parser, const token_t *token, bool rec);
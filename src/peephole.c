@@ -0,0 +1,443 @@
+#include "lib.h"
+#include "insn.h"
+#include "common.h"
+#include "compiler.h"
+#include "peephole.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define INSN_BUFFER_INIT_CAP 256
+#define INSN_CHUNK_SIZE (64 * 1024)
+
+// Passes over a body till nothing matches, one rewrite may let another one match
+#define PEEPHOLE_MAX_PASSES 4
+
+typedef enum {
+	PEEP_PUSH_POP,
+	PEEP_MOV_IMM_PUSH,
+	PEEP_MOV_IMM_OP,
+	PEEP_STORE_RELOAD,
+	PEEP_SELF_MOV,
+	PEEP_JMP_NEXT,
+	PEEP_CMP_BRANCH,
+	PEEP_REDUNDANT_TEST,
+	PEEP_COUNT,
+} peephole_pattern_t;
+
+static const char *PEEPHOLE_PATTERN_NAMES[PEEP_COUNT] = {
+	[PEEP_PUSH_POP]       = "push X; pop Y -> mov Y, X",
+	[PEEP_MOV_IMM_PUSH]   = "mov reg, imm; push reg -> push imm",
+	[PEEP_MOV_IMM_OP]     = "mov reg, imm; op dst, reg -> op dst, imm",
+	[PEEP_STORE_RELOAD]   = "mov A, B; mov B, A -> mov A, B",
+	[PEEP_SELF_MOV]       = "mov A, A ->",
+	[PEEP_JMP_NEXT]       = "jmp L; L: -> L:",
+	[PEEP_CMP_BRANCH]     = "cmp; set<cc>; movzx; test; jz -> cmp; j<!cc>",
+	[PEEP_REDUNDANT_TEST] = "op reg, X; test reg, reg; jz -> op reg, X; jz",
+};
+
+static size_t peephole_hits[PEEP_COUNT] = {0};
+
+static const reg_t TOS_REGISTERS[TOS_REGISTERS_COUNT] = TOS_REGISTER_LIST;
+
+/* ------------------------------------------------------- */
+/* Buffer                                                  */
+/* ------------------------------------------------------- */
+
+void
+insn_buffer_add(insn_buffer_t *buf, insn_t insn)
+{
+	if (buf->len >= buf->cap) {
+		buf->cap = buf->cap ? buf->cap * 2 : INSN_BUFFER_INIT_CAP;
+		buf->insns = (insn_t *) realloc(buf->insns, sizeof(insn_t) * buf->cap);
+	}
+
+	buf->insns[buf->len++] = insn;
+}
+
+// Room for `len` bytes of text, a new chunk is started if the last one is full
+static char *
+text_alloc(insn_buffer_t *buf, size_t len)
+{
+	if (buf->chunks_len > 0 && buf->chunk_used + len <= INSN_CHUNK_SIZE) {
+		char *text = buf->chunks[buf->chunks_len - 1] + buf->chunk_used;
+		buf->chunk_used += len;
+		return text;
+	}
+
+	if (buf->chunks_len >= buf->chunks_cap) {
+		buf->chunks_cap = buf->chunks_cap ? buf->chunks_cap * 2 : 4;
+		buf->chunks = (char **) realloc(buf->chunks, sizeof(char *) * buf->chunks_cap);
+	}
+
+	char *chunk = (char *) malloc(len > INSN_CHUNK_SIZE ? len : INSN_CHUNK_SIZE);
+	buf->chunks[buf->chunks_len++] = chunk;
+	buf->chunk_used = len;
+	return chunk;
+}
+
+void
+insn_buffer_vcomment(insn_buffer_t *buf, const char *fmt, va_list args)
+{
+	va_list copy;
+	va_copy(copy, args);
+	const int len = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+
+	char *text = text_alloc(buf, (size_t) len + 1);
+	vsnprintf(text, (size_t) len + 1, fmt, args);
+	insn_buffer_add(buf, (insn_t) { .kind = INSN_COMMENT, .text = text, .text_len = (u32) len });
+}
+
+void
+insn_buffer_flush(insn_buffer_t *buf, void (*emit)(const insn_t *insn))
+{
+	for (size_t i = 0; i < buf->len; ++i) {
+		if (!buf->insns[i].dead) emit(&buf->insns[i]);
+	}
+
+	// The first chunk is kept for the next body
+	for (u32 i = 1; i < buf->chunks_len; ++i) free(buf->chunks[i]);
+	if (buf->chunks_len > 1) buf->chunks_len = 1;
+	buf->chunk_used = 0;
+	buf->len = 0;
+}
+
+void
+insn_buffer_free(insn_buffer_t *buf)
+{
+	free(buf->insns);
+	for (u32 i = 0; i < buf->chunks_len; ++i) free(buf->chunks[i]);
+	free(buf->chunks);
+	*buf = (insn_buffer_t) {0};
+}
+
+/* ------------------------------------------------------- */
+/* Patterns                                                */
+/* ------------------------------------------------------- */
+
+// The patterns take the registers of the cache of the top of the stack for dead where
+// `compiler.c` drops the values in them: past the push that spills one, past the op it is
+// the source of, and at the labels and jumps. The rewrites that rely on it check it in
+// DEBUG builds.
+
+// Next record after `idx` that is alive and is not a comment, `buf->len` if there is none
+INLINE size_t
+next_line(const insn_buffer_t *buf, size_t idx)
+{
+	for (idx++; idx < buf->len; ++idx) {
+		if (!buf->insns[idx].dead && buf->insns[idx].kind != INSN_COMMENT) return idx;
+	}
+	return buf->len;
+}
+
+INLINE insn_t *
+insn_at(insn_buffer_t *buf, size_t idx)
+{
+	return idx < buf->len && buf->insns[idx].kind == INSN_OP ? &buf->insns[idx] : NULL;
+}
+
+INLINE bool
+insn_is(const insn_t *insn, op_t op, u32 operands_count)
+{
+	return insn != NULL && insn->op == op && insn_operands_count(insn) == operands_count;
+}
+
+static bool
+is_tos_register(const operand_t *operand)
+{
+	for (u8 i = 0; i < TOS_REGISTERS_COUNT; ++i) {
+		if (operand_is_reg(operand, TOS_REGISTERS[i])) return true;
+	}
+	return false;
+}
+
+// Number that fits in the sign-extended 32-bit immediate
+INLINE bool
+is_imm32(const operand_t *operand)
+{
+	return operand->kind == OPERAND_IMM
+		&& operand->label.kind == LABEL_NONE
+		&& operand->value >= INT32_MIN
+		&& operand->value <= INT32_MAX;
+}
+
+// ALU ops that set the zero flag by the result, and take an immediate as the source
+INLINE bool
+is_alu(op_t op)
+{
+	return op == OP_ADD || op == OP_SUB || op == OP_OR || op == OP_AND || op == OP_XOR;
+}
+
+#ifdef DEBUG
+// The first operand is written and not read
+INLINE bool
+writes_first_operand(op_t op)
+{
+	return op == OP_MOV || op == OP_MOVZX || op == OP_MOVSXD || op == OP_LEA || op == OP_POP;
+}
+
+// Nothing past `idx` reads the register before it is written again, or before a label
+// or a jump, where the cache keeps nothing
+static bool
+is_dead_after(const insn_buffer_t *buf, size_t idx, reg_t reg)
+{
+	for (size_t i = next_line(buf, idx); i < buf->len; i = next_line(buf, i)) {
+		const insn_t *insn = &buf->insns[i];
+		if (insn->kind != INSN_OP || insn->op == OP_JMP || insn->op == OP_JCC || insn->op == OP_RET) return true;
+
+		const bool written = writes_first_operand((op_t) insn->op) && insn->operands[0].kind == OPERAND_REG;
+		const u32 count = insn_operands_count(insn);
+		for (u32 k = written ? 1 : 0; k < count; ++k) {
+			if (operand_uses(&insn->operands[k], reg)) return false;
+		}
+		if (written && insn->operands[0].reg == reg) return true;
+	}
+	return true;
+}
+
+#define CHECK_DEAD_AFTER(buf, idx, reg) \
+	ASSERT(is_dead_after(buf, idx, reg), "a cached register is read where the peephole pass takes it for dead")
+#else
+#define CHECK_DEAD_AFTER(buf, idx, reg) do { (void) (buf); (void) (idx); (void) (reg); } while (0)
+#endif // DEBUG
+
+// Skip the pushes of the cached registers other than `reg`, they do not touch the flags
+static size_t
+skip_flushes(insn_buffer_t *buf, size_t idx, const operand_t *reg)
+{
+	for (;;) {
+		const insn_t *insn = insn_at(buf, idx);
+		if (!insn_is(insn, OP_PUSH, 1)
+		|| !is_tos_register(&insn->operands[0])
+		|| operand_eq(&insn->operands[0], reg))
+		{
+			return idx;
+		}
+		idx = next_line(buf, idx);
+	}
+}
+
+INLINE bool
+is_zero_branch(const insn_t *insn)
+{
+	return insn_is(insn, OP_JCC, 1) && (insn->cc == CC_E || insn->cc == CC_NE);
+}
+
+INLINE void
+kill(insn_buffer_t *buf, size_t idx, peephole_pattern_t pattern)
+{
+	buf->insns[idx].dead = true;
+	peephole_hits[pattern]++;
+}
+
+static bool
+match_push_pop(insn_buffer_t *buf, size_t i)
+{
+	const insn_t *push = &buf->insns[i];
+	const size_t j = next_line(buf, i);
+	insn_t *pop = insn_at(buf, j);
+	if (!insn_is(push, OP_PUSH, 1) || !insn_is(pop, OP_POP, 1)) return false;
+
+	const operand_t src = push->operands[0];
+	const operand_t dst = pop->operands[0];
+	if (src.kind == OPERAND_MEM && dst.kind == OPERAND_MEM) return false;
+
+	if (operand_eq(&src, &dst)) pop->dead = true;
+	else *pop = insn_op2(OP_MOV, dst, src);
+
+	kill(buf, i, PEEP_PUSH_POP);
+	return true;
+}
+
+// The register is dead once it is pushed
+static bool
+match_mov_imm_push(insn_buffer_t *buf, size_t i)
+{
+	const insn_t *mov = &buf->insns[i];
+	const size_t j = next_line(buf, i);
+	insn_t *push = insn_at(buf, j);
+	if (!insn_is(mov, OP_MOV, 2) || !insn_is(push, OP_PUSH, 1)) return false;
+
+	const operand_t *reg = &mov->operands[0];
+	const operand_t *imm = &mov->operands[1];
+	if (!is_tos_register(reg) || !operand_eq(reg, &push->operands[0]) || !is_imm32(imm)) return false;
+
+	CHECK_DEAD_AFTER(buf, j, (reg_t) reg->reg);
+	push->operands[0] = *imm;
+	kill(buf, i, PEEP_MOV_IMM_PUSH);
+	return true;
+}
+
+// The source register of an op is consumed by it
+static bool
+match_mov_imm_op(insn_buffer_t *buf, size_t i)
+{
+	const insn_t *mov = &buf->insns[i];
+	const size_t j = next_line(buf, i);
+	insn_t *op = insn_at(buf, j);
+	if (!insn_is(mov, OP_MOV, 2) || op == NULL || insn_operands_count(op) != 2) return false;
+
+	const operand_t *reg = &mov->operands[0];
+	const operand_t *imm = &mov->operands[1];
+	const operand_t *dst = &op->operands[0];
+	if ((!is_alu((op_t) op->op) && op->op != OP_CMP)
+	|| !is_tos_register(reg)
+	|| !is_imm32(imm)
+	|| !operand_eq(&op->operands[1], reg)
+	|| operand_eq(dst, reg)
+	|| dst->kind == OPERAND_MEM)
+	{
+		return false;
+	}
+
+	CHECK_DEAD_AFTER(buf, j, (reg_t) reg->reg);
+	op->operands[1] = *imm;
+	kill(buf, i, PEEP_MOV_IMM_OP);
+	return true;
+}
+
+static bool
+match_movs(insn_buffer_t *buf, size_t i)
+{
+	const insn_t *first = &buf->insns[i];
+	if (!insn_is(first, OP_MOV, 2)) return false;
+
+	const operand_t *a = &first->operands[0];
+	const operand_t *b = &first->operands[1];
+	if (operand_eq(a, b)) {
+		kill(buf, i, PEEP_SELF_MOV);
+		return true;
+	}
+
+	// The second one moves back what is there already, unless the first one moved the address
+	const size_t j = next_line(buf, i);
+	const insn_t *second = insn_at(buf, j);
+	if (!insn_is(second, OP_MOV, 2)
+	|| !operand_eq(&second->operands[0], b)
+	|| !operand_eq(&second->operands[1], a)
+	|| (a->kind == OPERAND_REG && operand_uses(b, (reg_t) a->reg)))
+	{
+		return false;
+	}
+
+	kill(buf, j, PEEP_STORE_RELOAD);
+	return true;
+}
+
+static bool
+match_jmp_next(insn_buffer_t *buf, size_t i)
+{
+	const insn_t *jmp = &buf->insns[i];
+	if (!insn_is(jmp, OP_JMP, 1) || jmp->operands[0].label.kind == LABEL_NONE) return false;
+
+	for (size_t j = next_line(buf, i); j < buf->len && buf->insns[j].kind == INSN_LABEL; j = next_line(buf, j)) {
+		if (label_eq(buf->insns[j].operands[0].label, jmp->operands[0].label)) {
+			kill(buf, i, PEEP_JMP_NEXT);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// The cached registers are dead at the jump, and nothing reads the flags or `al` past it
+static bool
+match_cmp_branch(insn_buffer_t *buf, size_t i)
+{
+	const insn_t *cmp = &buf->insns[i];
+	if (!insn_is(cmp, OP_CMP, 2)) return false;
+
+	const size_t set_idx = next_line(buf, i);
+	const insn_t *set = insn_at(buf, set_idx);
+	if (!insn_is(set, OP_SETCC, 1) || set->operands[0].kind != OPERAND_REG || set->operands[0].reg != REG_RAX) {
+		return false;
+	}
+
+	const size_t movzx_idx = next_line(buf, set_idx);
+	const insn_t *movzx = insn_at(buf, movzx_idx);
+	if (!insn_is(movzx, OP_MOVZX, 2)
+	|| !is_tos_register(&movzx->operands[0])
+	|| !operand_eq(&movzx->operands[1], &set->operands[0]))
+	{
+		return false;
+	}
+
+	const operand_t *reg = &movzx->operands[0];
+	const size_t test_idx = skip_flushes(buf, next_line(buf, movzx_idx), reg);
+	const insn_t *test = insn_at(buf, test_idx);
+	if (!insn_is(test, OP_TEST, 2)
+	|| !operand_eq(&test->operands[0], reg)
+	|| !operand_eq(&test->operands[1], reg))
+	{
+		return false;
+	}
+
+	const size_t jump_idx = next_line(buf, test_idx);
+	insn_t *jump = insn_at(buf, jump_idx);
+	if (!is_zero_branch(jump)) return false;
+
+	CHECK_DEAD_AFTER(buf, jump_idx, (reg_t) reg->reg);
+	jump->cc = jump->cc == CC_E ? CC_NEGATE(set->cc) : set->cc;
+	buf->insns[set_idx].dead = true;
+	buf->insns[movzx_idx].dead = true;
+	kill(buf, test_idx, PEEP_CMP_BRANCH);
+	return true;
+}
+
+// The op has set the zero flag by its result already
+static bool
+match_redundant_test(insn_buffer_t *buf, size_t i)
+{
+	const insn_t *op = &buf->insns[i];
+	if (!is_alu((op_t) op->op) || insn_operands_count(op) != 2) return false;
+
+	const operand_t *reg = &op->operands[0];
+	if (!is_tos_register(reg)) return false;
+
+	const size_t test_idx = skip_flushes(buf, next_line(buf, i), reg);
+	const insn_t *test = insn_at(buf, test_idx);
+	if (!insn_is(test, OP_TEST, 2)
+	|| !operand_eq(&test->operands[0], reg)
+	|| !operand_eq(&test->operands[1], reg)
+	|| !is_zero_branch(insn_at(buf, next_line(buf, test_idx))))
+	{
+		return false;
+	}
+
+	kill(buf, test_idx, PEEP_REDUNDANT_TEST);
+	return true;
+}
+
+void
+peephole_run(insn_buffer_t *buf)
+{
+	bool changed = true;
+	for (u32 pass = 0; changed && pass < PEEPHOLE_MAX_PASSES; ++pass) {
+		changed = false;
+		for (size_t i = 0; i < buf->len; ++i) {
+			if (buf->insns[i].dead || buf->insns[i].kind != INSN_OP) continue;
+
+			changed |= match_push_pop(buf, i)
+				|| match_mov_imm_push(buf, i)
+				|| match_mov_imm_op(buf, i)
+				|| match_movs(buf, i)
+				|| match_jmp_next(buf, i)
+				|| match_cmp_branch(buf, i)
+				|| match_redundant_test(buf, i);
+		}
+	}
+}
+
+void
+peephole_print_stats(void)
+{
+	size_t total = 0;
+	for (u32 i = 0; i < PEEP_COUNT; ++i) total += peephole_hits[i];
+
+	printf("peephole: %zu rewrites\n", total);
+	for (u32 i = 0; i < PEEP_COUNT; ++i) {
+		printf("  %-48s %zu\n", PEEPHOLE_PATTERN_NAMES[i], peephole_hits[i]);
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef PEEPHOLE_H_
+#define PEEPHOLE_H_
+
+#include "insn.h"
+#include "common.h"
+
+#include <stdarg.h>
+
+typedef struct {
+	insn_t *insns;
+	size_t len;
+	size_t cap;
+
+	// Text of the comments, in chunks that stay where they are till the buffer is emptied
+	char **chunks;
+	u32 chunks_len;
+	u32 chunks_cap;
+	size_t chunk_used;
+} insn_buffer_t;
+
+void
+insn_buffer_add(insn_buffer_t *buf, insn_t insn);
+
+void
+insn_buffer_vcomment(insn_buffer_t *buf, const char *fmt, va_list args);
+
+// Rewrite the instructions of the buffer, the ones that go are marked dead
+void
+peephole_run(insn_buffer_t *buf);
+
+// Hand the records that are not dead to `emit` in order, and empty the buffer
+void
+insn_buffer_flush(insn_buffer_t *buf, void (*emit)(const insn_t *insn));
+
+void
+insn_buffer_free(insn_buffer_t *buf);
+
+void
+peephole_print_stats(void);
+
+#endif // PEEPHOLE_H_
@@ -0,0 +1,1275 @@
+#include "lib.h"
+#include "insn.h"
+#include "common.h"
+#include "emit.h"
+#include "compiler.h"
+#include "regalloc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define SET_BITS 64
+
+static size_t values_in_registers = 0;
+static size_t values_spilled = 0;
+static size_t copies_coalesced = 0;
+
+// Scratch of the liveness and the scan, kept for the next body
+static struct {
+	// Interval of every value, in the positions of the instructions: the start of the body
+	// is 0, the instruction `i` is at `i + 1`
+	u32 *start;
+	u32 *end;
+	// Phi the value is merged by, its register is the one to try first
+	ir_value_t *merged_by;
+	u64 *keys;
+	u32 values_cap;
+
+	// Live values of every block, the sets are `words` long and are parts of `sets`
+	u64 *sets;
+	size_t sets_cap;
+	u64 *gen;
+	u64 *kill;
+	u64 *live_in;
+	u64 *live_out;
+	u64 *phi_out;
+
+	// Live phis whose operands are counted as used
+	u64 *counted;
+	size_t counted_cap;
+
+	// Positions of the instructions that overwrite the register, ascending, the ones of
+	// the register `reg` are from `clobbered_first[reg]` to `clobbered_first[reg + 1]`
+	u32 *clobbered;
+	size_t clobbered_cap;
+	u32 clobbered_first[RA_REGISTERS_COUNT + 1];
+} scratch = {0};
+
+static void *
+reserve(void *items, size_t *cap, size_t len, size_t size)
+{
+	if (len <= *cap) return items;
+	while (len > *cap) *cap = *cap ? *cap * 2 : IR_INIT_CAP;
+	return realloc(items, size * *cap);
+}
+
+INLINE bool
+set_has(const u64 *set, u32 value)
+{
+	return (set[value / SET_BITS] >> (value % SET_BITS)) & 1;
+}
+
+INLINE void
+set_add(u64 *set, u32 value)
+{
+	set[value / SET_BITS] |= (u64) 1 << (value % SET_BITS);
+}
+
+INLINE bool
+fits_i32(i64 value)
+{
+	return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+INLINE ir_value_t
+find(const regalloc_t *ra, ir_value_t value)
+{
+	while (ra->copy_of[value] != value) value = ra->copy_of[value];
+	return value;
+}
+
+u32
+regalloc_used_operands(const ir_instr_t *instr, u32 *first)
+{
+	switch (instr->op) {
+	// The copies are kept where the values they copy are
+	case IR_PICK:
+	case IR_COLLAPSE:
+	case IR_DROP: {
+		*first = instr->operands_count;
+	} return instr->operands_count;
+
+	case IR_RETURN: {
+		*first = instr->operands_count - (u32) instr->imm;
+	} return instr->operands_count;
+
+	case IR_NOP:
+	case IR_PHI:
+	case IR_CONST:
+	case IR_STRING:
+	case IR_ADDRESS:
+	case IR_ARG:
+	case IR_LOAD:
+	case IR_STORE:
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+	case IR_DIV:
+	case IR_MOD:
+	case IR_OR:
+	case IR_NOT:
+	case IR_INDEX:
+	case IR_EQUAL:
+	case IR_LESS:
+	case IR_GREATER:
+	case IR_GREATER_EQUAL:
+	case IR_LESS_EQUAL:
+	case IR_PRINT:
+	case IR_SYSCALL:
+	case IR_CALL:
+	case IR_CALL_EXTERN:
+	case IR_JUMP:
+	case IR_BRANCH:
+	case IR_OP_COUNT: break;
+	}
+
+	*first = 0;
+	return instr->operands_count;
+}
+
+// Picks, the results of inline bodies and phis that merge one value are copies, every read
+// of an argument is a copy of the first one
+static void
+find_copies(regalloc_t *ra, const ir_func_t *ir)
+{
+	for (ir_value_t v = 0; v < ir->values_len; ++v) ra->copy_of[v] = v;
+
+	ir_value_t args[IR_INIT_CAP];
+	u32 args_len = 0;
+
+	for (u32 i = 0; i < ir->instrs_len; ++i) {
+		const ir_instr_t *instr = &ir->instrs[i];
+		const ir_value_t *operands = ir_operands(ir, instr);
+
+		if (instr->op == IR_PICK) {
+			ra->copy_of[instr->result] = find(ra, operands[0]);
+		} else if (instr->op == IR_COLLAPSE) {
+			for (u8 k = 0; k < instr->results_count; ++k) {
+				ra->copy_of[instr->result + k] = find(ra, operands[instr->operands_count - 1 - k]);
+			}
+		} else if (instr->op == IR_ARG) {
+			u32 k = 0;
+			while (k < args_len && ir_def(ir, args[k])->imm != instr->imm) k++;
+			if (k < args_len) ra->copy_of[instr->result] = args[k];
+			else if (args_len < IR_INIT_CAP) args[args_len++] = instr->result;
+		}
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (u32 i = 0; i < ir->instrs_len; ++i) {
+			const ir_instr_t *instr = &ir->instrs[i];
+			if (instr->op != IR_PHI || ra->copy_of[instr->result] != instr->result) continue;
+
+			ir_value_t same = IR_NONE;
+			bool copy = true;
+			for (u32 j = 0; j < instr->operands_count && copy; ++j) {
+				const ir_value_t operand = find(ra, ir_operands(ir, instr)[j]);
+				if (operand == instr->result || operand == same) continue;
+				if (same != IR_NONE) copy = false;
+				same = operand;
+			}
+
+			if (!copy || same == IR_NONE) continue;
+			ra->copy_of[instr->result] = same;
+			changed = true;
+		}
+	}
+
+	for (ir_value_t v = 0; v < ir->values_len; ++v) {
+		ra->copy_of[v] = find(ra, v);
+		if (ra->copy_of[v] != v) copies_coalesced++;
+	}
+}
+
+INLINE bool
+is_live_phi(const regalloc_t *ra, const ir_instr_t *instr)
+{
+	return instr->op == IR_PHI && ra->copy_of[instr->result] == instr->result && ra->uses[instr->result] > 0;
+}
+
+// A phi uses its operands only once it is used itself, so that the values merged by a phi
+// nothing reads, or only the phis of a loop read, are not kept
+static void
+count_uses(regalloc_t *ra, const ir_func_t *ir)
+{
+	memset(ra->uses, 0, sizeof(u32) * ir->values_len);
+
+	for (u32 i = 0; i < ir->instrs_len; ++i) {
+		const ir_instr_t *instr = &ir->instrs[i];
+		if (instr->op == IR_NOP || instr->op == IR_PHI) continue;
+
+		u32 first = 0;
+		const u32 end = regalloc_used_operands(instr, &first);
+		for (u32 j = first; j < end; ++j) ra->uses[ra->copy_of[ir_operands(ir, instr)[j]]]++;
+	}
+
+	const size_t words = (ir->values_len + SET_BITS - 1) / SET_BITS;
+	scratch.counted = (u64 *) reserve(scratch.counted, &scratch.counted_cap, words, sizeof(u64));
+	memset(scratch.counted, 0, sizeof(u64) * words);
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (u32 i = 0; i < ir->instrs_len; ++i) {
+			const ir_instr_t *instr = &ir->instrs[i];
+			if (!is_live_phi(ra, instr) || set_has(scratch.counted, instr->result)) continue;
+
+			set_add(scratch.counted, instr->result);
+			changed = true;
+			for (u32 j = 0; j < instr->operands_count; ++j) {
+				const ir_value_t operand = ra->copy_of[ir_operands(ir, instr)[j]];
+				if (operand != instr->result) ra->uses[operand]++;
+			}
+		}
+	}
+}
+
+// The value needs a place of its own while it is live
+INLINE bool
+is_kept(const regalloc_t *ra, ir_value_t value)
+{
+	return ra->copy_of[value] == value && ra->uses[value] > 0 && ra->locs[value].kind != RA_LOC_IMM;
+}
+
+static u32
+successors(const ir_func_t *ir, const ir_block_t *block, u32 succs[2])
+{
+	const ir_instr_t *term = &ir->instrs[block->end - 1];
+	switch (term->op) {
+	case IR_JUMP: {
+		succs[0] = term->targets[0];
+	} return 1;
+
+	case IR_BRANCH: {
+		succs[0] = term->targets[0];
+		succs[1] = term->targets[1];
+	} return 2;
+
+	default: return 0;
+	}
+}
+
+INLINE void
+extend(ir_value_t value, u32 pos)
+{
+	if (pos < scratch.start[value]) scratch.start[value] = pos;
+	if (pos > scratch.end[value]) scratch.end[value] = pos;
+}
+
+// Extend the intervals over the positions where the values are live. An interval is one
+// range from the first to the last of them, what is live at the head of a loop covers all of it.
+static void
+build_intervals(const regalloc_t *ra, const ir_func_t *ir)
+{
+	const size_t words = (ir->values_len + SET_BITS - 1) / SET_BITS;
+	const size_t sets_len = words * ir->blocks_len;
+	scratch.sets = (u64 *) reserve(scratch.sets, &scratch.sets_cap, sets_len * 5, sizeof(u64));
+	scratch.gen = scratch.sets;
+	scratch.kill = scratch.gen + sets_len;
+	scratch.live_in = scratch.kill + sets_len;
+	scratch.live_out = scratch.live_in + sets_len;
+	scratch.phi_out = scratch.live_out + sets_len;
+	memset(scratch.sets, 0, sizeof(u64) * sets_len * 5);
+
+	// The arguments are read at the start of the body
+	for (u32 i = 0; i < ir->instrs_len; ++i) {
+		const ir_instr_t *instr = &ir->instrs[i];
+		if (instr->op == IR_ARG && is_kept(ra, instr->result)) set_add(scratch.kill, instr->result);
+	}
+
+	for (u32 b = 0; b < ir->blocks_len; ++b) {
+		const ir_block_t *block = &ir->blocks[b];
+		u64 *gen = scratch.gen + b * words;
+		u64 *kill = scratch.kill + b * words;
+
+		for (u32 i = block->first; i < block->end; ++i) {
+			const ir_instr_t *instr = &ir->instrs[i];
+			const ir_value_t *operands = ir_operands(ir, instr);
+
+			if (instr->op == IR_PHI) {
+				if (!is_live_phi(ra, instr)) continue;
+				set_add(kill, instr->result);
+				for (u32 j = 0; j < instr->operands_count; ++j) {
+					const ir_value_t operand = ra->copy_of[operands[j]];
+					if (is_kept(ra, operand)) set_add(scratch.phi_out + block->preds[j] * words, operand);
+				}
+				continue;
+			}
+
+			if (instr->op == IR_NOP) continue;
+
+			u32 first = 0;
+			const u32 end = regalloc_used_operands(instr, &first);
+			for (u32 j = first; j < end; ++j) {
+				const ir_value_t operand = ra->copy_of[operands[j]];
+				if (is_kept(ra, operand) && !set_has(kill, operand)) set_add(gen, operand);
+			}
+
+			if (instr->op == IR_ARG) continue;
+			for (u8 k = 0; k < instr->results_count; ++k) {
+				if (is_kept(ra, instr->result + k)) set_add(kill, instr->result + k);
+			}
+		}
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (u32 b = ir->blocks_len; b > 0; --b) {
+			const ir_block_t *block = &ir->blocks[b - 1];
+			u64 *out = scratch.live_out + (b - 1) * words;
+			u64 *in = scratch.live_in + (b - 1) * words;
+			const u64 *gen = scratch.gen + (b - 1) * words;
+			const u64 *kill = scratch.kill + (b - 1) * words;
+
+			memcpy(out, scratch.phi_out + (b - 1) * words, sizeof(u64) * words);
+			u32 succs[2];
+			const u32 succs_count = successors(ir, block, succs);
+			for (u32 s = 0; s < succs_count; ++s) {
+				const u64 *succ_in = scratch.live_in + succs[s] * words;
+				for (size_t w = 0; w < words; ++w) out[w] |= succ_in[w];
+			}
+
+			for (size_t w = 0; w < words; ++w) {
+				const u64 live = gen[w] | (out[w] & ~kill[w]);
+				if (live != in[w]) {
+					in[w] = live;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	for (ir_value_t v = 0; v < ir->values_len; ++v) {
+		scratch.start[v] = UINT32_MAX;
+		scratch.end[v] = 0;
+	}
+
+	for (u32 b = 0; b < ir->blocks_len; ++b) {
+		const ir_block_t *block = &ir->blocks[b];
+		const u32 block_start = block->first + 1, block_end = block->end;
+
+		for (size_t w = 0; w < words; ++w) {
+			for (u64 bits = scratch.live_in[b * words + w]; bits; bits &= bits - 1) {
+				extend((ir_value_t) (w * SET_BITS + (size_t) __builtin_ctzll(bits)), block_start);
+			}
+			for (u64 bits = scratch.live_out[b * words + w]; bits; bits &= bits - 1) {
+				extend((ir_value_t) (w * SET_BITS + (size_t) __builtin_ctzll(bits)), block_end);
+			}
+		}
+
+		for (u32 i = block->first; i < block->end; ++i) {
+			const ir_instr_t *instr = &ir->instrs[i];
+			if (instr->op == IR_NOP) continue;
+
+			if (instr->op != IR_PHI) {
+				u32 first = 0;
+				const u32 end = regalloc_used_operands(instr, &first);
+				for (u32 j = first; j < end; ++j) {
+					const ir_value_t operand = ra->copy_of[ir_operands(ir, instr)[j]];
+					if (is_kept(ra, operand)) extend(operand, i + 1);
+				}
+			}
+
+			for (u8 k = 0; k < instr->results_count; ++k) {
+				if (!is_kept(ra, instr->result + k)) continue;
+				extend(instr->result + k, instr->op == IR_ARG ? 0 : i + 1);
+			}
+		}
+	}
+}
+
+// Registers overwritten by the instructions between the positions, the ends excluded
+static u16
+clobbered_between(u32 start, u32 end)
+{
+	if (end <= start + 1) return 0;
+
+	u16 mask = 0;
+	for (u8 reg = 0; reg < RA_REGISTERS_COUNT; ++reg) {
+		// The first position after `start` the register is overwritten at
+		u32 lo = scratch.clobbered_first[reg], hi = scratch.clobbered_first[reg + 1];
+		while (lo < hi) {
+			const u32 mid = lo + (hi - lo) / 2;
+			if (scratch.clobbered[mid] <= start) lo = mid + 1;
+			else hi = mid;
+		}
+
+		if (lo < scratch.clobbered_first[reg + 1] && scratch.clobbered[lo] < end) mask |= (u16) (1 << reg);
+	}
+	return mask;
+}
+
+// Most of the instructions overwrite nothing, only the positions of the ones that do are kept
+static void
+collect_clobbers(const ir_func_t *ir, const u16 *clobbers)
+{
+	u32 counts[RA_REGISTERS_COUNT] = {0};
+	for (u32 i = 0; i < ir->instrs_len; ++i) {
+		for (u16 bits = clobbers[i]; bits; bits &= bits - 1) counts[__builtin_ctz(bits)]++;
+	}
+
+	u32 total = 0;
+	for (u8 reg = 0; reg < RA_REGISTERS_COUNT; ++reg) {
+		scratch.clobbered_first[reg] = total;
+		total += counts[reg];
+		counts[reg] = scratch.clobbered_first[reg];
+	}
+	scratch.clobbered_first[RA_REGISTERS_COUNT] = total;
+	scratch.clobbered = (u32 *) reserve(scratch.clobbered, &scratch.clobbered_cap, total, sizeof(u32));
+
+	for (u32 i = 0; i < ir->instrs_len; ++i) {
+		for (u16 bits = clobbers[i]; bits; bits &= bits - 1) scratch.clobbered[counts[__builtin_ctz(bits)]++] = i + 1;
+	}
+}
+
+static int
+compare_keys(const void *a, const void *b)
+{
+	const u64 x = *(const u64 *) a, y = *(const u64 *) b;
+	return (x > y) - (x < y);
+}
+
+static void
+spill(regalloc_t *ra, const ir_func_t *ir, ir_value_t value)
+{
+	const ir_instr_t *def = ir_def(ir, value);
+	if (def->op == IR_ARG) {
+		ra->locs[value] = (ra_loc_t) { .kind = RA_LOC_ARG, .slot = (u32) def->imm };
+	} else {
+		ra->locs[value] = (ra_loc_t) { .kind = RA_LOC_SLOT, .slot = ra->slots++ };
+	}
+	values_spilled++;
+}
+
+// Register the value would best get: the one of the operand an op overwrites, or of a value
+// a phi merges, or of the phi that merges it, so that no move is needed
+static i32
+preferred_reg(const regalloc_t *ra, const ir_func_t *ir, ir_value_t value, u16 free)
+{
+	ir_value_t candidates[3] = { IR_NONE, IR_NONE, scratch.merged_by[value] };
+	const ir_instr_t *def = ir_def(ir, value);
+	switch (def->op) {
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+	case IR_OR:
+	case IR_NOT: {
+		candidates[0] = ir_operands(ir, def)[0];
+	} break;
+
+	case IR_PHI: {
+		candidates[0] = ir_operands(ir, def)[0];
+		candidates[1] = ir_operands(ir, def)[1];
+	} break;
+
+	default: break;
+	}
+
+	for (u32 i = 0; i < 3; ++i) {
+		if (candidates[i] == IR_NONE) continue;
+		const ra_loc_t loc = ra->locs[ra->copy_of[candidates[i]]];
+		if (loc.kind == RA_LOC_REG && (free & (1 << loc.reg))) return loc.reg;
+	}
+	return -1;
+}
+
+static void
+linear_scan(regalloc_t *ra, const ir_func_t *ir, const u8 *order, u8 order_len)
+{
+	u32 count = 0;
+	for (ir_value_t v = 0; v < ir->values_len; ++v) {
+		if (is_kept(ra, v)) scratch.keys[count++] = ((u64) scratch.start[v] << 32) | v;
+	}
+	qsort(scratch.keys, count, sizeof(u64), compare_keys);
+
+	u16 allowed = 0;
+	for (u8 i = 0; i < order_len; ++i) allowed |= (u16) (1 << order[i]);
+
+	// Values in registers, live at the current position
+	ir_value_t active[RA_REGISTERS_COUNT];
+	u32 active_len = 0;
+
+	for (u32 k = 0; k < count; ++k) {
+		const ir_value_t value = (ir_value_t) scratch.keys[k];
+		const u32 start = scratch.start[value], end = scratch.end[value];
+
+		u16 busy = 0;
+		u32 kept = 0;
+		for (u32 i = 0; i < active_len; ++i) {
+			if (scratch.end[active[i]] <= start) continue;
+			active[kept++] = active[i];
+			busy |= (u16) (1 << ra->locs[active[i]].reg);
+		}
+		active_len = kept;
+
+		const u16 clobbered = clobbered_between(start, end);
+		const u16 free = allowed & ~busy & ~clobbered;
+
+		i32 reg = preferred_reg(ra, ir, value, free);
+		for (u8 i = 0; i < order_len && reg < 0; ++i) {
+			if (free & (1 << order[i])) reg = order[i];
+		}
+
+		if (reg < 0) {
+			// The value that lives the longest goes to memory
+			u32 victim = active_len;
+			for (u32 i = 0; i < active_len; ++i) {
+				if (clobbered & (1 << ra->locs[active[i]].reg)) continue;
+				if (victim == active_len || scratch.end[active[i]] > scratch.end[active[victim]]) victim = i;
+			}
+
+			if (victim == active_len || scratch.end[active[victim]] <= end) {
+				spill(ra, ir, value);
+				continue;
+			}
+
+			reg = ra->locs[active[victim]].reg;
+			spill(ra, ir, active[victim]);
+			values_in_registers--;
+			active[victim] = active[--active_len];
+		}
+
+		ra->locs[value] = (ra_loc_t) { .kind = RA_LOC_REG, .reg = (u8) reg };
+		ra->used |= (u16) (1 << reg);
+		active[active_len++] = value;
+		values_in_registers++;
+	}
+}
+
+void
+regalloc_run(regalloc_t *ra, const ir_func_t *ir, const u16 *clobbers, const u8 *order, u8 order_len)
+{
+	if (ir->values_len > ra->values_cap) {
+		while (ir->values_len > ra->values_cap) ra->values_cap = ra->values_cap ? ra->values_cap * 2 : IR_INIT_CAP;
+		ra->copy_of = (ir_value_t *) realloc(ra->copy_of, sizeof(ir_value_t) * ra->values_cap);
+		ra->locs = (ra_loc_t *) realloc(ra->locs, sizeof(ra_loc_t) * ra->values_cap);
+		ra->uses = (u32 *) realloc(ra->uses, sizeof(u32) * ra->values_cap);
+	}
+
+	if (ir->values_len > scratch.values_cap) {
+		while (ir->values_len > scratch.values_cap) {
+			scratch.values_cap = scratch.values_cap ? scratch.values_cap * 2 : IR_INIT_CAP;
+		}
+		scratch.start = (u32 *) realloc(scratch.start, sizeof(u32) * scratch.values_cap);
+		scratch.end = (u32 *) realloc(scratch.end, sizeof(u32) * scratch.values_cap);
+		scratch.merged_by = (ir_value_t *) realloc(scratch.merged_by, sizeof(ir_value_t) * scratch.values_cap);
+		scratch.keys = (u64 *) realloc(scratch.keys, sizeof(u64) * scratch.values_cap);
+	}
+
+	ra->slots = 0;
+	ra->used = 0;
+
+	find_copies(ra, ir);
+	count_uses(ra, ir);
+
+	for (ir_value_t v = 0; v < ir->values_len; ++v) {
+		const ir_instr_t *def = ir_def(ir, v);
+		ra->locs[v] = (ra_loc_t) { .kind = RA_LOC_NONE };
+		scratch.merged_by[v] = IR_NONE;
+		if (ra->copy_of[v] == v && def->op == IR_CONST && fits_i32(def->imm)) {
+			ra->locs[v] = (ra_loc_t) { .kind = RA_LOC_IMM, .imm = def->imm };
+		}
+	}
+
+	for (u32 i = 0; i < ir->instrs_len; ++i) {
+		const ir_instr_t *instr = &ir->instrs[i];
+		if (!is_live_phi(ra, instr)) continue;
+		for (u32 j = 0; j < instr->operands_count; ++j) {
+			scratch.merged_by[ra->copy_of[ir_operands(ir, instr)[j]]] = instr->result;
+		}
+	}
+
+	build_intervals(ra, ir);
+	collect_clobbers(ir, clobbers);
+	linear_scan(ra, ir, order, order_len);
+
+	for (ir_value_t v = 0; v < ir->values_len; ++v) ra->locs[v] = ra->locs[ra->copy_of[v]];
+}
+
+// Lowering of the allocated body to the records `compiler.c` emits. What it leaves out:
+// - `r12` and `r13` are never allocated, they are reserved for the cache of the top of the
+//   stack of the bodies emitted from the asts, see `TOS_REGISTER_LIST`
+// - a call of a proc or func pushes its operands and pops its results, it passes them on
+//   the stack as every body expects, only externs and syscalls take them in registers
+// A value live across a call is kept in a register the callees save, or in a slot.
+
+// Body being lowered, and the numbers its labels of ifs and whiles start at
+static const ir_func_t *ir = NULL;
+static size_t label_base = 0;
+static size_t while_label_base = 0;
+
+static const label_kind_t IR_LABEL_KINDS[] = {
+	[IR_LABEL_NONE]  = LABEL_NONE,
+	[IR_LABEL_ELSE]  = LABEL_ELSE,
+	[IR_LABEL_EDON]  = LABEL_EDON,
+	[IR_LABEL_WHILE] = LABEL_WHILE,
+	[IR_LABEL_WDON]  = LABEL_WDON,
+};
+
+// Label of the block, numbered on from the ones of the bodies before
+INLINE label_t
+block_label(u32 target)
+{
+	const ir_block_t *block = &ir->blocks[target];
+	const bool is_while = block->label == IR_LABEL_WHILE || block->label == IR_LABEL_WDON;
+	const size_t base = is_while ? while_label_base : label_base;
+	return label_numbered(IR_LABEL_KINDS[block->label], base + block->label_number);
+}
+
+#define REG_BIT(reg) ((u16) (1 << (reg)))
+
+// The values of an IR body are kept in these, the ones overwritten the most often go first.
+// `rax` and `r11` are the scratch of the emitted code, `r12` and `r13` are left to the cache
+// of the top of the stack, see above.
+#define ALLOCATABLE_REGISTERS_COUNT 11
+static const u8 ALLOCATABLE_REGISTERS[ALLOCATABLE_REGISTERS_COUNT] = {
+	REG_RSI, REG_RDI, REG_RCX, REG_RDX, REG_R14, REG_R10, REG_R9, REG_R8, REG_RBX, REG_R15, REG_RBP,
+};
+
+// Nothing emitted from the asts touches these, a body that keeps values in them saves them
+#define CALLEE_SAVED_REGISTERS_COUNT 3
+static const reg_t CALLEE_SAVED_REGISTERS[CALLEE_SAVED_REGISTERS_COUNT] = { REG_RBX, REG_RBP, REG_R15 };
+
+static regalloc_t ra = {0};
+static u16 *clobbers = NULL;
+static u32 clobbers_cap = 0;
+
+// Words of the frame below the return address, the saved registers and the slots,
+// and the words pushed on top of it by the body
+static u32 frame_words = 0;
+static u32 pushed = 0;
+
+// The branch right after a compare jumps on `fused_cc`, the compare sets the flags only
+static bool fused = false;
+static cc_t fused_cc = CC_E;
+
+typedef struct {
+	ra_loc_t dst;
+	ra_loc_t src;
+} move_t;
+
+static move_t *moves = NULL;
+static u32 moves_len = 0;
+static u32 moves_cap = 0;
+
+// Registers the instruction overwrites, what it writes to the ones of its results aside
+static u16
+instr_clobbers(const ir_instr_t *instr)
+{
+	switch ((ir_op_t) instr->op) {
+	case IR_DIV:
+	case IR_MOD: return REG_BIT(REG_RAX) | REG_BIT(REG_RDX);
+
+	// `dmp_i64`, or `strlen` and the write
+	case IR_PRINT: {
+		return REG_BIT(REG_RAX) | REG_BIT(REG_RCX) | REG_BIT(REG_RDX) | REG_BIT(REG_RSI)
+			| REG_BIT(REG_RDI) | REG_BIT(REG_R11) | REG_BIT(REG_R14);
+	}
+
+	case IR_SYSCALL: {
+		u16 mask = REG_BIT(REG_RAX) | REG_BIT(REG_RCX) | REG_BIT(REG_R11);
+		for (u32 i = 0; i + 1 < instr->operands_count; ++i) mask |= REG_BIT(CONVENTION_REGISTERS[i]);
+		return mask;
+	}
+
+	case IR_CALL: {
+		u16 mask = 0xFFFF;
+		for (size_t i = 0; i < CALLEE_SAVED_REGISTERS_COUNT; ++i) {
+			mask &= (u16) ~REG_BIT(CALLEE_SAVED_REGISTERS[i]);
+		}
+		return mask;
+	}
+
+	case IR_CALL_EXTERN: {
+		return REG_BIT(REG_RAX) | REG_BIT(REG_RCX) | REG_BIT(REG_RDX) | REG_BIT(REG_RSI) | REG_BIT(REG_RDI)
+			| REG_BIT(REG_R8) | REG_BIT(REG_R9) | REG_BIT(REG_R10) | REG_BIT(REG_R11);
+	}
+
+	case IR_NOP:
+	case IR_PHI:
+	case IR_CONST:
+	case IR_STRING:
+	case IR_ADDRESS:
+	case IR_ARG:
+	case IR_LOAD:
+	case IR_STORE:
+	case IR_PICK:
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+	case IR_OR:
+	case IR_NOT:
+	case IR_INDEX:
+	case IR_EQUAL:
+	case IR_LESS:
+	case IR_GREATER:
+	case IR_GREATER_EQUAL:
+	case IR_LESS_EQUAL:
+	case IR_DROP:
+	case IR_COLLAPSE:
+	case IR_JUMP:
+	case IR_BRANCH:
+	case IR_RETURN:
+	case IR_OP_COUNT: return 0;
+	}
+
+	return 0;
+}
+
+INLINE bool
+loc_is_memory(ra_loc_t loc)
+{
+	return loc.kind == RA_LOC_SLOT || loc.kind == RA_LOC_ARG;
+}
+
+INLINE bool
+loc_eq(ra_loc_t a, ra_loc_t b)
+{
+	if (a.kind != b.kind) return false;
+	if (a.kind == RA_LOC_REG) return a.reg == b.reg;
+	if (a.kind == RA_LOC_IMM) return a.imm == b.imm;
+	return a.slot == b.slot;
+}
+
+INLINE ra_loc_t
+reg_loc(u8 reg)
+{
+	return (ra_loc_t) { .kind = RA_LOC_REG, .reg = reg };
+}
+
+// The location as an operand of an instruction
+static operand_t
+loc_operand(ra_loc_t loc)
+{
+	switch ((ra_loc_kind_t) loc.kind) {
+	case RA_LOC_REG:  return operand_reg((reg_t) loc.reg);
+	case RA_LOC_SLOT: return operand_mem(8, REG_RSP, (pushed + loc.slot) * WORD_SIZE);
+	case RA_LOC_ARG:  return operand_mem(8, REG_RSP, (pushed + frame_words + loc.slot) * WORD_SIZE);
+	case RA_LOC_IMM:  return operand_imm(loc.imm);
+	case RA_LOC_NONE: UNREACHABLE; break;
+	}
+
+	return (operand_t) {0};
+}
+
+INLINE operand_t
+value_operand(ir_value_t value)
+{
+	return loc_operand(regalloc_loc(&ra, value));
+}
+
+INLINE bool
+in_reg(ir_value_t value, u8 reg)
+{
+	const ra_loc_t loc = regalloc_loc(&ra, value);
+	return loc.kind == RA_LOC_REG && loc.reg == reg;
+}
+
+// The value in a register, the one it is kept in or `into` it is loaded into
+static operand_t
+value_in_reg(ir_value_t value, reg_t into)
+{
+	if (regalloc_loc(&ra, value).kind == RA_LOC_REG) return value_operand(value);
+	emit_op2(OP_MOV, operand_reg(into), value_operand(value));
+	return operand_reg(into);
+}
+
+// The value as the source of an op, an immediate is loaded into `r11` if the op can't take it
+static operand_t
+source_operand(ir_value_t value, bool takes_imm)
+{
+	if (takes_imm || regalloc_loc(&ra, value).kind != RA_LOC_IMM) return value_operand(value);
+	emit_op2(OP_MOV, operand_reg(REG_R11), value_operand(value));
+	return operand_reg(REG_R11);
+}
+
+// Register the result is computed in, `rax` if it is kept in memory or not at all
+INLINE reg_t
+result_reg(ir_value_t value)
+{
+	const ra_loc_t loc = regalloc_loc(&ra, value);
+	return loc.kind == RA_LOC_REG ? (reg_t) loc.reg : REG_RAX;
+}
+
+// Store the result computed in `rax` to its slot
+INLINE void
+store_result(ir_value_t value)
+{
+	if (regalloc_loc(&ra, value).kind == RA_LOC_SLOT) emit_op2(OP_MOV, value_operand(value), operand_reg(REG_RAX));
+}
+
+INLINE void
+move_add(ra_loc_t dst, ra_loc_t src)
+{
+	if (loc_eq(dst, src)) return;
+	if (moves_len >= moves_cap) {
+		moves_cap = moves_cap ? moves_cap * 2 : IR_INIT_CAP;
+		moves = (move_t *) realloc(moves, sizeof(move_t) * moves_cap);
+	}
+	moves[moves_len++] = (move_t) { .dst = dst, .src = src };
+}
+
+// Arguments of a syscall or an extern to the registers of the convention
+INLINE void
+move_args(const ir_value_t *operands, u32 count)
+{
+	for (u32 i = 0; i < count; ++i) move_add(reg_loc(CONVENTION_REGISTERS[i]), regalloc_loc(&ra, operands[i]));
+}
+
+// Emit the moves added as if they were done at once. Every destination left is a source of
+// another move in a cycle, one of them is saved to `r11` to break it.
+static void
+emit_moves(void)
+{
+	u32 left = moves_len;
+	while (left > 0) {
+		bool progress = false;
+		for (u32 i = 0; i < moves_len; ++i) {
+			move_t *move = &moves[i];
+			if (move->dst.kind == RA_LOC_NONE) continue;
+
+			bool blocked = false;
+			for (u32 j = 0; j < moves_len && !blocked; ++j) {
+				blocked = j != i && moves[j].dst.kind != RA_LOC_NONE && loc_eq(moves[j].src, move->dst);
+			}
+			if (blocked) continue;
+
+			if (loc_is_memory(move->dst) && loc_is_memory(move->src)) {
+				emit_op2(OP_MOV, operand_reg(REG_RAX), loc_operand(move->src));
+				emit_op2(OP_MOV, loc_operand(move->dst), operand_reg(REG_RAX));
+			} else {
+				emit_op2(OP_MOV, loc_operand(move->dst), loc_operand(move->src));
+			}
+
+			move->dst.kind = RA_LOC_NONE;
+			left--;
+			progress = true;
+		}
+
+		if (progress) continue;
+
+		u32 i = 0;
+		while (moves[i].dst.kind == RA_LOC_NONE) i++;
+		const ra_loc_t saved = moves[i].dst;
+		emit_op2(OP_MOV, operand_reg(REG_R11), loc_operand(saved));
+		for (u32 j = 0; j < moves_len; ++j) {
+			if (moves[j].dst.kind != RA_LOC_NONE && loc_eq(moves[j].src, saved)) moves[j].src = reg_loc(REG_R11);
+		}
+	}
+
+	moves_len = 0;
+}
+
+// Move the values the phis of the target merge from the block to where the phis are kept
+static void
+move_phis(u32 block, u32 target)
+{
+	const ir_block_t *join = &ir->blocks[target];
+	u32 pred = 0;
+	while (pred < join->preds_count && join->preds[pred] != block) pred++;
+	if (pred == join->preds_count) return;
+
+	for (u32 i = join->first; i < join->end; ++i) {
+		const ir_instr_t *phi = &ir->instrs[i];
+		if (phi->op == IR_NOP) continue;
+		if (phi->op != IR_PHI) break;
+		if (ra.copy_of[phi->result] != phi->result || regalloc_loc(&ra, phi->result).kind == RA_LOC_NONE) continue;
+
+		move_add(regalloc_loc(&ra, phi->result), regalloc_loc(&ra, ir_operands(ir, phi)[pred]));
+	}
+
+	emit_moves();
+}
+
+// Nothing is emitted for the instruction: the copies, and the values that are put where they
+// are used or are not used at all
+static bool
+is_silent(const ir_instr_t *instr)
+{
+	switch ((ir_op_t) instr->op) {
+	case IR_NOP:
+	case IR_PHI:
+	case IR_PICK:
+	case IR_COLLAPSE:
+	case IR_DROP:
+	// Read at the start of the body
+	case IR_ARG: return true;
+
+	case IR_CONST:
+	case IR_STRING:
+	case IR_ADDRESS:
+	case IR_LOAD:
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+	case IR_OR:
+	case IR_NOT:
+	case IR_EQUAL:
+	case IR_LESS:
+	case IR_GREATER:
+	case IR_GREATER_EQUAL:
+	case IR_LESS_EQUAL: {
+		const u8 kind = regalloc_loc(&ra, instr->result).kind;
+		return kind == RA_LOC_NONE || kind == RA_LOC_IMM;
+	}
+
+	case IR_STORE:
+	case IR_DIV:
+	case IR_MOD:
+	case IR_INDEX:
+	case IR_PRINT:
+	case IR_SYSCALL:
+	case IR_CALL:
+	case IR_CALL_EXTERN:
+	case IR_JUMP:
+	case IR_BRANCH:
+	case IR_RETURN:
+	case IR_OP_COUNT: return false;
+	}
+
+	return false;
+}
+
+// The result of the compare is used only by the branch that ends the block, and nothing
+// emitted in between touches the flags
+static bool
+is_fused(u32 block, const ir_instr_t *compare)
+{
+	if (regalloc_uses(&ra, compare->result) != 1) return false;
+
+	const ir_block_t *b = &ir->blocks[block];
+	for (const ir_instr_t *instr = compare + 1; instr < ir->instrs + b->end; ++instr) {
+		if (instr->op == IR_BRANCH) return ra.copy_of[ir_operands(ir, instr)[0]] == compare->result;
+		if (!is_silent(instr)) return false;
+	}
+	return false;
+}
+
+static void
+lower_compare(u32 block, const ir_instr_t *instr, cc_t cc)
+{
+	const ir_value_t a = ir_operands(ir, instr)[0];
+	const ir_value_t b = ir_operands(ir, instr)[1];
+	const ra_loc_t la = regalloc_loc(&ra, a);
+
+	const operand_t lhs = la.kind == RA_LOC_IMM || (loc_is_memory(la) && loc_is_memory(regalloc_loc(&ra, b)))
+		? value_in_reg(a, REG_RAX)
+		: value_operand(a);
+	emit_op2(OP_CMP, lhs, value_operand(b));
+
+	if (is_fused(block, instr)) {
+		fused = true;
+		fused_cc = CC_NEGATE(cc);
+		return;
+	}
+
+	emit(insn_setcc(cc, operand_reg_sized(REG_RAX, 1)));
+	emit_op2(OP_MOVZX, operand_reg(result_reg(instr->result)), operand_reg_sized(REG_RAX, 1));
+	store_result(instr->result);
+}
+
+// The result is computed in the register of the first operand if it is kept there,
+// or of the second one if the op is commutative
+static void
+lower_binop(const ir_instr_t *instr, op_t op, bool commutative)
+{
+	const ir_value_t a = ir_operands(ir, instr)[0];
+	const ir_value_t b = ir_operands(ir, instr)[1];
+	const reg_t dst = result_reg(instr->result);
+	const operand_t reg = operand_reg(dst);
+	const bool takes_imm = instr->op != IR_MUL;
+
+	if (in_reg(a, dst)) {
+		emit_op2(op, reg, source_operand(b, takes_imm));
+	} else if (in_reg(b, dst) && commutative) {
+		emit_op2(op, reg, source_operand(a, takes_imm));
+	} else if (in_reg(b, dst)) {
+		emit_op2(OP_MOV, operand_reg(REG_RAX), value_operand(a));
+		emit_op2(op, operand_reg(REG_RAX), reg);
+		emit_op2(OP_MOV, reg, operand_reg(REG_RAX));
+	} else {
+		emit_op2(OP_MOV, reg, value_operand(a));
+		emit_op2(op, reg, source_operand(b, takes_imm));
+	}
+
+	store_result(instr->result);
+}
+
+INLINE void
+lower_jump(u32 target)
+{
+	emit_op1(OP_JMP, operand_address(block_label(target)));
+}
+
+static void
+lower_instr(u32 block, const ir_instr_t *instr)
+{
+#ifdef DEBUG
+	if (instr->op != IR_NOP) emit_comment("%s", ir_instr_to_str(ir, instr));
+#endif
+
+	if (is_silent(instr)) return;
+
+	const ir_value_t *operands = ir_operands(ir, instr);
+	switch ((ir_op_t) instr->op) {
+	case IR_NOP:
+	case IR_PHI:
+	case IR_PICK:
+	case IR_COLLAPSE:
+	case IR_DROP:
+	case IR_ARG: break;
+
+	case IR_CONST: {
+		emit_op2(OP_MOV, operand_reg(result_reg(instr->result)), operand_imm(instr->imm));
+		store_result(instr->result);
+	} break;
+
+	case IR_STRING: {
+		const label_t str = string_literal(instr->name);
+		emit_op2(OP_MOV, operand_reg(result_reg(instr->result)), operand_address(str));
+		store_result(instr->result);
+	} break;
+
+	case IR_ADDRESS: {
+		emit_op2(OP_MOV, operand_reg(result_reg(instr->result)), operand_address(label_func(instr->name)));
+		store_result(instr->result);
+	} break;
+
+	case IR_LOAD: {
+		emit_op2(OP_MOV, operand_reg(result_reg(instr->result)), operand_mem_label(0, label_named(instr->name)));
+		store_result(instr->result);
+	} break;
+
+	case IR_STORE: {
+		const ra_loc_t loc = regalloc_loc(&ra, operands[0]);
+		const label_t var = label_named(instr->name);
+		if (loc.kind == RA_LOC_IMM) emit_op2(OP_MOV, operand_mem_label(8, var), operand_imm(loc.imm));
+		else emit_op2(OP_MOV, operand_mem_label(0, var), value_in_reg(operands[0], REG_RAX));
+	} break;
+
+	case IR_ADD: lower_binop(instr, OP_ADD, true); break;
+	case IR_SUB: lower_binop(instr, OP_SUB, false); break;
+	case IR_MUL: lower_binop(instr, OP_IMUL, true); break;
+	case IR_OR:  lower_binop(instr, OP_OR, true); break;
+
+	case IR_NOT: {
+		const reg_t dst = result_reg(instr->result);
+		if (!in_reg(operands[0], dst)) emit_op2(OP_MOV, operand_reg(dst), value_operand(operands[0]));
+		emit_op1(OP_NOT, operand_reg(dst));
+		store_result(instr->result);
+	} break;
+
+	case IR_INDEX: {
+		const operand_t base = value_in_reg(operands[0], REG_RAX);
+		const operand_t index = value_in_reg(operands[1], REG_R11);
+		const operand_t byte = operand_mem_index(1, (reg_t) base.reg, index.reg, 0);
+		emit_op2(OP_MOVZX, operand_reg(result_reg(instr->result)), byte);
+		store_result(instr->result);
+	} break;
+
+	case IR_DIV:
+	case IR_MOD: {
+		// `rdx` is cleared before the division
+		operand_t divisor = value_operand(operands[1]);
+		if (regalloc_loc(&ra, operands[1]).kind == RA_LOC_IMM || in_reg(operands[1], REG_RDX)) {
+			emit_op2(OP_MOV, operand_reg(REG_R11), divisor);
+			divisor = operand_reg(REG_R11);
+		}
+
+		emit_op2(OP_MOV, operand_reg(REG_RAX), value_operand(operands[0]));
+		emit_op2(OP_XOR, operand_reg_sized(REG_RDX, 4), operand_reg_sized(REG_RDX, 4));
+		emit_op1(OP_DIV, divisor);
+
+		const reg_t dst = result_reg(instr->result);
+		const reg_t src = instr->op == IR_DIV ? REG_RAX : REG_RDX;
+		if (dst != src) emit_op2(OP_MOV, operand_reg(dst), operand_reg(src));
+		store_result(instr->result);
+	} break;
+
+	case IR_EQUAL:         lower_compare(block, instr, CC_E); break;
+	case IR_LESS:          lower_compare(block, instr, CC_B); break;
+	case IR_GREATER:       lower_compare(block, instr, CC_G); break;
+	case IR_GREATER_EQUAL: lower_compare(block, instr, CC_GE); break;
+	case IR_LESS_EQUAL:    lower_compare(block, instr, CC_LE); break;
+
+	case IR_PRINT: {
+		const value_kind_t kind = (value_kind_t) instr->imm;
+		emit_op2(OP_MOV, operand_reg(print_value_reg(kind)), value_operand(operands[0]));
+		print_value(kind);
+	} break;
+
+	case IR_SYSCALL: {
+		// The number of the syscall is on the top
+		const u32 args_count = instr->operands_count - 1;
+		move_add(reg_loc(REG_RAX), regalloc_loc(&ra, operands[args_count]));
+		move_args(operands, args_count);
+		emit_moves();
+		emit_op0(OP_SYSCALL);
+	} break;
+
+	case IR_CALL: {
+		for (u32 i = 0; i < instr->operands_count; ++i) {
+			emit_op1(OP_PUSH, value_operand(operands[i]));
+			pushed++;
+		}
+
+		// The callee pops the arguments and pushes the results, the ones nothing uses are dropped
+		emit_call(instr->name);
+		pushed = instr->results_count;
+		u32 dead = 0;
+		for (u8 i = instr->results_count; i > 0; --i) {
+			const ir_value_t result = instr->result + i - 1;
+			pushed--;
+			if (regalloc_loc(&ra, result).kind == RA_LOC_NONE) {
+				dead++;
+				continue;
+			}
+
+			if (dead > 0) emit_op2(OP_ADD, operand_reg(REG_RSP), operand_imm(dead * WORD_SIZE));
+			dead = 0;
+			emit_op1(OP_POP, operand_reg(result_reg(result)));
+			store_result(result);
+		}
+		if (dead > 0) emit_op2(OP_ADD, operand_reg(REG_RSP), operand_imm(dead * WORD_SIZE));
+	} break;
+
+	case IR_CALL_EXTERN: {
+		move_args(operands, instr->operands_count);
+		emit_moves();
+		emit_extern_call(instr->name);
+
+		// Only for integrals now
+		if (instr->results_count > 0) {
+			const reg_t dst = result_reg(instr->result);
+			if (dst != REG_RAX) emit_op2(OP_MOV, operand_reg(dst), operand_reg(REG_RAX));
+			store_result(instr->result);
+		}
+	} break;
+
+	case IR_JUMP: {
+		move_phis(block, instr->targets[0]);
+		if (instr->targets[0] != block + 1) lower_jump(instr->targets[0]);
+	} break;
+
+	case IR_BRANCH: {
+		const ra_loc_t loc = regalloc_loc(&ra, operands[0]);
+		if (fused) {
+			emit_jcc(fused_cc, block_label(instr->targets[1]));
+			fused = false;
+		} else if (loc.kind == RA_LOC_IMM) {
+			if (loc.imm == 0) lower_jump(instr->targets[1]);
+		} else if (loc.kind == RA_LOC_REG) {
+			emit_op2(OP_TEST, loc_operand(loc), loc_operand(loc));
+			emit_jcc(CC_E, block_label(instr->targets[1]));
+		} else {
+			emit_op2(OP_CMP, loc_operand(loc), operand_imm(0));
+			emit_jcc(CC_E, block_label(instr->targets[1]));
+		}
+	} break;
+
+	// The returned values go to the registers of the epilogue, the top one to the first
+	case IR_RETURN: {
+		for (i64 i = 0; i < instr->imm; ++i) {
+			const ir_value_t value = operands[instr->operands_count - 1 - (u32) i];
+			move_add(reg_loc(CONVENTION_REGISTERS[i]), regalloc_loc(&ra, value));
+		}
+		emit_moves();
+
+		if (ra.slots > 0) emit_op2(OP_ADD, operand_reg(REG_RSP), operand_imm(ra.slots * WORD_SIZE));
+		for (size_t i = CALLEE_SAVED_REGISTERS_COUNT; i > 0; --i) {
+			const reg_t reg = CALLEE_SAVED_REGISTERS[i - 1];
+			if (ra.used & REG_BIT(reg)) emit_op1(OP_POP, operand_reg(reg));
+		}
+	} break;
+
+	case IR_OP_COUNT: UNREACHABLE; break;
+	}
+}
+
+// Allocate the values, save the registers of the caller the body uses and load the
+// arguments kept in registers, then emit the blocks in the order they are translated in
+void
+regalloc_lower(const ir_func_t *body, size_t labels, size_t while_labels)
+{
+	ir = body;
+	label_base = labels;
+	while_label_base = while_labels;
+
+	if (ir->instrs_len > clobbers_cap) {
+		while (ir->instrs_len > clobbers_cap) clobbers_cap = clobbers_cap ? clobbers_cap * 2 : IR_INIT_CAP;
+		clobbers = (u16 *) realloc(clobbers, sizeof(u16) * clobbers_cap);
+	}
+	for (u32 i = 0; i < ir->instrs_len; ++i) clobbers[i] = instr_clobbers(&ir->instrs[i]);
+
+	regalloc_run(&ra, ir, clobbers, ALLOCATABLE_REGISTERS, ALLOCATABLE_REGISTERS_COUNT);
+
+	frame_words = ra.slots;
+	pushed = 0;
+	for (size_t i = 0; i < CALLEE_SAVED_REGISTERS_COUNT; ++i) {
+		const reg_t reg = CALLEE_SAVED_REGISTERS[i];
+		if (!(ra.used & REG_BIT(reg))) continue;
+		emit_op1(OP_PUSH, operand_reg(reg));
+		frame_words++;
+	}
+	if (ra.slots > 0) emit_op2(OP_SUB, operand_reg(REG_RSP), operand_imm(ra.slots * WORD_SIZE));
+
+	for (ir_value_t v = 0; v < ir->values_len; ++v) {
+		const ir_instr_t *def = ir_def(ir, v);
+		const ra_loc_t loc = regalloc_loc(&ra, v);
+		if (def->op != IR_ARG || ra.copy_of[v] != v || loc.kind != RA_LOC_REG) continue;
+
+		const ra_loc_t arg = { .kind = RA_LOC_ARG, .slot = (u32) def->imm };
+		emit_op2(OP_MOV, loc_operand(loc), loc_operand(arg));
+	}
+
+	for (u32 b = 0; b < ir->blocks_len; ++b) {
+		const ir_block_t *block = &ir->blocks[b];
+		if (block->label != IR_LABEL_NONE) emit_label(block_label(b));
+
+		for (u32 i = block->first; i < block->end; ++i) lower_instr(b, &ir->instrs[i]);
+	}
+
+	ir = NULL;
+}
+
+void
+regalloc_lower_free(void)
+{
+	regalloc_free(&ra);
+	free(clobbers);
+	clobbers = NULL;
+	clobbers_cap = 0;
+	free(moves);
+	moves = NULL;
+	moves_len = 0;
+	moves_cap = 0;
+}
+
+void
+regalloc_free(regalloc_t *ra)
+{
+	free(ra->copy_of);
+	free(ra->locs);
+	free(ra->uses);
+	*ra = (regalloc_t) {0};
+
+	free(scratch.start);
+	free(scratch.end);
+	free(scratch.merged_by);
+	free(scratch.keys);
+	free(scratch.sets);
+	free(scratch.counted);
+	free(scratch.clobbered);
+	memset(&scratch, 0, sizeof(scratch));
+}
+
+void
+regalloc_print_stats(void)
+{
+	printf("regalloc: %zu values in registers, %zu spilled, %zu copies coalesced\n",
+				 values_in_registers, values_spilled, copies_coalesced);
+}
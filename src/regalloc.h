@@ -0,0 +1,82 @@
+#ifndef REGALLOC_H_
+#define REGALLOC_H_
+
+#include "ir.h"
+#include "common.h"
+
+// Linear scan allocation of the values of an IR body. A copy is kept where the value it
+// copies is, and the arguments read from the frame are loaded once at the start of the body.
+// A value gets a register that none of the instructions it lives across overwrites, or is
+// kept in a slot of the frame of the body if there are not enough of them.
+//
+// Registers are numbered as they are encoded, a set of them is a mask of these bits.
+
+#define RA_REGISTERS_COUNT 16
+
+typedef enum {
+	// Used by nothing
+	RA_LOC_NONE,
+	RA_LOC_REG,
+	RA_LOC_SLOT,
+	// Const that fits a sign-extended 32-bit immediate, it is put where it is used
+	RA_LOC_IMM,
+	// Word of the frame of the body the argument is read from, see `IR_ARG`
+	RA_LOC_ARG,
+} ra_loc_kind_t;
+
+typedef struct {
+	u8 kind;
+	u8 reg;
+	u32 slot;
+	i64 imm;
+} ra_loc_t;
+
+typedef struct {
+	// Per value: the value it is a copy of or itself, where it is kept, and the uses of it
+	// by the instructions, the ones of its copies are counted with it
+	ir_value_t *copy_of;
+	ra_loc_t *locs;
+	u32 *uses;
+	u32 values_cap;
+
+	u32 slots;
+	// Registers given to some value
+	u16 used;
+} regalloc_t;
+
+// Allocate the values of the body to the registers of `order`, picked in that order,
+// the ones overwritten by every instruction are in `clobbers`
+void
+regalloc_run(regalloc_t *ra, const ir_func_t *ir, const u16 *clobbers, const u8 *order, u8 order_len);
+
+// Operands of the instruction that are read by it, from `*first` to the end
+u32
+regalloc_used_operands(const ir_instr_t *instr, u32 *first);
+
+INLINE ra_loc_t
+regalloc_loc(const regalloc_t *ra, ir_value_t value)
+{
+	return ra->locs[value];
+}
+
+INLINE u32
+regalloc_uses(const regalloc_t *ra, ir_value_t value)
+{
+	return ra->uses[ra->copy_of[value]];
+}
+
+void
+regalloc_free(regalloc_t *ra);
+
+// Allocate the values of the body and emit it, the records go where `emit` puts them.
+// Its labels of ifs and whiles are numbered on from `labels` and `while_labels`.
+void
+regalloc_lower(const ir_func_t *ir, size_t labels, size_t while_labels);
+
+void
+regalloc_lower_free(void);
+
+void
+regalloc_print_stats(void);
+
+#endif // REGALLOC_H_
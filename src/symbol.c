@@ -0,0 +1,141 @@
+#include "lib.h"
+#include "symbol.h"
+#include "common.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#define SYMBOLS_TABLE_INIT_CAP 1024
+
+symtab_t SYMBOLS = {
+	.syms = NULL,
+	.size = 0,
+	.cap = 0,
+	.slots = NULL,
+	.slots_cap = 0,
+	.copy = true
+};
+
+static void
+symtab_grow_slots(symtab_t *tab)
+{
+	free(tab->slots);
+	tab->slots_cap = tab->slots_cap ? tab->slots_cap * 2 : SYMBOLS_TABLE_INIT_CAP;
+	tab->slots = (sym_id_t *) calloc(tab->slots_cap, sizeof(sym_id_t));
+
+	const u32 mask = tab->slots_cap - 1;
+	for (sym_id_t id = SYM_NONE + 1; id < tab->size; ++id) {
+		u32 i = tab->syms[id].hash & mask;
+		while (tab->slots[i]) i = (i + 1) & mask;
+		tab->slots[i] = id;
+	}
+}
+
+sym_id_t
+symtab_intern(symtab_t *tab, const char *str, u32 len, u32 hash)
+{
+	if (len == 0) return SYM_NONE;
+
+	// Keep the table at most half full
+	if ((tab->size + 1) * 2 > tab->slots_cap) symtab_grow_slots(tab);
+
+	const u32 mask = tab->slots_cap - 1;
+
+	u32 i = hash & mask;
+	for (sym_id_t id; (id = tab->slots[i]); i = (i + 1) & mask) {
+		const symbol_t *sym = &tab->syms[id];
+		if (sym->hash == hash && sym->len == len && 0 == memcmp(sym->str, str, len)) {
+			return id;
+		}
+	}
+
+	if (tab->size + 1 >= tab->cap) {
+		tab->cap = tab->cap ? tab->cap * 2 : SYMBOLS_TABLE_INIT_CAP;
+		tab->syms = (symbol_t *) realloc(tab->syms, sizeof(symbol_t) * tab->cap);
+	}
+
+	// Reserve `SYM_NONE`
+	if (tab->size == SYM_NONE) {
+		tab->syms[tab->size++] = (symbol_t) { .len = 0, .hash = 0, .str = "" };
+	}
+
+	if (tab->copy) {
+		char *copy = calloc_string(len + 1);
+		memcpy(copy, str, len);
+		str = copy;
+	}
+
+	const sym_id_t id = tab->size++;
+	tab->syms[id] = (symbol_t) {
+		.len = len,
+		.hash = hash,
+		.str = str
+	};
+
+	tab->slots[i] = id;
+	return id;
+}
+
+void
+symtab_free(symtab_t *tab)
+{
+	free(tab->slots);
+	free(tab->syms);
+	tab->slots = NULL;
+	tab->syms = NULL;
+	tab->slots_cap = 0;
+	tab->cap = 0;
+	tab->size = 0;
+}
+
+sym_id_t
+sym_intern(const char *str, u32 len)
+{
+	return symtab_intern(&SYMBOLS, str, len, fnv1a(str, len));
+}
+
+i32
+sym_index_get(const sym_index_t *index, sym_id_t sym)
+{
+	if (sym >= index->cap) return -1;
+	return index->slots[sym];
+}
+
+void
+sym_index_put(sym_index_t *index, sym_id_t sym, i32 idx)
+{
+	if (sym >= index->cap) {
+		u32 cap = index->cap ? index->cap : SYMBOLS_TABLE_INIT_CAP;
+		while (cap <= sym) cap *= 2;
+
+		index->slots = (i32 *) realloc(index->slots, sizeof(i32) * cap);
+		for (u32 i = index->cap; i < cap; ++i) index->slots[i] = -1;
+		index->cap = cap;
+	}
+
+	index->slots[sym] = idx;
+}
+
+void
+sym_index_free(sym_index_t *index)
+{
+	free(index->slots);
+	index->slots = NULL;
+	index->cap = 0;
+}
+
+static sym_id_t main_sym = SYM_NONE;
+
+sym_id_t
+sym_main(void)
+{
+	if (main_sym == SYM_NONE) main_sym = sym_intern(MAIN_FUNCTION, sizeof(MAIN_FUNCTION) - 1);
+	return main_sym;
+}
+
+void
+symbols_release(void)
+{
+	main_sym = SYM_NONE;
+	symtab_free(&SYMBOLS);
+}
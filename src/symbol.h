@@ -0,0 +1,73 @@
+#ifndef SYMBOL_H_
+#define SYMBOL_H_
+
+#include "common.h"
+
+#include <stdbool.h>
+
+// Dense id of an interned identifier, `SYM_NONE` is reserved for tokens that are not identifiers.
+typedef u32 sym_id_t;
+
+#define SYM_NONE 0
+
+typedef struct {
+	u32 len;
+	u32 hash;
+	const char *str;
+} symbol_t;
+
+// Table of interned strings. The global one copies the strings into the arena,
+// the ones local to a lexer point into the source of the file.
+typedef struct {
+	symbol_t *syms;
+	u32 size;
+	u32 cap;
+
+	// Open addressing table of symbol ids, zero is an empty slot.
+	sym_id_t *slots;
+	u32 slots_cap;
+
+	bool copy;
+} symtab_t;
+
+sym_id_t
+symtab_intern(symtab_t *tab, const char *str, u32 len, u32 hash);
+
+void
+symtab_free(symtab_t *tab);
+
+// Return the id of the identifier in the global table, interning it on the first occurrence.
+sym_id_t
+sym_intern(const char *str, u32 len);
+
+// Maps symbol ids to indices of an insertion-ordered array of entries.
+typedef struct {
+	i32 *slots;
+	u32 cap;
+} sym_index_t;
+
+// Index of the entry of the symbol, -1 if there is none.
+i32
+sym_index_get(const sym_index_t *index, sym_id_t sym);
+
+void
+sym_index_put(sym_index_t *index, sym_id_t sym, i32 idx);
+
+void
+sym_index_free(sym_index_t *index);
+
+// Id of `MAIN_FUNCTION`, interned on the first call.
+sym_id_t
+sym_main(void);
+
+// Release the strings table
+void
+symbols_release(void);
+
+extern symtab_t SYMBOLS;
+
+#define symid(id) (SYMBOLS.syms[id])
+#define symstr(id) (SYMBOLS.syms[id].str)
+#define syms_len (SYMBOLS.size)
+
+#endif // SYMBOL_H_
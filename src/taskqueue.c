@@ -0,0 +1,54 @@
+// Copyright (c) 2022 Christoffer Lerno. All rights reserved.
+// Use of this source code is governed by the GNU LGPLv3.0 license
+// a copy of which can be found in the LICENSE file.
+
+#include "lib.h"
+#include "common.h"
+
+#include <pthread.h>
+
+typedef struct TaskQueue_
+{
+	pthread_mutex_t lock;
+	Task **queue;
+} TaskQueue;
+
+static void *taskqueue_thread(void *data)
+{
+	TaskQueue *task_queue = data;
+	while (true)
+	{
+		pthread_mutex_lock(&task_queue->lock);
+		unsigned task_count = vec_size(task_queue->queue);
+		if (!task_count)
+		{
+			pthread_mutex_unlock(&task_queue->lock);
+			break;
+		}
+		Task *task = task_queue->queue[task_count - 1];
+		vec_pop(task_queue->queue);
+		pthread_mutex_unlock(&task_queue->lock);
+		task->task(task->arg);
+	}
+	return NULL;
+}
+
+// Run all the tasks on `threads` worker threads and wait for them to finish.
+// Tasks are taken from the end of the list.
+void taskqueue_run(int threads, Task **task_list)
+{
+	ASSERT(threads > 0, "Expected at least one thread");
+	pthread_t *pthreads = malloc(sizeof(pthread_t) * (unsigned)threads);
+	TaskQueue queue = { .queue = task_list };
+	if (pthread_mutex_init(&queue.lock, NULL)) error_exit("Failed to set up mutex");
+	for (int i = 0; i < threads; i++)
+	{
+		if (pthread_create(&pthreads[i], NULL, taskqueue_thread, &queue)) error_exit("Failed to set up thread pool");
+	}
+	for (int i = 0; i < threads; i++)
+	{
+		if (pthread_join(pthreads[i], NULL) != 0) error_exit("Failed to join thread.");
+	}
+	free(pthreads);
+	pthread_mutex_destroy(&queue.lock);
+}
@@ -33,7 +33,7 @@ static inline void mmap_init(Vmem *vmem, size_t size)
 	if (min_size < 1) min_size = size;
 	while (size >= min_size)
 	{
-		ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
 		// It worked?
 		if (ptr != MAP_FAILED && ptr) break;
 		// Did it fail in a non-retriable way?